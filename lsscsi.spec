@@ -52,6 +52,8 @@ fi
 %doc ChangeLog INSTALL README CREDITS AUTHORS COPYING
 %attr(0755,root,root) %{_bindir}/*
 %{_mandir}/man8/*
+%{_libdir}/liblsscsi.a
+%{_includedir}/liblsscsi.h
 
 
 %changelog
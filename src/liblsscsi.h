@@ -0,0 +1,137 @@
+#ifndef LIBLSSCSI_H
+#define LIBLSSCSI_H
+
+/*
+ *  Copyright (C) 2003-2023 D. Gilbert
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* liblsscsi: what lsscsi lists, as typed records in the calling process
+ * rather than as text (or JSON) from a child process. A context is made
+ * with lsscsi_ctx_new(), filled by lsscsi_scan() and read with
+ * lsscsi_next(). A context may be scanned again; the indexes that lsscsi
+ * builds from sysfs and /dev (the hosts and devices present, device
+ * nodes, /dev/disk links, transports of hosts and targets, enclosure
+ * slots) are kept between scans until lsscsi_ctx_refresh() is called.
+ * Those indexes (and the sysfs and /dev roots) are process wide, so only
+ * one context should be in use at a time and calls on it must not be
+ * concurrent.
+ *
+ * The lsscsi utility itself is lsscsi_main() with the usual arguments. */
+
+/* For SCSI 'h' is host_num, 'c' is channel, 't' is target, 'l' is LUN is
+ * uint64_t and lun_arr[8] is LUN as 8 byte array. For NVMe, h=0x7fff
+ * (NVME_HOST_NUM) and displayed as 'N'; 'c' is Linux's NVMe controller
+ * number, 't' is NVMe Identify controller CTNLID field, and 'l' is
+ * namespace id (1 to (2**32)-1) rendered as a little endian 4 byte sequence
+ * in lun_arr, last 4 bytes are zeros. invalidate_hctl() puts -1 in
+ * integers, 0xff in bytes */
+struct addr_hctl {
+        int h;                 /* if h==0x7fff, display as 'N' for NVMe */
+        int c;
+        int t;
+        uint64_t l;           /* SCSI: Linux word flipped; NVME: uint32_t */
+        uint8_t lun_arr[8];   /* T10, SAM-5 order; NVME: little endian */
+};
+
+#define LSSCSI_NVME_HOST_NUM 0x7fff     /* addr_hctl::h of NVMe */
+
+/* Values of lsscsi_entry::transport_id */
+#define LSSCSI_TRANSPORT_UNKNOWN 0
+#define LSSCSI_TRANSPORT_SPI 1
+#define LSSCSI_TRANSPORT_FC 2
+#define LSSCSI_TRANSPORT_SAS 3
+#define LSSCSI_TRANSPORT_SAS_CLASS 4
+#define LSSCSI_TRANSPORT_ISCSI 5
+#define LSSCSI_TRANSPORT_SBP 6
+#define LSSCSI_TRANSPORT_USB 7
+#define LSSCSI_TRANSPORT_ATA 8         /* probably PATA, could be SATA */
+#define LSSCSI_TRANSPORT_SATA 9        /* most likely SATA */
+#define LSSCSI_TRANSPORT_FCOE 10
+#define LSSCSI_TRANSPORT_SRP 11
+#define LSSCSI_TRANSPORT_PCIE 12       /* most likely NVMe */
+#define LSSCSI_TRANSPORT_PSEUDO_0 99   /* scsi_debug driver */
+
+/* Kinds of entry, OR-ed together for lsscsi_scan() */
+#define LSSCSI_SDEV 0x1         /* SCSI device (logical unit) */
+#define LSSCSI_NDEV 0x2         /* NVMe namespace */
+#define LSSCSI_SHOST 0x4        /* SCSI host (HBA) */
+#define LSSCSI_NHOST 0x8        /* NVMe controller */
+#define LSSCSI_ALL 0xf
+
+#define LSSCSI_NAME_SZ 64
+#define LSSCSI_ID_SZ 48
+#define LSSCSI_NODE_SZ 256
+#define LSSCSI_STR_SZ 256
+
+/* One device or host. Strings are null terminated and empty when there
+ * is no value; they hold what lsscsi shows with the option given. */
+struct lsscsi_entry {
+        int kind;                       /* one of LSSCSI_SDEV ... NHOST */
+        struct addr_hctl hctl;          /* hosts: only 'h' (or 'c' for
+                                         * NVMe controllers) is valid */
+        int pdt;                        /* SCSI peripheral device type, 0
+                                         * for NVMe namespaces, else -1 */
+        int transport_id;               /* LSSCSI_TRANSPORT_* */
+        unsigned int dev_major;         /* of dev_node, when it's set */
+        unsigned int dev_minor;
+        uint64_t size_512;              /* disks: 512 byte blocks, else 0 */
+        char name[LSSCSI_NAME_SZ];      /* in sysfs: "2:0:1:0", "nvme0n1",
+                                         * "host2" or "nvme0" */
+        char vendor[LSSCSI_ID_SZ];      /* SCSI devices */
+        char model[LSSCSI_ID_SZ];       /* NVMe: the controller's */
+        char rev[LSSCSI_ID_SZ];         /* NVMe: firmware revision */
+        char serial[LSSCSI_ID_SZ];      /* NVMe only */
+        char driver[LSSCSI_ID_SZ];      /* SCSI hosts: proc_name */
+        char dev_node[LSSCSI_NODE_SZ];  /* primary node, e.g. /dev/sda */
+        char sg_node[LSSCSI_NODE_SZ];   /* generic node, e.g. /dev/sg0 */
+        char wwn[LSSCSI_STR_SZ];        /* --wwn; NVMe namespaces: wwid */
+        char lu_name[LSSCSI_STR_SZ];    /* --unit */
+        char transport[LSSCSI_STR_SZ];  /* --transport */
+};
+
+struct lsscsi_ctx;
+
+/* Returns a new context that looks below 'sysroot' for sys and dev (as
+ * the --sysroot= option), or below / if 'sysroot' is NULL. Returns NULL
+ * if 'sysroot' does not start with '/', is too long or out of memory. */
+struct lsscsi_ctx * lsscsi_ctx_new(const char * sysroot);
+
+void lsscsi_ctx_free(struct lsscsi_ctx * ctxp);
+
+/* Drops the indexes kept between scans. Use when devices (or their /dev
+ * nodes) may have come or gone since the last scan. */
+void lsscsi_ctx_refresh(struct lsscsi_ctx * ctxp);
+
+/* Replaces the entries of 'ctxp' with those of the 'kinds' (LSSCSI_SDEV
+ * and so on, OR-ed together) now present, in lsscsi's order: SCSI
+ * devices, NVMe namespaces, SCSI hosts then NVMe controllers. The
+ * iterator is rewound. Returns the number of entries or a negated errno
+ * value. */
+int lsscsi_scan(struct lsscsi_ctx * ctxp, int kinds);
+
+/* Returns the next entry of the last scan or NULL after the last. It
+ * remains valid until the next scan of (or freeing) 'ctxp'. */
+const struct lsscsi_entry * lsscsi_next(struct lsscsi_ctx * ctxp);
+
+void lsscsi_rewind(struct lsscsi_ctx * ctxp);
+
+/* The lsscsi utility: 'argc' and 'argv' as given to main(). Returns its
+ * exit status. Meant to be called once per process. */
+int lsscsi_main(int argc, char ** argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -21,6 +21,7 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -35,6 +36,14 @@
 #include <linux/major.h>
 #include <linux/limits.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <grp.h>
+#include <signal.h>
+#include <linux/netlink.h>
+#include <sys/mman.h>
 #define __STDC_FORMAT_MACROS 1
 #include <inttypes.h>
 
@@ -42,9 +51,16 @@
 #include "config.h"
 #endif
 
+#if HAVE_IO_URING
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
 #include "sg_unaligned.h"
 #include "sg_pr2serr.h"
 #include "sg_json.h"
+#include "liblsscsi.h"
 
 /* Package release number is first number, whole string is version */
 static const char * release_str = "0.33  2023/12/17 [svn: r194]";
@@ -64,34 +80,34 @@ static const char * release_str = "0.33  2023/12/17 [svn: r194]";
  *                          by the readlink(2) system call.
  *
  * Each file (including directories) has a unique canonical path. When a
- * directories's canonical path is required this utility uses the
- * following technique:
- *     1) change directory to the location [e.g. with if_directory_chdir() )
- *     2) if step 1) succeeds , call the getcwd(2) system call
- * If both steps succeed then we have the canonical path.
+ * directories's canonical path is required this utility calls realpath(3)
+ * [e.g. via if_directory_canon() ]. Earlier versions changed directory to
+ * the location then called getcwd(2); that altered process wide state
+ * so it stopped devices being processed concurrently (see --jobs=N).
  */
 
 #define FT_OTHER 0
 #define FT_BLOCK 1
 #define FT_CHAR 2
 
-/* N.B. The following are distinct from T10's PROTOCOL identifier values */
-#define TRANSPORT_UNKNOWN 0
-#define TRANSPORT_SPI 1
-#define TRANSPORT_FC 2
-#define TRANSPORT_SAS 3         /* PROTOCOL identifier for SAS is 6 */
-#define TRANSPORT_SAS_CLASS 4
-#define TRANSPORT_ISCSI 5
-#define TRANSPORT_SBP 6
-#define TRANSPORT_USB 7
-#define TRANSPORT_ATA 8         /* probably PATA, could be SATA */
-#define TRANSPORT_SATA 9        /* most likely SATA */
-#define TRANSPORT_FCOE 10
-#define TRANSPORT_SRP 11
-#define TRANSPORT_PCIE 12       /* most likely NVMe */
-#define TRANSPORT_PSEUDO_0 99   /* scsi_debug driver */
-
-#define NVME_HOST_NUM 0x7fff    /* 32767, high to avoid SCSI host numbers */
+/* N.B. These (see liblsscsi.h) are distinct from T10's PROTOCOL identifier
+ * values. */
+#define TRANSPORT_UNKNOWN LSSCSI_TRANSPORT_UNKNOWN
+#define TRANSPORT_SPI LSSCSI_TRANSPORT_SPI
+#define TRANSPORT_FC LSSCSI_TRANSPORT_FC
+#define TRANSPORT_SAS LSSCSI_TRANSPORT_SAS
+#define TRANSPORT_SAS_CLASS LSSCSI_TRANSPORT_SAS_CLASS
+#define TRANSPORT_ISCSI LSSCSI_TRANSPORT_ISCSI
+#define TRANSPORT_SBP LSSCSI_TRANSPORT_SBP
+#define TRANSPORT_USB LSSCSI_TRANSPORT_USB
+#define TRANSPORT_ATA LSSCSI_TRANSPORT_ATA
+#define TRANSPORT_SATA LSSCSI_TRANSPORT_SATA
+#define TRANSPORT_FCOE LSSCSI_TRANSPORT_FCOE
+#define TRANSPORT_SRP LSSCSI_TRANSPORT_SRP
+#define TRANSPORT_PCIE LSSCSI_TRANSPORT_PCIE
+#define TRANSPORT_PSEUDO_0 LSSCSI_TRANSPORT_PSEUDO_0
+
+#define NVME_HOST_NUM LSSCSI_NVME_HOST_NUM /* high, unlike SCSI hosts */
 
 #ifdef PATH_MAX
 #define LMAX_PATH PATH_MAX
@@ -111,7 +127,16 @@ static const char * release_str = "0.33  2023/12/17 [svn: r194]";
 
 #define SEP_EQ_NO_SP SGJ_SEP_EQUAL_NO_SPACE
 
-static int transport_id = TRANSPORT_UNKNOWN;
+#define MAX_JOBS 256            /* upper limit for --jobs=N */
+#define MAX_FIELDS 32           /* upper limit of names in --fields= */
+
+#ifndef SG_ARRAY_SIZE
+#define SG_ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+#define MAX_FETCH_ATTRS 32      /* names per fetch_attrs() call */
+#define ATTR_ARENA_SZ (MAX_FETCH_ATTRS * LMAX_NAME)
+#define DEV_PART_SZ 2048        /* of what a timed out device had read */
 
 static char sysfsroot[256] = "/sys"; /* overwritten if -y PATH or -Y given */
 static char devfsroot[100] = "/dev"; /* overwritten when -Y AR_PT given */
@@ -133,7 +158,11 @@ static const char * iscsi_h_s = "/class/iscsi_host/";
 static const char * iscsi_sess_s = "/class/iscsi_session/";
 static const char * srp_h_s = "/class/srp_host/";
 // static const char * dev_pse_dir_s = "/dev";
-static const char * dev_disk_byid_dir = "/dev/disk/by-id";
+/* Like devfsroot these two are overwritten when -Y AR_PT given */
+static char dev_disk_byid_dir[128] = "/dev/disk/by-id";
+static char dev_disk_bypath_dir[128] = "/dev/disk/by-path";
+static const char * def_cache_dir = "/run/lsscsi";
+static const char * def_daemon_sock = "/run/lsscsi/lsscsid.sock";
 static const char * pdt_sn = "peripheral_device_type";
 static const char * mmnbl_s = "module may not be loaded";
 static const char * lun_s = "lun";
@@ -202,24 +231,7 @@ static const char * wwid_s = "wwid";
 static const char * addr_s = "address";
 #endif
 
-static char wd_at_start[LMAX_DEVPATH];
-
-/* For SCSI 'h' is host_num, 'c' is channel, 't' is target, 'l' is LUN is
- * uint64_t and lun_arr[8] is LUN as 8 byte array. For NVMe, h=0x7fff
- * (NVME_HOST_NUM) and displayed as 'N'; 'c' is Linux's NVMe controller
- * number, 't' is NVMe Identify controller CTNLID field, and 'l' is
- * namespace id (1 to (2**32)-1) rendered as a little endian 4 byte sequence
- * in lun_arr, last 4 bytes are zeros. invalidate_hctl() puts -1 in
- * integers, 0xff in bytes */
-struct addr_hctl {
-        int h;                 /* if h==0x7fff, display as 'N' for NVMe */
-        int c;
-        int t;
-        uint64_t l;           /* SCSI: Linux word flipped; NVME: uint32_t */
-        uint8_t lun_arr[8];   /* T10, SAM-5 order; NVME: little endian */
-};
-
-struct addr_hctl filter;
+static struct addr_hctl filter;
 static bool filter_active = false;
 
 struct lsscsi_opts {
@@ -228,17 +240,25 @@ struct lsscsi_opts {
         bool dev_maj_min;   /* -d */
         bool generic;       /* -g */
         bool do_hosts;      /* -H or -C */
+        bool enclosure;     /* --enclosure */
+        bool io_uring;      /* --io-uring: batch attribute reads */
         bool do_json;       /* -j or -J */
         bool kname;         /* -k */
         bool no_nvme;       /* -N */
         bool pdt;           /* -D= peripheral device type in hex */
         bool protection;    /* -p: data integrity */
         bool protmode;      /* -P: data integrity */
+        bool sas_tree;      /* --sas-tree */
         bool scsi_id;       /* -i: udev derived from /dev/disk/by-id/scsi* */
         bool scsi_id_twice; /* -ii: scsi_id without "from whence" prefix */
         bool transport_info;  /* -t */
+        bool watch;         /* --watch: then report uevent driven changes */
         bool wwn;           /* -w */
         bool wwn_twice;     /* -ww */
+        int dev_timeout_ms; /* --device-timeout=MS: 0 if not given */
+        int jobs;           /* --jobs=N: worker threads for devices */
+        int num_fields;     /* --fields=LIST: 0 if not given */
+        uint8_t fields[MAX_FIELDS];     /* indexes into fld_tbl[] */
         int long_opt;       /* -l: --long; -L equivalent to -lll */
         int lunhex;         /* -x */
         int ssize;          /* show storage size, once->base 10 (e.g. 3 GB
@@ -247,8 +267,15 @@ struct lsscsi_opts {
         int unit;           /* -u: logical unit (LU) name: from vpd_pg83 */
         int verbose;        /* -v */
         int version_count;  /* -V */
+        const char * cache_dir; /* --cache[=DIR]: NULL if not given */
+        const char * capture_fn;  /* --capture=FILE: NULL if not given */
+        const char * daemon_sock; /* --daemon[=SOCK]: NULL if not given */
+        const char * diff_fn;   /* --diff=PREV: NULL if not given */
+        const char * fields_arg;  /* --fields=LIST: NULL if not given */
         const char * json_arg;  /* carries [JO] if any */
         const char * js_file; /* --js-file= argument */
+        const char * replay_fn; /* --replay=FILE: NULL if not given */
+        const char * snapshot_fn; /* --snapshot=FILE: NULL if not given */
         sgj_state json_st;  /* -j[JO] or --json[=JO] */
 };
 
@@ -293,15 +320,44 @@ static const char * const scsi_short_device_types[] = {
         "wlun   ", "no dev ",
 };
 
+/* Values for long options that have no short form, above any char value */
+enum lo_only_t {
+        LO_JOBS = 0x100,
+        LO_CACHE,
+        LO_WATCH,
+        LO_STATS,
+        LO_FIELDS,
+        LO_SAS_TREE,
+        LO_ENCLOSURE,
+        LO_IO_URING,
+        LO_DAEMON,
+        LO_SNAPSHOT,
+        LO_DIFF,
+        LO_DEVICE_TIMEOUT,
+        LO_CAPTURE,
+        LO_REPLAY,
+};
+
 /* '--name' ('-n') option removed in version 0.11 and can now be reused */
 static struct option long_options[] = {
         {"brief", no_argument, 0, 'b'},
+        {"cache", optional_argument, 0, LO_CACHE},
+        {"capture", required_argument, 0, LO_CAPTURE},
         {"classic", no_argument, 0, 'c'},
         {"controllers", no_argument, 0, 'C'},
+        {"daemon", optional_argument, 0, LO_DAEMON},
         {"device", no_argument, 0, 'd'},
+        {"device-timeout", required_argument, 0, LO_DEVICE_TIMEOUT},
+        {"device_timeout", required_argument, 0, LO_DEVICE_TIMEOUT},
+        {"diff", required_argument, 0, LO_DIFF},
+        {"enclosure", no_argument, 0, LO_ENCLOSURE},
+        {"fields", required_argument, 0, LO_FIELDS},
         {"generic", no_argument, 0, 'g'},
         {"help", no_argument, 0, 'h'},
         {"hosts", no_argument, 0, 'H'},
+        {"io-uring", no_argument, 0, LO_IO_URING},
+        {"io_uring", no_argument, 0, LO_IO_URING},
+        {"jobs", required_argument, 0, LO_JOBS},
         {"json", optional_argument, 0, '^'},    /* short option is '-j' */
         {"js-file", required_argument, 0, 'J'},
         {"js_file", required_argument, 0, 'J'},
@@ -314,9 +370,14 @@ static struct option long_options[] = {
         {"pdt", no_argument, 0, 'D'},
         {"protection", no_argument, 0, 'p'},
         {"protmode", no_argument, 0, 'P'},
+        {"replay", required_argument, 0, LO_REPLAY},
+        {"sas-tree", no_argument, 0, LO_SAS_TREE},
+        {"sas_tree", no_argument, 0, LO_SAS_TREE},
         {"scsi_id", no_argument, 0, 'i'},
         {"scsi-id", no_argument, 0, 'i'}, /* convenience, not documented */
         {"size", no_argument, 0, 's'},
+        {"snapshot", required_argument, 0, LO_SNAPSHOT},
+        {"stats", no_argument, 0, LO_STATS},
         {"sz-lbs", no_argument, 0, 'S'},
         {"sz_lbs", no_argument, 0, 'S'},  /* convenience, not documented */
         {"sysfsroot", required_argument, 0, 'y'},
@@ -327,6 +388,7 @@ static struct option long_options[] = {
         {"long-unit", no_argument, 0, 'U'},
         {"verbose", no_argument, 0, 'v'},
         {"version", no_argument, 0, 'V'},
+        {"watch", no_argument, 0, LO_WATCH},
         {"wwn", no_argument, 0, 'w'},
         {0, 0, 0, 0}
 };
@@ -334,40 +396,172 @@ static struct option long_options[] = {
 static void tag_lun(const uint8_t * lunp, int * tag_arr);
 
 
-/* Device node list: contains the information needed to match a node with a
- * sysfs class device. */
-#define DEV_NODE_LIST_ENTRIES 16
+/* Device node map: contains the information needed to match a node with a
+ * sysfs class device. It is an open addressed (linear probing) hash table
+ * keyed on major, minor and type that only keeps the newest node (by
+ * mtime) for each key. Node names are held in one string pool. */
+#define DEV_NODE_MAP_INIT_SZ 256        /* must be a power of 2 */
+#define STR_POOL_INIT_SZ 4096
 enum dev_type {BLK_DEV, CHR_DEV};
 
+/* Null terminated strings packed end to end, referred to by offset */
+struct str_pool {
+        char * p;
+        unsigned int len;
+        unsigned int sz;
+};
+
 struct dev_node_entry {
-       unsigned int maj, min;
-       enum dev_type d_typ;
-       time_t mtime;
-       char name[LMAX_DEVPATH];
+        bool used;
+        enum dev_type d_typ;
+        unsigned int maj, min;
+        time_t mtime;
+        unsigned int name_off;  /* basename, in dev_node_map.pool */
 };
 
-struct dev_node_list {
-       struct dev_node_list *next;
-       unsigned int count;
-       struct dev_node_entry nodes[DEV_NODE_LIST_ENTRIES];
+struct dev_node_map {
+        unsigned int size;      /* number of slots in tbl, a power of 2 */
+        unsigned int count;     /* number of slots in use */
+        struct dev_node_entry * tbl;    /* NULL until collected */
+        struct str_pool pool;
 };
-static struct dev_node_list* dev_node_listhead = NULL;
+static struct dev_node_map dev_node_map;
 
 /* Allow for '0x' + prefix + wwn<128-bit> + <null-terminator> */
 #define DSK_WWN_MXLEN 36
 
-struct disk_wwn_node_entry {
-        char wwn[DSK_WWN_MXLEN];
-        char disk_bname[12];
+/* Disk link index: each symlink in /dev/disk/by-id and /dev/disk/by-path
+ * is read once per run and the best link of each kind is kept for the
+ * disk it leads to. Kinds looked up by the st_rdev of that disk come
+ * first, then those looked up by the basename of the symlink target. */
+#define DISK_LINK_TBL_INIT_SZ 64        /* must be a power of 2 */
+enum disk_link_kind {
+        DLK_SCSI,       /* by-id/scsi-*, best by "328S10" prefix priority */
+        DLK_MPATH,      /* by-id/dm-uuid-mpath-* */
+        DLK_USB,        /* by-id/usb-* */
+        DLK_PATH,       /* any by-path link */
+        DLK_SCSI_WWN,   /* by-id/scsi-[328]* without "part", for -w */
+        DLK_WWN,        /* by-id/wwn-* without "part", for -ww */
+        DLK_NUM
+};
+#define DLK_FIRST_BY_BNAME DLK_SCSI_WWN
+
+struct disk_link_rec {
+        bool used;
+        dev_t rdev;                     /* key, in the by_rdev table */
+        unsigned int bname_off;         /* key, in the by_bname table */
+        int rank[DLK_NUM];              /* priority of link_off[], 0 best */
+        unsigned int link_off[DLK_NUM]; /* symlink name, 0 for none */
+};
+
+struct disk_link_tbl {
+        unsigned int size;              /* a power of 2 */
+        unsigned int count;
+        struct disk_link_rec * recs;
+};
+
+struct disk_link_index {
+        bool collected;
+        bool want_only;         /* only links to disks already in by_bname */
+        struct disk_link_tbl by_rdev;
+        struct disk_link_tbl by_bname;
+        struct str_pool pool;
+};
+static struct disk_link_index disk_link_index;
+
+/* Enclosure slot index: each device linked to a component (slot) of an
+ * enclosure in class/enclosure, keyed on the device's <h:c:t:l>, with the
+ * names of that enclosure and component and the component's slot number.
+ * Each enclosure directory is read once per run rather than each device's
+ * directory being searched for its enclosure_device:* link. */
+#define ENCL_SLOT_TBL_INIT_SZ 64        /* must be a power of 2 */
+
+struct encl_slot_rec {
+        bool used;
+        int h, c, t;                    /* key, with l */
+        uint64_t l;
+        int slot;                       /* -1 if no "slot" attribute */
+        unsigned int encl_off;          /* e.g. "6:0:40:0", in pool */
+        unsigned int comp_off;          /* e.g. "SLOT 01", in pool */
 };
 
-#define DISK_WWN_NODE_LIST_ENTRIES 16
-struct disk_wwn_node_list {
-        struct disk_wwn_node_list *next;
+struct encl_slot_index {
+        bool collected;
+        unsigned int size;              /* a power of 2 */
         unsigned int count;
-        struct disk_wwn_node_entry nodes[DISK_WWN_NODE_LIST_ENTRIES];
+        struct encl_slot_rec * recs;
+        struct str_pool pool;
+};
+static struct encl_slot_index encl_slot_index;
+
+/* The node map and the link and enclosure slot indexes above are all
+ * collected on first use, which may be from a --jobs=N worker thread */
+static pthread_mutex_t node_list_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Tasks of --device-timeout=MS, see struct dev_task_t */
+static pthread_mutex_t dev_task_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int dev_tasks_running;   /* not done nor abandoned */
+static int dev_tasks_astray;    /* abandoned, not done */
+
+/* File system work done by one thread, counted for --stats. Each thread
+ * has its own (so no locking is needed when counting); worker threads add
+ * theirs to lsscsi_stats::io_pooled when they finish. */
+struct io_counts {
+        uint64_t dirs;          /* directories read, e.g. by scandir(3) */
+        uint64_t attrs;         /* files (mainly sysfs attributes) read */
+        uint64_t bytes;         /* read from those files */
+        uint64_t links;         /* symlinks read */
+        uint64_t canon;         /* realpath(3) calls */
+        uint64_t nodes;         /* JSON values made, see io_snap() */
+};
+static __thread struct io_counts tl_io;
+
+/* What --stats times. The first three are in enum dev_list_kind order.
+ * The node map and the indexes are collected during the list that first
+ * needs them, attributes are prefetched and JSON output is done as each
+ * list goes, so the times of the phases after STP_SAS_TREE are also in
+ * those of the lists. */
+enum stats_phase {
+        STP_SDEVS = 0,          /* list_sdevices() */
+        STP_NDEVS,              /* list_ndevices() */
+        STP_SHOSTS,             /* list_shosts() */
+        STP_NHOSTS,             /* list_nhosts() */
+        STP_SAS_TREE,           /* list_sas_tree() */
+        STP_DEV_NODES,          /* collect_dev_nodes() */
+        STP_DISK_LINKS,         /* collect_disk_links() */
+        STP_ENCL_SLOTS,         /* collect_encl_slots() */
+        STP_TOPOLOGY,           /* topo_get() */
+        STP_PREFETCH,           /* dev_jobs_prefetch(), with --io-uring */
+        STP_JSON_OUT,           /* adding device objects, streaming them */
+        STP_NUM
+};
+#define STATS_SLOWEST 5         /* devices shown by --stats */
+
+struct stats_phase_rec {
+        int runs;
+        int devices;            /* given to run_dev_jobs() */
+        int cached;             /* of those, taken from the --cache */
+        uint64_t ns;
+        uint64_t dev_ns;        /* of 'ns', in run_dev_jobs() */
+        struct io_counts io;
+};
+
+struct stats_dev_rec {
+        enum stats_phase phase;
+        uint64_t ns;
+        struct io_counts io;
+        char name[LMAX_NAME];
 };
-static struct disk_wwn_node_list * disk_wwn_node_listhead = NULL;
+
+static struct lsscsi_stats {
+        bool on;                /* --stats given */
+        uint64_t start_ns;
+        pthread_mutex_t mtx;    /* protects io_pooled */
+        struct io_counts io_pooled;
+        struct stats_phase_rec ph[STP_NUM];
+        int num_slow;           /* slowest first */
+        struct stats_dev_rec slow[STATS_SLOWEST];
+} stats = {.mtx = PTHREAD_MUTEX_INITIALIZER};
 
 struct item_t {
         char name[LMAX_DEVPATH];
@@ -375,52 +569,285 @@ struct item_t {
         int d_type;
 };
 
-static struct item_t non_sg;
-static struct item_t aa_sg;
-static struct item_t aa_first;
-static struct item_t enclosure_device;
+/* The device identification VPD page (0x83) of a SCSI device (LU) as read
+ * from sysfs, with its designation descriptors indexed by association and
+ * designator type. Descriptors with the same pair are chained in page
+ * order. Filled once per device by vpd_di_get(). */
+#define VPD_DI_PAGE_SZ 512
+#define VPD_DI_MAX_DESC 64
+struct vpd_desig {
+        uint8_t b0;             /* protocol identifier and code set */
+        uint8_t b1;             /* PIV, association and designator type */
+        uint8_t len;            /* of the designator */
+        int8_t next;            /* index of next with same pair, or -1 */
+        uint16_t off;           /* of the designator in vpd_di::page */
+};
+
+struct vpd_di {
+        bool read;              /* vpd_di_get() has been called */
+        bool ok;                /* and the page is valid */
+        int num;
+        int8_t first[4][16];    /* [association][designator type] */
+        struct vpd_desig d[VPD_DI_MAX_DESC];
+        uint8_t page[VPD_DI_PAGE_SZ];
+};
+
+/* What the task of a device has read so far with --device-timeout=MS,
+ * reported if the task times out. Written under dev_task_mtx. */
+struct dev_part {
+        int num;                /* name, value pairs in arena[] */
+        int used;               /* bytes of arena[] */
+        char arena[DEV_PART_SZ];        /* each null terminated */
+};
+
+/* Scratch state for the device (or host) currently being listed. These
+ * were file scope variables, now one instance is passed down the call
+ * chain for each device so that several devices can be processed at the
+ * same time (see --jobs=N). dev_ctx_init() readies an instance for each
+ * device, the transport functions then update transport_id and the other
+ * fields are written by the scan functions. The two directory file
+ * descriptors let a device's sysfs attributes be reached with openat(2)
+ * and friends rather than by walking the full path each time. */
+struct dev_ctx_t {
+        int transport_id;
+        int iscsi_tsession_num;
+        int parent_fd;          /* e.g. /sys/bus/scsi/devices, or -1 */
+        int dev_fd;             /* parent_fd/<devname>, or -1 */
+        struct item_t non_sg;
+        struct item_t aa_sg;
+        struct item_t aa_first;
+#if (HAVE_NVME && (! IGNORE_NVME))
+        struct item_t aa_ng;
+        const struct nvme_ctl_t * nvme_ctl;     /* of this namespace */
+#endif
+        const struct addr_hctl * hctlp; /* as parsed in topo, or NULL */
+        char sas_hold_end_device[LMAX_NAME];
+        char errpath[LMAX_PATH];
+        struct vpd_di vpd_di;   /* of this LU, see vpd_di_get() */
+        const struct attr_memo * pre;   /* see dev_jobs_prefetch() */
+        const char * const * pre_names; /* pre->num of them */
+        struct dev_part * part;         /* NULL unless --device-timeout */
+};
+
+/* Used by iscsi_target_scan() to pass its arguments to the select
+ * function and get the session number back. */
+struct iscsi_scan_t {
+        const char * dir_name;
+        const struct addr_hctl * hctl;
+        int tsession_num;
+};
+
+/* View of one attribute value within attr_set::arena. 'vp' is null
+ * terminated (so it can be given to printf("%s")) and is NULL when the
+ * attribute could not be opened. */
+struct attr_view {
+        const char * vp;
+        int len;
+};
+
+/* Values of up to MAX_FETCH_ATTRS attributes from one sysfs directory as
+ * read by fetch_attrs(). Each fetch_attrs() call reuses the arena, so views
+ * from the previous call become invalid. */
+struct attr_set {
+        int num;
+        const char * const * names;     /* the caller's, 'num' elements */
+        struct attr_view av[MAX_FETCH_ATTRS];
+        char arena[ATTR_ARENA_SZ];
+};
+
 #if (HAVE_NVME && (! IGNORE_NVME))
-static struct item_t aa_ng;
+/* Attributes of an NVMe controller that are shown for each of its
+ * namespaces. list_ndevices() reads them once per controller with
+ * nvme_ctl_init() rather than once per namespace. Indexes below are into
+ * nvme_ctl_names[] and so into nvme_ctl_t::as */
+enum nvme_ctl_attrs {
+        NCA_CNTLID,
+        NCA_MODEL,              /* these three have white space trimmed */
+        NCA_SERIAL,
+        NCA_FW_REV,
+        NCA_TRANSPORT,
+        NCA_NUM
+};
+
+static const char * const nvme_ctl_names[] = {
+        "cntlid", "model", "serial", "firmware_rev", "transport",
+};
+
+struct nvme_ctl_t {
+        bool have_cntlid;
+        int cntlid;                     /* 0 if not decoded */
+        char dir[LMAX_DEVPATH];         /* e.g. /sys/class/nvme/nvme0 */
+        char pcie_ids[LMAX_NAME];       /* "<svid>:<sdid>" for --transport */
+        struct attr_set as;             /* of nvme_ctl_names[] */
+};
 #endif
 
-static char sas_low_phy[LMAX_NAME];
-static char sas_hold_end_device[LMAX_NAME];
+/* Transport memo: what transport_sdev_tport() and transport_tport_longer()
+ * find for each SCSI target (the <h:c:t> shared by its LUs), together with
+ * which transport class directories each SCSI host has (where c and t are
+ * -1). Both are looked up once per run rather than once per LU (or per
+ * host listing). It is an open addressed (linear probing) hash table of
+ * pointers to records so that a record does not move when the table
+ * grows. */
+#define TPORT_MEMO_INIT_SZ 64           /* must be a power of 2 */
+#define SAS_TOPO_MAX_DEPTH 32           /* cascaded expanders */
+enum tport_attrs {
+        TPA_SPI,        /* class/spi_transport/target<h:c:t> */
+        TPA_FC_RPORT,   /* the target's rport: names and roles */
+        TPA_FC_RPORT2,  /* the target's rport: timeouts */
+        TPA_SAS_DEV,    /* class/sas_device/end_device-* */
+        TPA_SAS_END,    /* class/sas_end_device/end_device-* */
+        TPA_ISCSI,      /* class/iscsi_session/session<n> */
+        TPA_NUM
+};
+
+/* Transport class directories of a SCSI host, see tport_host_classes() */
+#define THC_SAS 0x1             /* class/sas_host/host<h> */
+#define THC_SPI 0x2             /* class/spi_host/host<h> */
+#define THC_FC 0x4              /* class/fc_host/host<h> */
+#define THC_FCOE 0x8            /* ... whose symbolic_name has " over " */
+#define THC_SRP 0x10            /* class/srp_host/host<h> */
+#define THC_ISCSI 0x20          /* class/iscsi_host/host<h> */
+#define THC_ISCSI_DEV 0x40      /* class/iscsi_host/host<h>/device */
+#define THC_KNOWN 0x100         /* the above have been checked */
+
+/* Copy of an attr_set whose views point into its own (trimmed) arena */
+struct attr_memo {
+        int num;
+        struct attr_view av[MAX_FETCH_ATTRS];
+        char arena[];
+};
+
+struct tport_rec {
+        int h, c, t;                    /* key */
+        unsigned int thc_mask;          /* hosts only, THC_* */
+        bool have_tport;                /* transport_sdev_tport() found */
+        int transport_id;               /* ... this */
+        int iscsi_tsession_num;
+        char * tport;                   /* its one line string */
+        char * sas_end_device;          /* NULL if not SAS */
+        char * fc_rport;                /* rport-* and its sysfs directory */
+        char * fc_rport_dir;
+        struct attr_memo * amp[TPA_NUM];
+        struct sas_topo * sas_topo;     /* SAS hosts only, see below */
+};
 
-/* A code analyzer sees a potential local auto leak via these next two
- * pointers. While the leak is there, it is not exploited. The warning
- * is circumvented by writing NULL to them on their way out of
- * iscsi_target_scan(). */
-static const char * iscsi_dir_name;
-static const struct addr_hctl * iscsi_target_hct;
+struct tport_memo {
+        unsigned int size;              /* number of slots in tbl */
+        unsigned int count;
+        struct tport_rec ** tbl;        /* NULL until first use */
+};
+static struct tport_memo tport_memo;
+static pthread_mutex_t tport_memo_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* SAS topology index: the host -> port -> phy, expander -> port -> end
+ * device -> target -> LU hierarchy below a SAS host's sysfs directory
+ * (class/sas_host/host<h>/device). Only the host's phys and ports (and
+ * their phys) are walked unless 'fabric' is set, which is what the host
+ * listings need; --sas-tree wants all of it plus the sas_address and
+ * link rate of each node. Children are kept in directory order. One is
+ * built on first use for each SAS host and kept in its tport_rec. */
+enum sas_node_kind {
+        SNK_HOST = 0,   /* in the order --sas-tree shows siblings */
+        SNK_PHY,
+        SNK_PORT,
+        SNK_EXPANDER,
+        SNK_END_DEV,
+        SNK_TARGET,
+        SNK_LU,
+};
 
-static int iscsi_tsession_num;
+struct sas_node {
+        uint8_t kind;                   /* SNK_* */
+        int parent;                     /* index in nodes[], -1 for host */
+        int child;                      /* first child, -1 if none */
+        int next;                       /* next sibling, -1 if none */
+        int num;                        /* phys: number after last ':' */
+        char name[48];                  /* e.g. "end_device-2:0:3" */
+        char sas_address[24];           /* 'fabric' only, else "" */
+        char linkrate[24];              /* port phys, 'fabric' only */
+};
 
-static char errpath[LMAX_PATH];
+struct sas_topo {
+        bool fabric;                    /* expanders and below walked */
+        int num;                        /* nodes[0] is the host */
+        int max;
+        struct sas_node * nodes;
+        struct sas_topo * older;        /* replaced, still may be in use */
+};
 
 
 static const char * const usage_message1 =
-        "Usage: lsscsi  [--brief] [--classic] [--controllers] [--device] "
+        "Usage: lsscsi  [--brief] [--cache[=DIR]] [--capture=FILE] "
+        "[--classic]\n"
+        "               [--controllers] [--daemon[=SOCK]] [--device] "
+        "[--device-timeout=MS]\n"
+        "               [--diff=PREV] [--enclosure] [--fields=LIST] "
         "[--generic]\n"
-        "               [--help] [--hosts] [--json[=JO]] [--js-file=JFN] "
-        "[--kname]\n"
-        "               [--list] [--long] [--long-unit] [--lunhex] "
-        "[--no-nvme] [--pdt]\n"
-        "               [--protection] [--prot-mode] [--scsi_id] [--size] "
-        "[--sz-lbs]\n"
-        "               [--sysfsroot=PATH] [--sysroot=AR_PT] [--transport] "
-        "[--unit]\n"
-        "               [--verbose] [--version] [--wwn]  [<h:c:t:l>]\n"
+        "               [--help] [--hosts] [--io-uring] [--jobs=N] "
+        "[--json[=JO]]\n"
+        "               [--js-file=JFN] [--kname] [--list] [--long] "
+        "[--long-unit]\n"
+        "               [--lunhex] [--no-nvme] [--pdt] [--protection] "
+        "[--prot-mode]\n"
+        "               [--replay=FILE] [--sas-tree] [--scsi_id] [--size] "
+        "[--snapshot=FILE]\n"
+        "               [--stats] [--sz-lbs] [--sysfsroot=PATH] "
+        "[--sysroot=AR_PT]\n"
+        "               [--transport] [--unit] [--verbose] [--version] "
+        "[--watch]\n"
+        "               [--wwn] "
+        "[<h:c:t:l>]\n"
         "  where:\n"
         "    --brief|-b        tuple and device name only\n"
+        "    --cache[=DIR]     keep what is found for each device in DIR "
+        "(def:\n"
+        "                      /run/lsscsi) and reuse it while sysfs shows "
+        "that\n"
+        "                      device unchanged\n"
+        "    --capture=FILE    record the directories, links and attributes "
+        "read\n"
+        "                      below sysfs and /dev in archive FILE (added "
+        "to\n"
+        "                      FILE if it holds a capture of the same roots)\n"
         "    --classic|-c      alternate output similar to 'cat "
         "/proc/scsi/scsi'\n"
         "    --controllers|-C   synonym for --hosts since NVMe controllers "
         "treated\n"
         "                       like SCSI hosts\n"
+        "    --daemon[=SOCK]   run as lsscsid: keep the topology in "
+        "memory,\n"
+        "                      current by kernel uevents, and answer "
+        "lsscsi's\n"
+        "                      JSON queries on Unix socket SOCK (def:\n"
+        "                      /run/lsscsi/lsscsid.sock)\n"
         "    --device|-d       show device node's major + minor numbers\n"
+        "    --device-timeout=MS    give up on a device that takes longer "
+        "than MS\n"
+        "                      milliseconds, report it as timed out and "
+        "go on\n"
+        "                      with the others\n"
+        "    --diff=PREV       report the devices and hosts added, removed, "
+        "changed\n"
+        "                      or moved since snapshot PREV "
+        "(from --snapshot=)\n"
+        "    --enclosure       show the enclosure and component (slot) "
+        "each device\n"
+        "                      is in, from class/enclosure\n"
+        "    --fields=LIST     output only the fields in LIST (comma "
+        "separated),\n"
+        "                      reading only what they need; use "
+        "--fields=? to\n"
+        "                      list them\n"
         "    --generic|-g      show scsi generic device name\n"
         "    --help|-h         this usage information\n"
         "    --hosts|-H        lists scsi hosts rather than scsi devices\n"
+        "    --io-uring        read the main attributes of all devices in "
+        "large\n"
+        "                      batches with io_uring, when available\n"
+        "    --jobs=N          use N threads to gather device information "
+        "(def: 1);\n"
+        "                      output order is the same as when N is 1\n"
         "    --json[=JO]|-j[=JO]    output in JSON instead of plain text. "
             "Use\n"
         "                           --json=? or '-j=?' for JSON help\n"
@@ -446,12 +873,27 @@ static const char * const usage_message2 =
         "    --protection|-p   show target and initiator protection "
         "information\n"
         "    --protmode|-P     show negotiated protection information mode\n"
+        "    --replay=FILE     take what sysfs and /dev hold from archive "
+        "FILE\n"
+        "                      (made by --capture=) rather than reading "
+        "them\n"
+        "    --sas-tree        show the SAS fabric below each SAS host: "
+        "ports,\n"
+        "                      phys, expanders and end devices with their "
+        "SAS\n"
+        "                      addresses and link rates\n"
         "    --scsi_id|-i      show udev derived /dev/disk/by-id/scsi* "
         "entry\n"
         "    --size|-s         show disk size, (once for decimal (e.g. "
         "3 GB),\n"
         "                      twice for power of two (e.g. 2.7 GiB),\n"
         "                      thrice for number of blocks))\n"
+        "    --snapshot=FILE   write a snapshot of the devices and hosts "
+        "to FILE,\n"
+        "                      for a later --diff=\n"
+        "    --stats           time each phase and count the files read, "
+        "output\n"
+        "                      to stderr (or in the JSON output)\n"
         "    --sysfsroot=PATH|-y PATH    set sysfs mount point to PATH (def: "
             "/sys)\n"
         "    --sysroot=AR_PT|-Y AR_PT    set alternate root path (def: / ). "
@@ -471,6 +913,10 @@ static const char * const usage_message2 =
         "ATA/SATA)\n"
         "    --verbose|-v      output path names where data is found\n"
         "    --version|-V      output version string and exit\n"
+        "    --watch           after listing, report devices that come, go "
+        "or\n"
+        "                      change (from kernel uevents) until "
+        "interrupted\n"
         "    --wwn|-w          output WWN for disks (from "
         "/dev/disk/by-id/*)\n"
         "    <h:c:t:l>         filter output list (def: '*:*:*:*' (all)). "
@@ -484,6 +930,583 @@ static const char * const usage_message2 =
         "by this utility. Hyphenated long\noption names can also take "
         "underscore (and vice versa).\n";
 
+/* --capture=FILE records what a scan reads from sysfs and /dev: the
+ * directories opened (with their entries when listed), file contents,
+ * stat(2) results, symlink targets and canonical paths. Each record is
+ * keyed by a kind character then the path as lsscsi built it, the first
+ * record for a key is kept. --replay=FILE maps such an archive and serves
+ * the same calls from it, so each attribute costs a lookup rather than
+ * system calls. In replay a directory's descriptor is virtual: VFS_FD_BASE
+ * plus the index of its VK_OPEN record. What was not recorded is missing
+ * (ENOENT). */
+#define VFS_MAGIC "LSSCAP01"    /* 8 bytes, not null terminated */
+#define VFS_BOM 0x01020304U     /* in the byte order of the capturing host */
+#define VFS_FD_BASE 0x40000000  /* well above any real file descriptor */
+#define VFS_FILE_MAX 8192       /* most of a file that is captured */
+#define VFS_KEY_SZ (LMAX_PATH + 2)
+#define VFS_ENTS_INIT_SZ 4096   /* capture: initial slots, a power of 2 */
+
+/* Kinds of record, the first character of each key */
+#define VK_OPEN 'O'     /* directory opened, no value */
+#define VK_LIST 'D'     /* each entry: a d_type byte, its name, a null */
+#define VK_FILE 'F'     /* contents, at most VFS_FILE_MAX bytes */
+#define VK_STAT 'S'     /* struct vfs_stat from stat(2) */
+#define VK_LSTAT 's'    /* struct vfs_stat from lstat(2) */
+#define VK_LINK 'L'     /* symlink target, not null terminated */
+#define VK_CANON 'R'    /* realpath(3), not null terminated */
+
+enum vfs_mode {
+        VFS_LIVE = 0,
+        VFS_CAPTURE,
+        VFS_REPLAY,
+};
+
+/* An archive starts with this header, then the sysfs and /dev roots (each
+ * null terminated) at roots_off, the keys (null terminated, not counted
+ * in key_len) and values, then 'num' records at index_off sorted by key */
+struct vfs_hdr {
+        char magic[8];
+        uint32_t bom;
+        uint32_t num;
+        uint32_t roots_off;
+        uint32_t index_off;
+        uint64_t size;
+};
+
+struct vfs_rec {
+        uint32_t key_off;
+        uint32_t key_len;
+        uint32_t val_off;
+        uint32_t val_len;
+};
+
+/* Value of VK_STAT and VK_LSTAT records: the fields that lsscsi uses */
+struct vfs_stat {
+        uint32_t mode;
+        uint32_t rdev_maj;
+        uint32_t rdev_min;
+        uint32_t pad;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t size;
+        uint64_t ino;
+};
+
+/* A record made by --capture, held until the archive is written */
+struct vfs_ent {
+        uint32_t key_len;
+        uint32_t val_len;
+        char * kv;              /* key, a null, then the value */
+};
+
+/* Directory being listed, see vfs_fdopendir() */
+struct vfs_dir {
+        int fd;                 /* for openat(2) and the like */
+        DIR * dirp;             /* live and capture */
+        char * own;             /* capture: the entries, as recorded */
+        const char * cur;       /* capture and replay: next entry */
+        const char * end;
+        struct dirent de;       /* capture and replay: last entry read */
+};
+
+static struct vfs_t {
+        enum vfs_mode mode;
+        pthread_mutex_t mtx;    /* capture: of ents[] and fd_paths[] */
+        unsigned int num;       /* capture: records in ents[] */
+        unsigned int size;      /* capture: slots in ents[] */
+        struct vfs_ent * ents;
+        int num_fds;            /* capture: slots in fd_paths[] */
+        char ** fd_paths;       /* capture: path of each open directory */
+        const char * fn;        /* the archive */
+        const uint8_t * img;    /* replay: the archive, mapped */
+        size_t img_len;
+        const struct vfs_rec * recs;
+        uint32_t num_recs;
+} vfs = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+static unsigned int
+vfs_hash(const char * key, uint32_t len)
+{
+        unsigned int h = 2166136261U;   /* FNV-1a */
+
+        for ( ; len > 0; --len, ++key)
+                h = (h ^ (uint8_t)*key) * 16777619U;
+        return h;
+}
+
+/* Returns the slot in 'tbl' (which has 'size' slots, a power of 2) that
+ * holds 'key', or the empty slot where it belongs. */
+static struct vfs_ent *
+vfs_ent_slot(struct vfs_ent * tbl, unsigned int size, const char * key,
+             uint32_t len)
+{
+        unsigned int mask = size - 1;
+        unsigned int k = vfs_hash(key, len) & mask;
+        struct vfs_ent * ep;
+
+        for ( ; ; k = (k + 1) & mask) {
+                ep = tbl + k;
+                if ((NULL == ep->kv) || ((len == ep->key_len) &&
+                                         (0 == memcmp(key, ep->kv, len))))
+                        return ep;
+        }
+}
+
+/* Doubles the slots of vfs.ents (the caller holds vfs.mtx) */
+static bool
+vfs_ents_grow(void)
+{
+        unsigned int k;
+        unsigned int n_size = vfs.size ? (2 * vfs.size) : VFS_ENTS_INIT_SZ;
+        struct vfs_ent * n_tbl;
+        struct vfs_ent * ep;
+
+        n_tbl = (struct vfs_ent *)calloc(n_size, sizeof(*n_tbl));
+        if (NULL == n_tbl)
+                return false;
+        for (k = 0; k < vfs.size; ++k) {
+                ep = vfs.ents + k;
+                if (ep->kv)
+                        *vfs_ent_slot(n_tbl, n_size, ep->kv,
+                                      ep->key_len) = *ep;
+        }
+        free(vfs.ents);
+        vfs.ents = n_tbl;
+        vfs.size = n_size;
+        return true;
+}
+
+/* Captures a record unless there is one for 'key' already */
+static void
+vfs_put(const char * key, int key_len, const void * val, uint32_t val_len)
+{
+        char * kv;
+        struct vfs_ent * ep;
+
+        if (key_len < 1)
+                return;
+        pthread_mutex_lock(&vfs.mtx);
+        if ((2 * (vfs.num + 1) > vfs.size) && (! vfs_ents_grow()))
+                goto fini;
+        ep = vfs_ent_slot(vfs.ents, vfs.size, key, key_len);
+        if (ep->kv)
+                goto fini;
+        kv = (char *)malloc(key_len + 1 + val_len);
+        if (NULL == kv)
+                goto fini;
+        memcpy(kv, key, key_len);
+        kv[key_len] = '\0';
+        if (val_len > 0)
+                memcpy(kv + key_len + 1, val, val_len);
+        ep->kv = kv;
+        ep->key_len = key_len;
+        ep->val_len = val_len;
+        ++vfs.num;
+fini:
+        pthread_mutex_unlock(&vfs.mtx);
+}
+
+/* Capture: notes that 'fd' is open on the directory 'path' (of 'len'
+ * bytes), or that it is no longer when 'path' is NULL */
+static void
+vfs_fd_path_set(int fd, const char * path, int len)
+{
+        int k;
+        char * cp = NULL;
+        char ** n_paths;
+
+        if (fd < 0)
+                return;
+        if (path && (NULL == (cp = strndup(path, len))))
+                return;
+        pthread_mutex_lock(&vfs.mtx);
+        if (fd >= vfs.num_fds) {
+                if (NULL == cp)
+                        goto fini;
+                k = (fd < 32) ? 64 : (2 * fd);
+                n_paths = (char **)realloc(vfs.fd_paths,
+                                           k * sizeof(*n_paths));
+                if (NULL == n_paths) {
+                        free(cp);
+                        goto fini;
+                }
+                memset(n_paths + vfs.num_fds, 0,
+                       (k - vfs.num_fds) * sizeof(*n_paths));
+                vfs.fd_paths = n_paths;
+                vfs.num_fds = k;
+        }
+        free(vfs.fd_paths[fd]);
+        vfs.fd_paths[fd] = cp;
+fini:
+        pthread_mutex_unlock(&vfs.mtx);
+}
+
+/* Places in 'key' (VFS_KEY_SZ bytes) the kind 'k' then the path of 'rel'
+ * relative to the directory open on 'dir_fd', as for openat(2). Returns
+ * the key's length or -1 if 'dir_fd' is not a directory that capture or
+ * replay knows of. */
+static int
+vfs_key(char k, int dir_fd, const char * rel, char * key)
+{
+        int n = -1;
+        const struct vfs_rec * rp;
+
+        key[0] = k;
+        if ((AT_FDCWD == dir_fd) || ('/' == rel[0]))
+                n = snprintf(key + 1, VFS_KEY_SZ - 1, "%s", rel);
+        else if (VFS_REPLAY == vfs.mode) {
+                if ((dir_fd < VFS_FD_BASE) ||
+                    ((uint32_t)(dir_fd - VFS_FD_BASE) >= vfs.num_recs))
+                        return -1;
+                rp = vfs.recs + (dir_fd - VFS_FD_BASE);
+                n = snprintf(key + 1, VFS_KEY_SZ - 1, "%.*s/%s",
+                             (int)rp->key_len - 1,
+                             (const char *)vfs.img + rp->key_off + 1, rel);
+        } else {
+                pthread_mutex_lock(&vfs.mtx);
+                if ((dir_fd >= 0) && (dir_fd < vfs.num_fds) &&
+                    vfs.fd_paths[dir_fd])
+                        n = snprintf(key + 1, VFS_KEY_SZ - 1, "%s/%s",
+                                     vfs.fd_paths[dir_fd], rel);
+                pthread_mutex_unlock(&vfs.mtx);
+        }
+        return ((n >= 0) && (n < VFS_KEY_SZ - 1)) ? (n + 1) : -1;
+}
+
+static int
+vfs_key_cmp(const char * a, uint32_t a_len, const char * b, uint32_t b_len)
+{
+        int res = memcmp(a, b, (a_len < b_len) ? a_len : b_len);
+
+        if (res)
+                return res;
+        return (a_len < b_len) ? -1 : (a_len > b_len);
+}
+
+/* Replay: returns the record for 'key' or NULL (with errno ENOENT) */
+static const struct vfs_rec *
+vfs_find(const char * key, int key_len)
+{
+        int res;
+        uint32_t mid;
+        uint32_t lo = 0;
+        uint32_t hi = vfs.num_recs;
+        const struct vfs_rec * rp;
+
+        while ((key_len > 0) && (lo < hi)) {
+                mid = lo + (hi - lo) / 2;
+                rp = vfs.recs + mid;
+                res = vfs_key_cmp(key, key_len,
+                                  (const char *)vfs.img + rp->key_off,
+                                  rp->key_len);
+                if (0 == res)
+                        return rp;
+                if (res < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+        errno = ENOENT;
+        return NULL;
+}
+
+/* Replay: the record of kind 'k' for 'rel' relative to 'dir_fd' */
+static const struct vfs_rec *
+vfs_lookup(char k, int dir_fd, const char * rel)
+{
+        char key[VFS_KEY_SZ];
+
+        return vfs_find(key, vfs_key(k, dir_fd, rel, key));
+}
+
+/* Opens the directory 'rel' (relative to 'dir_fd' which may be AT_FDCWD)
+ * for use as the 'dirfd' argument of openat(2), fstatat(2), readlinkat(2)
+ * and the like (through the vfs_*() functions below). Symlinks are
+ * followed. Returns a file descriptor or -1 . */
+static int
+opendir_fd(int dir_fd, const char * rel)
+{
+        int fd, n;
+        const struct vfs_rec * rp;
+        char key[VFS_KEY_SZ];
+
+        if (VFS_REPLAY == vfs.mode) {
+                rp = vfs_lookup(VK_OPEN, dir_fd, rel);
+                return rp ? (VFS_FD_BASE + (int)(rp - vfs.recs)) : -1;
+        }
+        fd = openat(dir_fd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if ((VFS_CAPTURE == vfs.mode) && (fd >= 0) &&
+            ((n = vfs_key(VK_OPEN, dir_fd, rel, key)) > 0)) {
+                vfs_put(key, n, NULL, 0);
+                vfs_fd_path_set(fd, key + 1, n - 1);
+        }
+        return fd;
+}
+
+/* Closes a directory descriptor from opendir_fd() or vfs_dupfd() */
+static void
+vfs_close(int fd)
+{
+        if (VFS_REPLAY == vfs.mode) {
+                if (fd >= VFS_FD_BASE)
+                        return;
+        } else if (VFS_CAPTURE == vfs.mode)
+                vfs_fd_path_set(fd, NULL, 0);
+        close(fd);
+}
+
+/* Like fcntl(fd, F_DUPFD_CLOEXEC, 0) for a directory descriptor */
+static int
+vfs_dupfd(int fd)
+{
+        int n_fd;
+        char * cp = NULL;
+
+        if ((VFS_REPLAY == vfs.mode) && (fd >= VFS_FD_BASE))
+                return fd;
+        n_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if ((VFS_CAPTURE == vfs.mode) && (n_fd >= 0)) {
+                pthread_mutex_lock(&vfs.mtx);
+                if ((fd < vfs.num_fds) && vfs.fd_paths[fd])
+                        cp = strdup(vfs.fd_paths[fd]);
+                pthread_mutex_unlock(&vfs.mtx);
+                if (cp)
+                        vfs_fd_path_set(n_fd, cp, strlen(cp));
+                free(cp);
+        }
+        return n_fd;
+}
+
+/* Reads at most 'len' bytes from the start of file 'rel' (relative to
+ * 'dir_fd' as for openat(2)) into 'buf'. Returns the number of bytes read
+ * (0 if the read fails) or -1 if the file can't be opened. */
+static ssize_t
+vfs_read_at(int dir_fd, const char * rel, void * buf, size_t len)
+{
+        int fd, n;
+        ssize_t res;
+        const struct vfs_rec * rp;
+        char key[VFS_KEY_SZ];
+        char img[VFS_FILE_MAX];
+
+        if (VFS_REPLAY == vfs.mode) {
+                if (NULL == (rp = vfs_lookup(VK_FILE, dir_fd, rel)))
+                        return -1;
+                res = (rp->val_len < len) ? rp->val_len : len;
+                memcpy(buf, vfs.img + rp->val_off, res);
+                return res;
+        }
+        fd = openat(dir_fd, rel, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+        if (VFS_LIVE == vfs.mode) {
+                res = pread(fd, buf, len, 0);
+                close(fd);
+                return (res < 0) ? 0 : res;
+        }
+        /* capture all (or the first VFS_FILE_MAX bytes) of it */
+        res = pread(fd, img, sizeof(img), 0);
+        close(fd);
+        if (res < 0)
+                res = 0;
+        if ((n = vfs_key(VK_FILE, dir_fd, rel, key)) > 0)
+                vfs_put(key, n, img, res);
+        if ((size_t)res > len)
+                res = len;
+        memcpy(buf, img, res);
+        return res;
+}
+
+/* fstatat(2) with 'flags' 0 or AT_SYMLINK_NOFOLLOW. Only the type and
+ * permissions in st_mode, st_rdev, st_ino, st_size and st_mtim are kept
+ * by capture and set by replay. */
+static int
+vfs_fstatat(int dir_fd, const char * rel, struct stat * stp, int flags)
+{
+        int n, res;
+        char k = (flags & AT_SYMLINK_NOFOLLOW) ? VK_LSTAT : VK_STAT;
+        const struct vfs_rec * rp;
+        struct vfs_stat vs;
+        char key[VFS_KEY_SZ];
+
+        if (VFS_REPLAY == vfs.mode) {
+                rp = vfs_lookup(k, dir_fd, rel);
+                if ((NULL == rp) || (rp->val_len != sizeof(vs))) {
+                        errno = ENOENT;
+                        return -1;
+                }
+                memcpy(&vs, vfs.img + rp->val_off, sizeof(vs));
+                memset(stp, 0, sizeof(*stp));
+                stp->st_mode = vs.mode;
+                stp->st_rdev = makedev(vs.rdev_maj, vs.rdev_min);
+                stp->st_ino = vs.ino;
+                stp->st_size = vs.size;
+                stp->st_mtim.tv_sec = vs.mtime_sec;
+                stp->st_mtim.tv_nsec = vs.mtime_nsec;
+                return 0;
+        }
+        res = fstatat(dir_fd, rel, stp, flags);
+        if ((VFS_CAPTURE == vfs.mode) && (0 == res) &&
+            ((n = vfs_key(k, dir_fd, rel, key)) > 0)) {
+                memset(&vs, 0, sizeof(vs));
+                vs.mode = stp->st_mode;
+                vs.rdev_maj = major(stp->st_rdev);
+                vs.rdev_min = minor(stp->st_rdev);
+                vs.mtime_sec = stp->st_mtim.tv_sec;
+                vs.mtime_nsec = stp->st_mtim.tv_nsec;
+                vs.size = stp->st_size;
+                vs.ino = stp->st_ino;
+                vfs_put(key, n, &vs, sizeof(vs));
+        }
+        return res;
+}
+
+static int
+vfs_stat(const char * path, struct stat * stp)
+{
+        return vfs_fstatat(AT_FDCWD, path, stp, 0);
+}
+
+/* readlinkat(2): no null is appended */
+static ssize_t
+vfs_readlinkat(int dir_fd, const char * rel, char * buf, size_t len)
+{
+        int n;
+        ssize_t res;
+        const struct vfs_rec * rp;
+        char key[VFS_KEY_SZ];
+
+        if (VFS_REPLAY == vfs.mode) {
+                if (NULL == (rp = vfs_lookup(VK_LINK, dir_fd, rel)))
+                        return -1;
+                res = (rp->val_len < len) ? rp->val_len : len;
+                memcpy(buf, vfs.img + rp->val_off, res);
+                return res;
+        }
+        res = readlinkat(dir_fd, rel, buf, len);
+        if ((VFS_CAPTURE == vfs.mode) && (res > 0) &&
+            ((n = vfs_key(VK_LINK, dir_fd, rel, key)) > 0))
+                vfs_put(key, n, buf, res);
+        return res;
+}
+
+/* realpath(3) with 'out' of PATH_MAX bytes */
+static char *
+vfs_realpath(const char * path, char * out)
+{
+        int n;
+        char * res;
+        const struct vfs_rec * rp;
+        char key[VFS_KEY_SZ];
+
+        if (VFS_REPLAY == vfs.mode) {
+                rp = vfs_lookup(VK_CANON, AT_FDCWD, path);
+                if ((NULL == rp) || (rp->val_len >= PATH_MAX))
+                        return NULL;
+                memcpy(out, vfs.img + rp->val_off, rp->val_len);
+                out[rp->val_len] = '\0';
+                return out;
+        }
+        res = realpath(path, out);
+        if ((VFS_CAPTURE == vfs.mode) && res &&
+            ((n = vfs_key(VK_CANON, AT_FDCWD, path, key)) > 0))
+                vfs_put(key, n, res, strlen(res));
+        return res;
+}
+
+/* Readies 'vdp' to list the directory open on 'fd', which it then owns
+ * (vfs_closedir() closes it). Returns false if that fails, 'fd' is then
+ * still the caller's. */
+static bool
+vfs_fdopendir(struct vfs_dir * vdp, int fd)
+{
+        int n, len;
+        int max_len = 0;
+        struct dirent * dep;
+        const struct vfs_rec * rp;
+        char * cp;
+        char key[VFS_KEY_SZ];
+
+        memset(vdp, 0, sizeof(*vdp));
+        vdp->fd = fd;
+        if (VFS_REPLAY == vfs.mode) {
+                /* opened but never listed by the capture: no entries */
+                if ((rp = vfs_lookup(VK_LIST, fd, "."))) {
+                        vdp->cur = (const char *)vfs.img + rp->val_off;
+                        vdp->end = vdp->cur + rp->val_len;
+                }
+                return fd >= VFS_FD_BASE;
+        }
+        vdp->dirp = fdopendir(fd);
+        if (NULL == vdp->dirp)
+                return false;
+        if (VFS_LIVE == vfs.mode)
+                return true;
+        /* capture reads all the entries now, then hands them out */
+        for (n = 0; (dep = readdir(vdp->dirp)); n += len + 2) {
+                len = strlen(dep->d_name);
+                if (n + len + 2 > max_len) {
+                        max_len = 2 * (n + len + 2) + 256;
+                        cp = (char *)realloc(vdp->own, max_len);
+                        if (NULL == cp)
+                                break;
+                        vdp->own = cp;
+                }
+                vdp->own[n] = (char)dep->d_type;
+                memcpy(vdp->own + n + 1, dep->d_name, len + 1);
+        }
+        if ((len = vfs_key(VK_LIST, fd, ".", key)) > 0)
+                vfs_put(key, len, vdp->own, n);
+        vdp->cur = vdp->own;
+        vdp->end = vdp->own + n;
+        return true;
+}
+
+/* Opens 'rel' (relative to 'dir_fd') and readies 'vdp' to list it */
+static bool
+vfs_opendir_at(struct vfs_dir * vdp, int dir_fd, const char * rel)
+{
+        int fd = opendir_fd(dir_fd, rel);
+
+        if (fd < 0)
+                return false;
+        if (vfs_fdopendir(vdp, fd))
+                return true;
+        vfs_close(fd);
+        return false;
+}
+
+/* Like readdir(3): NULL after the last entry */
+static struct dirent *
+vfs_readdir(struct vfs_dir * vdp)
+{
+        int len;
+
+        if (VFS_LIVE == vfs.mode)
+                return readdir(vdp->dirp);
+        if ((NULL == vdp->cur) || (vdp->cur + 2 > vdp->end))
+                return NULL;
+        len = strnlen(vdp->cur + 1, vdp->end - vdp->cur - 1);
+        if (len >= (int)sizeof(vdp->de.d_name))
+                return NULL;
+        vdp->de.d_type = (uint8_t)vdp->cur[0];
+        memcpy(vdp->de.d_name, vdp->cur + 1, len);
+        vdp->de.d_name[len] = '\0';
+        vdp->cur += len + 2;
+        return &vdp->de;
+}
+
+static void
+vfs_closedir(struct vfs_dir * vdp)
+{
+        if (VFS_CAPTURE == vfs.mode) {
+                vfs_fd_path_set(vdp->fd, NULL, 0);
+                free(vdp->own);
+        }
+        if (vdp->dirp)
+                closedir(vdp->dirp);
+}
+
 
 #if (HAVE_NVME && (! IGNORE_NVME))
 
@@ -498,7 +1521,7 @@ trim_lead_trail(char * s, bool trim_leading, bool trim_trailing)
         char * p = s;
 
         if ((NULL == s) || (0 == ((n = (int)strlen(p)))) ||
-            (! (trim_leading && trim_trailing))) /* sanity checks */
+            (! (trim_leading || trim_trailing))) /* sanity checks */
                 return s ? (int)strlen(s) : 0;
 
         if (trim_trailing) {
@@ -537,7 +1560,7 @@ trunc_pad2n(char * str, int n, bool trailing__on_trunc)
 
 static const char * bad_arg = "Bad_argument";
 
-/* Opens the file 'dirp/fname' and searches for 'name'=, the first one found
+/* Reads the file 'dirp/fname' and searches for 'name'=, the first one found
  * has its value (rest of line after "=") returned in 'b'. The 'name' is
  * typically in upper case. Example: 'MAJOR=253' if name is 'MAJOR' returns
  * pointer to string containing '253'. */
@@ -545,13 +1568,13 @@ static char *
 name_eq2value(const char * dirp, const char * fname, const char * name,
               int b_len, char * b)
 {
-        bool ok = false;
-        int k;
         size_t len = 0;
         size_t n;
+        ssize_t got;
         char * full_name;
-        FILE * fp = NULL;
-        char line[132];
+        const char * lp;
+        const char * ep;
+        char img[VFS_FILE_MAX];
 
         if (b_len > 0)
                 b[0] = '\0';
@@ -576,9 +1599,12 @@ name_eq2value(const char * dirp, const char * fname, const char * name,
         else    /* fname must be nz (if zero(null) then len==0 above) */
                 snprintf(full_name, len - 2, "%s", fname);
 
-        fp = fopen(full_name, "r");
-        if (NULL == fp)
+        got = vfs_read_at(AT_FDCWD, full_name, img, sizeof(img) - 1);
+        if (got < 0)
                 goto clean_up;
+        ++tl_io.attrs;
+        tl_io.bytes += got;
+        img[got] = '\0';
 
         if (strlen(name) >= (len - 2)) {
                 snprintf(b, b_len, "%s", bad_arg);
@@ -588,24 +1614,20 @@ name_eq2value(const char * dirp, const char * fname, const char * name,
         snprintf(full_name, len - 1, "%s=", name);
         n = strlen(full_name);
 
-        for (k = 0; k < 1024; ++k) {    /* shouldn't be that many lines */
-                if (NULL == fgets(line, sizeof(line), fp))
-                        break;
-                if (0 == strncmp(line, full_name, n)) {
-                        ok = true;
+        for (lp = img; *lp; lp = ep + 1) {
+                ep = strchr(lp, '\n');
+                if (0 == strncmp(lp, full_name, n)) {
+                        /* value without its trailing LF */
+                        snprintf(b, b_len, "%.*s",
+                                 (int)(ep ? (ep - lp - n) : strlen(lp + n)),
+                                 lp + n);
                         break;
                 }
-        }
-        if (ok) {
-                snprintf(b, b_len, "%s", line + n);
-                n = strlen(b);
-                if ((n > 0) && ('\n' == b[n - 1]))
-                        b[n - 1] = '\0';        /* remove trailing LF */
+                if (NULL == ep)
+                        break;
         }
 clean_up:
         free(full_name);
-        if (fp)
-                fclose(fp);
         return b;
 }
 
@@ -675,33 +1697,109 @@ my_strcopy(char *dest, const char *src, int dest_maxlen)
 }
 
 static uint64_t
-lun_word_flip(uint64_t in)
+stats_now_ns(void)
 {
-        int k;
-        uint64_t res = 0;
+        struct timespec ts;
 
-        for (k = 0; ; ++k) {
-                res |= (in & 0xffff);
-                if (k > 2)
-                        break;
-                res <<= 16;
-                in >>= 16;
-        }
-        return res;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
 }
 
-/* Bits 3, 2, 1, 0 in sel_mask select the h, c, t, l components respectively.
- * Bits 4+5 of sel_mask convey the --lunhex option selecting l (LUN) in
- * hex. Generates string of the form %d:%d:%d with a colon between
- * components, returns 4th argument. */
-static char *
-tuple2string(const struct addr_hctl * tp, int sel_mask, int blen, char * b)
+/* Adds each of the counts in 'bp' to those in 'ap', or subtracts them if
+ * 'sub' is true. */
+static void
+io_add(struct io_counts * ap, const struct io_counts * bp, bool sub)
 {
-        bool got1 = false;
-        bool is_nvme = (NVME_HOST_NUM == tp->h);
-        int n = 0;
+        if (sub) {
+                ap->dirs -= bp->dirs;
+                ap->attrs -= bp->attrs;
+                ap->bytes -= bp->bytes;
+                ap->links -= bp->links;
+                ap->canon -= bp->canon;
+                ap->nodes -= bp->nodes;
+        } else {
+                ap->dirs += bp->dirs;
+                ap->attrs += bp->attrs;
+                ap->bytes += bp->bytes;
+                ap->links += bp->links;
+                ap->canon += bp->canon;
+                ap->nodes += bp->nodes;
+        }
+}
 
-        if (0x8 & sel_mask) {
+/* Places the counts of the calling thread in 'icp'. If 'all' is true the
+ * counts of worker threads that have finished are added. */
+static void
+io_snap(struct io_counts * icp, bool all)
+{
+        *icp = tl_io;
+        icp->nodes = sgj_values_made();
+        if (all) {
+                pthread_mutex_lock(&stats.mtx);
+                io_add(icp, &stats.io_pooled, false);
+                pthread_mutex_unlock(&stats.mtx);
+        }
+}
+
+/* Where a --stats phase began */
+struct stats_mark {
+        uint64_t ns;
+        struct io_counts io;
+};
+
+static void
+stats_begin(struct stats_mark * smp, bool all)
+{
+        if (! stats.on)
+                return;
+        io_snap(&smp->io, all);
+        smp->ns = stats_now_ns();
+}
+
+/* Adds what was done since stats_begin(smp, all) to phase 'ph' */
+static void
+stats_end(enum stats_phase ph, const struct stats_mark * smp, bool all)
+{
+        struct io_counts now;
+        struct stats_phase_rec * prp = stats.ph + ph;
+
+        if (! stats.on)
+                return;
+        prp->ns += stats_now_ns() - smp->ns;
+        io_snap(&now, all);
+        io_add(&now, &smp->io, true);
+        io_add(&prp->io, &now, false);
+        ++prp->runs;
+}
+
+static uint64_t
+lun_word_flip(uint64_t in)
+{
+        int k;
+        uint64_t res = 0;
+
+        for (k = 0; ; ++k) {
+                res |= (in & 0xffff);
+                if (k > 2)
+                        break;
+                res <<= 16;
+                in >>= 16;
+        }
+        return res;
+}
+
+/* Bits 3, 2, 1, 0 in sel_mask select the h, c, t, l components respectively.
+ * Bits 4+5 of sel_mask convey the --lunhex option selecting l (LUN) in
+ * hex. Generates string of the form %d:%d:%d with a colon between
+ * components, returns 4th argument. */
+static char *
+tuple2string(const struct addr_hctl * tp, int sel_mask, int blen, char * b)
+{
+        bool got1 = false;
+        bool is_nvme = (NVME_HOST_NUM == tp->h);
+        int n = 0;
+
+        if (0x8 & sel_mask) {
                 if (is_nvme)
                         n += sg_scn3pr(b, blen, n, "N");
                 else
@@ -896,18 +1994,125 @@ invalidate_hctl(struct addr_hctl * p)
         }
 }
 
+typedef int (* dirent_select_ctx_fn) (const struct dirent *, void *);
+
+/* Like scandir(3) with no sort function, but the select function 'fn' is
+ * also given 'ctx' so it can record what it finds without using file scope
+ * variables. 'dir_name' is relative to the directory open on 'dir_fd'
+ * unless it is absolute or 'dir_fd' is AT_FDCWD (i.e. as for openat(2)).
+ * If 'namelistp' is NULL, selected entries are only counted,
+ * otherwise a heap allocated array of copies is placed in *namelistp so it
+ * can be freed like scandir()'s output. Returns the number of entries
+ * selected or -1 for error (with errno set). */
+static int
+scandir_ctx(int dir_fd, const char * dir_name, struct dirent *** namelistp,
+            dirent_select_ctx_fn fn, void * ctx)
+{
+        int num = 0;
+        int max_num = 0;
+        struct dirent * dep;
+        struct dirent * cp_dep;
+        struct dirent ** nl = NULL;
+        struct dirent ** n2l;
+        struct vfs_dir vd;
+
+        if (namelistp)
+                *namelistp = NULL;
+        if (! vfs_opendir_at(&vd, dir_fd, dir_name))
+                return -1;
+        ++tl_io.dirs;
+        while ((dep = vfs_readdir(&vd))) {
+                if (fn && (! fn(dep, ctx)))
+                        continue;
+                if (namelistp) {
+                        if (num >= max_num) {
+                                max_num = max_num ? (2 * max_num) : 16;
+                                n2l = (struct dirent **)realloc(nl,
+                                                max_num * sizeof(*nl));
+                                if (NULL == n2l)
+                                        goto err_out;
+                                nl = n2l;
+                        }
+                        cp_dep = (struct dirent *)malloc(sizeof(*dep));
+                        if (NULL == cp_dep)
+                                goto err_out;
+                        memcpy(cp_dep, dep, sizeof(*dep));
+                        nl[num] = cp_dep;
+                }
+                ++num;
+        }
+        vfs_closedir(&vd);
+        if (namelistp)
+                *namelistp = nl;
+        return num;
+err_out:
+        while (--num >= 0)
+                free(nl[num]);
+        free(nl);
+        vfs_closedir(&vd);
+        return -1;
+}
+
+/* The select and compare functions of scandir_cnt() */
+struct scandir_fns {
+        int (* select_fn)(const struct dirent *);
+        int (* compar_fn)(const struct dirent **, const struct dirent **);
+};
+
+static int
+scandir_fns_select(const struct dirent * s, void * ctx)
+{
+        const struct scandir_fns * sfp = (const struct scandir_fns *)ctx;
+
+        return sfp->select_fn ? sfp->select_fn(s) : 1;
+}
+
+static int
+scandir_fns_cmp(const void * a, const void * b, void * ctx)
+{
+        const struct scandir_fns * sfp = (const struct scandir_fns *)ctx;
+
+        return sfp->compar_fn((const struct dirent **)a,
+                              (const struct dirent **)b);
+}
+
+/* scandir(3), counted for --stats. Capture and replay go through
+ * scandir_ctx() then sort as scandir(3) does. */
+static int
+scandir_cnt(const char * dir_name, struct dirent *** namelistp,
+            int (* select_fn)(const struct dirent *),
+            int (* compar_fn)(const struct dirent **,
+                              const struct dirent **))
+{
+        int num;
+        struct scandir_fns sf = {select_fn, compar_fn};
+
+        if (VFS_LIVE == vfs.mode) {
+                ++tl_io.dirs;
+                return scandir(dir_name, namelistp, select_fn, compar_fn);
+        }
+        num = scandir_ctx(AT_FDCWD, dir_name, namelistp, scandir_fns_select,
+                          &sf);
+        if ((num > 1) && compar_fn)
+                qsort_r(*namelistp, num, sizeof(**namelistp),
+                        scandir_fns_cmp, &sf);
+        return num;
+}
+
 /* Return 1 for directory entry that is link or directory (other than
  * a directory name starting with dot). Else return 0.  */
 static int
-first_dir_scan_select(const struct dirent * s)
+first_dir_scan_select(const struct dirent * s, void * ctx)
 {
-        if (FT_OTHER != aa_first.ft)
+        struct item_t * ip = (struct item_t *)ctx;
+
+        if (FT_OTHER != ip->ft)
                 return 0;
         if (! dir_or_link(s, NULL))
                 return 0;
-        my_strcopy(aa_first.name, s->d_name, LMAX_NAME);
-        aa_first.ft = FT_CHAR;  /* dummy */
-        aa_first.d_type = s->d_type;
+        my_strcopy(ip->name, s->d_name, LMAX_NAME);
+        ip->ft = FT_CHAR;  /* dummy */
+        ip->d_type = s->d_type;
         return 1;
 }
 
@@ -950,7 +2155,7 @@ sub_scan(char * dir_name, const char * sub_str, dirent_select_fn fn)
         int num, k, len;
         struct dirent ** namelist;
 
-        num = scandir(dir_name, &namelist, fn, NULL);
+        num = scandir_cnt(dir_name, &namelist, fn, NULL);
         if (num <= 0)
                 return false;
         len = strlen(dir_name);
@@ -963,7 +2168,8 @@ sub_scan(char * dir_name, const char * sub_str, dirent_select_fn fn)
         free(namelist);
 
         if (strstr(dir_name, sub_str) == 0) {
-                num = scandir(dir_name, &namelist, sub_dir_scan_select, NULL);
+                num = scandir_cnt(dir_name, &namelist, sub_dir_scan_select,
+                                  NULL);
                 if (num <= 0)
                         return false;
                 len = strlen(dir_name);
@@ -995,116 +2201,74 @@ sd_scan(char * dir_name)
         return sub_scan(dir_name, "scsi_disk:", sd_dir_scan_select);
 }
 
-static int
-enclosure_device_dir_scan_select(const struct dirent * s)
-{
-        if (dir_or_link(s, "enclosure_device")) {
-                my_strcopy(enclosure_device.name, s->d_name,
-                           LMAX_NAME);
-                enclosure_device.ft = FT_CHAR;  /* dummy */
-                enclosure_device.d_type = s->d_type;
-                return 1;
-        }
-        return 0;
-}
-
-/* Return true for directory entry that is link or directory (other than a
- * directory name starting with dot) that contains "enclosure_device".
- * Else return false.  */
-static bool
-enclosure_device_scan(const char * dir_name, const struct lsscsi_opts * op)
-{
-        int num, k;
-        struct dirent ** namelist;
-
-        num = scandir(dir_name, &namelist, enclosure_device_dir_scan_select,
-                      NULL);
-        if (num < 0) {
-                if (op->verbose > 0) {
-                        int n = 0;
-                        int elen = sizeof(errpath);
-
-                        n += sg_scn3pr(errpath, elen, n, "%s: scandir: ",
-                                       __func__);
-                        sg_scn3pr(errpath, elen, n, "%s", dir_name);
-                        perror(errpath);
-                }
-                return false;
-        }
-        for (k = 0; k < num; ++k)
-                free(namelist[k]);
-        free(namelist);
-        return !! num;
-}
-
 /* scan for directory entry that is either a symlink or a directory. Returns
- * number found or -1 for error. */
+ * number found or -1 for error. 'dir_name' is relative to 'dir_fd' which
+ * may be AT_FDCWD. */
 static int
-scan_for_first(const char * dir_name, const struct lsscsi_opts * op)
+scan_for_first(int dir_fd, const char * dir_name,
+               const struct lsscsi_opts * op, struct dev_ctx_t * dcp)
 {
-        int num, k;
-        struct dirent ** namelist;
+        int num;
 
-        aa_first.ft = FT_OTHER;
-        num = scandir(dir_name, &namelist, first_dir_scan_select, NULL);
+        dcp->aa_first.ft = FT_OTHER;
+        num = scandir_ctx(dir_fd, dir_name, NULL, first_dir_scan_select,
+                          &dcp->aa_first);
         if (num < 0) {
                 if (op->verbose > 0) {
                         int n = 0;
-                        int elen = sizeof(errpath);
+                        int elen = sizeof(dcp->errpath);
 
-                        n += sg_scn3pr(errpath, elen, n, "%s: scandir: ",
+                        n += sg_scn3pr(dcp->errpath, elen, n, "%s: scandir: ",
                                        __func__);
-                        sg_scn3pr(errpath, elen, n, "%s", dir_name);
-                        perror(errpath);
+                        sg_scn3pr(dcp->errpath, elen, n, "%s", dir_name);
+                        perror(dcp->errpath);
                 }
                 return -1;
         }
-        for (k = 0; k < num; ++k)
-                free(namelist[k]);
-        free(namelist);
         return num;
 }
 
 /* Assume at most 1 of the subdirectory/symlinks from the scanned directory
  * matches the strings in the strncmp() calls below. */
 static int
-non_sg_dir_scan_select(const struct dirent * s)
+non_sg_dir_scan_select(const struct dirent * s, void * ctx)
 {
         int len;
+        struct item_t * ip = (struct item_t *)ctx;
 
-        if (FT_OTHER != non_sg.ft)
+        if (FT_OTHER != ip->ft)
                 return 0;
         if (! dir_or_link(s, NULL))
                 return 0;
         if (0 == strncmp("scsi_changer", s->d_name, 12)) {
-                my_strcopy(non_sg.name, s->d_name, LMAX_NAME);
-                non_sg.ft = FT_CHAR;
-                non_sg.d_type = s->d_type;
+                my_strcopy(ip->name, s->d_name, LMAX_NAME);
+                ip->ft = FT_CHAR;
+                ip->d_type = s->d_type;
                 return 1;
         } else if (0 == strncmp("block", s->d_name, 5)) {
-                my_strcopy(non_sg.name, s->d_name, LMAX_NAME);
-                non_sg.ft = FT_BLOCK;
-                non_sg.d_type = s->d_type;
+                my_strcopy(ip->name, s->d_name, LMAX_NAME);
+                ip->ft = FT_BLOCK;
+                ip->d_type = s->d_type;
                 return 1;
         } else if (0 == strcmp("tape", s->d_name)) {
-                my_strcopy(non_sg.name, s->d_name, LMAX_NAME);
-                non_sg.ft = FT_CHAR;
-                non_sg.d_type = s->d_type;
+                my_strcopy(ip->name, s->d_name, LMAX_NAME);
+                ip->ft = FT_CHAR;
+                ip->d_type = s->d_type;
                 return 1;
         } else if (0 == strncmp("scsi_tape:st", s->d_name, 12)) {
                 len = strlen(s->d_name);
                 if (isdigit(s->d_name[len - 1])) {
                         /* want 'st<num>' symlink only */
-                        my_strcopy(non_sg.name, s->d_name, LMAX_NAME);
-                        non_sg.ft = FT_CHAR;
-                        non_sg.d_type = s->d_type;
+                        my_strcopy(ip->name, s->d_name, LMAX_NAME);
+                        ip->ft = FT_CHAR;
+                        ip->d_type = s->d_type;
                         return 1;
                 } else
                         return 0;
         } else if (0 == strncmp("onstream_tape:os", s->d_name, 16)) {
-                my_strcopy(non_sg.name, s->d_name, LMAX_NAME);
-                non_sg.ft = FT_CHAR;
-                non_sg.d_type = s->d_type;
+                my_strcopy(ip->name, s->d_name, LMAX_NAME);
+                ip->ft = FT_CHAR;
+                ip->d_type = s->d_type;
                 return 1;
         } else
                 return 0;
@@ -1112,39 +2276,40 @@ non_sg_dir_scan_select(const struct dirent * s)
 
 /* Want to know the primary device sysfs directory (if any). Ignore the scsi
  * generic sysfs directory.  Returns number found (expected to be 1 or 0) or
- * -1 for error */
+ * -1 for error. 'dir_name' is relative to 'dir_fd' which may be
+ * AT_FDCWD. */
 static int
-non_sg_scan(const char * dir_name, const struct lsscsi_opts * op)
+non_sg_scan(int dir_fd, const char * dir_name, const struct lsscsi_opts * op,
+            struct dev_ctx_t * dcp)
 {
-        int num, k;
-        struct dirent ** namelist;
+        int num;
 
-        non_sg.ft = FT_OTHER;
-        num = scandir(dir_name, &namelist, non_sg_dir_scan_select, NULL);
+        dcp->non_sg.ft = FT_OTHER;
+        num = scandir_ctx(dir_fd, dir_name, NULL, non_sg_dir_scan_select,
+                          &dcp->non_sg);
         if (num < 0) {
                 if (op->verbose > 0) {
-                        sg_scnpr(errpath, LMAX_PATH, "%s: scandir: %s",
+                        sg_scnpr(dcp->errpath, LMAX_PATH, "%s: scandir: %s",
                                  __func__, dir_name);
-                        perror(errpath);
+                        perror(dcp->errpath);
                 }
                 return -1;
         }
-        for (k = 0; k < num; ++k)
-                free(namelist[k]);
-        free(namelist);
         return num;
 }
 
 
 static int
-sg_dir_scan_select(const struct dirent * s)
+sg_dir_scan_select(const struct dirent * s, void * ctx)
 {
-        if (FT_OTHER != aa_sg.ft)
+        struct item_t * ip = (struct item_t *)ctx;
+
+        if (FT_OTHER != ip->ft)
                 return 0;
         if (dir_or_link(s, "scsi_generic")) {
-                my_strcopy(aa_sg.name, s->d_name, LMAX_NAME);
-                aa_sg.ft = FT_CHAR;
-                aa_sg.d_type = s->d_type;
+                my_strcopy(ip->name, s->d_name, LMAX_NAME);
+                ip->ft = FT_CHAR;
+                ip->d_type = s->d_type;
                 return 1;
         } else
                 return 0;
@@ -1153,32 +2318,26 @@ sg_dir_scan_select(const struct dirent * s)
 /* Returns number of directories or links starting with "scsi_generic"
  * found or -1 for error. */
 static int
-sg_scan(const char * dir_name)
+sg_scan(const char * dir_name, struct dev_ctx_t * dcp)
 {
-        int num, k;
-        struct dirent ** namelist;
-
-        aa_sg.ft = FT_OTHER;
-        num = scandir(dir_name, &namelist, sg_dir_scan_select, NULL);
-        if (num < 0)
-                return -1;
-        for (k = 0; k < num; ++k)
-                free(namelist[k]);
-        free(namelist);
-        return num;
+        dcp->aa_sg.ft = FT_OTHER;
+        return scandir_ctx(AT_FDCWD, dir_name, NULL, sg_dir_scan_select,
+                           &dcp->aa_sg);
 }
 
 #if (HAVE_NVME && (! IGNORE_NVME))
 
 static int
-ng_dir_scan_select(const struct dirent * s)
+ng_dir_scan_select(const struct dirent * s, void * ctx)
 {
-        if (FT_OTHER != aa_ng.ft)
+        struct item_t * ip = (struct item_t *)ctx;
+
+        if (FT_OTHER != ip->ft)
                 return 0;
         if (dir_or_link(s, "ng")) {
-                my_strcopy(aa_ng.name, s->d_name, LMAX_NAME);
-                aa_ng.ft = FT_CHAR;
-                aa_ng.d_type = s->d_type;
+                my_strcopy(ip->name, s->d_name, LMAX_NAME);
+                ip->ft = FT_CHAR;
+                ip->d_type = s->d_type;
                 return 1;
         } else
                 return 0;
@@ -1187,190 +2346,168 @@ ng_dir_scan_select(const struct dirent * s)
 /* Returns number of directories or links starting with "ng"
  * found or -1 for error. */
 static int
-ng_scan(const char * dir_name)
-{
-        int num, k;
-        struct dirent ** namelist;
-
-        aa_ng.ft = FT_OTHER;
-        num = scandir(dir_name, &namelist, ng_dir_scan_select, NULL);
-        if (num < 0)
-                return -1;
-        for (k = 0; k < num; ++k)
-                free(namelist[k]);
-        free(namelist);
-        return num;
-}
-
-#endif
-
-static int
-sas_port_dir_scan_select(const struct dirent * s)
-{
-        return (dir_or_link(s, "port-")) ? 1 : 0;
-}
-
-static int
-sas_port_scan(const char * dir_name, struct dirent ***port_list)
+ng_scan(const char * dir_name, struct dev_ctx_t * dcp)
 {
-        int num;
-        struct dirent ** namelist;
-
-        namelist = NULL;
-        num = scandir(dir_name, &namelist, sas_port_dir_scan_select, NULL);
-        if (num < 0) {
-                *port_list = NULL;
-                return -1;
-        }
-        *port_list = namelist;
-        return num;
+        dcp->aa_ng.ft = FT_OTHER;
+        return scandir_ctx(AT_FDCWD, dir_name, NULL, ng_dir_scan_select,
+                           &dcp->aa_ng);
 }
 
-
+/* Like ng_scan() but looks for the "nvme-generic" device of namespace
+ * 'ns_name' (e.g. "ng0n2" for "nvme0n2") first, rather than taking the
+ * first of the controller's. */
 static int
-sas_low_phy_dir_scan_select(const struct dirent * s)
+ng_ns_scan(const char * dir_name, const char * ns_name,
+           struct dev_ctx_t * dcp)
 {
-        int n, m;
-        char * cp;
+        struct stat a_stat;
+        char b[LMAX_PATH];
 
-        if (dir_or_link(s, "phy")) {
-                if (0 == strlen(sas_low_phy))
-                        my_strcopy(sas_low_phy, s->d_name, LMAX_NAME);
-                else {
-                        cp = (char *)strrchr(s->d_name, ':');
-                        if (NULL == cp)
-                                return 0;
-                        n = atoi(cp + 1);
-                        cp = strrchr(sas_low_phy, ':');
-                        if (NULL == cp)
-                                return 0;
-                        m = atoi(cp + 1);
-                        if (n < m)
-                                my_strcopy(sas_low_phy, s->d_name, LMAX_NAME);
+        if (0 == strncmp(ns_name, "nvme", 4)) {
+                snprintf(dcp->aa_ng.name, sizeof(dcp->aa_ng.name), "ng%s",
+                         ns_name + 4);
+                snprintf(b, sizeof(b), "%s/%s", dir_name, dcp->aa_ng.name);
+                if (vfs_stat(b, &a_stat) >= 0) {
+                        dcp->aa_ng.ft = FT_CHAR;
+                        dcp->aa_ng.d_type = DT_UNKNOWN;
+                        return 1;
                 }
-                return 1;
-        } else
-                return 0;
+        }
+        return ng_scan(dir_name, dcp);
 }
 
-static int
-sas_low_phy_scan(const char * dir_name, struct dirent ***phy_list)
-{
-        int num, k;
-        struct dirent ** namelist = NULL;
-
-        memset(sas_low_phy, 0, sizeof(sas_low_phy));
-        num = scandir(dir_name, &namelist, sas_low_phy_dir_scan_select, NULL);
-        if (num < 0)
-                return -1;
-        if (! phy_list) {
-                for (k = 0; k < num; ++k)
-                        free(namelist[k]);
-                free(namelist);
-        } else
-                *phy_list = namelist;
-        return num;
-}
+#endif
 
 static int
-iscsi_target_dir_scan_select(const struct dirent * s)
+iscsi_target_dir_scan_select(const struct dirent * s, void * ctx)
 {
         int off;
         char buff[LMAX_PATH];
         struct stat a_stat;
+        struct iscsi_scan_t * isp = (struct iscsi_scan_t *)ctx;
 
         if (dir_or_link(s, "session")) {
-                iscsi_tsession_num = atoi(s->d_name + 7);
-                my_strcopy(buff, iscsi_dir_name, LMAX_PATH);
+                my_strcopy(buff, isp->dir_name, LMAX_PATH);
                 off = strlen(buff);
                 snprintf(buff + off, sizeof(buff) - off,
-                         "/%s/target%d:%d:%d", s->d_name, iscsi_target_hct->h,
-                         iscsi_target_hct->c, iscsi_target_hct->t);
-                if ((stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode))
+                         "/%s/target%d:%d:%d", s->d_name, isp->hctl->h,
+                         isp->hctl->c, isp->hctl->t);
+                if ((vfs_stat(buff, &a_stat) >= 0) &&
+                    S_ISDIR(a_stat.st_mode)) {
+                        /* only the session holding this target counts */
+                        isp->tsession_num = atoi(s->d_name + 7);
                         return 1;
-                else
+                } else
                         return 0;
         } else
                 return 0;
 }
 
 static int
-iscsi_target_scan(const char * dir_name, const struct addr_hctl * hctl)
+iscsi_target_scan(const char * dir_name, const struct addr_hctl * hctl,
+                  struct dev_ctx_t * dcp)
 {
-        int num, k;
-        struct dirent ** namelist;
-
-        iscsi_dir_name = dir_name;
-        iscsi_target_hct = hctl;
-        iscsi_tsession_num = -1;
-        num = scandir(dir_name, &namelist, iscsi_target_dir_scan_select,
-                      NULL);
-        if (num < 0) {
-                num = -1;
-                goto fini;
-        }
-        for (k = 0; k < num; ++k)
-                free(namelist[k]);
-        free(namelist);
-fini:
-        iscsi_dir_name = NULL;          /* so analyzer doesn't see a leak */
-        iscsi_target_hct = NULL;        /* so analyzer doesn't see a leak */
-        return num;
+        int num;
+        struct iscsi_scan_t isc;
+
+        isc.dir_name = dir_name;
+        isc.hctl = hctl;
+        isc.tsession_num = -1;
+        num = scandir_ctx(AT_FDCWD, dir_name, NULL,
+                          iscsi_target_dir_scan_select, &isc);
+        dcp->iscsi_tsession_num = isc.tsession_num;
+        return (num < 0) ? -1 : num;
 }
 
 
-/* If 'dir_name'/'base_name' is a directory chdir to it. 'base_name' may be
- * NULL in which case 'dir_name' is used instead. If that is successful
-   return true, else false */
+/* If 'dir_name'/'base_name' is a directory place its canonical path (i.e.
+ * with symlinks, "." and ".." resolved) in 'out' and return true, else
+ * return false. 'base_name' may be NULL in which case 'dir_name' is used
+ * instead. 'out' may be NULL when only the test is wanted. */
 static bool
-if_directory_chdir(const char * dir_name, const char * base_name)
+if_directory_canon(const char * dir_name, const char * base_name, char * out,
+                   int out_len)
 {
         char b[LMAX_PATH];
+        char rp[PATH_MAX];
         struct stat a_stat;
 
         if (base_name)
             snprintf(b, sizeof(b), "%s/%s", dir_name, base_name);
         else
             snprintf(b, sizeof(b), "%s", dir_name);
-        if (stat(b, &a_stat) < 0)
+        if (vfs_stat(b, &a_stat) < 0)
+                return false;
+        if (! S_ISDIR(a_stat.st_mode))
                 return false;
-        if (S_ISDIR(a_stat.st_mode)) {
-                if (chdir(b) < 0)
+        if (out && (out_len > 0)) {
+                ++tl_io.canon;
+                if (NULL == vfs_realpath(b, rp))
                         return false;
-                return true;
+                my_strcopy(out, rp, out_len);
         }
-        return false;
+        return true;
 }
 
-/* If 'dir_name'/generic is a directory chdir to it. If that is successful
-   return true. Otherwise look a directory of the form
-   'dir_name'/scsi_generic:sg<n> and if found chdir to it and return true.
-   Otherwise return false. */
+/* If 'dir_name'/generic is a directory place its canonical path in 'out'
+   and return true. Otherwise look a directory of the form
+   'dir_name'/scsi_generic:sg<n> and if found place its canonical path in
+   'out' and return true. Otherwise return false. */
 static bool
-if_directory_ch2generic(const char * dir_name)
+if_directory_2generic(const char * dir_name, struct dev_ctx_t * dcp,
+                      char * out, int out_len)
 {
-        char b[LMAX_PATH];
-        struct stat a_stat;
         static const char * old_name = "generic";
 
-        snprintf(b, sizeof(b), "%s/%s", dir_name, old_name);
-        if ((stat(b, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                if (chdir(b) < 0)
-                        return false;
+        if (if_directory_canon(dir_name, old_name, out, out_len))
                 return true;
-        }
         /* No "generic", so now look for "scsi_generic:sg<n>" */
-        if (1 != sg_scan(dir_name))
+        if (1 != sg_scan(dir_name, dcp))
+                return false;
+        return if_directory_canon(dir_name, dcp->aa_sg.name, out, out_len);
+}
+
+/* Places the contents of the symlink 'rel' (relative to 'dir_fd') in 'out'
+ * which is always null terminated. Links in sysfs are relative with their
+ * components as in the canonical path of the target, so the trailing
+ * elements (e.g. "end_device-2:0:1/target2:0:1/2:0:1:0") can be taken from
+ * that instead of calling realpath(3). Returns true on success. */
+static bool
+readlink_at(int dir_fd, const char * rel, char * out, int out_len)
+{
+        ssize_t len;
+
+        if (out_len < 2)
                 return false;
-        snprintf(b, sizeof(b), "%s/%s", dir_name, aa_sg.name);
-        if (stat(b, &a_stat) < 0)
+        ++tl_io.links;
+        len = vfs_readlinkat(dir_fd, rel, out, out_len - 1);
+        if (len <= 0)
                 return false;
-        if (S_ISDIR(a_stat.st_mode)) {
-                if (chdir(b) < 0)
-                        return false;
-                return true;
-        }
-        return false;
+        out[len] = '\0';
+        return true;
+}
+
+/* If 'base_name' (relative to 'dir_fd' which may be AT_FDCWD) is found,
+ * places the first line of its contents in 'value' and returns true. Else
+ * returns false. Like fgets(3) a trailing newline is stripped. */
+static bool
+get_value_at(int dir_fd, const char * base_name, char * value,
+             int max_value_len)
+{
+        ssize_t len;
+        char * cp;
+
+        if (max_value_len < 1)
+                return false;
+        len = vfs_read_at(dir_fd, base_name, value, max_value_len - 1);
+        if (len < 0)
+                return false;
+        ++tl_io.attrs;
+        tl_io.bytes += len;
+        value[len] = '\0';
+        if ((cp = strchr(value, '\n')))
+                *cp = '\0';
+        return true;
 }
 
 /* If 'dir_name'/'base_name' is found places corresponding value in 'value'
@@ -1379,28 +2516,16 @@ static bool
 get_value(const char * dir_name, const char * base_name, char * value,
           int max_value_len)
 {
-        int len;
-        FILE * f;
+        int n;
         char b[LMAX_PATH];
 
         if (base_name)
-                snprintf(b, sizeof(b), "%s/%s", dir_name, base_name);
+                n = snprintf(b, sizeof(b), "%s/%s", dir_name, base_name);
         else
-                snprintf(b, sizeof(b), "%s", dir_name);
-        if (NULL == (f = fopen(b, "r"))) {
-                return false;
-        }
-        if (NULL == fgets(value, max_value_len, f)) {
-                /* assume empty */
-                value[0] = '\0';
-                fclose(f);
-                return true;
-        }
-        len = strlen(value);
-        if ((len > 0) && (value[len - 1] == '\n'))
-                value[len - 1] = '\0';
-        fclose(f);
-        return true;
+                n = snprintf(b, sizeof(b), "%s", dir_name);
+        if ((n < 0) || (n >= (int)sizeof(b)))
+                return false;   /* path too long, so not found */
+        return get_value_at(AT_FDCWD, b, value, max_value_len);
 }
 
 /* Concatenates first three arguments with "/" as separator and opens a
@@ -1410,400 +2535,1197 @@ static bool
 get2_value(const char * dir_name, const char * middle_name,
            const char * base_name, char * value, int max_value_len)
 {
+        int n = 0;
         char b[LMAX_PATH];
+        static const int blen = sizeof(b);
 
+        n += sg_scn3pr(b, blen, n, "%s", dir_name);
         if (middle_name)
-                snprintf(b, sizeof(b), "%s/%s", dir_name, middle_name);
+                n += sg_scn3pr(b, blen, n, "/%s", middle_name);
+        if (base_name)
+                sg_scn3pr(b, blen, n, "/%s", base_name);
+        return get_value_at(AT_FDCWD, b, value, max_value_len);
+}
+
+/* Reads the attributes named in 'names' (there are 'num' of them, at most
+ * MAX_FETCH_ATTRS) from one sysfs directory into 'asp'. That directory is
+ * 'dir_fd' if it is open (i.e. >= 0), otherwise 'dir_name' (if not NULL)
+ * is opened for the duration of the call. Each attribute costs an
+ * openat(2), a pread(2) and a close(2) (none with --replay); the first
+ * line of its value (at most LMAX_NAME - 1 bytes) is kept. Returns the
+ * number found. */
+static int
+fetch_attrs(int dir_fd, const char * dir_name, const char * const * names,
+            int num, struct attr_set * asp)
+{
+        int k, d_fd, found;
+        int off = 0;
+        ssize_t len;
+        char * bp;
+        char * cp;
+
+        if (num > MAX_FETCH_ATTRS)
+                num = MAX_FETCH_ATTRS;
+        asp->num = num;
+        asp->names = names;
+        memset(asp->av, 0, num * sizeof(asp->av[0]));
+        if (dir_fd >= 0)
+                d_fd = dir_fd;
         else
-                snprintf(b, sizeof(b), "%s", dir_name);
-        return get_value(b, base_name, value, max_value_len);
+                d_fd = dir_name ? opendir_fd(AT_FDCWD, dir_name) : -1;
+        if (d_fd < 0)
+                return 0;
+        for (k = 0, found = 0; k < num; ++k) {
+                bp = asp->arena + off;
+                len = vfs_read_at(d_fd, names[k], bp, LMAX_NAME - 1);
+                if (len < 0)
+                        continue;
+                ++tl_io.attrs;
+                tl_io.bytes += len;
+                bp[len] = '\0';
+                if ((cp = (char *)memchr(bp, '\n', len))) {
+                        *cp = '\0';
+                        len = cp - bp;
+                }
+                asp->av[k].vp = bp;
+                asp->av[k].len = len;
+                off += len + 1;
+                ++found;
+        }
+        if (d_fd != dir_fd)
+                vfs_close(d_fd);
+        return found;
 }
 
+/* Returns the value of attribute 'name' held in 'asp', or NULL if it was
+ * not found. 'name' is usually the same pointer given to fetch_attrs() so
+ * that is checked before falling back to strcmp(). */
+static const char *
+attr_get(const struct attr_set * asp, const char * name)
+{
+        int k;
+
+        for (k = 0; k < asp->num; ++k) {
+                if (asp->names[k] == name)
+                        return asp->av[k].vp;
+        }
+        for (k = 0; k < asp->num; ++k) {
+                if (0 == strcmp(asp->names[k], name))
+                        return asp->av[k].vp;
+        }
+        return NULL;
+}
 
-/* Allocate dev_node_list and collect info on every char and block devices
- * in /dev but not its subdirectories. This list excludes symlinks, even if
- * they are to devices. */
+/* Outputs each attribute found in 'asp', in fetch order, as
+ * <name>=<value> to the plain text and JSON sinks. */
 static void
-collect_dev_nodes(void)
+haj_attrs(sgj_state * jsp, sgj_opaque_p jop, int leadin_sp,
+          const struct attr_set * asp)
 {
-        size_t dnl_sz = sizeof(struct dev_node_list);
-        struct dirent *dep;
-        DIR *dirp;
-        struct dev_node_list *cur_list, *prev_list;
-        struct dev_node_entry *cur_ent;
-        char device_path[LMAX_DEVPATH];
-        struct stat stats;
+        int k;
 
-        if (dev_node_listhead)
-                return; /* already collected nodes */
+        for (k = 0; k < asp->num; ++k) {
+                if (asp->av[k].vp)
+                        sgj_haj_vs(jsp, jop, leadin_sp, asp->names[k],
+                                   SEP_EQ_NO_SP, asp->av[k].vp);
+        }
+}
 
-        dev_node_listhead = (struct dev_node_list *)calloc(1, dnl_sz);
-        if (! dev_node_listhead)
-                return;
 
-        cur_list = dev_node_listhead;
-        cur_list->next = NULL;
-        cur_list->count = 0;
+/* Looks for attribute 'name' in what dev_jobs_prefetch() read for this
+ * device. Returns -1 if it was not prefetched, 0 if it was but could not
+ * be opened and 1 if its value has been copied to 'value'. */
+static int
+pre_value(const struct dev_ctx_t * dcp, const char * name, char * value,
+          int max_value_len)
+{
+        int k;
+        const struct attr_memo * mp = dcp->pre;
+
+        if (NULL == mp)
+                return -1;
+        for (k = 0; k < mp->num; ++k) {
+                if (0 == strcmp(dcp->pre_names[k], name))
+                        break;
+        }
+        if (k >= mp->num)
+                return -1;
+        if (NULL == mp->av[k].vp)
+                return 0;
+        my_strcopy(value, mp->av[k].vp, max_value_len);
+        return 1;
+}
 
-        dirp = opendir(devfsroot);
-        if (dirp == NULL)
+/* With --device-timeout=MS, adds 'name' and its 'value' to what the task
+ * of this device has read, unless 'name' is there already or it is full */
+static void
+dev_part_note(const struct dev_ctx_t * dcp, const char * name,
+              const char * value)
+{
+        int k, off;
+        int nlen = strlen(name) + 1;
+        int vlen = strlen(value) + 1;
+        struct dev_part * pp = dcp->part;
+
+        if (NULL == pp)
                 return;
+        pthread_mutex_lock(&dev_task_mtx);
+        for (k = 0, off = 0; k < pp->num; ++k) {
+                if (0 == strcmp(pp->arena + off, name))
+                        goto fini;
+                off += strlen(pp->arena + off) + 1;
+                off += strlen(pp->arena + off) + 1;
+        }
+        if ((pp->used + nlen + vlen) <= (int)sizeof(pp->arena)) {
+                memcpy(pp->arena + pp->used, name, nlen);
+                memcpy(pp->arena + pp->used + nlen, value, vlen);
+                pp->used += nlen + vlen;
+                ++pp->num;
+        }
+fini:
+        pthread_mutex_unlock(&dev_task_mtx);
+}
 
-        while (1) {
-                dep = readdir(dirp);
-                if (dep == NULL)
-                        break;
+/* Like get_value_at() but takes the value from what dev_jobs_prefetch()
+ * read, if it read 'base_name'. */
+static bool
+dev_value_at(const struct dev_ctx_t * dcp, int dir_fd, const char * base_name,
+             char * value, int max_value_len)
+{
+        int res = pre_value(dcp, base_name, value, max_value_len);
 
-                snprintf(device_path, sizeof(device_path), "%.80s/%s",
-                         devfsroot, dep->d_name);
-                /* device_path[LMAX_PATH] = '\0'; */
+        if (res >= 0)
+                return (res > 0);
+        if (! get_value_at(dir_fd, base_name, value, max_value_len))
+                return false;
+        dev_part_note(dcp, base_name, value);
+        return true;
+}
 
-                /* lstat() does not follow symlinks, stat() does */
-                if (lstat(device_path, &stats))
-                        continue;       /* unlikely: error */
+/* Like get_value() but takes the value from what dev_jobs_prefetch()
+ * read, if it read 'base_name'. */
+static bool
+dev_value(const struct dev_ctx_t * dcp, const char * dir_name,
+          const char * base_name, char * value, int max_value_len)
+{
+        int res = pre_value(dcp, base_name, value, max_value_len);
 
-                /* Skip non-block/char files. */
-                if ((! S_ISBLK(stats.st_mode)) && (! S_ISCHR(stats.st_mode)))
-                        continue;
+        if (res >= 0)
+                return (res > 0);
+        if (! get_value(dir_name, base_name, value, max_value_len))
+                return false;
+        dev_part_note(dcp, base_name, value);
+        return true;
+}
 
-                /* Add to the list. */
-                if (cur_list->count >= DEV_NODE_LIST_ENTRIES) {
-                        prev_list = cur_list;
-                        cur_list = (struct dev_node_list *)calloc(1, dnl_sz);
-                        if (! cur_list)
+/* Like fetch_attrs() but when dev_jobs_prefetch() has read all the
+ * attributes named, 'asp' is filled from that instead. */
+static int
+dev_fetch_attrs(const struct dev_ctx_t * dcp, int dir_fd,
+                const char * dir_name, const char * const * names, int num,
+                struct attr_set * asp)
+{
+        int k, j, end;
+        int used = 0;
+        int found = 0;
+        int idx[MAX_FETCH_ATTRS];
+        const struct attr_memo * mp = dcp->pre;
+
+        if (num > MAX_FETCH_ATTRS)
+                num = MAX_FETCH_ATTRS;
+        if (NULL == mp)
+                goto read;
+        for (k = 0; k < num; ++k) {
+                for (j = 0; j < mp->num; ++j) {
+                        if (0 == strcmp(dcp->pre_names[j], names[k]))
                                 break;
-                        prev_list->next = cur_list;
-                        cur_list->next = NULL;
-                        cur_list->count = 0;
                 }
-
-                cur_ent = &cur_list->nodes[cur_list->count];
-                cur_ent->maj = major(stats.st_rdev);
-                cur_ent->min = minor(stats.st_rdev);
-                if (S_ISBLK(stats.st_mode))
-                        cur_ent->d_typ = BLK_DEV;
-                else if (S_ISCHR(stats.st_mode))
-                        cur_ent->d_typ = CHR_DEV;
-                cur_ent->mtime = stats.st_mtime;
-                my_strcopy(cur_ent->name, device_path, sizeof(cur_ent->name));
-
-                cur_list->count++;
+                if (j >= mp->num)
+                        goto read;
+                idx[k] = j;
+        }
+        for (j = 0; j < mp->num; ++j) {
+                if (mp->av[j].vp) {
+                        end = (mp->av[j].vp - mp->arena) + mp->av[j].len + 1;
+                        if (end > used)
+                                used = end;
+                }
         }
-        closedir(dirp);
+        memcpy(asp->arena, mp->arena, used);
+        asp->num = num;
+        asp->names = names;
+        for (k = 0; k < num; ++k) {
+                asp->av[k] = mp->av[idx[k]];
+                if (asp->av[k].vp) {
+                        asp->av[k].vp = asp->arena +
+                                        (mp->av[idx[k]].vp - mp->arena);
+                        ++found;
+                }
+        }
+        return found;
+read:
+        found = fetch_attrs(dir_fd, dir_name, names, num, asp);
+        for (k = 0; (k < asp->num) && dcp->part; ++k) {
+                if (asp->av[k].vp)
+                        dev_part_note(dcp, asp->names[k], asp->av[k].vp);
+        }
+        return found;
 }
 
-/* Free dev_node_list. */
+#if HAVE_IO_URING
+
+/* Optional io_uring(7) backend for reading many sysfs attributes at once,
+ * see --io-uring and dev_jobs_prefetch(). Each attribute is a chain of
+ * three requests: an openat(2) into a direct (registered) file slot, a
+ * read into that slot's part of a registered buffer, then a close of the
+ * slot. So a batch of up to URING_SLOTS attributes costs one call of
+ * io_uring_enter(2) rather than three system calls each. Only the thread
+ * that calls run_dev_jobs() uses it. Without direct descriptors (before
+ * Linux 5.15), or if the ring can't be set up, attributes are read
+ * synchronously instead. */
+#define URING_SLOTS 128
+#define URING_ENTRIES 512       /* >= 3 * URING_SLOTS, a power of 2 */
+
+/* user_data of each request: the slot and which of its three it is */
+#define URING_UD(slot, step) (((uint64_t)(slot) << 2) | (step))
+
+struct uring_t {
+        bool tried;             /* uring_get() has been called */
+        bool ok;                /* ... and the ring may be used */
+        int fd;
+        unsigned int sq_mask;
+        unsigned int cq_mask;
+        unsigned int * sq_tail;
+        unsigned int * sq_array;
+        unsigned int * cq_head;
+        unsigned int * cq_tail;
+        struct io_uring_sqe * sqes;
+        struct io_uring_cqe * cqes;
+        void * sq_mp;
+        void * cq_mp;           /* may be the same mapping as sq_mp */
+        size_t sq_len;
+        size_t cq_len;
+        size_t sqes_len;
+        char * bufs;            /* URING_SLOTS * LMAX_NAME, registered */
+};
+static struct uring_t uring = {.fd = -1};
+
+/* One attribute read by uring_batch(). Its value is placed in slot k of
+ * uring_t::bufs where k is its index in the batch. */
+struct attr_rd {
+        int dir_fd;             /* AT_FDCWD or an open directory */
+        int len;                /* of the value, -1 if it was not found */
+        char path[LMAX_DEVPATH];        /* relative to dir_fd */
+};
+
 static void
-free_dev_node_list(void)
+uring_free(struct uring_t * up)
 {
-        if (dev_node_listhead) {
-                struct dev_node_list *cur_list, *next_list;
+        if (up->sqes)
+                munmap(up->sqes, up->sqes_len);
+        if (up->cq_mp && (up->cq_mp != up->sq_mp))
+                munmap(up->cq_mp, up->cq_len);
+        if (up->sq_mp)
+                munmap(up->sq_mp, up->sq_len);
+        if (up->fd >= 0)
+                close(up->fd);
+        free(up->bufs);
+        up->sqes = NULL;
+        up->sq_mp = NULL;
+        up->cq_mp = NULL;
+        up->bufs = NULL;
+        up->fd = -1;
+        up->ok = false;
+}
 
-                cur_list = dev_node_listhead;
-                while (cur_list) {
-                        next_list = cur_list->next;
-                        free(cur_list);
-                        cur_list = next_list;
-                }
+static void *
+uring_mmap(const struct uring_t * up, size_t len, off_t off)
+{
+        void * p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, up->fd, off);
 
-                dev_node_listhead = NULL;
-        }
+        return (MAP_FAILED == p) ? NULL : p;
 }
 
-/* Given a path to a class device, find the most recent device node with
- * matching major/minor and type. Outputs to node which is assumed to be at
- * least LMAX_NAME bytes long. Returns true if match found, false
- * otherwise. */
-static bool
-get_dev_node(const char * wd, char * node, enum dev_type d_typ)
+/* The next submission queue entry, zeroed, with 'tail' advanced past it */
+static struct io_uring_sqe *
+uring_sqe(struct uring_t * up, unsigned int * tail)
 {
-        bool match_found = false;
-        unsigned int k = 0;
-        unsigned int maj, min;
-        time_t newest_mtime = 0;
-        struct dev_node_entry *cur_ent;
-        struct dev_node_list *cur_list;
-        char value[LMAX_NAME];
+        unsigned int k = (*tail)++ & up->sq_mask;
+        struct io_uring_sqe * sqp = up->sqes + k;
 
-        /* assume 'node' is at least 2 bytes long */
-        memcpy(node, "-", 2);
-        if (dev_node_listhead == NULL) {
-                collect_dev_nodes();
-                if (dev_node_listhead == NULL)
-                        goto fini;
-        }
+        up->sq_array[k] = k;
+        memset(sqp, 0, sizeof(*sqp));
+        return sqp;
+}
 
-        /* Get the major/minor for this device. */
-        if (!get_value(wd, dv_s, value, LMAX_NAME))
-                goto fini;
-        if (2 != sscanf(value, "%u:%u", &maj, &min))
-                goto fini;
+/* Opens "/" into direct file slot 0 then empties the slot again. Linux
+ * 5.6 to 5.14 ignore sqe->file_index and return a normal descriptor
+ * instead, which a read with IOSQE_FIXED_FILE can't use and a close with
+ * file_index (fd 0) would not close, so the ring is then not used.
+ * Returns true if direct descriptors work. */
+static bool
+uring_probe_direct(struct uring_t * up)
+{
+        int res;
+        int fd = -1;
+        unsigned int tail, head;
+        struct io_uring_sqe * sqp;
+        struct io_uring_files_update fu;
+
+        tail = *up->sq_tail;
+        sqp = uring_sqe(up, &tail);
+        sqp->opcode = IORING_OP_OPENAT;
+        sqp->fd = AT_FDCWD;
+        sqp->addr = (uintptr_t)"/";
+        sqp->open_flags = O_RDONLY;
+        sqp->file_index = 1;
+        sqp->user_data = URING_UD(0, 0);
+        __atomic_store_n(up->sq_tail, tail, __ATOMIC_RELEASE);
+        do {
+                res = syscall(__NR_io_uring_enter, up->fd, 1, 1,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+        } while ((res < 0) && (EINTR == errno));
+        if (res < 0)
+                return false;
+        head = *up->cq_head;
+        if (head == __atomic_load_n(up->cq_tail, __ATOMIC_ACQUIRE)) {
+                errno = EIO;
+                return false;
+        }
+        res = up->cqes[head & up->cq_mask].res;
+        __atomic_store_n(up->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (res > 0) {          /* a normal descriptor */
+                close(res);
+                errno = EOPNOTSUPP;
+                return false;
+        } else if (res < 0) {
+                errno = -res;
+                return false;
+        }
+        memset(&fu, 0, sizeof(fu));
+        fu.offset = 0;
+        fu.fds = (uintptr_t)&fd;
+        return (syscall(__NR_io_uring_register, up->fd,
+                        IORING_REGISTER_FILES_UPDATE, &fu, 1) >= 0);
+}
 
-        /* Search the node list for the newest match on this major/minor. */
-        cur_list = dev_node_listhead;
+/* Sets up the ring with its registered buffer and URING_SLOTS empty
+ * direct file slots. Returns false on failure, leaving up->fd (and any
+ * mappings) for uring_free(). */
+static bool
+uring_setup(struct uring_t * up)
+{
+        int k;
+        int fds[URING_SLOTS];
+        char * sp;
+        char * cp;
+        struct io_uring_params p;
+        struct iovec iov;
+
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                  IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        up->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        if ((up->fd < 0) && (EINVAL == errno)) {
+                memset(&p, 0, sizeof(p));       /* before Linux 6.1 */
+                up->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        }
+        if (up->fd < 0)
+                return false;
+        up->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        up->cq_len = p.cq_off.cqes +
+                     p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (up->cq_len > up->sq_len)
+                        up->sq_len = up->cq_len;
+        }
+        up->sq_mp = uring_mmap(up, up->sq_len, IORING_OFF_SQ_RING);
+        if (NULL == up->sq_mp)
+                return false;
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                up->cq_mp = up->sq_mp;
+        else if (NULL == (up->cq_mp = uring_mmap(up, up->cq_len,
+                                                 IORING_OFF_CQ_RING)))
+                return false;
+        up->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        up->sqes = (struct io_uring_sqe *)uring_mmap(up, up->sqes_len,
+                                                     IORING_OFF_SQES);
+        if (NULL == up->sqes)
+                return false;
+        sp = (char *)up->sq_mp;
+        cp = (char *)up->cq_mp;
+        up->sq_mask = *(unsigned int *)(sp + p.sq_off.ring_mask);
+        up->sq_tail = (unsigned int *)(sp + p.sq_off.tail);
+        up->sq_array = (unsigned int *)(sp + p.sq_off.array);
+        up->cq_mask = *(unsigned int *)(cp + p.cq_off.ring_mask);
+        up->cq_head = (unsigned int *)(cp + p.cq_off.head);
+        up->cq_tail = (unsigned int *)(cp + p.cq_off.tail);
+        up->cqes = (struct io_uring_cqe *)(cp + p.cq_off.cqes);
+
+        up->bufs = (char *)malloc(URING_SLOTS * LMAX_NAME);
+        if (NULL == up->bufs)
+                return false;
+        iov.iov_base = up->bufs;
+        iov.iov_len = URING_SLOTS * LMAX_NAME;
+        if (syscall(__NR_io_uring_register, up->fd, IORING_REGISTER_BUFFERS,
+                    &iov, 1) < 0)
+                return false;
+        for (k = 0; k < URING_SLOTS; ++k)
+                fds[k] = -1;    /* sparse, filled by each openat */
+        if (syscall(__NR_io_uring_register, up->fd, IORING_REGISTER_FILES,
+                    fds, URING_SLOTS) < 0)
+                return false;
+        return uring_probe_direct(up);
+}
 
-        while (1) {
-                if (k >= cur_list->count) {
-                        cur_list = cur_list->next;
-                        if (! cur_list)
-                                break;
-                        k = 0;
+/* Returns the ring, setting it up on the first call, or NULL if io_uring
+ * can't be used. */
+static struct uring_t *
+uring_get(const struct lsscsi_opts * op)
+{
+        struct uring_t * up = &uring;
+
+        if (! up->tried) {
+                up->tried = true;
+                up->ok = uring_setup(up);
+                if (! up->ok) {
+                        if (op->verbose > 0)
+                                pr2serr("io_uring not available (%s), "
+                                        "reading attributes synchronously\n",
+                                        strerror(errno));
+                        uring_free(up);
                 }
+        }
+        return up->ok ? up : NULL;
+}
 
-                cur_ent = &cur_list->nodes[k];
-                k++;
+/* Reads the 'num' (at most URING_SLOTS) attributes in 'rds' with one
+ * ring submission, their completions arriving in any order. Values are
+ * null terminated with any newline stripped, as by fetch_attrs(). Returns
+ * false (after which the ring is not used again) if the ring fails or
+ * direct descriptors do not work as they should; the caller then reads
+ * them some other way. */
+static bool
+uring_batch(struct uring_t * up, struct attr_rd * rds, int num)
+{
+        bool bad = false;
+        int k, res, len;
+        unsigned int tail, head, ctail, step;
+        unsigned int to_submit, seen, want;
+        int open_res[URING_SLOTS];
+        int read_res[URING_SLOTS];
+        char * bp;
+        char * cp;
+        struct io_uring_sqe * sqp;
+        const struct io_uring_cqe * cqp;
 
-                if ((maj == cur_ent->maj) &&
-                    (min == cur_ent->min) &&
-                    (d_typ == cur_ent->d_typ)) {
-                        if ((! match_found) ||
-                            (difftime(cur_ent->mtime, newest_mtime) > 0)) {
-                                newest_mtime = cur_ent->mtime;
-                                my_strcopy(node, cur_ent->name, LMAX_NAME);
+        tail = *up->sq_tail;
+        for (k = 0; k < num; ++k) {
+                open_res[k] = -ECANCELED;
+                read_res[k] = -ECANCELED;
+                sqp = uring_sqe(up, &tail);
+                sqp->opcode = IORING_OP_OPENAT;
+                sqp->flags = IOSQE_IO_LINK;     /* read only if opened */
+                sqp->fd = rds[k].dir_fd;
+                sqp->addr = (uintptr_t)rds[k].path;
+                sqp->open_flags = O_RDONLY;     /* direct, so no O_CLOEXEC */
+                sqp->file_index = k + 1;
+                sqp->user_data = URING_UD(k, 0);
+                sqp = uring_sqe(up, &tail);
+                sqp->opcode = IORING_OP_READ_FIXED;
+                /* a short read fails a soft link, so close regardless */
+                sqp->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+                sqp->fd = k;
+                sqp->addr = (uintptr_t)(up->bufs + (k * LMAX_NAME));
+                sqp->len = LMAX_NAME - 1;
+                sqp->buf_index = 0;
+                sqp->user_data = URING_UD(k, 1);
+                sqp = uring_sqe(up, &tail);
+                /* with file_index, fd must be 0; uring_probe_direct()
+                 * has checked that the kernel then closes the slot */
+                sqp->opcode = IORING_OP_CLOSE;
+                sqp->file_index = k + 1;
+                sqp->user_data = URING_UD(k, 2);
+        }
+        __atomic_store_n(up->sq_tail, tail, __ATOMIC_RELEASE);
+
+        want = 3 * num;
+        to_submit = want;
+        for (seen = 0; seen < want; ) {
+                res = syscall(__NR_io_uring_enter, up->fd, to_submit,
+                              want - seen, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (res < 0) {
+                        if (EINTR == errno)
+                                continue;
+                        up->ok = false;
+                        return false;
+                }
+                to_submit -= ((unsigned int)res < to_submit) ?
+                             (unsigned int)res : to_submit;
+                head = *up->cq_head;
+                ctail = __atomic_load_n(up->cq_tail, __ATOMIC_ACQUIRE);
+                for ( ; head != ctail; ++head, ++seen) {
+                        cqp = up->cqes + (head & up->cq_mask);
+                        k = (int)(cqp->user_data >> 2);
+                        step = (unsigned int)(cqp->user_data & 0x3);
+                        if ((k < 0) || (k >= num))
+                                continue;
+                        if (0 == step) {
+                                open_res[k] = cqp->res;
+                                if (cqp->res > 0) {
+                                        close(cqp->res);  /* not direct */
+                                        bad = true;
+                                } else if (-EINVAL == cqp->res)
+                                        bad = true;  /* no direct opens */
+                        } else if (1 == step) {
+                                read_res[k] = cqp->res;
+                                if (-EBADF == cqp->res)
+                                        bad = true;  /* slot not filled */
                         }
-                        match_found = true;
                 }
+                __atomic_store_n(up->cq_head, head, __ATOMIC_RELEASE);
         }
-fini:
-        return match_found;
+        if (bad) {
+                up->ok = false;
+                return false;
+        }
+        for (k = 0; k < num; ++k) {
+                if (open_res[k] < 0) {
+                        rds[k].len = -1;
+                        continue;
+                }
+                len = (read_res[k] > 0) ? read_res[k] : 0;  /* else empty */
+                ++tl_io.attrs;
+                tl_io.bytes += len;
+                bp = up->bufs + (k * LMAX_NAME);
+                bp[len] = '\0';
+                if ((cp = (char *)memchr(bp, '\n', len))) {
+                        *cp = '\0';
+                        len = cp - bp;
+                }
+                rds[k].len = len;
+        }
+        return true;
 }
 
-/* Allocate disk_wwn_node_list and collect info on every node in
- * /dev/disk/by-id/scsi-* that does not contain "part" . Returns
- * number of wwn nodes collected, 0 for already collected and
- * -1 for error. */
-static int
-collect_disk_wwn_nodes(bool wwn_twice)
+/* Reads the 'num' attributes in 'rds' into the slots of 'bufs', with the
+ * ring if possible, otherwise one after another. */
+static void
+attr_rd_batch(struct uring_t * up, struct attr_rd * rds, int num,
+              char * bufs)
 {
         int k;
-        int num = 0;
-        size_t dwnl_sz = sizeof(struct disk_wwn_node_list);
-        struct disk_wwn_node_list *cur_list, *prev_list;
-        struct disk_wwn_node_entry *cur_ent;
-        DIR *dirp;
-        struct dirent *dep;
-        char device_path[PATH_MAX + 1];
-        char symlink_path[PATH_MAX + 1];
-        struct stat stats;
+        char * bp;
 
-        if (disk_wwn_node_listhead)
-                return num; /* already collected nodes */
+        if (up->ok && uring_batch(up, rds, num))
+                return;
+        for (k = 0; k < num; ++k) {
+                bp = bufs + (k * LMAX_NAME);
+                if (get_value_at(rds[k].dir_fd, rds[k].path, bp, LMAX_NAME))
+                        rds[k].len = strlen(bp);
+                else
+                        rds[k].len = -1;
+        }
+}
 
-        disk_wwn_node_listhead =
-                         (struct disk_wwn_node_list *)calloc(1, dwnl_sz);
-        if (! disk_wwn_node_listhead)
-                return -1;
+#endif          /* HAVE_IO_URING */
 
-        cur_list = disk_wwn_node_listhead;
 
-        dirp = opendir(dev_disk_byid_dir);
-        if (dirp == NULL)
-                return -1;
+static unsigned int
+dev_node_hash(unsigned int maj, unsigned int min, enum dev_type d_typ)
+{
+        unsigned int h = (maj * 0x9e3779b1U) ^ (min * 0x85ebca6bU) ^ d_typ;
 
-        if (wwn_twice)
-                goto wwn_really;
+        return h ^ (h >> 16);
+}
 
-        while (1) {
-                dep = readdir(dirp);
-                if (dep == NULL)
-                        break;
-                if (memcmp("scsi-", dep->d_name, 5))
-                        continue;       /* needs to start with "scsi-" */
-                if (strstr(dep->d_name, "part"))
-                        continue;       /* skip if contains "part" */
-                /* accepted device identification VPD page designator types */
-                if (dep->d_name[5] != '3' &&    /* NAA */
-                    dep->d_name[5] != '2' &&    /* EUI-64 based */
-                    dep->d_name[5] != '8')      /* SCSI name string (iSCSI) */
-                        continue;       /* skip for invalid identifier */
-
-                snprintf(device_path, PATH_MAX, "%s/%s", dev_disk_byid_dir,
-                         dep->d_name);
-                device_path[PATH_MAX] = '\0';
-                if (lstat(device_path, &stats))
-                        continue;       /* unlikely: error */
-                if (! S_ISLNK(stats.st_mode))
-                        continue;       /* Skip non-symlinks */
-                if ((k = readlink(device_path, symlink_path, PATH_MAX)) < 1)
-                        continue;       /* expect 1 or more chars in symlink */
-                symlink_path[k] = '\0';
-
-                /* Add to the list. */
-                if (cur_list->count >= DISK_WWN_NODE_LIST_ENTRIES) {
-                        prev_list = cur_list;
-                        cur_list = (struct disk_wwn_node_list *)
-                                                        calloc(1, dwnl_sz);
-                        if (! cur_list)
-                                break;
-                        prev_list->next = cur_list;
-                }
+/* Returns the slot in 'tbl' (which has 'size' slots, a power of 2) that
+ * holds the given key, or the empty slot where it belongs. The caller
+ * ensures there is at least one empty slot. */
+static struct dev_node_entry *
+dev_node_slot(struct dev_node_entry * tbl, unsigned int size,
+              unsigned int maj, unsigned int min, enum dev_type d_typ)
+{
+        unsigned int mask = size - 1;
+        unsigned int k = dev_node_hash(maj, min, d_typ) & mask;
+        struct dev_node_entry * ep;
 
-                cur_ent = &cur_list->nodes[cur_list->count];
-                my_strcopy(cur_ent->wwn, "0x", 3);
-                /* step over designator type */
-                my_strcopy(cur_ent->wwn + 2, dep->d_name + 6,
-                           sizeof(cur_ent->wwn) - 2);
-                my_strcopy(cur_ent->disk_bname, basename(symlink_path),
-                           sizeof(cur_ent->disk_bname));
-                cur_list->count++;
-                ++num;
+        for ( ; ; k = (k + 1) & mask) {
+                ep = tbl + k;
+                if ((! ep->used) || ((maj == ep->maj) && (min == ep->min) &&
+                                     (d_typ == ep->d_typ)))
+                        return ep;
         }
-        closedir(dirp);
-        return num;
-wwn_really:
+}
+
+/* Doubles the number of slots in dev_node_map. Returns false if out of
+ * memory, in which case the map is unchanged. */
+static bool
+dev_node_map_grow(void)
+{
+        unsigned int k;
+        unsigned int n_size = dev_node_map.size * 2;
+        struct dev_node_entry * ep;
+        struct dev_node_entry * n_tbl;
+
+        n_tbl = (struct dev_node_entry *)calloc(n_size, sizeof(*n_tbl));
+        if (NULL == n_tbl)
+                return false;
+        for (k = 0; k < dev_node_map.size; ++k) {
+                ep = dev_node_map.tbl + k;
+                if (ep->used)
+                        *dev_node_slot(n_tbl, n_size, ep->maj, ep->min,
+                                       ep->d_typ) = *ep;
+        }
+        free(dev_node_map.tbl);
+        dev_node_map.tbl = n_tbl;
+        dev_node_map.size = n_size;
+        return true;
+}
+
+/* Appends 'name' (and its null terminator) to 'spp' and places its offset
+ * in 'offp'. Returns false if out of memory. */
+static bool
+str_pool_add(struct str_pool * spp, const char * name, unsigned int * offp)
+{
+        unsigned int len = strlen(name) + 1;
+        unsigned int n_sz;
+        char * n_p;
+
+        if (spp->len + len > spp->sz) {
+                n_sz = spp->sz ? spp->sz : STR_POOL_INIT_SZ;
+                while (spp->len + len > n_sz)
+                        n_sz *= 2;
+                n_p = (char *)realloc(spp->p, n_sz);
+                if (NULL == n_p)
+                        return false;
+                spp->p = n_p;
+                spp->sz = n_sz;
+        }
+        memcpy(spp->p + spp->len, name, len);
+        *offp = spp->len;
+        spp->len += len;
+        return true;
+}
+
+/* Allocate dev_node_map and collect info on every char and block devices
+ * in /dev but not its subdirectories. This map excludes symlinks, even if
+ * they are to devices. When several nodes share a major/minor and type,
+ * only the one with the newest mtime (or the first seen, if equal) is
+ * kept. */
+static void
+collect_dev_nodes(void)
+{
+        unsigned int maj, min;
+        enum dev_type d_typ;
+        struct dirent *dep;
+        struct vfs_dir vd;
+        struct dev_node_entry *cur_ent;
+        struct stat stats;
+
+        if (dev_node_map.tbl)
+                return; /* already collected nodes */
+
+        dev_node_map.tbl = (struct dev_node_entry *)
+                        calloc(DEV_NODE_MAP_INIT_SZ, sizeof(*dev_node_map.tbl));
+        if (! dev_node_map.tbl)
+                return;
+        dev_node_map.size = DEV_NODE_MAP_INIT_SZ;
+        dev_node_map.count = 0;
+
+        if (! vfs_opendir_at(&vd, AT_FDCWD, devfsroot))
+                return;
+        ++tl_io.dirs;
+
         while (1) {
-                dep = readdir(dirp);
+                dep = vfs_readdir(&vd);
                 if (dep == NULL)
                         break;
-                if (memcmp("wwn-", dep->d_name, 4))
-                        continue;       /* needs to start with "wwn-" */
-                if (strstr(dep->d_name, "part"))
-                        continue;       /* skip if contains "part" */
 
-                snprintf(device_path, PATH_MAX, "%s/%s", dev_disk_byid_dir,
-                         dep->d_name);
-                device_path[PATH_MAX] = '\0';
-                if (lstat(device_path, &stats))
+                /* like lstat(), does not follow symlinks */
+                if (vfs_fstatat(vd.fd, dep->d_name, &stats,
+                                AT_SYMLINK_NOFOLLOW))
                         continue;       /* unlikely: error */
-                if (! S_ISLNK(stats.st_mode))
-                        continue;       /* Skip non-symlinks */
-                if ((k = readlink(device_path, symlink_path, PATH_MAX)) < 1)
+
+                /* Skip non-block/char files. */
+                if (S_ISBLK(stats.st_mode))
+                        d_typ = BLK_DEV;
+                else if (S_ISCHR(stats.st_mode))
+                        d_typ = CHR_DEV;
+                else
                         continue;
-                symlink_path[k] = '\0';
-
-                /* Add to the list. */
-                if (cur_list->count >= DISK_WWN_NODE_LIST_ENTRIES) {
-                        prev_list = cur_list;
-                        cur_list = (struct disk_wwn_node_list *)
-                                                        calloc(1, dwnl_sz);
-                        if (! cur_list)
-                                break;
-                        prev_list->next = cur_list;
-                }
+                maj = major(stats.st_rdev);
+                min = minor(stats.st_rdev);
 
-                cur_ent = &cur_list->nodes[cur_list->count];
-                my_strcopy(cur_ent->wwn, dep->d_name + 4,
-                           sizeof(cur_ent->wwn));
-                my_strcopy(cur_ent->disk_bname, basename(symlink_path),
-                           sizeof(cur_ent->disk_bname));
-                cur_list->count++;
-                ++num;
+                /* Keep the load factor at or below one half */
+                if ((2 * (dev_node_map.count + 1) > dev_node_map.size) &&
+                    (! dev_node_map_grow()))
+                        break;
+                cur_ent = dev_node_slot(dev_node_map.tbl, dev_node_map.size,
+                                        maj, min, d_typ);
+                if (cur_ent->used &&
+                    (difftime(stats.st_mtime, cur_ent->mtime) <= 0))
+                        continue;       /* existing node is as new */
+                if (! str_pool_add(&dev_node_map.pool, dep->d_name,
+                                   &cur_ent->name_off))
+                        break;
+                if (! cur_ent->used) {
+                        cur_ent->used = true;
+                        cur_ent->maj = maj;
+                        cur_ent->min = min;
+                        cur_ent->d_typ = d_typ;
+                        dev_node_map.count++;
+                }
+                cur_ent->mtime = stats.st_mtime;
         }
-        closedir(dirp);
-        return num;
+        vfs_closedir(&vd);
+}
+
+/* Returns true while a task abandoned by --device-timeout may still use
+ * the shared indexes */
+static bool
+dev_tasks_stray(void)
+{
+        bool res;
+
+        pthread_mutex_lock(&dev_task_mtx);
+        res = (dev_tasks_astray > 0);
+        pthread_mutex_unlock(&dev_task_mtx);
+        return res;
 }
 
-/* Free disk_wwn_node_list. */
+/* Free dev_node_map. */
 static void
-free_disk_wwn_node_list(void)
+free_dev_node_list(void)
 {
-        if (disk_wwn_node_listhead) {
-                struct disk_wwn_node_list *cur_list, *next_list;
+        if (dev_tasks_stray())
+                return;
+        free(dev_node_map.tbl);
+        free(dev_node_map.pool.p);
+        memset(&dev_node_map, 0, sizeof(dev_node_map));
+}
 
-                cur_list = disk_wwn_node_listhead;
-                while (cur_list) {
-                        next_list = cur_list->next;
-                        free(cur_list);
-                        cur_list = next_list;
-                }
+/* Checks if the node in /dev with the basename of class device 'wd' has
+ * major/minor 'maj':'min' and type 'd_typ'. If so outputs its path to
+ * 'node' (at least LMAX_NAME bytes long) and returns true. */
+static bool
+get_dev_node_by_name(const char * wd, unsigned int maj, unsigned int min,
+                     enum dev_type d_typ, char * node)
+{
+        const char * bnp = strrchr(wd, '/');
+        struct stat stats;
+        char b[LMAX_NAME];
 
-                disk_wwn_node_listhead = NULL;
-        }
+        bnp = bnp ? (bnp + 1) : wd;
+        snprintf(b, sizeof(b), "%.80s/%s", devfsroot, bnp);
+        if (vfs_fstatat(AT_FDCWD, b, &stats, AT_SYMLINK_NOFOLLOW) < 0)
+                return false;
+        if (! ((BLK_DEV == d_typ) ? S_ISBLK(stats.st_mode) :
+                                    S_ISCHR(stats.st_mode)))
+                return false;
+        if ((major(stats.st_rdev) != maj) || (minor(stats.st_rdev) != min))
+                return false;
+        my_strcopy(node, b, LMAX_NAME);
+        return true;
 }
 
 /* Given a path to a class device, find the most recent device node with
-   matching major/minor. Returns true if match found, false otherwise. */
+ * matching major/minor and type. Outputs to node which is assumed to be at
+ * least LMAX_NAME bytes long. Returns true if match found, false
+ * otherwise. */
 static bool
-get_disk_wwn(const char *wd, char * wwn_str, int max_wwn_str_len,
-             bool wwn_twice)
+get_dev_node(const char * wd, char * node, enum dev_type d_typ)
 {
-        unsigned int k = 0;
-        char * bn;
-        struct disk_wwn_node_list *cur_list;
-        struct disk_wwn_node_entry *cur_ent;
-        char name[LMAX_PATH];
+        unsigned int maj, min;
+        struct dev_node_entry *cur_ent;
+        struct stats_mark sm;
+        char value[LMAX_NAME];
 
-        my_strcopy(name, wd, sizeof(name));
-        name[sizeof(name) - 1] = '\0';
-        bn = basename(name);
-        if (disk_wwn_node_listhead == NULL) {
-                collect_disk_wwn_nodes(wwn_twice);
-                if (disk_wwn_node_listhead == NULL)
-                        return false;
+        /* assume 'node' is at least 2 bytes long */
+        memcpy(node, "-", 2);
+
+        /* Get the major/minor for this device. */
+        if (!get_value(wd, dv_s, value, LMAX_NAME))
+                return false;
+        if (2 != sscanf(value, "%u:%u", &maj, &min))
+                return false;
+
+        /* With a filter few nodes are wanted, so try the one with the
+         * kernel's name for the device before reading all of /dev */
+        if (filter_active && get_dev_node_by_name(wd, maj, min, d_typ, node))
+                return true;
+
+        pthread_mutex_lock(&node_list_mtx);
+        if (dev_node_map.tbl == NULL) {
+                stats_begin(&sm, false);
+                collect_dev_nodes();
+                stats_end(STP_DEV_NODES, &sm, false);
         }
-        cur_list = disk_wwn_node_listhead;
-        while (1) {
-                if (k >= cur_list->count) {
-                        cur_list = cur_list->next;
-                        if (! cur_list)
-                                break;
-                        k = 0;
-                }
-                cur_ent = &cur_list->nodes[k];
-                k++;
-                if (0 == strcmp(cur_ent->disk_bname, bn)) {
-                        my_strcopy(wwn_str, cur_ent->wwn, max_wwn_str_len);
-                        wwn_str[max_wwn_str_len - 1] = '\0';
-                        return true;
-                }
+        pthread_mutex_unlock(&node_list_mtx);
+        if ((dev_node_map.tbl == NULL) || (0 == dev_node_map.count))
+                return false;
+
+        cur_ent = dev_node_slot(dev_node_map.tbl, dev_node_map.size, maj,
+                                min, d_typ);
+        if (! cur_ent->used)
+                return false;
+        snprintf(node, LMAX_NAME, "%.80s/%s", devfsroot,
+                 dev_node_map.pool.p + cur_ent->name_off);
+        return true;
+}
+
+static unsigned int
+disk_link_hash(dev_t rdev, const char * bname)
+{
+        unsigned int h;
+
+        if (bname) {            /* FNV-1a */
+                for (h = 2166136261U; *bname; ++bname)
+                        h = (h ^ (unsigned char)*bname) * 16777619U;
+        } else {
+                uint64_t v = (uint64_t)rdev;
+
+                h = (unsigned int)(v ^ (v >> 32)) * 0x9e3779b1U;
         }
-        return false;
+        return h ^ (h >> 16);
+}
+
+/* Returns the record in 'recs' (which has 'size' slots, a power of 2)
+ * keyed on 'bname', or on 'rdev' when 'bname' is NULL. If there is no such
+ * record returns the empty slot where it belongs. The caller ensures there
+ * is at least one empty slot. */
+static struct disk_link_rec *
+disk_link_slot(struct disk_link_rec * recs, unsigned int size, dev_t rdev,
+               const char * bname)
+{
+        unsigned int mask = size - 1;
+        unsigned int k = disk_link_hash(rdev, bname) & mask;
+        struct disk_link_rec * rp;
+
+        for ( ; ; k = (k + 1) & mask) {
+                rp = recs + k;
+                if (! rp->used)
+                        return rp;
+                if (bname) {
+                        if (0 == strcmp(bname, disk_link_index.pool.p +
+                                               rp->bname_off))
+                                return rp;
+                } else if (rdev == rp->rdev)
+                        return rp;
+        }
+}
+
+/* Doubles the number of slots in 'tp' (or gives it its first ones).
+ * Returns false if out of memory, in which case 'tp' is unchanged. */
+static bool
+disk_link_tbl_grow(struct disk_link_tbl * tp, bool by_bname)
+{
+        unsigned int k;
+        unsigned int n_size = tp->size ? (2 * tp->size) :
+                                         DISK_LINK_TBL_INIT_SZ;
+        struct disk_link_rec * rp;
+        struct disk_link_rec * n_recs;
+
+        n_recs = (struct disk_link_rec *)calloc(n_size, sizeof(*n_recs));
+        if (NULL == n_recs)
+                return false;
+        for (k = 0; k < tp->size; ++k) {
+                rp = tp->recs + k;
+                if (rp->used)
+                        *disk_link_slot(n_recs, n_size, rp->rdev,
+                                        by_bname ? (disk_link_index.pool.p +
+                                                    rp->bname_off) : NULL) =
+                                *rp;
+        }
+        free(tp->recs);
+        tp->recs = n_recs;
+        tp->size = n_size;
+        return true;
+}
+
+/* Returns the record in 'tp' keyed on 'bname' (or on 'rdev' when 'bname'
+ * is NULL), adding it if need be. Returns NULL if out of memory. */
+static struct disk_link_rec *
+disk_link_rec_get(struct disk_link_tbl * tp, dev_t rdev, const char * bname)
+{
+        struct disk_link_rec * rp;
+
+        /* Keep the load factor at or below one half */
+        if ((2 * (tp->count + 1) > tp->size) &&
+            (! disk_link_tbl_grow(tp, !! bname)))
+                return NULL;
+        rp = disk_link_slot(tp->recs, tp->size, rdev, bname);
+        if (! rp->used) {
+                if (bname && (! str_pool_add(&disk_link_index.pool, bname,
+                                             &rp->bname_off)))
+                        return NULL;
+                rp->used = true;
+                rp->rdev = rdev;
+                tp->count++;
+        }
+        return rp;
+}
+
+/* Keeps symlink 'name' as the 'kind' link of 'rp' unless the one already
+ * held has the same or a better (lower) 'rank'. So with equal ranks the
+ * first seen, in readdir() order, is kept. */
+static void
+disk_link_offer(struct disk_link_rec * rp, enum disk_link_kind kind,
+                int rank, const char * name)
+{
+        unsigned int off;
+
+        if (rp->link_off[kind] && (rank >= rp->rank[kind]))
+                return;
+        if (str_pool_add(&disk_link_index.pool, name, &off)) {
+                rp->link_off[kind] = off;
+                rp->rank[kind] = rank;
+        }
+}
+
+/* Adds the symlinks found in 'dir_name' to disk_link_index. When 'by_id'
+ * is true 'dir_name' is expected to be /dev/disk/by-id and names are
+ * sorted into kinds by their prefix, otherwise all are DLK_PATH. */
+static void
+disk_link_scan(const char * dir_name, bool by_id)
+{
+        int k, rank, d_fd;
+        enum disk_link_kind kind;
+        struct vfs_dir vd;
+        struct dirent *dep;
+        const char * nm;
+        const char * cp;
+        struct disk_link_rec * rp;
+        struct stat stats;
+        char symlink_path[LMAX_PATH];
+        static const char * scsi_pfx = "scsi-";
+        static const char * scsi_prio = "328S10";
+        static const char * mpath_pfx = "dm-uuid-mpath-";
+        static const char * usb_pfx = "usb-";
+        static const char * wwn_pfx = "wwn-";
+        static const int scsi_pfx_len = 5;
+
+        if (! vfs_opendir_at(&vd, AT_FDCWD, dir_name))
+                return;
+        ++tl_io.dirs;
+        d_fd = vd.fd;
+
+        while ((dep = vfs_readdir(&vd)) != NULL) {
+                nm = dep->d_name;
+                if (disk_link_index.want_only) {
+                        /* readlinkat() fails on other than a symlink */
+                        k = vfs_readlinkat(d_fd, nm, symlink_path,
+                                           sizeof(symlink_path) - 1);
+                        if (k < 1)
+                                continue;
+                        ++tl_io.links;
+                        symlink_path[k] = '\0';
+                        rp = disk_link_slot(disk_link_index.by_bname.recs,
+                                            disk_link_index.by_bname.size, 0,
+                                            basename(symlink_path));
+                        if (! rp->used)
+                                continue;       /* not to a wanted disk */
+                } else {
+                        if (vfs_fstatat(d_fd, nm, &stats,
+                                        AT_SYMLINK_NOFOLLOW))
+                                continue;       /* unlikely: error */
+                        if (! S_ISLNK(stats.st_mode))
+                                continue;       /* Skip non-symlinks */
+                        ++tl_io.links;
+                        k = vfs_readlinkat(d_fd, nm, symlink_path,
+                                           sizeof(symlink_path) - 1);
+                        if (k < 1)
+                                continue;       /* expect 1 or more chars */
+                        symlink_path[k] = '\0';
+                }
+
+                /* kinds keyed on st_rdev of the node the link leads to */
+                if ((0 == vfs_fstatat(d_fd, nm, &stats, 0)) &&
+                    (rp = disk_link_rec_get(&disk_link_index.by_rdev,
+                                            stats.st_rdev, NULL))) {
+                        if (! by_id)
+                                disk_link_offer(rp, DLK_PATH, 0, nm);
+                        else if (0 == strncmp(nm, scsi_pfx, scsi_pfx_len)) {
+                                cp = nm[scsi_pfx_len] ?
+                                     strchr(scsi_prio, nm[scsi_pfx_len]) :
+                                     NULL;
+                                rank = cp ? (int)(cp - scsi_prio) :
+                                            (int)strlen(scsi_prio);
+                                disk_link_offer(rp, DLK_SCSI, rank, nm);
+                        } else if (0 == strncmp(nm, mpath_pfx,
+                                                strlen(mpath_pfx)))
+                                disk_link_offer(rp, DLK_MPATH, 0, nm);
+                        else if (0 == strncmp(nm, usb_pfx, strlen(usb_pfx)))
+                                disk_link_offer(rp, DLK_USB, 0, nm);
+                }
+
+                /* kinds keyed on the basename of the link's target */
+                if ((! by_id) || strstr(nm, "part"))
+                        continue;       /* skip if contains "part" */
+                if (0 == strncmp(nm, scsi_pfx, scsi_pfx_len)) {
+                        /* accepted device identification VPD page
+                         * designator types: NAA, EUI-64 based and SCSI
+                         * name string (iSCSI) */
+                        if ((nm[scsi_pfx_len] != '3') &&
+                            (nm[scsi_pfx_len] != '2') &&
+                            (nm[scsi_pfx_len] != '8'))
+                                continue;
+                        kind = DLK_SCSI_WWN;
+                } else if (0 == strncmp(nm, wwn_pfx, strlen(wwn_pfx)))
+                        kind = DLK_WWN;
+                else
+                        continue;
+                rp = disk_link_rec_get(&disk_link_index.by_bname, 0,
+                                       basename(symlink_path));
+                if (rp)
+                        disk_link_offer(rp, kind, 0, nm);
+        }
+        vfs_closedir(&vd);
+}
+
+/* Reads /dev/disk/by-id and /dev/disk/by-path into disk_link_index, once */
+static void
+collect_disk_links(void)
+{
+        unsigned int off;
+        struct stats_mark sm;
+
+        pthread_mutex_lock(&node_list_mtx);
+        if (! disk_link_index.collected) {
+                stats_begin(&sm, false);
+                /* so an offset of 0 can mean no link */
+                if (0 == disk_link_index.pool.len)
+                        str_pool_add(&disk_link_index.pool, "", &off);
+                if ((! disk_link_index.want_only) ||
+                    (disk_link_index.by_bname.count > 0)) {
+                        disk_link_scan(dev_disk_byid_dir, true);
+                        disk_link_scan(dev_disk_bypath_dir, false);
+                }
+                disk_link_index.collected = true;
+                stats_end(STP_DISK_LINKS, &sm, false);
+        }
+        pthread_mutex_unlock(&node_list_mtx);
+}
+
+/* Where disk_want_dir_scan_select() is scanning: the "block" directory of
+ * a SCSI device, below the directory open on dir_fd */
+struct disk_want_ctx {
+        int dir_fd;
+        const char * dir_name;
+};
+
+/* Adds the disk (e.g. "sda") named by 's' to disk_link_index so that, once
+ * want_only is set, only links to such disks are read. When 'ctx' is given
+ * the disk's holders (e.g. "dm-3" of a multipath map) are added too, since
+ * get_disk_scsi_id() may take the id from their links. Only called before
+ * the index is collected and any --jobs=N worker is started. */
+static int
+disk_want_dir_scan_select(const struct dirent * s, void * ctx)
+{
+        unsigned int off;
+        const struct disk_want_ctx * wcp = (const struct disk_want_ctx *)ctx;
+        char b[LMAX_PATH];
+
+        if (! dir_or_link(s, NULL))
+                return 0;
+        if (0 == disk_link_index.pool.len)
+                str_pool_add(&disk_link_index.pool, "", &off);
+        disk_link_rec_get(&disk_link_index.by_bname, 0, s->d_name);
+        if (wcp) {
+                snprintf(b, sizeof(b), "%s/%s/holders", wcp->dir_name,
+                         s->d_name);
+                scandir_ctx(wcp->dir_fd, b, NULL, disk_want_dir_scan_select,
+                            NULL);
+        }
+        return 1;
+}
+
+/* Free disk_link_index. */
+static void
+free_disk_link_index(void)
+{
+        if (dev_tasks_stray())
+                return;
+        free(disk_link_index.by_rdev.recs);
+        free(disk_link_index.by_bname.recs);
+        free(disk_link_index.pool.p);
+        memset(&disk_link_index, 0, sizeof(disk_link_index));
+}
+
+/* Returns the name (without directory) of the best 'kind' link to the
+ * disk whose device number is 'rdev', or for kinds from DLK_FIRST_BY_BNAME
+ * onwards, to the disk node whose basename is 'bname'. Returns NULL if
+ * there is no such link. */
+static const char *
+get_disk_link(enum disk_link_kind kind, dev_t rdev, const char * bname)
+{
+        struct disk_link_tbl * tp;
+        struct disk_link_rec * rp;
+
+        collect_disk_links();
+        if (kind >= DLK_FIRST_BY_BNAME) {
+                tp = &disk_link_index.by_bname;
+                if (NULL == bname)
+                        return NULL;
+        } else {
+                tp = &disk_link_index.by_rdev;
+                bname = NULL;
+        }
+        if (0 == tp->count)
+                return NULL;
+        rp = disk_link_slot(tp->recs, tp->size, rdev, bname);
+        if ((! rp->used) || (0 == rp->link_off[kind]))
+                return NULL;
+        return disk_link_index.pool.p + rp->link_off[kind];
+}
+
+/* Given a path to a class device, find the disk's WWN from the
+ * /dev/disk/by-id/scsi-* link (or with 'wwn_twice', the wwn-* link) to
+ * its node. Returns true if match found, false otherwise. */
+static bool
+get_disk_wwn(const char *wd, char * wwn_str, int max_wwn_str_len,
+             bool wwn_twice)
+{
+        const char * lnp;
+        char name[LMAX_PATH];
+
+        my_strcopy(name, wd, sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+        lnp = get_disk_link(wwn_twice ? DLK_WWN : DLK_SCSI_WWN, 0,
+                            basename(name));
+        if (NULL == lnp)
+                return false;
+        if (max_wwn_str_len > DSK_WWN_MXLEN)
+                max_wwn_str_len = DSK_WWN_MXLEN;
+        if (wwn_twice)
+                my_strcopy(wwn_str, lnp + 4, max_wwn_str_len);
+        else    /* step over designator type */
+                snprintf(wwn_str, max_wwn_str_len, "0x%s", lnp + 6);
+        wwn_str[max_wwn_str_len - 1] = '\0';
+        return true;
 }
 
 /*
- * Look up a device node in a directory with symlinks to device nodes.
- * @dir: Directory to examine, e.g. "/dev/disk/by-id".
- * @pfx: Prefix of the symlink, e.g. "scsi-".
- * @priority: Identifier priority of the @pfx prefix from highest to lowest.
+ * Look up a device node's link of a given kind in disk_link_index.
+ * @kind: One of the kinds keyed on st_rdev, e.g. DLK_SCSI.
+ * @pfx_len: Length of the prefix of that kind, e.g. 5 for "scsi-".
  * @dev: Device node to look up, e.g. "/dev/sda".
  * Returns a pointer to the name of the symlink without the prefix if a match
- * has been found. When @priority is supplied the best available symlink
- * is chosen by comparing first character of the identifier within
- * the @priority set.
- * Side effect: changes the working directory to @dir.
+ * has been found. For DLK_SCSI the best available symlink is the one whose
+ * identifier's first character comes earliest in "328S10".
  * Note: The caller must free the pointer returned by this function.
  */
 static char *
-lookup_dev(const char *dir, const char *pfx, const char *priority,
-           const char *dev)
+lookup_dev(enum disk_link_kind kind, int pfx_len, const char *dev)
 {
-        unsigned int st_rdev;
-        DIR *dirp;
-        struct dirent *entry;
-        char *result = NULL;
+        const char * lnp;
         struct stat stats;
 
-        if (stat(dev, &stats) < 0)
-                goto out;
-        st_rdev = stats.st_rdev;
-        if (chdir(dir) < 0)
-                goto out;
-        dirp = opendir(dir);
-        if (!dirp)
-                goto out;
-        while ((entry = readdir(dirp)) != NULL) {
-                if (stat(entry->d_name, &stats) >= 0 &&
-                    stats.st_rdev == st_rdev &&
-                    strncmp(entry->d_name, pfx, strlen(pfx)) == 0) {
-                        char *nm = entry->d_name + strlen(pfx);
-
-                        if (!priority || *nm == *priority) {
-                                free(result);
-                                result = strdup(nm);
-                                break;
-                        }
-                        if (!result ||
-                            ((strchr(priority, *nm) != NULL) &&
-                             (strchr(priority, *nm) <
-                              strchr(priority, *result)))) {
-                                free(result);
-                                result = strdup(nm);
-                        }
-                }
-        }
-        closedir(dirp);
-out:
-        return result;
+        if (vfs_stat(dev, &stats) < 0)
+                return NULL;
+        lnp = get_disk_link(kind, stats.st_rdev, NULL);
+        return lnp ? strdup(lnp + pfx_len) : NULL;
 }
 
 /*
@@ -1817,12 +3739,13 @@ static char *
 get_disk_scsi_id(const char *dev_node, bool wo_prefix)
 {
         char *scsi_id = NULL;
-        DIR *dir;
+        const char * cp;
+        struct vfs_dir vd;
         struct dirent *entry;
         char holder[LMAX_PATH + 6];
         char sys_block[LMAX_PATH];
 
-        scsi_id = lookup_dev(dev_disk_byid_dir, "scsi-", "328S10", dev_node);
+        scsi_id = lookup_dev(DLK_SCSI, 5 /* "scsi-" */, dev_node);
         if (scsi_id) {
                 if (wo_prefix) {
                         size_t len = strlen(scsi_id);
@@ -1834,25 +3757,28 @@ get_disk_scsi_id(const char *dev_node, bool wo_prefix)
                 }
                 goto out;
         }
-        scsi_id = lookup_dev(dev_disk_byid_dir, "dm-uuid-mpath-", NULL,
-                             dev_node);
+        scsi_id = lookup_dev(DLK_MPATH, 14 /* "dm-uuid-mpath-" */, dev_node);
         if (scsi_id)
                 goto out;
-        scsi_id = lookup_dev(dev_disk_byid_dir, "usb-", NULL, dev_node);
+        scsi_id = lookup_dev(DLK_USB, 4 /* "usb-" */, dev_node);
         if (scsi_id)
                 goto out;
+        cp = strrchr(dev_node, '/');
         snprintf(sys_block, sizeof(sys_block), "%s/class/block/%s/holders",
-                 sysfsroot, dev_node + 5);
-        dir = opendir(sys_block);
-        if (!dir)
+                 sysfsroot, cp ? cp + 1 : dev_node);
+        if (! vfs_opendir_at(&vd, AT_FDCWD, sys_block))
                 goto out;
-        while ((entry = readdir(dir)) != NULL) {
-                snprintf(holder, sizeof(holder), "/dev/%s", entry->d_name);
+        ++tl_io.dirs;
+        while ((entry = vfs_readdir(&vd)) != NULL) {
+                if ('.' == entry->d_name[0])
+                        continue;
+                snprintf(holder, sizeof(holder), "%s/%s", devfsroot,
+                         entry->d_name);
                 scsi_id = get_disk_scsi_id(holder, wo_prefix); /* recurse */
                 if (scsi_id)
                         break;
         }
-        closedir(dir);
+        vfs_closedir(&vd);
 out:
         return scsi_id;
 }
@@ -1881,7 +3807,7 @@ get_usb_devname(const char * hname, const char * devname, char * b, int b_len)
                 np = devname;
         } else
                 return NULL;
-        if (if_directory_chdir(buff, np) && getcwd(bf2, sizeof(bf2)) &&
+        if (if_directory_canon(buff, np, bf2, sizeof(bf2)) &&
             strstr(bf2, "usb")) {
                 if (b_len > 0)
                         b[0] = '\0';
@@ -1903,39 +3829,84 @@ get_usb_devname(const char * hname, const char * devname, char * b, int b_len)
 #define VPD_ASSOC_TPORT 1
 #define TPROTO_ISCSI 5
 
-/* Iterates to next designation descriptor in the device identification
- * VPD page. The 'initial_desig_desc' should point to start of first
- * descriptor with 'page_len' being the number of valid bytes in that
- * and following descriptors. To start, 'off' should point to a negative
- * value, thereafter it should point to the value yielded by the previous
- * call. If 0 returned then 'initial_desig_desc + *off' should be a valid
- * descriptor; returns -1 if normal end condition and -2 for an abnormal
- * termination. Matches association, designator_type and/or code_set when
- * any of those values are greater than or equal to zero. */
-static int
-sg_vpd_dev_id_iter(const uint8_t * initial_desig_desc, int page_len,
-                   int * off, int m_assoc, int m_desig_type, int m_code_set)
+/* Returns the device identification VPD page of the LU 'devname' with its
+ * designation descriptors indexed, or NULL if it has no (valid) page. The
+ * page is read on the first call for the LU and kept in 'dcp', later
+ * calls are lookups. */
+static const struct vpd_di *
+vpd_di_get(const char * devname, struct dev_ctx_t * dcp)
 {
-        const uint8_t * bp;
-        int k, c_set, assoc, desig_type;
+        int res, len, k;
+        int assoc, desig_type;
+        uint8_t * bp;
+        struct vpd_di * vp = &dcp->vpd_di;
+        struct vpd_desig * dp;
+        int8_t last[4][16];
+        char buff[LMAX_DEVPATH];
 
-        for (k = *off, bp = initial_desig_desc ; (k + 3) < page_len; ) {
-                k = (k < 0) ? 0 : (k + bp[k + 3] + 4);
-                if ((k + 4) > page_len)
-                        break;
-                c_set = (bp[k] & 0xf);
-                if ((m_code_set >= 0) && (m_code_set != c_set))
-                        continue;
-                assoc = ((bp[k + 1] >> 4) & 0x3);
-                if ((m_assoc >= 0) && (m_assoc != assoc))
-                        continue;
-                desig_type = (bp[k + 1] & 0xf);
-                if ((m_desig_type >= 0) && (m_desig_type != desig_type))
-                        continue;
-                *off = k;
-                return 0;
+        if (vp->read)
+                return vp->ok ? vp : NULL;
+        vp->read = true;
+        if (dcp->dev_fd >= 0)
+                res = vfs_read_at(dcp->dev_fd, "vpd_pg83", vp->page,
+                                  sizeof(vp->page));
+        else {
+                snprintf(buff, sizeof(buff), "%s/%s/%s/%s/device/vpd_pg83",
+                         sysfsroot, cl_s, sdev_s, devname);
+                res = vfs_read_at(AT_FDCWD, buff, vp->page,
+                                  sizeof(vp->page));
+        }
+        if (res < 0)
+                return NULL;
+        ++tl_io.attrs;
+        tl_io.bytes += (res > 0) ? res : 0;
+        if (res <= 8)
+                return NULL;
+        if (VPD_DEVICE_ID != vp->page[1])
+                return NULL;
+        len = sg_get_unaligned_be16(vp->page + 2);
+        if ((len + 4) != res)
+                return NULL;
+
+        memset(vp->first, 0xff, sizeof(vp->first));
+        bp = vp->page + 4;
+        for (k = 0; ((k + 4) <= len) && (vp->num < VPD_DI_MAX_DESC);
+             k += bp[k + 3] + 4) {
+                if ((k + 4 + bp[k + 3]) > len)
+                        break;          /* last designator truncated */
+                assoc = (bp[k + 1] >> 4) & 0x3;
+                desig_type = bp[k + 1] & 0xf;
+                dp = vp->d + vp->num;
+                dp->b0 = bp[k];
+                dp->b1 = bp[k + 1];
+                dp->len = bp[k + 3];
+                dp->off = 4 + k + 4;
+                dp->next = -1;
+                if (vp->first[assoc][desig_type] < 0)
+                        vp->first[assoc][desig_type] = vp->num;
+                else
+                        vp->d[last[assoc][desig_type]].next = vp->num;
+                last[assoc][desig_type] = vp->num;
+                ++vp->num;
+        }
+        vp->ok = true;
+        return vp;
+}
+
+/* Returns the first designation descriptor in 'vp' with association
+ * 'assoc', designator type 'desig_type' and code set 'code_set' (any code
+ * set when -1), or NULL if there is none. */
+static const struct vpd_desig *
+vpd_di_find(const struct vpd_di * vp, int assoc, int desig_type,
+            int code_set)
+{
+        int k;
+
+        for (k = vp->first[assoc][desig_type]; k >= 0; k = vp->d[k].next) {
+                if ((code_set < 0) || (code_set == (vp->d[k].b0 & 0xf)))
+                        return vp->d + k;
         }
-        return (k == page_len) ? -1 : -2;
+        return NULL;
 }
 
 /* Fetch logical unit (LU) name given the device name in the form:
@@ -1947,61 +3918,39 @@ sg_vpd_dev_id_iter(const uint8_t * initial_desig_desc, int page_len,
  * none of the above are present then check for T10 Vendor ID
  * (designator_type=1) and use if available. */
 static char *
-get_lu_name(const char * devname, char * b, int b_len, bool want_prefix)
+get_lu_name(const char * devname, struct dev_ctx_t * dcp, char * b,
+            int b_len, bool want_prefix)
 {
-        int fd, res, len, dlen, sns_dlen, off, k, n;
-        uint8_t *bp;
+        int dlen, k, n;
+        const uint8_t * dbp;
         char *cp;
-        char buff[LMAX_DEVPATH];
-        uint8_t u[512];
-        uint8_t u_sns[512];
-        struct stat a_stat;
+        const struct vpd_di * vp;
+        const struct vpd_desig * dp;
+        const struct vpd_desig * sns_dp;
 
         if ((NULL == b) || (b_len < 1))
                 return b;
         b[0] = '\0';
-        snprintf(buff, sizeof(buff), "%s/%s/%s/%s/device/vpd_pg83",
-                 sysfsroot, cl_s, sdev_s, devname);
-        if (! ((stat(buff, &a_stat) >= 0) && S_ISREG(a_stat.st_mode)))
-                return b;
-        if ((fd = open(buff, O_RDONLY)) < 0)
-                return b;
-        res = read(fd, u, sizeof(u));
-        if (res <= 8) {
-                close(fd);
-                return b;
-        }
-        close(fd);
-        if (VPD_DEVICE_ID != u[1])
-                return b;
-        len = sg_get_unaligned_be16(u + 2);
-        if ((len + 4) != res)
+        if (NULL == (vp = vpd_di_get(devname, dcp)))
                 return b;
-        bp = u + 4;
         cp = b;
-        off = -1;
-        if (0 == sg_vpd_dev_id_iter(bp, len, &off, VPD_ASSOC_LU,
-                                    8 /* SCSI name string (sns) */,
-                                    3 /* UTF-8 */)) {
-                sns_dlen = bp[off + 3];
-                memcpy(u_sns, bp + off + 4, sns_dlen);
+        sns_dp = vpd_di_find(vp, VPD_ASSOC_LU, 8 /* SCSI name string */,
+                             3 /* UTF-8 */);
+        if (sns_dp) {
                 /* now want to check if this is iSCSI */
-                off = -1;
-                if (0 == sg_vpd_dev_id_iter(bp, len, &off, VPD_ASSOC_TPORT,
-                                            8 /* SCSI name string (sns) */,
-                                            3 /* UTF-8 */)) {
-                        if ((0x80 & bp[1]) &&
-                            (TPROTO_ISCSI == (bp[0] >> 4))) {
-                                snprintf(b, b_len, "%.*s", sns_dlen, u_sns);
-                                return b;
-                        }
+                dp = vpd_di_find(vp, VPD_ASSOC_TPORT, 8 /* SCSI name string */,
+                                 3 /* UTF-8 */);
+                if (dp && (0x80 & dp->b1) && (TPROTO_ISCSI == (dp->b0 >> 4))) {
+                        snprintf(b, b_len, "%.*s", sns_dp->len,
+                                 vp->page + sns_dp->off);
+                        return b;
                 }
-        } else
-                sns_dlen = 0;
+        }
 
-        if (0 == sg_vpd_dev_id_iter(bp, len, &off, VPD_ASSOC_LU,
-                                    3 /* NAA */, 1 /* binary */)) {
-                dlen = bp[off + 3];
+        dp = vpd_di_find(vp, VPD_ASSOC_LU, 3 /* NAA */, 1 /* binary */);
+        if (dp) {
+                dlen = dp->len;
+                dbp = vp->page + dp->off;
                 if (! ((8 == dlen) || (16 == dlen)))
                         return b;
                 if (want_prefix) {
@@ -2011,13 +3960,14 @@ get_lu_name(const char * devname, char * b, int b_len, bool want_prefix)
                         b_len -= n;
                 }
                 for (k = 0; ((k < dlen) && (b_len > 1)); ++k) {
-                        snprintf(cp, b_len, "%02x", bp[off + 4 + k]);
+                        snprintf(cp, b_len, "%02x", dbp[k]);
                         cp += 2;
                         b_len -= 2;
                 }
-        } else if (0 == sg_vpd_dev_id_iter(bp, len, &off, VPD_ASSOC_LU,
-                                           2 /* EUI */, 1 /* binary */)) {
-                dlen = bp[off + 3];
+        } else if ((dp = vpd_di_find(vp, VPD_ASSOC_LU, 2 /* EUI */,
+                                     1 /* binary */))) {
+                dlen = dp->len;
+                dbp = vp->page + dp->off;
                 if (! ((8 == dlen) || (12 == dlen) || (16 == dlen)))
                         return b;
                 if (want_prefix) {
@@ -2027,14 +3977,15 @@ get_lu_name(const char * devname, char * b, int b_len, bool want_prefix)
                         b_len -= n;
                 }
                 for (k = 0; ((k < dlen) && (b_len > 1)); ++k) {
-                        snprintf(cp, b_len, "%02x", bp[off + 4 + k]);
+                        snprintf(cp, b_len, "%02x", dbp[k]);
                         cp += 2;
                         b_len -= 2;
                 }
-        } else if (0 == sg_vpd_dev_id_iter(bp, len, &off, VPD_ASSOC_LU,
-                                           0xa /* UUID */,  1 /* binary */)) {
-                dlen = bp[off + 3];
-                if ((1 != ((bp[off + 4] >> 4) & 0xf)) || (18 != dlen)) {
+        } else if ((dp = vpd_di_find(vp, VPD_ASSOC_LU, 0xa /* UUID */,
+                                     1 /* binary */))) {
+                dlen = dp->len;
+                dbp = vp->page + dp->off;
+                if ((18 != dlen) || (1 != ((dbp[0] >> 4) & 0xf))) {
                         snprintf(cp, b_len, "??");
                         /* cp += 2; */
                         /* b_len -= 2; */
@@ -2054,17 +4005,18 @@ get_lu_name(const char * devname, char * b, int b_len, bool want_prefix)
                                         --b_len;
                                 }
                                 snprintf(cp, b_len, "%02x",
-                                         (unsigned int)bp[off + 6 + k]);
+                                         (unsigned int)dbp[2 + k]);
                                 cp += 2;
                                 b_len -= 2;
                         }
                 }
-        } else if (sns_dlen > 0)
-                snprintf(b, b_len, "%.*s", sns_dlen, u_sns);
-        else if ((0 == sg_vpd_dev_id_iter(bp, len, &off, VPD_ASSOC_LU,
-                                          0x1 /* T10 vendor ID */,  -1)) &&
-                 ((bp[off] & 0xf) > 1 /* ASCII or UTF */)) {
-                dlen = bp[off + 3];
+        } else if (sns_dp)
+                snprintf(b, b_len, "%.*s", sns_dp->len,
+                         vp->page + sns_dp->off);
+        else if ((dp = vpd_di_find(vp, VPD_ASSOC_LU, 0x1 /* T10 vendor ID */,
+                                   -1)) &&
+                 ((dp->b0 & 0xf) > 1 /* ASCII or UTF */)) {
+                dlen = dp->len;
                 if (dlen < 8)
                         return b;       /* must have 8 byte T10 vendor id */
                 if (want_prefix) {
@@ -2073,7 +4025,7 @@ get_lu_name(const char * devname, char * b, int b_len, bool want_prefix)
                         cp += n;
                         b_len -= n;
                 }
-                snprintf(cp, b_len, "%.*s", dlen, bp + off + 4);
+                snprintf(cp, b_len, "%.*s", dlen, vp->page + dp->off);
         }
         return b;
 }
@@ -2095,6 +4047,8 @@ parse_colon_list(const char * colon_list, struct addr_hctl * outp)
                 int val;
 
                 outp->h = NVME_HOST_NUM;
+                outp->t = 0;    /* when no 'c' (e.g. "nvme0n1") */
+                outp->l = 0;
                 if ((0 == strncmp(colon_list, "nvme", 4)) &&
                     (1 == sscanf(colon_list + 4, "%d%n", &outp->c, &k)))
                         colon_list = colon_list + 4 + k;
@@ -2158,312 +4112,1075 @@ parse_colon_list(const char * colon_list, struct addr_hctl * outp)
         return true;
 }
 
-/* Print enclosure device link from the rport- or end_device- */
-static void
-print_enclosure_device(const char *devname, const char *path,
-                       struct lsscsi_opts * op)
+/* Places the address of the SCSI device 'devname' that 'dcp' (if not
+ * NULL) is for in 'outp': the one parsed when the topology was built, if
+ * known, to save parsing it again. Returns false if 'devname' does not
+ * parse. */
+static bool
+dev_hctl(const struct dev_ctx_t * dcp, const char * devname,
+         struct addr_hctl * outp)
 {
-        sgj_state * jsp = &op->json_st;
-        struct addr_hctl hctl;
-        char b[LMAX_PATH];
-
-        if (parse_colon_list(devname, &hctl)) {
-                snprintf(b, sizeof(b),
-                         "%s/device/target%d:%d:%d/%d:%d:%d:%" PRIu64,
-                         path, hctl.h, hctl.c, hctl.t,
-                         hctl.h, hctl.c, hctl.t, hctl.l);
-                if (enclosure_device_scan(b, op) > 0)
-                        sgj_pr_hr(jsp, "  %s\n", enclosure_device.name);
+        if (dcp && dcp->hctlp) {
+                *outp = *dcp->hctlp;
+                return true;
         }
+        return parse_colon_list(devname, outp);
 }
 
-/*
- * Obtain the GUID of the InfiniBand port associated with SCSI host number h
- * by stripping prefix fe80:0000:0000:0000: from GID 0. An example:
- * 0002:c903:00a0:5de2.
- */
-static void
-get_local_srp_gid(const int h, char *b, int b_len)
+static unsigned int
+encl_slot_hash(int h, int c, int t, uint64_t l)
 {
-        int port;
-        char buff[LMAX_DEVPATH];
-        char value[LMAX_NAME];
+        unsigned int k = ((unsigned int)h * 0x9e3779b1U) ^
+                         ((unsigned int)c * 0x85ebca6bU) ^
+                         ((unsigned int)t * 0xc2b2ae35U) ^
+                         (unsigned int)(l ^ (l >> 32));
 
-        snprintf(buff, sizeof(buff), "%s%shost%d", sysfsroot, scsi_host_s, h);
-        if (!get_value(buff, "local_ib_port", value, sizeof(value)))
-                return;
-        if (sscanf(value, "%d", &port) != 1)
-                return;
-        if (!get_value(buff, "local_ib_device", value, sizeof(value)))
-                return;
-        snprintf(buff, sizeof(buff), "%.80s/class/infiniband/%s/ports/%d/gids",
-                 sysfsroot, value, port);
-        if (!get_value(buff, "0", value, sizeof(value)))
-                return;
-        if (strlen(value) > 20)
-                snprintf(b, b_len, "%s", value + 20);
+        return k ^ (k >> 16);
 }
 
-/*
- * Obtain the original GUID of the remote InfiniBand port associated with a
- * SCSI host by stripping prefix fe80:0000:0000:0000: from its GID. An
- * example: 0002:c903:00a0:5de2. Returns true on success, else false.
- */
-static bool
-get_srp_orig_dgid(const int h, char *b, int b_len)
+/* Returns the record in 'recs' (which has 'size' slots, a power of 2)
+ * keyed on 'hp', or the empty slot where it belongs. The caller ensures
+ * there is at least one empty slot. */
+static struct encl_slot_rec *
+encl_slot_slot(struct encl_slot_rec * recs, unsigned int size,
+               const struct addr_hctl * hp)
 {
-        char buff[LMAX_DEVPATH];
-        char value[LMAX_NAME];
+        unsigned int mask = size - 1;
+        unsigned int k = encl_slot_hash(hp->h, hp->c, hp->t, hp->l) & mask;
+        struct encl_slot_rec * rp;
 
-        snprintf(buff, sizeof(buff), "%s%shost%d", sysfsroot, scsi_host_s, h);
-        if (get_value(buff, odgi_s, value, sizeof(value)) &&
-            strlen(value) > 20) {
-                snprintf(b, b_len, "%s", value + 20);
-                return true;
+        for ( ; ; k = (k + 1) & mask) {
+                rp = recs + k;
+                if ((! rp->used) ||
+                    ((hp->h == rp->h) && (hp->c == rp->c) &&
+                     (hp->t == rp->t) && (hp->l == rp->l)))
+                        return rp;
         }
-        return false;
 }
 
-/*
- * Obtain the GUID of the remote InfiniBand port associated with a SCSI host
- * by stripping prefix fe80:0000:0000:0000: from its GID. An example:
- * 0002:c903:00a0:5de2. Returns true on success else false.
- */
-static bool
-get_srp_dgid(const int h, char *b, int b_len)
+/* Adds to encl_slot_index the device 'hp' in component 'comp' (whose slot
+ * number is 'slot') of enclosure 'encl'. A device already there keeps
+ * the first component seen. */
+static void
+encl_slot_add(const struct addr_hctl * hp, const char * encl,
+              const char * comp, int slot)
 {
-        char buff[LMAX_DEVPATH];
-        char value[LMAX_NAME];
+        unsigned int k;
+        unsigned int n_size;
+        struct encl_slot_rec * rp;
+        struct encl_slot_rec * n_recs;
+        struct encl_slot_index * ip = &encl_slot_index;
+        struct addr_hctl hctl;
 
-        snprintf(buff, sizeof(buff), "%s%shost%d", sysfsroot, scsi_host_s, h);
-        if (get_value(buff, dgi_s, value, sizeof(value)) &&
-            strlen(value) > 20) {
-                snprintf(b, b_len, "%s", value + 20);
-                return true;
+        /* Keep the load factor at or below one half */
+        if (2 * (ip->count + 1) > ip->size) {
+                n_size = ip->size ? (2 * ip->size) : ENCL_SLOT_TBL_INIT_SZ;
+                n_recs = (struct encl_slot_rec *)calloc(n_size,
+                                                        sizeof(*n_recs));
+                if (NULL == n_recs)
+                        return;
+                for (k = 0; k < ip->size; ++k) {
+                        rp = ip->recs + k;
+                        if (! rp->used)
+                                continue;
+                        hctl.h = rp->h;
+                        hctl.c = rp->c;
+                        hctl.t = rp->t;
+                        hctl.l = rp->l;
+                        *encl_slot_slot(n_recs, n_size, &hctl) = *rp;
+                }
+                free(ip->recs);
+                ip->recs = n_recs;
+                ip->size = n_size;
         }
-        return false;
+        rp = encl_slot_slot(ip->recs, ip->size, hp);
+        if (rp->used)
+                return;
+        if (! (str_pool_add(&ip->pool, encl, &rp->encl_off) &&
+               str_pool_add(&ip->pool, comp, &rp->comp_off)))
+                return;
+        rp->used = true;
+        rp->h = hp->h;
+        rp->c = hp->c;
+        rp->t = hp->t;
+        rp->l = hp->l;
+        rp->slot = slot;
+        ++ip->count;
 }
 
-/* Check host associated with 'devname' for known transport types. If so set
- * transport_id, place a string in 'b' and return true. Otherwise return
- * false. */
-static bool
-transport_h_init(const char * devname, int b_len, char * b)
+/* Adds the components of enclosure 'encl' (in class/enclosure, whose
+ * directory is open on 'fd') that have a device linked to them. */
+static void
+encl_slot_scan(int fd, const char * encl)
 {
-        int off;
-        char * cp;
-        char buff[LMAX_DEVPATH];
-        char wd[LMAX_PATH];
-        struct stat a_stat;
-        static const int bufflen = sizeof(buff);
+        int slot;
+        struct vfs_dir vd;
+        struct dirent * dep;
+        const char * cp;
+        struct addr_hctl hctl;
+        char b[LMAX_NAME + 16];
+        char link[LMAX_PATH];
+        char value[32];
 
-        /* SPI host */
-        snprintf(buff, bufflen, "%s%s%s", sysfsroot, spi_host_s, devname);
-        if ((stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                transport_id = TRANSPORT_SPI;
-                snprintf(b, b_len, "spi:");
-                return true;
+        if (! vfs_fdopendir(&vd, fd)) {
+                vfs_close(fd);
+                return;
+        }
+        ++tl_io.dirs;
+        while ((dep = vfs_readdir(&vd))) {
+                if (! dir_or_link(dep, NULL))
+                        continue;
+                snprintf(b, sizeof(b), "%s/device", dep->d_name);
+                if (! readlink_at(fd, b, link, sizeof(link)))
+                        continue;       /* empty slot, or not a component */
+                cp = strrchr(link, '/');
+                if (! parse_colon_list(cp ? (cp + 1) : link, &hctl))
+                        continue;
+                snprintf(b, sizeof(b), "%s/slot", dep->d_name);
+                if (! (get_value_at(fd, b, value, sizeof(value)) &&
+                       (1 == sscanf(value, "%d", &slot))))
+                        slot = -1;
+                encl_slot_add(&hctl, encl, dep->d_name, slot);
         }
+        vfs_closedir(&vd);      /* also closes fd */
+}
 
-        /* FC host */
-        snprintf(buff, bufflen, "%s/%s/%s/%s", sysfsroot, cl_s, fc_h_s,
-                 devname);
-        if ((stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                if (get_value(buff, "symbolic_name", wd, sizeof(wd))) {
-                        if (strstr(wd, " over ")) {
-                                transport_id = TRANSPORT_FCOE;
-                                snprintf(b, b_len, "fcoe:");
-                        }
-                }
-                if (transport_id != TRANSPORT_FCOE) {
-                        transport_id = TRANSPORT_FC;
-                        snprintf(b, b_len, "fc:");
+/* Reads each enclosure in class/enclosure into encl_slot_index, once */
+static void
+collect_encl_slots(void)
+{
+        int fd;
+        unsigned int off;
+        struct vfs_dir vd;
+        struct dirent * dep;
+        struct stats_mark sm;
+        char b[LMAX_DEVPATH];
+
+        pthread_mutex_lock(&node_list_mtx);
+        if (encl_slot_index.collected)
+                goto fini;
+        stats_begin(&sm, false);
+        /* so that no real name has an offset of 0 */
+        str_pool_add(&encl_slot_index.pool, "", &off);
+        snprintf(b, sizeof(b), "%s/%s/enclosure", sysfsroot, cl_s);
+        if (vfs_opendir_at(&vd, AT_FDCWD, b)) {
+                ++tl_io.dirs;
+                while ((dep = vfs_readdir(&vd))) {
+                        if (! dir_or_link(dep, NULL))
+                                continue;
+                        fd = opendir_fd(vd.fd, dep->d_name);
+                        if (fd >= 0)
+                                encl_slot_scan(fd, dep->d_name);
                 }
-                off = strlen(b);
-                if (get_value(buff, ptn_s, b + off, b_len - off)) {
-                        off = strlen(b);
-                        my_strcopy(b + off, ",", b_len - off);
-                        off = strlen(b);
-                } else
-                        return false;
-                if (get_value(buff, "port_id", b + off, b_len - off))
-                        return true;
-                else
-                        return false;
+                vfs_closedir(&vd);
         }
+        encl_slot_index.collected = true;
+        stats_end(STP_ENCL_SLOTS, &sm, false);
+fini:
+        pthread_mutex_unlock(&node_list_mtx);
+}
 
-        /* SRP host */
-        snprintf(buff, bufflen, "%s%s%s", sysfsroot, srp_h_s, devname);
-        if (stat(buff, &a_stat) >= 0 && S_ISDIR(a_stat.st_mode)) {
-                int h;
+/* Free encl_slot_index. */
+static void
+free_encl_slot_index(void)
+{
+        if (dev_tasks_stray())
+                return;
+        free(encl_slot_index.recs);
+        free(encl_slot_index.pool.p);
+        memset(&encl_slot_index, 0, sizeof(encl_slot_index));
+}
 
-                transport_id = TRANSPORT_SRP;
-                snprintf(b, b_len, "srp:");
-                if (sscanf(devname, "host%d", &h) == 1)
-                        get_local_srp_gid(h, b + strlen(b), b_len - strlen(b));
-                return true;
-        }
+/* Returns the enclosure component that the SCSI device named 'devname'
+ * (e.g. "6:0:3:0") is linked to, or NULL if none. */
+static const struct encl_slot_rec *
+get_encl_slot(const char * devname)
+{
+        struct addr_hctl hctl;
+        struct encl_slot_rec * rp;
 
-        /* SAS host */
-        /* SAS transport layer representation */
-        snprintf(buff, bufflen, "%s%s%s", sysfsroot, sas_host_s, devname);
-        if ((stat(buff, &a_stat) >= 0) && stat_is_dir_or_symlink(&a_stat)) {
-                transport_id = TRANSPORT_SAS;
-                snprintf(b, b_len, "sas:");
-                off = strlen(buff);
-                snprintf(buff + off, bufflen - off, "/device");
-                if (sas_low_phy_scan(buff, NULL) < 1)
-                        return false;
-                snprintf(buff, bufflen, "%s%s%s", sysfsroot, sas_phy_s,
-                         sas_low_phy);
-                off = strlen(b);
-                if (get_value(buff, sas_ad_s, b + off, b_len - off))
-                        return true;
-                else {
-                        if (gl_verbose)
-                                pr2serr("%s: no %s, wd=%s\n", __func__,
-                                        sas_ad_s, buff);
-                        return false;
+        collect_encl_slots();
+        if ((0 == encl_slot_index.count) ||
+            (! parse_colon_list(devname, &hctl)))
+                return NULL;
+        rp = encl_slot_slot(encl_slot_index.recs, encl_slot_index.size,
+                            &hctl);
+        return rp->used ? rp : NULL;
+}
+
+/* Appends "  <enclosure>,<component>" (or "  -") for the SCSI device named
+ * 'devname' to 'b' and, for JSON, adds an "enclosure_slot" object to
+ * 'jop'. Returns the number of characters appended. */
+static int
+rend_encl_slot(const char * devname, char * b, int blen, sgj_state * jsp,
+               sgj_opaque_p jop)
+{
+        const char * ep;
+        const char * cp;
+        const struct encl_slot_rec * rp = get_encl_slot(devname);
+        sgj_opaque_p jo2p;
+
+        if (NULL == rp)
+                return sg_scn3pr(b, blen, 0, "  %s", "-");
+        ep = encl_slot_index.pool.p + rp->encl_off;
+        cp = encl_slot_index.pool.p + rp->comp_off;
+        if (jsp->pr_as_json) {
+                jo2p = sgj_named_subobject_r(jsp, jop, "enclosure_slot");
+                sgj_js_nv_s(jsp, jo2p, "enclosure", ep);
+                sgj_js_nv_s(jsp, jo2p, "component", cp);
+                if (rp->slot >= 0)
+                        sgj_js_nv_i(jsp, jo2p, "slot", rp->slot);
+        }
+        return sg_scn3pr(b, blen, 0, "  %s,%s", ep, cp);
+}
+
+/* Print the enclosure component that the SCSI device 'devname' is linked
+ * to, as the name of the link to it from the device's directory */
+static void
+print_enclosure_device(const char * devname, struct lsscsi_opts * op)
+{
+        const struct encl_slot_rec * rp = get_encl_slot(devname);
+
+        if (rp)
+                sgj_pr_hr(&op->json_st, "  enclosure_device:%s\n",
+                          encl_slot_index.pool.p + rp->comp_off);
+}
+
+static unsigned int
+tport_hash(int h, int c, int t)
+{
+        unsigned int k = ((unsigned int)h * 0x9e3779b1U) ^
+                         ((unsigned int)c * 0x85ebca6bU) ^
+                         ((unsigned int)t * 0xc2b2ae35U);
+
+        return k ^ (k >> 16);
+}
+
+/* Returns the slot in 'tbl' (which has 'size' slots, a power of 2) that
+ * holds the record keyed on <h:c:t>, or the empty slot where it belongs. */
+static struct tport_rec **
+tport_slot(struct tport_rec ** tbl, unsigned int size, int h, int c, int t)
+{
+        unsigned int mask = size - 1;
+        unsigned int k = tport_hash(h, c, t) & mask;
+        struct tport_rec * rp;
+
+        for ( ; ; k = (k + 1) & mask) {
+                rp = tbl[k];
+                if ((NULL == rp) ||
+                    ((h == rp->h) && (c == rp->c) && (t == rp->t)))
+                        return tbl + k;
+        }
+}
+
+/* Returns the record keyed on <h:c:t>, adding an empty one if need be.
+ * Returns NULL if out of memory. Caller holds tport_memo_mtx. */
+static struct tport_rec *
+tport_rec_get(int h, int c, int t)
+{
+        unsigned int k;
+        unsigned int n_size;
+        struct tport_rec ** rpp;
+        struct tport_rec ** n_tbl;
+        struct tport_rec * rp;
+
+        if (NULL == tport_memo.tbl) {
+                tport_memo.tbl = (struct tport_rec **)
+                        calloc(TPORT_MEMO_INIT_SZ, sizeof(rp));
+                if (NULL == tport_memo.tbl)
+                        return NULL;
+                tport_memo.size = TPORT_MEMO_INIT_SZ;
+        }
+        rpp = tport_slot(tport_memo.tbl, tport_memo.size, h, c, t);
+        if (*rpp)
+                return *rpp;
+        if (2 * (tport_memo.count + 1) > tport_memo.size) {
+                n_size = 2 * tport_memo.size;
+                n_tbl = (struct tport_rec **)calloc(n_size, sizeof(rp));
+                if (NULL == n_tbl)
+                        return NULL;
+                for (k = 0; k < tport_memo.size; ++k) {
+                        rp = tport_memo.tbl[k];
+                        if (rp)
+                                *tport_slot(n_tbl, n_size, rp->h, rp->c,
+                                            rp->t) = rp;
                 }
+                free(tport_memo.tbl);
+                tport_memo.tbl = n_tbl;
+                tport_memo.size = n_size;
+                rpp = tport_slot(n_tbl, n_size, h, c, t);
         }
+        rp = (struct tport_rec *)calloc(1, sizeof(*rp));
+        if (NULL == rp)
+                return NULL;
+        rp->h = h;
+        rp->c = c;
+        rp->t = t;
+        *rpp = rp;
+        ++tport_memo.count;
+        return rp;
+}
 
-        /* SAS class representation */
-        snprintf(buff, bufflen, "%s%s%s%s", sysfsroot, scsi_host_s,
-                 devname, "/device/sas/ha");
-        if ((stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                transport_id = TRANSPORT_SAS_CLASS;
-                snprintf(b, b_len, "sas:");
-                off = strlen(b);
-                if (get_value(buff, dev_n_s, b + off, b_len - off))
-                        return true;
-                else {
-                        if (gl_verbose)
-                                pr2serr("%s: no %s, wd=%s\n",
-                                        __func__, dev_n_s, buff);
-                        return false;
+static void
+sas_topo_free(struct sas_topo * tp)
+{
+        struct sas_topo * op;
+
+        for ( ; tp; tp = op) {
+                op = tp->older;
+                free(tp->nodes);
+                free(tp);
+        }
+}
+
+/* Free tport_memo. */
+static void
+free_tport_memo(void)
+{
+        unsigned int k;
+        int j;
+        struct tport_rec * rp;
+
+        if (dev_tasks_stray())
+                return;
+        for (k = 0; k < tport_memo.size; ++k) {
+                rp = tport_memo.tbl[k];
+                if (NULL == rp)
+                        continue;
+                free(rp->tport);
+                free(rp->sas_end_device);
+                free(rp->fc_rport);
+                free(rp->fc_rport_dir);
+                for (j = 0; j < TPA_NUM; ++j)
+                        free(rp->amp[j]);
+                sas_topo_free(rp->sas_topo);
+                free(rp);
+        }
+        free(tport_memo.tbl);
+        memset(&tport_memo, 0, sizeof(tport_memo));
+}
+
+/* Returns a mask of THC_* values for the transport class directories that
+ * SCSI host 'h' has. They are only checked on the first call for 'h'. */
+static unsigned int
+tport_host_classes(int h)
+{
+        unsigned int mask = 0;
+        struct tport_rec * rp;
+        struct stat a_stat;
+        char buff[LMAX_DEVPATH];
+        char value[LMAX_NAME];
+        static const int bufflen = sizeof(buff);
+
+        pthread_mutex_lock(&tport_memo_mtx);
+        rp = tport_rec_get(h, -1, -1);
+        if (rp)
+                mask = rp->thc_mask;
+        pthread_mutex_unlock(&tport_memo_mtx);
+        if (mask & THC_KNOWN)
+                return mask;
+
+        mask = THC_KNOWN;
+        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, sas_host_s, h);
+        if ((vfs_stat(buff, &a_stat) >= 0) && stat_is_dir_or_symlink(&a_stat))
+                mask |= THC_SAS;
+        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, spi_host_s, h);
+        if ((vfs_stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode))
+                mask |= THC_SPI;
+        snprintf(buff, bufflen, "%s/%s/%s/host%d", sysfsroot, cl_s, fc_h_s,
+                 h);
+        if ((vfs_stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
+                mask |= THC_FC;
+                if (get_value(buff, "symbolic_name", value, sizeof(value)) &&
+                    strstr(value, " over "))
+                        mask |= THC_FCOE;
+        }
+        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, srp_h_s, h);
+        if ((vfs_stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode))
+                mask |= THC_SRP;
+        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, iscsi_h_s, h);
+        if ((vfs_stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
+                mask |= THC_ISCSI;
+                my_strcopy(buff + strlen(buff), "/device",
+                           bufflen - strlen(buff));
+                if ((vfs_stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode))
+                        mask |= THC_ISCSI_DEV;
+        }
+
+        pthread_mutex_lock(&tport_memo_mtx);
+        if (rp)
+                rp->thc_mask = mask;
+        pthread_mutex_unlock(&tport_memo_mtx);
+        return mask;
+}
+
+/* If transport_sdev_tport() has already found the transport of the target
+ * that 'hp' is in, sets in 'dcp' and 'b' what it set then and returns
+ * true. Otherwise returns false. */
+static bool
+tport_memo_get(const struct addr_hctl * hp, struct dev_ctx_t * dcp,
+               int b_len, char * b)
+{
+        bool found = false;
+        struct tport_rec * rp;
+
+        pthread_mutex_lock(&tport_memo_mtx);
+        rp = tport_rec_get(hp->h, hp->c, hp->t);
+        if (rp && rp->have_tport) {
+                dcp->transport_id = rp->transport_id;
+                dcp->iscsi_tsession_num = rp->iscsi_tsession_num;
+                if (rp->sas_end_device)
+                        my_strcopy(dcp->sas_hold_end_device,
+                                   rp->sas_end_device,
+                                   sizeof(dcp->sas_hold_end_device));
+                my_strcopy(b, rp->tport, b_len);
+                found = true;
+        }
+        pthread_mutex_unlock(&tport_memo_mtx);
+        return found;
+}
+
+/* Keeps what transport_sdev_tport() found for the target that 'hp' is
+ * in: 'b' and the transport fields of 'dcp'. */
+static void
+tport_memo_put(const struct addr_hctl * hp, const struct dev_ctx_t * dcp,
+               const char * b)
+{
+        char * tp = strdup(b);
+        char * sp = NULL;
+        struct tport_rec * rp;
+
+        if ((TRANSPORT_SAS == dcp->transport_id) &&
+            (NULL == (sp = strdup(dcp->sas_hold_end_device)))) {
+                free(tp);
+                return;
+        }
+        if (NULL == tp) {
+                free(sp);
+                return;
+        }
+        pthread_mutex_lock(&tport_memo_mtx);
+        rp = tport_rec_get(hp->h, hp->c, hp->t);
+        if (rp && (! rp->have_tport)) {
+                rp->have_tport = true;
+                rp->transport_id = dcp->transport_id;
+                rp->iscsi_tsession_num = dcp->iscsi_tsession_num;
+                rp->tport = tp;
+                rp->sas_end_device = sp;
+                tp = NULL;
+                sp = NULL;
+        }
+        pthread_mutex_unlock(&tport_memo_mtx);
+        free(tp);
+        free(sp);
+}
+
+/* Like fetch_attrs(-1, dir_name, names, num, asp) but the values are only
+ * read on the first call for the target that 'hp' is in and 'slot',
+ * later calls get a copy. 'names' must be the same on each call, as they
+ * are at any one call site. 'hp' may be NULL in which case nothing is
+ * kept. */
+static void
+fetch_attrs_memo(const struct addr_hctl * hp, enum tport_attrs slot,
+                 const char * dir_name, const char * const * names, int num,
+                 struct attr_set * asp)
+{
+        int k, end;
+        int used = 0;
+        struct tport_rec * rp;
+        struct attr_memo * mp = NULL;
+
+        if (hp) {
+                pthread_mutex_lock(&tport_memo_mtx);
+                rp = tport_rec_get(hp->h, hp->c, hp->t);
+                if (rp && (mp = rp->amp[slot])) {
+                        asp->num = mp->num;
+                        asp->names = names;
+                        for (k = 0; k < mp->num; ++k) {
+                                asp->av[k] = mp->av[k];
+                                if (mp->av[k].vp) {
+                                        end = mp->av[k].vp - mp->arena;
+                                        asp->av[k].vp = asp->arena + end;
+                                        end += mp->av[k].len + 1;
+                                        if (end > used)
+                                                used = end;
+                                }
+                        }
+                        memcpy(asp->arena, mp->arena, used);
                 }
+                pthread_mutex_unlock(&tport_memo_mtx);
+                if (mp)
+                        return;
         }
+        fetch_attrs(-1, dir_name, names, num, asp);
+        if (NULL == hp)
+                return;
 
-        /* SBP (FireWire) host */
-        do {
-                char *t, buff2[LMAX_DEVPATH - 4];
+        for (k = 0; k < asp->num; ++k) {
+                if (asp->av[k].vp) {
+                        end = (asp->av[k].vp - asp->arena) + asp->av[k].len +
+                              1;
+                        if (end > used)
+                                used = end;
+                }
+        }
+        mp = (struct attr_memo *)malloc(sizeof(*mp) + used);
+        if (NULL == mp)
+                return;
+        mp->num = asp->num;
+        for (k = 0; k < asp->num; ++k) {
+                mp->av[k] = asp->av[k];
+                if (asp->av[k].vp)
+                        mp->av[k].vp = mp->arena +
+                                       (asp->av[k].vp - asp->arena);
+        }
+        memcpy(mp->arena, asp->arena, used);
+        pthread_mutex_lock(&tport_memo_mtx);
+        rp = tport_rec_get(hp->h, hp->c, hp->t);
+        if (rp && (NULL == rp->amp[slot])) {
+                rp->amp[slot] = mp;
+                mp = NULL;
+        }
+        pthread_mutex_unlock(&tport_memo_mtx);
+        free(mp);
+}
 
-                /* resolve SCSI host device */
-                snprintf(buff, bufflen, "%s%s%s%s", sysfsroot, scsi_host_s,
-                         devname, "/device");
-                if (readlink(buff, buff2, sizeof(buff2)) <= 0)
+/* Returns the SNK_* kind of the entry called 'name' in the directory of
+ * a sas_topo node of kind 'parent_kind', or -1 if it is not part of the
+ * index. */
+static int
+sas_child_kind(int parent_kind, const char * name, bool fabric)
+{
+        switch (parent_kind) {
+        case SNK_HOST:
+        case SNK_EXPANDER:
+                if (0 == strncmp(name, "phy-", 4))
+                        return SNK_PHY;
+                if (0 == strncmp(name, "port-", 5))
+                        return SNK_PORT;
+                break;
+        case SNK_PORT:
+                if (0 == strncmp(name, "phy-", 4))
+                        return SNK_PHY;
+                if (! fabric)
                         break;
+                if (0 == strncmp(name, "expander-", 9))
+                        return SNK_EXPANDER;
+                if (0 == strncmp(name, "end_device-", 11))
+                        return SNK_END_DEV;
+                break;
+        case SNK_END_DEV:
+                if (0 == strncmp(name, "target", 6))
+                        return SNK_TARGET;
+                break;
+        case SNK_TARGET:
+                if (isdigit((uint8_t)name[0]) && strchr(name, ':'))
+                        return SNK_LU;
+                break;
+        default:
+                break;
+        }
+        return -1;
+}
 
-                /* check if the SCSI host has a FireWire host as ancestor */
-                if (!(t = strstr(buff2, "/fw-host")))
-                        break;
-                transport_id = TRANSPORT_SBP;
+struct sas_walk_t {
+        struct sas_topo * tp;
+        int parent;
+        int last;                       /* last child added, -1 if none */
+        bool oom;
+};
 
-                /* terminate buff2 after FireWire host */
-                if (!(t = strchr(t+1, '/')))
-                        break;
-                *t = 0;
+/* Adds directory entry 's' as a child of the node that 'ctx' (a struct
+ * sas_walk_t) refers to, if it belongs in the index. Always returns 0 so
+ * scandir_ctx() keeps nothing. */
+static int
+sas_topo_select(const struct dirent * s, void * ctx)
+{
+        int kind;
+        const char * cp;
+        struct sas_walk_t * wp = (struct sas_walk_t *)ctx;
+        struct sas_topo * tp = wp->tp;
+        struct sas_node * np;
 
-                /* resolve FireWire host device */
-                buff[strlen(buff) - strlen(dvc_s)] = 0;
-                if (strlen(buff) + strlen(buff2) + strlen("host_id/guid") + 2
-                    > bufflen)
-                        break;
-                my_strcopy(buff + strlen(buff), buff2, bufflen);
+        if (wp->oom || (! dir_or_link(s, NULL)))
+                return 0;
+        kind = sas_child_kind(tp->nodes[wp->parent].kind, s->d_name,
+                              tp->fabric);
+        if (kind < 0)
+                return 0;
+        if (tp->num >= tp->max) {
+                np = (struct sas_node *)realloc(tp->nodes, 2 * tp->max *
+                                                sizeof(*np));
+                if (NULL == np) {
+                        wp->oom = true;
+                        return 0;
+                }
+                tp->nodes = np;
+                tp->max *= 2;
+        }
+        np = tp->nodes + tp->num;
+        memset(np, 0, sizeof(*np));
+        np->kind = kind;
+        np->parent = wp->parent;
+        np->child = -1;
+        np->next = -1;
+        my_strcopy(np->name, s->d_name, sizeof(np->name));
+        if ((SNK_PHY == kind) && (cp = strrchr(np->name, ':')))
+                np->num = atoi(cp + 1);
+        if (wp->last < 0)
+                tp->nodes[wp->parent].child = tp->num;
+        else
+                tp->nodes[wp->last].next = tp->num;
+        wp->last = tp->num++;
+        return 0;
+}
 
-                /* read the FireWire host's EUI-64 */
-                if (!get_value(buff, "host_id/guid", buff2, sizeof(buff2)) ||
-                    strlen(buff2) != 18)
-                        break;
-                snprintf(b, b_len, "sbp:%.120s", buff2 + 2);
-                return true;
-        } while (0);
+/* Adds the children of node 'k' of 'tp' found in directory 'path' (which
+ * is LMAX_PATH bytes long and is restored before returning), then
+ * theirs. Returns false if out of memory. */
+static bool
+sas_topo_walk(struct sas_topo * tp, int k, char * path, int depth)
+{
+        int j, n;
+        struct sas_walk_t w = {tp, k, -1, false};
 
-        /* iSCSI host */
-        snprintf(buff, bufflen, "%s%s%s", sysfsroot, iscsi_h_s, devname);
-        if ((stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                transport_id = TRANSPORT_ISCSI;
-                snprintf(b, b_len, "iscsi:");
-// >>>       Can anything useful be placed after "iscsi:" in single line
-//           host output?
-//           Hmmm, probably would like SAM-4 ",i,0x" notation here.
+        if (depth > SAS_TOPO_MAX_DEPTH)
                 return true;
+        scandir_ctx(AT_FDCWD, path, NULL, sas_topo_select, &w);
+        if (w.oom)
+                return false;
+        n = strlen(path);
+        for (j = tp->nodes[k].child; j >= 0; j = tp->nodes[j].next) {
+                if ((SNK_PHY == tp->nodes[j].kind) ||
+                    (SNK_LU == tp->nodes[j].kind))
+                        continue;
+                snprintf(path + n, LMAX_PATH - n, "/%s", tp->nodes[j].name);
+                if (! sas_topo_walk(tp, j, path, depth + 1))
+                        return false;
         }
+        path[n] = '\0';
+        return true;
+}
 
-        /* USB host? */
-        cp = get_usb_devname(devname, NULL, wd, sizeof(wd) - 1);
-        if (cp) {
-                transport_id = TRANSPORT_USB;
-                snprintf(b, b_len, "usb:%s", cp);
-                return true;
+/* Returns the index in 'tp' of the phy child of node 'parent' that has
+ * the lowest number, or -1 if it has none. If 'nump' is not NULL the
+ * number of phy children is placed there. */
+static int
+sas_topo_low_phy(const struct sas_topo * tp, int parent, int * nump)
+{
+        int j;
+        int n = 0;
+        int low = -1;
+
+        for (j = tp->nodes[parent].child; j >= 0; j = tp->nodes[j].next) {
+                if (SNK_PHY != tp->nodes[j].kind)
+                        continue;
+                ++n;
+                if ((low < 0) || (tp->nodes[j].num < tp->nodes[low].num))
+                        low = j;
         }
+        if (nump)
+                *nump = n;
+        return low;
+}
 
-        /* ATA or SATA host, crude check: driver name */
-        snprintf(buff, bufflen, "%s%s%s", sysfsroot, scsi_host_s, devname);
-        if (get_value(buff, "proc_name", wd, sizeof(wd))) {
-                if (0 == strcmp("ahci", wd)) {
-                        transport_id = TRANSPORT_SATA;
-                        snprintf(b, b_len, "sata:");
-                        return true;
-                } else if (strstr(wd, "ata")) {
-                        if (0 == memcmp("sata", wd, 4)) {
-                                transport_id = TRANSPORT_SATA;
-                                snprintf(b, b_len, "sata:");
-                                return true;
-                        }
-                        transport_id = TRANSPORT_ATA;
-                        snprintf(b, b_len, "ata:");
-                        return true;
+/* Returns the number of children of node 'parent' in 'tp' of 'kind' */
+static int
+sas_topo_count(const struct sas_topo * tp, int parent, int kind)
+{
+        int j;
+        int n = 0;
+
+        for (j = tp->nodes[parent].child; j >= 0; j = tp->nodes[j].next) {
+                if (kind == tp->nodes[j].kind)
+                        ++n;
+        }
+        return n;
+}
+
+/* Reads the sas_address of the host (from its lowest numbered phy),
+ * expanders and end devices and the negotiated link rate of port phys. */
+static void
+sas_topo_attrs(struct sas_topo * tp)
+{
+        int k;
+        struct sas_node * np;
+        char b[LMAX_DEVPATH];
+
+        for (k = 0, np = tp->nodes; k < tp->num; ++k, ++np) {
+                switch (np->kind) {
+                case SNK_PHY:
+                        if (SNK_PORT != tp->nodes[np->parent].kind)
+                                break;
+                        snprintf(b, sizeof(b), "%s%s%s", sysfsroot,
+                                 sas_phy_s, np->name);
+                        get_value(b, neg_lr_s, np->linkrate,
+                                  sizeof(np->linkrate));
+                        break;
+                case SNK_EXPANDER:
+                case SNK_END_DEV:
+                        snprintf(b, sizeof(b), "%s/%s/%s/%s", sysfsroot,
+                                 cl_s, sasdev_s, np->name);
+                        get_value(b, sas_ad_s, np->sas_address,
+                                  sizeof(np->sas_address));
+                        break;
+                default:
+                        break;
                 }
         }
-        return false;
+        k = sas_topo_low_phy(tp, 0, NULL);
+        if (k >= 0) {
+                snprintf(b, sizeof(b), "%s%s%s", sysfsroot, sas_phy_s,
+                         tp->nodes[k].name);
+                get_value(b, sas_ad_s, tp->nodes[0].sas_address,
+                          sizeof(tp->nodes[0].sas_address));
+        }
 }
 
-/* Given the transport_id of a SCSI host (initiator) associated with
- * 'path_name' output additional information.
+/* Returns the SAS topology index of SAS host 'h', building it on the first
+ * call (or the first with 'fabric' set). Returns NULL if out of memory.
+ * The index is not changed once returned and lasts until
+ * free_tport_memo(). */
+static const struct sas_topo *
+sas_topo_get(int h, bool fabric)
+{
+        struct tport_rec * rp;
+        struct sas_topo * tp = NULL;
+        char path[LMAX_PATH];
+
+        pthread_mutex_lock(&tport_memo_mtx);
+        rp = tport_rec_get(h, -1, -1);
+        if (rp && rp->sas_topo && (rp->sas_topo->fabric || (! fabric)))
+                tp = rp->sas_topo;
+        pthread_mutex_unlock(&tport_memo_mtx);
+        if (tp || (NULL == rp))
+                return tp;
+
+        tp = (struct sas_topo *)calloc(1, sizeof(*tp));
+        if (NULL == tp)
+                return NULL;
+        tp->fabric = fabric;
+        tp->max = 16;
+        tp->nodes = (struct sas_node *)calloc(tp->max, sizeof(*tp->nodes));
+        if (NULL == tp->nodes) {
+                free(tp);
+                return NULL;
+        }
+        tp->num = 1;
+        tp->nodes[0].kind = SNK_HOST;
+        tp->nodes[0].parent = -1;
+        tp->nodes[0].child = -1;
+        tp->nodes[0].next = -1;
+        snprintf(tp->nodes[0].name, sizeof(tp->nodes[0].name), "host%d", h);
+        snprintf(path, sizeof(path), "%s%shost%d/device", sysfsroot,
+                 sas_host_s, h);
+        if (! sas_topo_walk(tp, 0, path, 0)) {
+                sas_topo_free(tp);
+                return NULL;
+        }
+        if (fabric)
+                sas_topo_attrs(tp);
+
+        pthread_mutex_lock(&tport_memo_mtx);
+        if (rp->sas_topo && (rp->sas_topo->fabric || (! fabric))) {
+                sas_topo_free(tp);      /* another thread got there first */
+                tp = rp->sas_topo;
+        } else {
+                tp->older = rp->sas_topo;
+                rp->sas_topo = tp;
+        }
+        pthread_mutex_unlock(&tport_memo_mtx);
+        return tp;
+}
+
+/*
+ * Obtain the GUID of the InfiniBand port associated with SCSI host number h
+ * by stripping prefix fe80:0000:0000:0000: from GID 0. An example:
+ * 0002:c903:00a0:5de2.
  */
 static void
-transport_init_longer(const char * path_name, struct lsscsi_opts * op,
-                      sgj_opaque_p jop)
+get_local_srp_gid(const int h, char *b, int b_len)
 {
-        int k, j, len, phynum, portnum;
-        char * cp;
-        sgj_state * jsp = &op->json_st;
-        sgj_opaque_p jo2p = NULL;
-        sgj_opaque_p jap = NULL;
-        struct dirent ** phylist;
-        struct dirent ** portlist;
-        struct stat a_stat;
-        char b[LMAX_PATH];
-        char bname[LMAX_NAME];
+        int port;
+        char buff[LMAX_DEVPATH];
         char value[LMAX_NAME];
-        static const int blen = sizeof(b);
-        static const int vlen = sizeof(value);
-        /* If string used by another function, moved to file scope */
-        static const char * sig_s = "signalling";
-        static const char * afc4_s = "active_fc4s";
-        static const char * sfc4_s = "supported_fc4s";
-        static const char * fn_s = "fabric_name";
-        static const char * mfs_s = "maxframe_size";
-        static const char * mnp_s = "max_npiv_vports";
-        static const char * nvi_s = "npiv_vports_inuse";
-        static const char * ptt_s = "port_type";
-        static const char * sp_s = "speed";
-        static const char * ssp_s = "supported_speeds";
-        static const char * tbt_s = "tgtid_bind_type";
-        static const char * ha_n_s = "ha_name";
-        static const char * vd_s = "version_descriptor";
-        static const char * e_s = "enabled";
-        static const char * om_s = "oob_mode";
-        static const char * r_s = "role";
-        static const char * ty_s = "type";
 
-        my_strcopy(b, path_name, blen);
-        cp = basename(b);
-        my_strcopy(bname, cp, sizeof(bname));
+        snprintf(buff, sizeof(buff), "%s%shost%d", sysfsroot, scsi_host_s, h);
+        if (!get_value(buff, "local_ib_port", value, sizeof(value)))
+                return;
+        if (sscanf(value, "%d", &port) != 1)
+                return;
+        if (!get_value(buff, "local_ib_device", value, sizeof(value)))
+                return;
+        snprintf(buff, sizeof(buff), "%.80s/class/infiniband/%s/ports/%d/gids",
+                 sysfsroot, value, port);
+        if (!get_value(buff, "0", value, sizeof(value)))
+                return;
+        if (strlen(value) > 20)
+                snprintf(b, b_len, "%s", value + 20);
+}
+
+/*
+ * Obtain the original GUID of the remote InfiniBand port associated with a
+ * SCSI host by stripping prefix fe80:0000:0000:0000: from its GID. An
+ * example: 0002:c903:00a0:5de2. Returns true on success, else false.
+ */
+static bool
+get_srp_orig_dgid(const int h, char *b, int b_len)
+{
+        char buff[LMAX_DEVPATH];
+        char value[LMAX_NAME];
+
+        snprintf(buff, sizeof(buff), "%s%shost%d", sysfsroot, scsi_host_s, h);
+        if (get_value(buff, odgi_s, value, sizeof(value)) &&
+            strlen(value) > 20) {
+                snprintf(b, b_len, "%s", value + 20);
+                return true;
+        }
+        return false;
+}
+
+/*
+ * Obtain the GUID of the remote InfiniBand port associated with a SCSI host
+ * by stripping prefix fe80:0000:0000:0000: from its GID. An example:
+ * 0002:c903:00a0:5de2. Returns true on success else false.
+ */
+static bool
+get_srp_dgid(const int h, char *b, int b_len)
+{
+        char buff[LMAX_DEVPATH];
+        char value[LMAX_NAME];
+
+        snprintf(buff, sizeof(buff), "%s%shost%d", sysfsroot, scsi_host_s, h);
+        if (get_value(buff, dgi_s, value, sizeof(value)) &&
+            strlen(value) > 20) {
+                snprintf(b, b_len, "%s", value + 20);
+                return true;
+        }
+        return false;
+}
+
+/* Check host associated with 'devname' for known transport types. If so set
+ * dcp->transport_id, place a string in 'b' and return true. Otherwise return
+ * false. */
+static bool
+transport_h_init(const char * devname, struct dev_ctx_t * dcp, int b_len,
+                 char * b)
+{
+        int off, h;
+        unsigned int thc;
+        char * cp;
+        char buff[LMAX_DEVPATH];
+        char wd[LMAX_PATH];
+        struct stat a_stat;
+        static const int bufflen = sizeof(buff);
+
+        thc = (1 == sscanf(devname, "host%d", &h)) ? tport_host_classes(h) :
+                                                     0;
+        /* SPI host */
+        if (thc & THC_SPI) {
+                dcp->transport_id = TRANSPORT_SPI;
+                snprintf(b, b_len, "spi:");
+                return true;
+        }
+
+        /* FC host */
+        if (thc & THC_FC) {
+                snprintf(buff, bufflen, "%s/%s/%s/%s", sysfsroot, cl_s,
+                         fc_h_s, devname);
+                if (thc & THC_FCOE) {
+                        dcp->transport_id = TRANSPORT_FCOE;
+                        snprintf(b, b_len, "fcoe:");
+                } else {
+                        dcp->transport_id = TRANSPORT_FC;
+                        snprintf(b, b_len, "fc:");
+                }
+                off = strlen(b);
+                if (get_value(buff, ptn_s, b + off, b_len - off)) {
+                        off = strlen(b);
+                        my_strcopy(b + off, ",", b_len - off);
+                        off = strlen(b);
+                } else
+                        return false;
+                if (get_value(buff, "port_id", b + off, b_len - off))
+                        return true;
+                else
+                        return false;
+        }
+
+        /* SRP host */
+        if (thc & THC_SRP) {
+                dcp->transport_id = TRANSPORT_SRP;
+                snprintf(b, b_len, "srp:");
+                get_local_srp_gid(h, b + strlen(b), b_len - strlen(b));
+                return true;
+        }
+
+        /* SAS host */
+        /* SAS transport layer representation */
+        if (thc & THC_SAS) {
+                int k = -1;
+                const struct sas_topo * tp = sas_topo_get(h, false);
+
+                dcp->transport_id = TRANSPORT_SAS;
+                snprintf(b, b_len, "sas:");
+                if (tp)
+                        k = sas_topo_low_phy(tp, 0, NULL);
+                if (k < 0)
+                        return false;
+                snprintf(buff, bufflen, "%s%s%s", sysfsroot, sas_phy_s,
+                         tp->nodes[k].name);
+                off = strlen(b);
+                if (get_value(buff, sas_ad_s, b + off, b_len - off))
+                        return true;
+                else {
+                        if (gl_verbose)
+                                pr2serr("%s: no %s, wd=%s\n", __func__,
+                                        sas_ad_s, buff);
+                        return false;
+                }
+        }
+
+        /* SAS class representation */
+        snprintf(buff, bufflen, "%s%s%s%s", sysfsroot, scsi_host_s,
+                 devname, "/device/sas/ha");
+        if ((vfs_stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
+                dcp->transport_id = TRANSPORT_SAS_CLASS;
+                snprintf(b, b_len, "sas:");
+                off = strlen(b);
+                if (get_value(buff, dev_n_s, b + off, b_len - off))
+                        return true;
+                else {
+                        if (gl_verbose)
+                                pr2serr("%s: no %s, wd=%s\n",
+                                        __func__, dev_n_s, buff);
+                        return false;
+                }
+        }
+
+        /* SBP (FireWire) host */
+        do {
+                char *t, buff2[LMAX_DEVPATH - 4];
+
+                /* resolve SCSI host device */
+                snprintf(buff, bufflen, "%s%s%s%s", sysfsroot, scsi_host_s,
+                         devname, "/device");
+                ++tl_io.links;
+                if (vfs_readlinkat(AT_FDCWD, buff, buff2, sizeof(buff2)) <= 0)
+                        break;
+
+                /* check if the SCSI host has a FireWire host as ancestor */
+                if (!(t = strstr(buff2, "/fw-host")))
+                        break;
+                dcp->transport_id = TRANSPORT_SBP;
+
+                /* terminate buff2 after FireWire host */
+                if (!(t = strchr(t+1, '/')))
+                        break;
+                *t = 0;
+
+                /* resolve FireWire host device */
+                buff[strlen(buff) - strlen(dvc_s)] = 0;
+                if (strlen(buff) + strlen(buff2) + strlen("host_id/guid") + 2
+                    > bufflen)
+                        break;
+                my_strcopy(buff + strlen(buff), buff2, bufflen);
+
+                /* read the FireWire host's EUI-64 */
+                if (!get_value(buff, "host_id/guid", buff2, sizeof(buff2)) ||
+                    strlen(buff2) != 18)
+                        break;
+                snprintf(b, b_len, "sbp:%.120s", buff2 + 2);
+                return true;
+        } while (0);
+
+        /* iSCSI host */
+        if (thc & THC_ISCSI) {
+                dcp->transport_id = TRANSPORT_ISCSI;
+                snprintf(b, b_len, "iscsi:");
+// >>>       Can anything useful be placed after "iscsi:" in single line
+//           host output?
+//           Hmmm, probably would like SAM-4 ",i,0x" notation here.
+                return true;
+        }
+
+        /* USB host? */
+        cp = get_usb_devname(devname, NULL, wd, sizeof(wd) - 1);
+        if (cp) {
+                dcp->transport_id = TRANSPORT_USB;
+                snprintf(b, b_len, "usb:%s", cp);
+                return true;
+        }
+
+        /* ATA or SATA host, crude check: driver name */
+        snprintf(buff, bufflen, "%s%s%s", sysfsroot, scsi_host_s, devname);
+        if (get_value(buff, "proc_name", wd, sizeof(wd))) {
+                if (0 == strcmp("ahci", wd)) {
+                        dcp->transport_id = TRANSPORT_SATA;
+                        snprintf(b, b_len, "sata:");
+                        return true;
+                } else if (strstr(wd, "ata")) {
+                        if (0 == memcmp("sata", wd, 4)) {
+                                dcp->transport_id = TRANSPORT_SATA;
+                                snprintf(b, b_len, "sata:");
+                                return true;
+                        }
+                        dcp->transport_id = TRANSPORT_ATA;
+                        snprintf(b, b_len, "ata:");
+                        return true;
+                }
+        }
+        return false;
+}
+
+/* Given the transport_id of a SCSI host (initiator) associated with
+ * 'path_name' output additional information.
+ */
+static void
+transport_init_longer(const char * path_name, struct lsscsi_opts * op,
+                      struct dev_ctx_t * dcp, sgj_opaque_p jop)
+{
+        int k, j, len, phynum, portnum;
+        char * cp;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jo2p = NULL;
+        sgj_opaque_p jap = NULL;
+        const struct sas_topo * tp = NULL;
+        struct stat a_stat;
+        char b[LMAX_PATH];
+        char bname[LMAX_NAME];
+        char value[LMAX_NAME];
+        static const int blen = sizeof(b);
+        static const int vlen = sizeof(value);
+        /* If string used by another function, moved to file scope */
+        static const char * sig_s = "signalling";
+        static const char * afc4_s = "active_fc4s";
+        static const char * sfc4_s = "supported_fc4s";
+        static const char * fn_s = "fabric_name";
+        static const char * mfs_s = "maxframe_size";
+        static const char * mnp_s = "max_npiv_vports";
+        static const char * nvi_s = "npiv_vports_inuse";
+        static const char * ptt_s = "port_type";
+        static const char * sp_s = "speed";
+        static const char * ssp_s = "supported_speeds";
+        static const char * tbt_s = "tgtid_bind_type";
+        static const char * ha_n_s = "ha_name";
+        static const char * vd_s = "version_descriptor";
+        static const char * e_s = "enabled";
+        static const char * om_s = "oob_mode";
+        static const char * r_s = "role";
+        static const char * ty_s = "type";
+        const char * low_phy_names[] = {sas_ad_s, ph_id_s, min_lr_s,
+                                        min_lrh_s, max_lr_s, max_lrh_s,
+                                        neg_lr_s};
+        struct attr_set as;
+
+        my_strcopy(b, path_name, blen);
+        cp = basename(b);
+        my_strcopy(bname, cp, sizeof(bname));
         bname[sizeof(bname) - 1] = '\0';
         cp = bname;
-        switch (transport_id) {
+        switch (dcp->transport_id) {
         case TRANSPORT_SPI:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "spi");
                 snprintf(b, blen, "%s%s%s", sysfsroot, spi_host_s, cp);
@@ -2473,44 +5190,23 @@ transport_init_longer(const char * path_name, struct lsscsi_opts * op,
         case TRANSPORT_FC:
         case TRANSPORT_FCOE:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP,
-                           (transport_id == TRANSPORT_FC) ? "fc:" : "fcoe:");
+                           (dcp->transport_id == TRANSPORT_FC) ? "fc:" : "fcoe:");
                 sg_scnpr(b, blen, "%s/%s/%s/%s", path_name, dvc_s, fc_h_s,
                          cp);
-                if (stat(b, &a_stat) < 0) {
+                if (vfs_stat(b, &a_stat) < 0) {
                         if (op->verbose > 2)
                                 pr2serr("no %s directory\n", fc_h_s);
                         break;
                 }
-                if (get_value(b, afc4_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, afc4_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, sfc4_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, sfc4_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, fn_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, fn_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, mfs_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mfs_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, mnp_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mnp_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, nvi_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, nvi_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, ndn_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ndn_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, ptn_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ptn_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, pti_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, pti_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, pts_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, pts_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, ptt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ptt_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, sp_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, sp_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, ssp_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ssp_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, scl_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, scl_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, tbt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tbt_s, SEP_EQ_NO_SP, value);
+                {
+                        const char * names[] = {afc4_s, sfc4_s, fn_s, mfs_s,
+                                                mnp_s, nvi_s, ndn_s, ptn_s,
+                                                pti_s, pts_s, ptt_s, sp_s,
+                                                ssp_s, scl_s, tbt_s};
+
+                        fetch_attrs(-1, b, names, SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
                 if (op->verbose > 2)
                         pr2serr("%s: %s\n", ffd_s, b);
                 break;
@@ -2531,52 +5227,42 @@ transport_init_longer(const char * path_name, struct lsscsi_opts * op,
                 break;
         case TRANSPORT_SAS:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "sas");
-                snprintf(b, blen, "%s%s", path_name, "" /* was: "/device" */);
-                if ((portnum = sas_port_scan(b, &portlist)) < 1) {
+                if (1 == sscanf(cp, "host%d", &k))
+                        tp = sas_topo_get(k, false);
+                portnum = tp ? sas_topo_count(tp, 0, SNK_PORT) : 0;
+                if (portnum < 1) {
                         /* no configured ports */
                         sgj_pr_hr(jsp, "  no configured ports\n");
-                        if ((phynum = sas_low_phy_scan(b, &phylist)) < 1) {
+                        phynum = tp ? sas_topo_count(tp, 0, SNK_PHY) : 0;
+                        if (phynum < 1) {
                                 sgj_pr_hr(jsp, "  no configured phys\n");
                                 return;
                         }
                         jap = sgj_named_subarray_r(jsp, jop, "phy_list");
-                        for (k = 0; k < phynum; ++k) {
+                        for (k = tp->nodes[0].child; k >= 0;
+                             k = tp->nodes[k].next) {
+                                const char * pn = tp->nodes[k].name;
+
+                                if (SNK_PHY != tp->nodes[k].kind)
+                                        continue;
                                 /* emit something potentially useful */
                                 snprintf(b, blen, "%s%s%s", sysfsroot,
-                                         sas_phy_s, phylist[k]->d_name);
-                                sgj_pr_hr(jsp, "  %s\n", phylist[k]->d_name);
+                                         sas_phy_s, pn);
+                                sgj_pr_hr(jsp, "  %s\n", pn);
                                 jo2p = sgj_new_unattached_object_r(jsp);
-                                sgj_js_nv_s(jsp, jo2p, "phy_name",
-                                            phylist[k]->d_name);
-                                if (get_value(b, sas_ad_s, value, vlen))
-                                        sgj_haj_vs(jsp, jo2p, 4, sas_ad_s,
-                                                   SEP_EQ_NO_SP, value);
-                                if (get_value(b, ph_id_s, value, vlen))
-                                        sgj_haj_vs(jsp, jo2p, 4, ph_id_s,
-                                                   SEP_EQ_NO_SP, value);
-                                if (get_value(b, min_lr_s, value, vlen))
-                                        sgj_haj_vs(jsp, jo2p, 4, min_lr_s,
-                                                   SEP_EQ_NO_SP, value);
-                                if (get_value(b, min_lrh_s, value, vlen))
-                                        sgj_haj_vs(jsp, jo2p, 4, min_lrh_s,
-                                                   SEP_EQ_NO_SP, value);
-                                if (get_value(b, max_lr_s, value, vlen))
-                                        sgj_haj_vs(jsp, jo2p, 4, max_lr_s,
-                                                   SEP_EQ_NO_SP, value);
-                                if (get_value(b, max_lrh_s, value, vlen))
-                                        sgj_haj_vs(jsp, jo2p, 4, max_lrh_s,
-                                                   SEP_EQ_NO_SP, value);
-                                if (get_value(b, neg_lr_s, value, vlen))
-                                        sgj_haj_vs(jsp, jo2p, 4, neg_lr_s,
-                                                   SEP_EQ_NO_SP, value);
+                                sgj_js_nv_s(jsp, jo2p, "phy_name", pn);
+                                fetch_attrs(-1, b, low_phy_names,
+                                            SG_ARRAY_SIZE(low_phy_names), &as);
+                                haj_attrs(jsp, jo2p, 4, &as);
                                 sgj_js_nv_o(jsp, jap, NULL, jo2p);
                         }
                         return;
                 }
                 jap = sgj_named_subarray_r(jsp, jop, "port_list");
-                for (k = 0; k < portnum; ++k) {     /* for each host port */
+                for (k = tp->nodes[0].child; k >= 0; k = tp->nodes[k].next) {
                         int n = 0;
-                        const char * pln = portlist[k]->d_name;
+                        int lp;
+                        const char * pln = tp->nodes[k].name;
                         char b2[168];
                         static const int b2len = sizeof(b2);
                         static const char * dt_s = "device_type";
@@ -2588,12 +5274,11 @@ transport_init_longer(const char * path_name, struct lsscsi_opts * op,
                         static const char * rdec_s =
                                         "running_disparity_error_count";
 
-                        sg_scnpr(b, blen, "%s%s%s", path_name, "/device/",
-                                 pln);
-                        if ((phynum = sas_low_phy_scan(b, &phylist)) < 1) {
+                        if (SNK_PORT != tp->nodes[k].kind)
+                                continue;       /* for each host port */
+                        if ((lp = sas_topo_low_phy(tp, k, &phynum)) < 0) {
                                 sgj_pr_hr(jsp, "  %s: phy list not "
                                           "available\n", pln);
-                                free(portlist[k]);
                                 continue;
                         }
                         snprintf(b, blen, "%s%s%s", sysfsroot,
@@ -2601,70 +5286,32 @@ transport_init_longer(const char * path_name, struct lsscsi_opts * op,
                         if (get_value(b, "num_phys", value, vlen)) {
                                 sgj_pr_hr(jsp, "  %s: num_phys=%s,", pln,
                                           value);
-                                for (j = 0; j < phynum; ++j) {
+                                for (j = 0; j < phynum; ++j)
                                         n += sg_scn3pr(b2, b2len, n, "  %s: "
                                                        "num_phys=%s,", pln,
                                                        value);
-                                        free(phylist[j]);
-                                }
                                 sgj_pr_hr(jsp, "%s\n", b2);
                                 if (op->verbose > 2)
                                         pr2serr("  %s: %s\n", ffd_s, b);
-                                free(phylist);
                         }
                         jo2p = sgj_new_unattached_object_r(jsp);
                         snprintf(b, blen, "%s%s%s", sysfsroot, sas_phy_s,
-                                 sas_low_phy);
-                        if (get_value(b, dt_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, dt_s, SEP_EQ_NO_SP,
-                                           value);
-                        if (get_value(b, ipp_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, ipp_s, SEP_EQ_NO_SP,
-                                           value);
-                        if (get_value(b, idc_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, idc_s, SEP_EQ_NO_SP,
-                                           value);
-                        if (get_value(b, lodsc_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, lodsc_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, min_lr_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, min_lr_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, min_lrh_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, min_lrh_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, max_lr_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, max_lr_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, max_lrh_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, max_lrh_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, neg_lr_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, neg_lr_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, ph_id_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, ph_id_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, prpc_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, prpc_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, rdec_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, rdec_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, sas_ad_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, sas_ad_s,
-                                           SEP_EQ_NO_SP, value);
-                        if (get_value(b, tpp_s, value, vlen))
-                                sgj_haj_vs(jsp, jo2p, 4, tpp_s,
-                                           SEP_EQ_NO_SP, value);
+                                 tp->nodes[lp].name);
+                        {
+                                const char * names[] = {dt_s, ipp_s, idc_s,
+                                        lodsc_s, min_lr_s, min_lrh_s,
+                                        max_lr_s, max_lrh_s, neg_lr_s,
+                                        ph_id_s, prpc_s, rdec_s, sas_ad_s,
+                                        tpp_s};
+
+                                fetch_attrs(-1, b, names, SG_ARRAY_SIZE(names),
+                                            &as);
+                                haj_attrs(jsp, jo2p, 4, &as);
+                        }
                         if (op->verbose > 2)
                                 pr2serr("  %s: %s\n", ffd_s, b);
-
-                        free(portlist[k]);
                         sgj_js_nv_o(jsp, jap, NULL, jo2p);
-
                 }
-                free(portlist);
 
                 break;
         case TRANSPORT_SAS_CLASS:
@@ -2672,37 +5319,24 @@ transport_init_longer(const char * path_name, struct lsscsi_opts * op,
                 sgj_haj_vs(jsp, jop, 2, subtrans_s, SEP_EQ_NO_SP,
                            "sas_class");
                 sg_scnpr(b, blen, "%s%s", path_name, "/device/sas/ha");
-                if (get_value(b, dev_n_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, dev_n_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, ha_n_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ha_n_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, vd_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, vd_s, SEP_EQ_NO_SP, value);
+                {
+                        const char * names[] = {dev_n_s, ha_n_s, vd_s};
+
+                        fetch_attrs(-1, b, names, SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
                 jo2p = sgj_named_subobject_r(jsp, jop, "phy0");
                 sgj_pr_hr(jsp, "  phy0:\n");
                 len = strlen(b);
                 snprintf(b + len, blen - len, "%s", "/phys/0");
-                if (get_value(b, cl_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, cl_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, e_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, e_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, "id", value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, "id", SEP_EQ_NO_SP, value);
-                if (get_value(b, ip_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, ip_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, lr_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, lr_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, om_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, om_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, r_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, r_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, sas_ad2_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, sas_ad2_s, SEP_EQ_NO_SP,
-                                   value);
-                if (get_value(b, tp_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, tp_s, SEP_EQ_NO_SP, value);
-                if (get_value(b, ty_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 4, ty_s, SEP_EQ_NO_SP, value);
+                {
+                        const char * names[] = {cl_s, e_s, "id", ip_s, lr_s,
+                                                om_s, r_s, sas_ad2_s, tp_s,
+                                                ty_s};
+
+                        fetch_attrs(-1, b, names, SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jo2p, 4, &as);
+                }
                 if (op->verbose > 2)
                         pr2serr("%s: %s\n", ffd_s, b);
                 break;
@@ -2739,38 +5373,35 @@ transport_init_longer(const char * path_name, struct lsscsi_opts * op,
         }
 }
 
-/* Attempt to determine the transport type of the SCSI device (LU) associated
- * with 'devname'. If found set transport_id, place string in 'b' and return
- * true. Otherwise return false. */
+/* Does the work of transport_sdev_tport() for the LU 'devname' whose
+ * address is 'hp'. Sets *per_tgtp if what was found holds for every LU in
+ * the same target. */
 static bool
-transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
-                int b_len, char * b)
+sdev_tport_find(const char * devname, const struct addr_hctl * hp,
+                const struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+                int b_len, char * b, bool * per_tgtp)
 {
         bool ata_dev;
         int n, off;
+        unsigned int thc;
         char * cp;
         char buff[LMAX_DEVPATH];
         char wd[LMAX_PATH];
         char nm[LMAX_NAME];
         char tpgt[LMAX_NAME];
-        struct addr_hctl hctl;
         struct stat a_stat;
         static const int bufflen = sizeof(buff);
         static const int wdlen = sizeof(wd);
 
-        if (! parse_colon_list(devname, &hctl))
-                return false;
-
+        thc = tport_host_classes(hp->h);
         /* check for SAS host */
-        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, sas_host_s, hctl.h);
-        if ((stat(buff, &a_stat) >= 0) && stat_is_dir_or_symlink(&a_stat)) {
+        if (thc & THC_SAS) {
                 /* SAS transport layer representation */
-                transport_id = TRANSPORT_SAS;
+                dcp->transport_id = TRANSPORT_SAS;
                 snprintf(buff, bufflen, "%s/%s/%s/%s", sysfsroot, cl_s,
                          sdev_s, devname);
-                if (if_directory_chdir(buff, dvc_s)) {
-                        if (NULL == getcwd(wd, wdlen))
-                                return false;
+                if (readlink_at(dcp->parent_fd, devname, wd, wdlen) ||
+                    if_directory_canon(buff, dvc_s, wd, wdlen)) {
                         cp = strrchr(wd, '/');
                         if (NULL == cp)
                                 return false;
@@ -2780,13 +5411,14 @@ transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
                                 return false;
                         *cp = '\0';
                         cp = basename(wd);
-                        my_strcopy(sas_hold_end_device, cp,
-                                   sizeof(sas_hold_end_device));
+                        my_strcopy(dcp->sas_hold_end_device, cp,
+                                   sizeof(dcp->sas_hold_end_device));
                         snprintf(buff, bufflen, "%s/%s/%s/%s", sysfsroot,
                                  cl_s, sasdev_s, cp);
 
                         snprintf(b, b_len, "sas:");
                         off = strlen(b);
+                        *per_tgtp = true;
                         if (get_value(buff, sas_ad_s, b + off, b_len - off))
                                 return true;
                         else {  /* non-SAS device in SAS domain */
@@ -2803,29 +5435,24 @@ transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
         }
 
         /* not SAS, so check for SPI host */
-        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, spi_host_s, hctl.h);
-        if ((stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                transport_id = TRANSPORT_SPI;
-                snprintf(b, b_len, "spi:%d", hctl.t);
+        if (thc & THC_SPI) {
+                dcp->transport_id = TRANSPORT_SPI;
+                snprintf(b, b_len, "spi:%d", hp->t);
+                *per_tgtp = true;
                 return true;
         }
 
         /* no, so check for FC host */
-        snprintf(buff, bufflen, "%s/%s/%s/host%d", sysfsroot, cl_s, fc_h_s,
-                 hctl.h);
-        if ((stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                if (get_value(buff, "symbolic_name", wd, wdlen)) {
-                        if (strstr(wd, " over ")) {
-                                transport_id = TRANSPORT_FCOE;
-                                snprintf(b, b_len, "fcoe:");
-                        }
-                }
-                if (transport_id != TRANSPORT_FCOE) {
-                        transport_id = TRANSPORT_FC;
+        if (thc & THC_FC) {
+                if (thc & THC_FCOE) {
+                        dcp->transport_id = TRANSPORT_FCOE;
+                        snprintf(b, b_len, "fcoe:");
+                } else {
+                        dcp->transport_id = TRANSPORT_FC;
                         snprintf(b, b_len, "fc:");
                 }
                 snprintf(buff, bufflen, "%s%starget%d:%d:%d", sysfsroot,
-                         "/class/fc_transport/", hctl.h, hctl.c, hctl.t);
+                         "/class/fc_transport/", hp->h, hp->c, hp->t);
                 off = strlen(b);
                 if (get_value(buff, ptn_s, b + off, b_len - off)) {
                         off = strlen(b);
@@ -2833,35 +5460,38 @@ transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
                         off = strlen(b);
                 } else
                         return false;
-                if (get_value(buff, "port_id", b + off, b_len - off))
+                if (get_value(buff, "port_id", b + off, b_len - off)) {
+                        *per_tgtp = true;
                         return true;
-                else
+                } else
                         return false;
         }
 
         /* no, so check for SRP host */
-        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, srp_h_s, hctl.h);
-        if (stat(buff, &a_stat) >= 0 && S_ISDIR(a_stat.st_mode)) {
-                transport_id = TRANSPORT_SRP;
+        if (thc & THC_SRP) {
+                dcp->transport_id = TRANSPORT_SRP;
                 snprintf(b, b_len, "srp:");
-                get_local_srp_gid(hctl.h, b + strlen(b), b_len - strlen(b));
+                get_local_srp_gid(hp->h, b + strlen(b), b_len - strlen(b));
+                *per_tgtp = true;
                 return true;
         }
 
         /* SAS class representation or SBP? */
         snprintf(buff, bufflen, "%s%s/%s", sysfsroot, bus_scsi_dev_s,
                  devname);
-        if (if_directory_chdir(buff, sasdev_s)) {
-                transport_id = TRANSPORT_SAS_CLASS;
+        if ((vfs_fstatat(dcp->dev_fd, sasdev_s, &a_stat, 0) >= 0) &&
+            S_ISDIR(a_stat.st_mode)) {
+                dcp->transport_id = TRANSPORT_SAS_CLASS;
                 snprintf(b, b_len, "sas:");
                 off = strlen(b);
-                if (get_value(".", sas_ad2_s, b + off, b_len - off))
+                snprintf(nm, sizeof(nm), "%s/%s", sasdev_s, sas_ad2_s);
+                if (get_value_at(dcp->dev_fd, nm, b + off, b_len - off))
                         return true;
                 else
                         pr2serr("%s: no sas_addr, wd=%s\n", __func__, buff);
-        } else if (get_value(buff, i1394id_s, wd, wdlen)) {
+        } else if (get_value_at(dcp->dev_fd, i1394id_s, wd, wdlen)) {
                 /* IEEE1394 SBP device */
-                transport_id = TRANSPORT_SBP;
+                dcp->transport_id = TRANSPORT_SBP;
                 n = 0;
                 n += sg_scn3pr(b, b_len, n, "%s", "sbp:");
                 sg_scn3pr(b, b_len, n, "%s:", wd);
@@ -2869,14 +5499,14 @@ transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
         }
 
         /* iSCSI device? */
-        snprintf(buff, bufflen, "%s%shost%d/device", sysfsroot, iscsi_h_s,
-                 hctl.h);
-        if ((stat(buff, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                if (1 != iscsi_target_scan(buff, &hctl))
+        if (thc & THC_ISCSI_DEV) {
+                snprintf(buff, bufflen, "%s%shost%d/device", sysfsroot,
+                         iscsi_h_s, hp->h);
+                if (1 != iscsi_target_scan(buff, hp, dcp))
                         return false;
-                transport_id = TRANSPORT_ISCSI;
+                dcp->transport_id = TRANSPORT_ISCSI;
                 snprintf(buff, bufflen, "%s%ssession%d", sysfsroot,
-                         iscsi_sess_s, iscsi_tsession_num);
+                         iscsi_sess_s, dcp->iscsi_tsession_num);
                 if (! get_value(buff, tgtn_s, nm, sizeof(nm)))
                         return false;
                 if (! get_value(buff, tpgt_s, tpgt, sizeof(tpgt)))
@@ -2887,31 +5517,32 @@ transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
                 sg_scn3pr(b, b_len, n, ",t,0x%x", (uint32_t)atoi(tpgt));
 // >>>       That reference says maximum length of targetname is 223 bytes
 //           (UTF-8) excluding trailing null.
+                *per_tgtp = true;
                 return true;
         }
 
         /* USB device? */
         cp = get_usb_devname(NULL, devname, wd, wdlen - 1);
         if (cp) {
-                transport_id = TRANSPORT_USB;
+                dcp->transport_id = TRANSPORT_USB;
                 snprintf(b, b_len, "usb:%s", cp);
                 return true;
         }
 
         /* ATA or SATA device, crude check: driver name */
-        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, scsi_host_s, hctl.h);
+        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, scsi_host_s, hp->h);
         if (get_value(buff, "proc_name", wd, wdlen)) {
                 ata_dev = false;
                 if (0 == strcmp("ahci", wd)) {
-                        transport_id = TRANSPORT_SATA;
+                        dcp->transport_id = TRANSPORT_SATA;
                         snprintf(b, b_len, "sata:");
                         ata_dev = true;
                 } else if (strstr(wd, "ata")) {
                         if (0 == memcmp("sata", wd, 4)) {
-                                transport_id = TRANSPORT_SATA;
+                                dcp->transport_id = TRANSPORT_SATA;
                                 snprintf(b, b_len, "sata:");
                         } else {
-                                transport_id = TRANSPORT_ATA;
+                                dcp->transport_id = TRANSPORT_ATA;
                                 snprintf(b, b_len, "ata:");
                         }
                         ata_dev = true;
@@ -2919,19 +5550,19 @@ transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
                 if (ata_dev) {
                         off = strlen(b);
                         sg_scn3pr(b, b_len, off, "%s",
-                                  get_lu_name(devname, wd, wdlen, false));
+                                  get_lu_name(devname, dcp, wd, wdlen, false));
                         return true;
                 }
         }
 
         /* Check for scsi_debug driver which is owned by device: "pseudo_0" */
-        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, scsi_host_s, hctl.h);
-        if ((stat(buff, &a_stat) >= 0) && stat_is_dir_or_symlink(&a_stat)) {
-                if (if_directory_chdir(buff, NULL)) {
-                        if (NULL == getcwd(wd, wdlen))
-                                return false;
+        snprintf(buff, bufflen, "%s%shost%d", sysfsroot, scsi_host_s, hp->h);
+        if ((vfs_stat(buff, &a_stat) >= 0) &&
+            stat_is_dir_or_symlink(&a_stat)) {
+                if (readlink_at(AT_FDCWD, buff, wd, wdlen) ||
+                    if_directory_canon(buff, NULL, wd, wdlen)) {
                         if (strstr(wd, "pseudo_0")) {
-                                transport_id = TRANSPORT_PSEUDO_0;
+                                dcp->transport_id = TRANSPORT_PSEUDO_0;
                                 snprintf(b, b_len, "pseudo_0");
                                 return true;
                         }
@@ -2940,12 +5571,105 @@ transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
         return false;
 }
 
+/* Attempt to determine the transport type of the SCSI device (LU) associated
+ * with 'devname'. If found set dcp->transport_id, place string in 'b' and
+ * return true. Otherwise return false. What is found for one LU in a
+ * target is kept for its other LUs. */
+static bool
+transport_sdev_tport(const char * devname, const struct lsscsi_opts * op,
+                     struct dev_ctx_t * dcp, int b_len, char * b)
+{
+        bool per_tgt = false;
+        struct addr_hctl hctl;
+
+        if (! dev_hctl(dcp, devname, &hctl))
+                return false;
+        if (tport_memo_get(&hctl, dcp, b_len, b))
+                return true;
+        if (! sdev_tport_find(devname, &hctl, op, dcp, b_len, b, &per_tgt))
+                return false;
+        if (per_tgt)
+                tport_memo_put(&hctl, dcp, b);
+        return true;
+}
+
+/* Places the name of the FC remote port (rport) that the LU at
+ * 'path_name' (whose address is 'hp', if known) is below in 'rp', and the
+ * sysfs directory of that rport in 'dir'. Returns false if not found.
+ * What is found is kept for the other LUs in the same target. */
+static bool
+fc_rport_find(const char * path_name, const struct addr_hctl * hp,
+              char * rp, int rp_len, char * dir, int dir_len)
+{
+        bool found = false;
+        int n;
+        char * cp;
+        struct tport_rec * trp;
+        char wd[LMAX_PATH];
+        char b2[LMAX_DEVPATH];
+        static const int wdlen = sizeof(wd);
+        static const int b2len = sizeof(b2);
+
+        if (hp) {
+                pthread_mutex_lock(&tport_memo_mtx);
+                trp = tport_rec_get(hp->h, hp->c, hp->t);
+                if (trp && trp->fc_rport) {
+                        my_strcopy(rp, trp->fc_rport, rp_len);
+                        my_strcopy(dir, trp->fc_rport_dir, dir_len);
+                        found = true;
+                }
+                pthread_mutex_unlock(&tport_memo_mtx);
+                if (found)
+                        return true;
+        }
+        if (! if_directory_canon(path_name, dvc_s, wd, wdlen))
+                return false;
+        cp = strrchr(wd, '/');
+        if (NULL == cp)
+                return false;
+        *cp = '\0';
+        cp = strrchr(wd, '/');
+        if (NULL == cp)
+                return false;
+        *cp = '\0';
+        cp = basename(wd);
+        my_strcopy(rp, cp, rp_len);
+        snprintf(dir, dir_len, "%s/%s", fc_rem_pts_s, cp);
+        if (if_directory_canon(wd, dir, b2, b2len)) {
+                my_strcopy(dir, b2, dir_len);
+        } else {  /* newer transport */
+                /* /sys  /class/fc_remote_ports/  rport-x:y-z  / */
+                n = snprintf(dir, dir_len, "%s/%s/%s/%s/", sysfsroot, cl_s,
+                             fc_rem_pts_s, rp);
+                if ((n < 0) || (n >= dir_len))
+                        return false;
+        }
+        if (NULL == hp)
+                return true;
+
+        pthread_mutex_lock(&tport_memo_mtx);
+        trp = tport_rec_get(hp->h, hp->c, hp->t);
+        if (trp && (NULL == trp->fc_rport)) {
+                trp->fc_rport = strdup(rp);
+                trp->fc_rport_dir = strdup(dir);
+                if ((NULL == trp->fc_rport) || (NULL == trp->fc_rport_dir)) {
+                        free(trp->fc_rport);
+                        free(trp->fc_rport_dir);
+                        trp->fc_rport = NULL;
+                        trp->fc_rport_dir = NULL;
+                }
+        }
+        pthread_mutex_unlock(&tport_memo_mtx);
+        return true;
+}
+
 /* Given the transport_id of the SCSI device (LU) associated with 'devname'
  * output additional information. */
 static void
 transport_tport_longer(const char * devname, struct lsscsi_opts * op,
-                       sgj_opaque_p jop)
+                       struct dev_ctx_t * dcp, sgj_opaque_p jop)
 {
+        bool have_hctl;
         int n;
         char * cp;
         sgj_state * jsp = &op->json_st;
@@ -2995,98 +5719,75 @@ transport_tport_longer(const char * devname, struct lsscsi_opts * op,
         static const char * mbl_s = "max_burst_len";
         static const char * mor2t_s = "max_outstanding_r2t";
         static const char * rtmo_s = "recovery_tmo";
+        struct attr_set as;
 
 #if 0
         snprintf(buff, bufflen, "%s/scsi_device:%s", path_name, devname);
-        if (! if_directory_chdir(buff, "device"))
-                return;
-        if (NULL == getcwd(wd, wdlen))
+        if (! if_directory_canon(buff, "device", wd, wdlen))
                 return;
 #else
         snprintf(path_name, sizeof(path_name), "%s/%s/%s/%s", sysfsroot,
                  cl_s, sdev_s, devname);
         my_strcopy(buff, path_name, bufflen);
 #endif
-        switch (transport_id) {
+        have_hctl = dev_hctl(dcp, devname, &hctl);
+        switch (dcp->transport_id) {
         case TRANSPORT_SPI:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "spi");
-                if (! parse_colon_list(devname, &hctl))
+                if (! have_hctl)
                         break;
                 snprintf(buff, bufflen, "%s%starget%d:%d:%d", sysfsroot,
                         "/class/spi_transport/", hctl.h, hctl.c, hctl.t);
                 sgj_haj_vi(jsp, jop, 2, "target_id", SEP_EQ_NO_SP, hctl.t,
                            false);
-                if (get_value(buff, dt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, dt_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, mo_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mo_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, mw_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mw_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, mp_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mp_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, of_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, of_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, pe_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, pe_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, wi_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, wi_s, SEP_EQ_NO_SP, value);
+                {
+                        const char * names[] = {dt_s, mo_s, mw_s, mp_s, of_s,
+                                                pe_s, wi_s};
+
+                        fetch_attrs_memo(&hctl, TPA_SPI, buff, names,
+                                         SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
                 break;
         case TRANSPORT_FC:
         case TRANSPORT_FCOE:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP,
-                           transport_id == TRANSPORT_FC ? "fc:" : "fcoe:");
-                if (! if_directory_chdir(path_name, dvc_s))
-                        return;
-                if (NULL == getcwd(wd, wdlen))
-                        return;
-                cp = strrchr(wd, '/');
-                if (NULL == cp)
+                           dcp->transport_id == TRANSPORT_FC ? "fc:" : "fcoe:");
+                if (! fc_rport_find(path_name, have_hctl ? &hctl : NULL,
+                                    wd, wdlen, buff, bufflen))
                         return;
-                *cp = '\0';
-                cp = strrchr(wd, '/');
-                if (NULL == cp)
-                        return;
-                *cp = '\0';
-                cp = basename(wd);
-                snprintf(buff, bufflen, "%s/%s", fc_rem_pts_s, cp);
-                if (if_directory_chdir(wd, buff)) {
-                        if (NULL == getcwd(buff, bufflen))
-                                return;
-                } else {  /* newer transport */
-                        /* /sys  /class/fc_remote_ports/  rport-x:y-z  / */
-                        snprintf(buff, bufflen, "%s/%s/%s/%s/", sysfsroot,
-                                 cl_s, fc_rem_pts_s, cp);
-                }
+                cp = wd;
                 n = 0;
                 n += sg_scn3pr(b2, b2len, n, "%s", path_name);
                 sg_scn3pr(b2, b2len, n, "%s", "/device/");
-                if (get_value(b2, vend_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, vend_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, model_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, model_s, SEP_EQ_NO_SP, value);
+                {
+                        const char * names[] = {vend_s, model_s};
+
+                        fetch_attrs(-1, b2, names, SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
                 sgj_pr_hr(jsp, "  %s\n", cp);    /* rport */
                 jo2p = sgj_named_subobject_r(jsp, jop, cp);
-                if (get_value(buff, ndn_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, ndn_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, ptn_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, ptn_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, pti_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, pti_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, pts_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, pts_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, ro_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, ro_s, SEP_EQ_NO_SP, value);
-// xxxxxxxxxxxx  following call to print_enclosure_device fails since b2 is
-// inappropriate, comment out since might be useless (check with FCP folks)
-                // print_enclosure_device(devname, b2, op);
-                if (get_value(buff, sti_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, sti_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, scl_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, scl_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, fif_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, fif_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, dlt_s, value, vlen))
-                        sgj_haj_vs(jsp, jo2p, 2, dlt_s, SEP_EQ_NO_SP, value);
+                {
+                        const char * names[] = {ndn_s, ptn_s, pti_s, pts_s,
+                                                ro_s};
+
+                        fetch_attrs_memo(have_hctl ? &hctl : NULL,
+                                         TPA_FC_RPORT, buff, names,
+                                         SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jo2p, 2, &as);
+                }
+                /* was commented out: it looked below the rport, not the
+                 * LU. The index needs no path so FC LUs now show it too */
+                print_enclosure_device(devname, op);
+                {
+                        const char * names[] = {sti_s, scl_s, fif_s, dlt_s};
+
+                        fetch_attrs_memo(have_hctl ? &hctl : NULL,
+                                         TPA_FC_RPORT2, buff, names,
+                                         SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jo2p, 2, &as);
+                }
                 if (op->verbose > 2) {
                         pr2serr("  %s: %s\n", ffd_s, buff);
                         pr2serr("  %s: %s\n", ffd_s, b2);
@@ -3094,7 +5795,7 @@ transport_tport_longer(const char * devname, struct lsscsi_opts * op,
                 break;
         case TRANSPORT_SRP:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "srp");
-                if (! parse_colon_list(devname, &hctl))
+                if (! have_hctl)
                         break;
                 if (get_srp_orig_dgid(hctl.h, value, vlen))
                         sgj_haj_vs(jsp, jop, 2, odgi_s, SEP_EQ_NO_SP, value);
@@ -3105,46 +5806,41 @@ transport_tport_longer(const char * devname, struct lsscsi_opts * op,
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "sas");
                 n = sg_scn3pr(b2, b2len, 0, "%s/%s/%s", sysfsroot, cl_s,
                               sasdev_s);
-                sg_scn3pr(b2, b2len, n, "%s", sas_hold_end_device);
-                if (get_value(b2, bid_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, bid_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, eid_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, eid_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, ipp_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ipp_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, ph_id_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ph_id_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, sas_ad_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, sas_ad_s, SEP_EQ_NO_SP,
-                                   value);
-                if (get_value(b2, sti_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, sti_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, tpp_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tpp_s, SEP_EQ_NO_SP, value);
+                sg_scn3pr(b2, b2len, n, "%s", dcp->sas_hold_end_device);
+                {
+                        const char * names[] = {bid_s, eid_s, ipp_s, ph_id_s,
+                                                sas_ad_s, sti_s, tpp_s};
+
+                        fetch_attrs_memo(have_hctl ? &hctl : NULL,
+                                         TPA_SAS_DEV, b2, names,
+                                         SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
                 if (op->verbose > 2)
                         pr2serr("%s: %s\n", ffd_s, b2);
                 n = 0;
                 n += sg_scn3pr(b2, b2len, n, "%s", path_name);
                 sg_scn3pr(b2, b2len, n, "%s", "/device/");
-                if (get_value(b2, vend_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, vend_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, model_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, model_s, SEP_EQ_NO_SP, value);
+                {
+                        const char * names[] = {vend_s, model_s};
+
+                        fetch_attrs(-1, b2, names, SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
                 n = 0;
                 n += sg_scn3pr(b2, b2len, n, "%s", sysfsroot);
                 n += sg_scn3pr(b2, b2len, n, "%s", "/class/sas_end_device/");
-                sg_scn3pr(b2, b2len, n, "%s", sas_hold_end_device);
-                print_enclosure_device(devname, b2, op);
-                if (get_value(b2, irt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, irt_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, itnlt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, itnlt_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, rlm_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, rlm_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, tlr_e_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tlr_e_s, SEP_EQ_NO_SP, value);
-                if (get_value(b2, tlr_s_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tlr_s_s, SEP_EQ_NO_SP, value);
+                sg_scn3pr(b2, b2len, n, "%s", dcp->sas_hold_end_device);
+                print_enclosure_device(devname, op);
+                {
+                        const char * names[] = {irt_s, itnlt_s, rlm_s, tlr_e_s,
+                                                tlr_s_s};
+
+                        fetch_attrs_memo(have_hctl ? &hctl : NULL,
+                                         TPA_SAS_END, b2, names,
+                                         SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
                 if (op->verbose > 2)
                         pr2serr("%s: %s\n", ffd_s, b2);
                 break;
@@ -3155,38 +5851,16 @@ transport_tport_longer(const char * devname, struct lsscsi_opts * op,
                 n = 0;
                 n += sg_scn3pr(buff, bufflen, n, "%s", path_name);
                 sg_scn3pr(buff, bufflen, n, "/%s/%s", dvc_s, sasdev_s);
-                if (get_value(buff, dev_n_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, dev_n_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, devt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, devt_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, ip_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ip_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, irt2_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, irt2_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, itnlt2_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, itnlt2_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, lr_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, lr_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, mlr_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mlr_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, mpw_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mpw_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, milr_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, milr_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, pw_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, pw_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, rlm_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, rlm_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, rl_wlun_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, rl_wlun_s, SEP_EQ_NO_SP,
-                                   value);
-                if (get_value(buff, sas_ad2_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, sas_ad2_s, SEP_EQ_NO_SP,
-                                   value);
-                if (get_value(buff, tp_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tp_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, tlr_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tlr_s, SEP_EQ_NO_SP, value);
+                {
+                        const char * names[] = {dev_n_s, devt_s, ip_s, irt2_s,
+                                                itnlt2_s, lr_s, mlr_s, mpw_s,
+                                                milr_s, pw_s, rlm_s, rl_wlun_s,
+                                                sas_ad2_s, tp_s, tlr_s};
+
+                        fetch_attrs(-1, buff, names, SG_ARRAY_SIZE(names),
+                                    &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
                 if (op->verbose > 2)
                         pr2serr("%s: %s\n", ffd_s, buff);
                 break;
@@ -3196,27 +5870,17 @@ transport_tport_longer(const char * devname, struct lsscsi_opts * op,
                 n += sg_scn3pr(buff, bufflen, n, "%s", sysfsroot);
                 n += sg_scn3pr(buff, bufflen, n, "%s", iscsi_sess_s);
                 n += sg_scn3pr(buff, bufflen, n, "%s", "session");
-                sg_scn3pr(buff, bufflen, n, "%d", iscsi_tsession_num);
-                if (get_value(buff, tgtn_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tgtn_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, tpgt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tpgt_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, dpio_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, dpio_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, dsio_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, dsio_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, erl_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, erl_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, fbl_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, fbl_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, ir2t_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ir2t_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, mbl_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mbl_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, mor2t_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, mor2t_s, SEP_EQ_NO_SP, value);
-                if (get_value(buff, rtmo_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, rtmo_s, SEP_EQ_NO_SP, value);
+                sg_scn3pr(buff, bufflen, n, "%d", dcp->iscsi_tsession_num);
+                {
+                        const char * names[] = {tgtn_s, tpgt_s, dpio_s, dsio_s,
+                                                erl_s, fbl_s, ir2t_s, mbl_s,
+                                                mor2t_s, rtmo_s};
+
+                        fetch_attrs_memo(have_hctl ? &hctl : NULL,
+                                         TPA_ISCSI, buff, names,
+                                         SG_ARRAY_SIZE(names), &as);
+                        haj_attrs(jsp, jop, 2, &as);
+                }
 // >>>       Would like to see what are readable attributes in this directory.
 //           Ignoring connections for the time being. Could add with an entry
 //           for connection=<n> with normal two space indent followed by
@@ -3226,9 +5890,7 @@ transport_tport_longer(const char * devname, struct lsscsi_opts * op,
                 break;
         case TRANSPORT_SBP:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "sbp");
-                if (! if_directory_chdir(path_name, dvc_s))
-                        return;
-                if (NULL == getcwd(wd, wdlen))
+                if (! if_directory_canon(path_name, dvc_s, wd, wdlen))
                         return;
                 if (get_value(wd, i1394id_s, value, vlen))
                         sgj_haj_vs(jsp, jop, 2, i1394id_s, SEP_EQ_NO_SP,
@@ -3243,19 +5905,19 @@ transport_tport_longer(const char * devname, struct lsscsi_opts * op,
                 break;
         case TRANSPORT_ATA:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "ata");
-                cp = get_lu_name(devname, b2, b2len, false);
+                cp = get_lu_name(devname, dcp, b2, b2len, false);
                 if (strlen(cp) > 0)
                         sgj_haj_vs(jsp, jop, 2, wwn_s, SEP_EQ_NO_SP, cp);
                 break;
         case TRANSPORT_SATA:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "sata");
-                cp = get_lu_name(devname, b2, b2len, false);
+                cp = get_lu_name(devname, dcp, b2, b2len, false);
                 if (strlen(cp) > 0)
                         sgj_haj_vs(jsp, jop, 2, wwn_s, SEP_EQ_NO_SP, cp);
                 break;
         case TRANSPORT_PSEUDO_0:
                 sgj_haj_vs(jsp, jop, 2, trans_s, SEP_EQ_NO_SP, "pseudo_0");
-                cp = get_lu_name(devname, b2, b2len, false);
+                cp = get_lu_name(devname, dcp, b2, b2len, false);
                 if (strlen(cp) > 0)
                         sgj_haj_vs(jsp, jop, 2, wwn_s, SEP_EQ_NO_SP, cp);
                 break;
@@ -3287,6 +5949,8 @@ rend_prot_protmode(const char * rb, char * o, int omlen, bool one_ln,
         static const char * tgsz_s = "tag_size";
         static const char * protm_s = "protection_mode";
 
+        if (omlen > 0)
+                o[0] = '\0';   /* so empty if neither option is given */
         as_json = jsp->pr_as_json;
         if (! one_ln)
                 sep = sing ? "\n" : "";
@@ -3297,8 +5961,8 @@ rend_prot_protmode(const char * rb, char * o, int omlen, bool one_ln,
 
                 jo2p = sgj_named_subobject_r(jsp, jop, "protection");
                 if (sd_scan(sddir) &&
-                    if_directory_chdir(sddir, ".") &&
-                    get_value(".", prott_s, value, vlen)) {
+                    if_directory_canon(sddir, NULL, NULL, 0) &&
+                    get_value(sddir, prott_s, value, vlen)) {
 
                         if (one_ln) {
                                 if (!strncmp(value, "0", 1))
@@ -3314,7 +5978,7 @@ rend_prot_protmode(const char * rb, char * o, int omlen, bool one_ln,
                         }
                         if (as_json)
                                 sgj_js_nv_s(jsp, jo2p, prott_s, value);
-                        if (get_value(".", ato_s, value, vlen)) {
+                        if (get_value(sddir, ato_s, value, vlen)) {
                                 if (as_json)
                                         sgj_js_nv_s(jsp, jo2p, ato_s, value);
                                 else if (! one_ln)
@@ -3326,8 +5990,9 @@ rend_prot_protmode(const char * rb, char * o, int omlen, bool one_ln,
                         q += sg_scn3pr(o, omlen, q, "  %-9s", "-");
 
                 if (block_scan(blkdir) &&
-                    if_directory_chdir(blkdir, "integrity")) {
-                        if (get_value(".", form_s, value, vlen)) {
+                    if_directory_canon(blkdir, "integrity", blkdir,
+                                       sizeof(blkdir))) {
+                        if (get_value(blkdir, form_s, value, vlen)) {
                                 if (one_ln)
                                         q += sg_scn3pr(o, omlen, q, "  %-16s",
                                                        value);
@@ -3338,7 +6003,7 @@ rend_prot_protmode(const char * rb, char * o, int omlen, bool one_ln,
                                 if (as_json)
                                         sgj_js_nv_s(jsp, jo2p, form_s, value);
                         }
-                        if (get_value(".", tgsz_s, value, vlen)) {
+                        if (get_value(blkdir, tgsz_s, value, vlen)) {
                                 if (as_json)
                                         sgj_js_nv_s(jsp, jo2p, tgsz_s, value);
                                 else if (! one_ln)
@@ -3352,7 +6017,8 @@ rend_prot_protmode(const char * rb, char * o, int omlen, bool one_ln,
         if (op->protmode) {
                 my_strcopy(sddir, rb, sizeof(sddir));
 
-                if (sd_scan(sddir) && if_directory_chdir(sddir, ".") &&
+                if (sd_scan(sddir) &&
+                    if_directory_canon(sddir, NULL, NULL, 0) &&
                     get_value(sddir, protm_s, value, vlen)) {
 
                         if (one_ln) {
@@ -3376,13 +6042,13 @@ rend_prot_protmode(const char * rb, char * o, int omlen, bool one_ln,
 
 static void
 longer_sdev_entry(const char * path_name, const char * devname,
-                  struct lsscsi_opts * op, sgj_opaque_p jop)
+                  struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+                  sgj_opaque_p jop)
 {
         int q = 0;
         sgj_state * jsp = &op->json_st;
-        char value[LMAX_NAME];
+        const char * vp;
         char b[256];
-        static const int vlen = sizeof(value);
         static const int blen = sizeof(b);
         /* If string used by another function, moved to file scope */
         static const char * db_s = "device_blocked";
@@ -3396,135 +6062,142 @@ longer_sdev_entry(const char * path_name, const char * devname,
         static const char * sl_s = "scsi_level";
         static const char * tm_s = "timeout";
         static const char * ty_s = "type";
+        /* the first six are all that a single --long needs */
+        const char * names[] = {stat_s, qd_s, sl_s, ty_s, db_s, tm_s,
+                                iocb_s, iodc_s, ioec_s, iorc_s, qt_s,
+                                dhs_s, uniqi_s};
+        struct attr_set as;
 
         if (op->transport_info) {
-                transport_tport_longer(devname, op, jop);
+                transport_tport_longer(devname, op, dcp, jop);
                 return;
         }
+        dev_fetch_attrs(dcp, dcp->dev_fd, path_name, names,
+                        (op->long_opt > 1) ? (int)SG_ARRAY_SIZE(names) : 6,
+                        &as);
         if (op->long_opt >= 3) {
-                if (get_value(path_name, db_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, db_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, db_s)))
+                        sgj_haj_vs(jsp, jop, 2, db_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", db_s);
-                if (get_value(path_name, dhs_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, dhs_s, SEP_EQ_NO_SP, value);
-                if (get_value(path_name, iocb_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, iocb_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, dhs_s)))
+                        sgj_haj_vs(jsp, jop, 2, dhs_s, SEP_EQ_NO_SP, vp);
+                if ((vp = attr_get(&as, iocb_s)))
+                        sgj_haj_vs(jsp, jop, 2, iocb_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", iocb_s);
-                if (get_value(path_name, iodc_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, iodc_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, iodc_s)))
+                        sgj_haj_vs(jsp, jop, 2, iodc_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", iodc_s);
-                if (get_value(path_name, ioec_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ioec_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, ioec_s)))
+                        sgj_haj_vs(jsp, jop, 2, ioec_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", ioec_s);
-                if (get_value(path_name, iorc_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, iorc_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, iorc_s)))
+                        sgj_haj_vs(jsp, jop, 2, iorc_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", iorc_s);
-                if (get_value(path_name, qd_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, qd_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, qd_s)))
+                        sgj_haj_vs(jsp, jop, 2, qd_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", qd_s);
-                if (get_value(path_name, qt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, qt_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, qt_s)))
+                        sgj_haj_vs(jsp, jop, 2, qt_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", qt_s);
-                if (get_value(path_name, sl_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, sl_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, sl_s)))
+                        sgj_haj_vs(jsp, jop, 2, sl_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", sl_s);
-                if (get_value(path_name, stat_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, stat_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, stat_s)))
+                        sgj_haj_vs(jsp, jop, 2, stat_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", stat_s);
-                if (get_value(path_name, tm_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, tm_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, tm_s)))
+                        sgj_haj_vs(jsp, jop, 2, tm_s, SEP_EQ_NO_SP, vp);
                 else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", tm_s);
-                if (get_value(path_name, ty_s, value, vlen)) {
+                if ((vp = attr_get(&as, ty_s))) {
                         int pdt = -1;
                         const char * pdt_s = "? ?";
 
-                        if ((1 == sscanf(value, "%d", &pdt)) &&
+                        if ((1 == sscanf(vp, "%d", &pdt)) &&
                             (pdt >= 0) && (pdt < 32))
                                 pdt_s = scsi_device_types[pdt];
                         sgj_haj_vistr_nex(jsp, jop, 2, ty_s, SEP_EQ_NO_SP,
                                           pdt, true, pdt_s,
                                           "Peripheral Device Type (PDT)");
-                        sgj_haj_vs(jsp, jop, 2, ty_s, SEP_EQ_NO_SP, value);
+                        sgj_haj_vs(jsp, jop, 2, ty_s, SEP_EQ_NO_SP, vp);
                 } else if (op->verbose > 0)
                         sgj_pr_hr(jsp, "  %s=?\n", ty_s);
-                if (get_value(path_name, uniqi_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, uniqi_s, SEP_EQ_NO_SP, value);
+                if ((vp = attr_get(&as, uniqi_s)))
+                        sgj_haj_vs(jsp, jop, 2, uniqi_s, SEP_EQ_NO_SP, vp);
                 rend_prot_protmode(path_name, b, blen, false, "  ", op, jop);
                 sgj_pr_hr(jsp, "%s", b);
                 return;
         }
 
-        if (get_value(path_name, stat_s, value, vlen)) {
-                q += sg_scn3pr(b, blen, q, " %s=%s", stat_s, value);
-                sgj_js_nv_s(jsp, jop, stat_s, value);
+        if ((vp = attr_get(&as, stat_s))) {
+                q += sg_scn3pr(b, blen, q, " %s=%s", stat_s, vp);
+                sgj_js_nv_s(jsp, jop, stat_s, vp);
         } else
                 q += sg_scn3pr(b, blen, q, "  %s=?", stat_s);
-        if (get_value(path_name, qd_s, value, vlen)) {
-                q += sg_scn3pr(b, blen, q, " %s=%s", qd_s, value);
-                sgj_js_nv_s(jsp, jop, qd_s, value);
+        if ((vp = attr_get(&as, qd_s))) {
+                q += sg_scn3pr(b, blen, q, " %s=%s", qd_s, vp);
+                sgj_js_nv_s(jsp, jop, qd_s, vp);
         } else
                 q += sg_scn3pr(b, blen, q, " %s=?", qd_s);
-        if (get_value(path_name, sl_s, value, vlen)) {
-                q += sg_scn3pr(b, blen, q, " %s=%s", sl_s, value);
-                sgj_js_nv_s(jsp, jop, sl_s, value);
+        if ((vp = attr_get(&as, sl_s))) {
+                q += sg_scn3pr(b, blen, q, " %s=%s", sl_s, vp);
+                sgj_js_nv_s(jsp, jop, sl_s, vp);
         } else
                 q += sg_scn3pr(b, blen, q, " %s=?", sl_s);
-        if (get_value(path_name, ty_s, value, vlen)) {
-                q += sg_scn3pr(b, blen, q, " %s=%s", ty_s, value);
-                sgj_js_nv_s(jsp, jop, ty_s, value);
+        if ((vp = attr_get(&as, ty_s))) {
+                q += sg_scn3pr(b, blen, q, " %s=%s", ty_s, vp);
+                sgj_js_nv_s(jsp, jop, ty_s, vp);
         } else
                 q += sg_scn3pr(b, blen, q, " %s=?", ty_s);
-        if (get_value(path_name, db_s, value, vlen)) {
-                q += sg_scn3pr(b, blen, q, " %s=%s", db_s, value);
-                sgj_js_nv_s(jsp, jop, db_s, value);
+        if ((vp = attr_get(&as, db_s))) {
+                q += sg_scn3pr(b, blen, q, " %s=%s", db_s, vp);
+                sgj_js_nv_s(jsp, jop, db_s, vp);
         } else
                 q += sg_scn3pr(b, blen, q, " %s=?", db_s);
-        if (get_value(path_name, tm_s, value, vlen)) {
-                /* q += */ sg_scn3pr(b, blen, q, " %s=%s", tm_s, value);
-                sgj_js_nv_s(jsp, jop, tm_s, value);
+        if ((vp = attr_get(&as, tm_s))) {
+                /* q += */ sg_scn3pr(b, blen, q, " %s=%s", tm_s, vp);
+                sgj_js_nv_s(jsp, jop, tm_s, vp);
         } else
                 /* q += */ sg_scn3pr(b, blen, q, " %s=?", tm_s);
         if (op->long_opt == 2) {
                 sgj_pr_hr(jsp, " %s\n", b);
                 q = 0;
-                if (get_value(path_name, iocb_s, value, vlen)) {
-                        q += sg_scn3pr(b, blen, q, "  %s=%s", iocb_s, value);
-                        sgj_js_nv_s(jsp, jop, iocb_s, value);
+                if ((vp = attr_get(&as, iocb_s))) {
+                        q += sg_scn3pr(b, blen, q, "  %s=%s", iocb_s, vp);
+                        sgj_js_nv_s(jsp, jop, iocb_s, vp);
                 } else if (op->verbose > 0)
                         q += sg_scn3pr(b, blen, q, "  %s=?\n", iocb_s);
-                if (get_value(path_name, iodc_s, value, vlen)) {
-                        q += sg_scn3pr(b, blen, q, " %s=%s", iodc_s, value);
-                        sgj_js_nv_s(jsp, jop, iodc_s, value);
+                if ((vp = attr_get(&as, iodc_s))) {
+                        q += sg_scn3pr(b, blen, q, " %s=%s", iodc_s, vp);
+                        sgj_js_nv_s(jsp, jop, iodc_s, vp);
                 } else
                         q += sg_scn3pr(b, blen, q, " %s=?", iodc_s);
-                if (get_value(path_name, ioec_s, value, vlen)) {
-                        q += sg_scn3pr(b, blen, q, " %s=%s", ioec_s, value);
-                        sgj_js_nv_s(jsp, jop, ioec_s, value);
+                if ((vp = attr_get(&as, ioec_s))) {
+                        q += sg_scn3pr(b, blen, q, " %s=%s", ioec_s, vp);
+                        sgj_js_nv_s(jsp, jop, ioec_s, vp);
                 } else
-                        q += sg_scn3pr(b, blen, q, " %s=%s", ioec_s, value);
-                if (get_value(path_name, iorc_s, value, vlen)) {
+                        q += sg_scn3pr(b, blen, q, " %s=?", ioec_s);
+                if ((vp = attr_get(&as, iorc_s))) {
                         /* q += */ sg_scn3pr(b, blen, q, " %s=%s", iorc_s,
-                                          value);
-                        sgj_js_nv_s(jsp, jop, iorc_s, value);
+                                          vp);
+                        sgj_js_nv_s(jsp, jop, iorc_s, vp);
                 } else
-                        /* q += */ sg_scn3pr(b, blen, q, " %s=%s", iorc_s,
-                                          value);
+                        /* q += */ sg_scn3pr(b, blen, q, " %s=?", iorc_s);
                 sgj_pr_hr(jsp, " %s\n", b);
-                if (get_value(path_name, qt_s, value, vlen)) {
-                        sg_scn3pr(b, blen, 0, " %s=%s", qt_s, value);
-                        sgj_js_nv_s(jsp, jop, qt_s, value);
+                if ((vp = attr_get(&as, qt_s))) {
+                        sg_scn3pr(b, blen, 0, " %s=%s", qt_s, vp);
+                        sgj_js_nv_s(jsp, jop, qt_s, vp);
                 } else
-                        sg_scn3pr(b, blen, 0, " %s=%s", qt_s, value);
+                        sg_scn3pr(b, blen, 0, " %s=?", qt_s);
         }
         sgj_pr_hr(jsp, "  %s\n", b);
         if (op->protection || op->protmode) {
@@ -3538,12 +6211,13 @@ longer_sdev_entry(const char * path_name, const char * devname,
 /* NVMe longer data for namespace listing */
 static void
 longer_nd_entry(const char * path_name, const char * devname,
-                struct lsscsi_opts * op, sgj_opaque_p jop)
+                struct lsscsi_opts * op, const struct dev_ctx_t * dcp,
+                sgj_opaque_p jop)
 {
+        int d_fd, q_fd;
         sgj_state * jsp = &op->json_st;
-        char value[LMAX_NAME];
+        const char * vp;
         char b[LMAX_NAME];
-        static const int vlen = sizeof(value);
         static const int blen = sizeof(b);
         static const char * cap_s = "capability";
         static const char * er_s = "ext_range";
@@ -3560,91 +6234,104 @@ longer_nd_entry(const char * path_name, const char * devname,
                 bool as_json = jsp->pr_as_json;
                 bool sing = (op->long_opt > 2);
                 const char * sep = sing ? "\n" : "";
+                const char * names[] = {cap_s, er_s, hi_s, nsid_s, ra_s,
+                                        rem_s};
+                const char * q_names[] = {nrq_s, rakb_s, wc_s, lbs_sn,
+                                          pbs_sn};
+                struct attr_set as;
 
-                if (get_value(path_name, cap_s, value, vlen)) {
+                d_fd = opendir_fd(AT_FDCWD, path_name);
+                dev_fetch_attrs(dcp, d_fd, NULL, names, SG_ARRAY_SIZE(names),
+                                &as);
+
+                if ((vp = attr_get(&as, cap_s))) {
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, cap_s, value);
-                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", cap_s, value,
+                                sgj_js_nv_s(jsp, jop, cap_s, vp);
+                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", cap_s, vp,
                                        sep);
                 } else
                         n += sg_scn3pr(b, blen, n, "  %s=?%s", cap_s, sep);
-                if (get_value(path_name, er_s, value, vlen)) {
+                if ((vp = attr_get(&as, er_s))) {
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, er_s, value);
-                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", er_s, value,
+                                sgj_js_nv_s(jsp, jop, er_s, vp);
+                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", er_s, vp,
                                        sep);
                 } else
                         n += sg_scn3pr(b, blen, n, "  %s=?%s", er_s, sep);
-                if (get_value(path_name, hi_s, value, vlen)) {
+                if ((vp = attr_get(&as, hi_s))) {
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, hi_s, value);
-                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", hi_s, value,
+                                sgj_js_nv_s(jsp, jop, hi_s, vp);
+                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", hi_s, vp,
                                        sep);
                 } else
                         n += sg_scn3pr(b, blen, n, "  %s=?%s", hi_s, sep);
-                if (get_value(path_name, nsid_s, value, vlen)) {
+                if ((vp = attr_get(&as, nsid_s))) {
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, nsid_s, value);
-                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", nsid_s, value,
+                                sgj_js_nv_s(jsp, jop, nsid_s, vp);
+                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", nsid_s, vp,
                                        sep);
                 } else
                         n += sg_scn3pr(b, blen, n, "  %s=?%s", nsid_s, sep);
-                if (get_value(path_name, ra_s, value, vlen)) {
+                if ((vp = attr_get(&as, ra_s))) {
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, ra_s, value);
-                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", ra_s, value,
+                                sgj_js_nv_s(jsp, jop, ra_s, vp);
+                        n += sg_scn3pr(b, blen, n, "  %s=%s%s", ra_s, vp,
                                        sep);
                 } else
                         n += sg_scn3pr(b, blen, n, "  %s=?%s", ra_s, sep);
-                if (get_value(path_name, rem_s, value, vlen)) {
+                if ((vp = attr_get(&as, rem_s))) {
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, rem_s, value);
-                        sg_scn3pr(b, blen, n, "  %s=%s%s", rem_s, value, sep);
+                                sgj_js_nv_s(jsp, jop, rem_s, vp);
+                        sg_scn3pr(b, blen, n, "  %s=%s%s", rem_s, vp, sep);
                 } else
                         sg_scn3pr(b, blen, n, "  %s=?%s", rem_s, sep);
                 sgj_pr_hr(jsp, "%s%s", b, sing ? "" : "\n");
                 n = 0;
                 if (op->long_opt > 1) {
-                        if (get2_value(path_name, qu_s, nrq_s, value, vlen)) {
+                        q_fd = (d_fd >= 0) ? opendir_fd(d_fd, qu_s) : -1;
+                        /* reuses 'as', the namespace values are done with */
+                        fetch_attrs(q_fd, NULL, q_names,
+                                    SG_ARRAY_SIZE(q_names), &as);
+                        if (q_fd >= 0)
+                                vfs_close(q_fd);
+                        if ((vp = attr_get(&as, nrq_s))) {
                                 if (as_json)
-                                        sgj_js_nv_s(jsp, jop, nrq_s, value);
+                                        sgj_js_nv_s(jsp, jop, nrq_s, vp);
                                 n += sg_scn3pr(b, blen, n, "  %s=%s%s", nrq_s,
-                                               value, sep);
+                                               vp, sep);
                         } else
                                 n += sg_scn3pr(b, blen, n, "  %s=?%s", nrq_s,
                                                sep);
-                        if (get2_value(path_name, qu_s, rakb_s, value,
-                                       vlen)) {
+                        if ((vp = attr_get(&as, rakb_s))) {
                                 if (as_json)
-                                        sgj_js_nv_s(jsp, jop, rakb_s, value);
+                                        sgj_js_nv_s(jsp, jop, rakb_s, vp);
                                 n += sg_scn3pr(b, blen, n, "  %s=%s%s",
-                                               rakb_s, value, sep);
+                                               rakb_s, vp, sep);
                         } else
                                 n += sg_scn3pr(b, blen, n, "  %s=?%s", rakb_s,
                                                sep);
-                        if (get2_value(path_name, qu_s, wc_s, value, vlen)) {
+                        if ((vp = attr_get(&as, wc_s))) {
                                 if (as_json)
-                                        sgj_js_nv_s(jsp, jop, wc_s, value);
+                                        sgj_js_nv_s(jsp, jop, wc_s, vp);
                                 sg_scn3pr(b, blen, n, "  %s=%s%s", wc_s,
-                                          value, sep);
+                                          vp, sep);
                         } else
                                 sg_scn3pr(b, blen, n, "  %s=?%s", wc_s, sep);
                         sgj_pr_hr(jsp, "%s%s", b, sing ? "" : "\n");
                         n = 0;
-                        if (get2_value(path_name, qu_s, lbs_sn, value, vlen)) {
+                        if ((vp = attr_get(&as, lbs_sn))) {
                                 if (as_json)
-                                        sgj_js_nv_s(jsp, jop, lbs_sn, value);
+                                        sgj_js_nv_s(jsp, jop, lbs_sn, vp);
                                 n += sg_scn3pr(b, blen, n, "  %s=%s%s",
-                                               lbs_sn, value, sep);
+                                               lbs_sn, vp, sep);
                         } else
                                 n += sg_scn3pr(b, blen, n, "  %s=?%s", lbs_sn,
                                                sep);
-                        if (get2_value(path_name, qu_s, pbs_sn, value,
-                                       vlen)) {
+                        if ((vp = attr_get(&as, pbs_sn))) {
                                 if (as_json)
-                                        sgj_js_nv_s(jsp, jop, pbs_sn, value);
+                                        sgj_js_nv_s(jsp, jop, pbs_sn, vp);
                                 sg_scn3pr(b, blen, n, "  %s=%s%s", pbs_sn,
-                                          value, sep);
+                                          vp, sep);
                         } else
                                 sg_scn3pr(b, blen, n, "  %s=?%s", pbs_sn,
                                           sep);
@@ -3652,6 +6339,8 @@ longer_nd_entry(const char * path_name, const char * devname,
                 }
                 // if (! sing)
                         // printf("\n");
+                if (d_fd >= 0)
+                        vfs_close(d_fd);
         }
 }
 
@@ -3660,7 +6349,7 @@ longer_nd_entry(const char * path_name, const char * devname,
 /* Leave this function as plain text only (i.e. no JSON rendering) . */
 static void
 one_classic_sdev_entry(const char * dir_name, const char * devname,
-                       struct lsscsi_opts * op)
+                       struct lsscsi_opts * op, struct dev_ctx_t * dcp)
 {
         int type, scsi_level;
         char buff[LMAX_DEVPATH];
@@ -3671,25 +6360,29 @@ one_classic_sdev_entry(const char * dir_name, const char * devname,
         static const char * ansi_ver_s = "ANSI SCSI revision:";
 
         snprintf(buff, sizeof(buff), "%s/%s", dir_name, devname);
-        if (! parse_colon_list(devname, &hctl))
+        if (! dev_hctl(dcp, devname, &hctl))
                 invalidate_hctl(&hctl);
         printf("Host: scsi%d Channel: %02d Target: %02d Lun: %02" PRIu64 "\n",
                hctl.h, hctl.c, hctl.t, hctl.l);
 
-        if (get_value(buff, vend_s, value, sizeof(value)))
+        if (dev_value(dcp, buff, vend_s, value,
+                      sizeof(value)))
                 printf("  Vendor: %-8s", value);
         else
                 printf("  Vendor: ?       ");
-        if (get_value(buff, model_s, value, sizeof(value)))
+        if (dev_value(dcp, buff, model_s, value,
+                      sizeof(value)))
                 printf(" Model: %-16s", value);
         else
                 printf(" Model: ?               ");
-        if (get_value(buff, rev_s, value, sizeof(value)))
+        if (dev_value(dcp, buff, rev_s, value,
+                      sizeof(value)))
                 printf(" Rev: %-4s", value);
         else
                 printf(" Rev: ?   ");
         printf("\n");
-        if (! get_value(buff, "type", value, sizeof(value))) {
+        if (! dev_value(dcp, buff, "type", value,
+                      sizeof(value))) {
                 printf("  Type:   %-33s", "?");
         } else if (1 != sscanf(value, "%d", &type)) {
                 printf("  Type:   %-33s", "??");
@@ -3697,7 +6390,8 @@ one_classic_sdev_entry(const char * dir_name, const char * devname,
                 printf("  Type:   %-33s", "???");
         } else  /* PDT */
                 printf("  Type:   %-33s", scsi_device_types[type]);
-        if (! get_value(buff, "scsi_level", value, sizeof(value))) {
+        if (! dev_value(dcp, buff, "scsi_level", value,
+                      sizeof(value))) {
                 printf("%s ?\n", ansi_ver_s);
         } else if (1 != sscanf(value, "%d", &scsi_level)) {
                 printf("%s ??\n", ansi_ver_s);
@@ -3707,26 +6401,19 @@ one_classic_sdev_entry(const char * dir_name, const char * devname,
                 printf("%s %02x\n", ansi_ver_s,
                        (scsi_level - 1) ? scsi_level - 1 : 1);
         if (op->generic) {
-                if (if_directory_ch2generic(buff)) {
-                        if (NULL == getcwd(wd, sizeof(wd)))
-                                printf("generic_dev error\n");
-                        else {
-                                if (op->kname)
-                                        snprintf(dev_node, sizeof(dev_node),
-                                                 "%.80s/%s", devfsroot,
-                                                 basename(wd));
-                                else if (! get_dev_node(wd, dev_node,
-                                                        CHR_DEV))
-                                        snprintf(dev_node, sizeof(dev_node),
-                                                 "-");
-                                printf("%s\n", dev_node);
-                        }
+                if (if_directory_2generic(buff, dcp, wd, sizeof(wd))) {
+                        if (op->kname)
+                                snprintf(dev_node, sizeof(dev_node),
+                                         "%.80s/%s", devfsroot, basename(wd));
+                        else if (! get_dev_node(wd, dev_node, CHR_DEV))
+                                snprintf(dev_node, sizeof(dev_node), "-");
+                        printf("%s\n", dev_node);
                 }
                 else
                         printf("-\n");
         }
         if (op->long_opt > 0)
-                longer_sdev_entry(buff, devname, op, NULL);
+                longer_sdev_entry(buff, devname, op, dcp, NULL);
         if (op->verbose)
                 printf("  dir: %s\n", buff);
 }
@@ -3819,125 +6506,652 @@ is_direct_access_dev(int pdt)
                 (0x14 == pdt));
 }
 
-/* List one SCSI device (LU) on a line. */
-static void
-one_sdev_entry(const char * dir_name, const char * devname,
-               struct lsscsi_opts * op, sgj_opaque_p jop)
+/* --fields=LIST: each field is resolved by a function that does only the
+ * sysfs reads its value needs. Parts needed by several fields (e.g. the
+ * class directory of the primary device) are found once per device, when
+ * first wanted. */
+struct fld_ctx_t {
+        bool nvme;              /* else SCSI device (LU) */
+        bool prim_done;
+        bool prim_ok;
+        bool node_done;
+        bool node_ok;
+        enum dev_type d_typ;    /* of the primary device */
+        const char * devname;   /* e.g. "2:0:1:0" or "nvme0n1" */
+        const char * ctl_dir;   /* NVMe controller's sysfs directory */
+        const struct nvme_ctl_t * ctl;  /* and its attributes */
+        struct lsscsi_opts * op;
+        struct dev_ctx_t * dcp;
+        char dir[LMAX_PATH];    /* the device's sysfs directory */
+        char prim[LMAX_PATH];   /* e.g. <dir>/block/sda */
+        char node[LMAX_NAME];   /* e.g. /dev/sda */
+};
+
+typedef bool (* fld_resolver_fn) (struct fld_ctx_t *, char *, int);
+
+struct fld_t {
+        const char * name;      /* also the JSON name */
+        int width;              /* of text column, left justified */
+        fld_resolver_fn fn;     /* false if no value (shown as "-") */
+        const char * desc;
+};
+
+/* Finds the class directory of the primary (i.e. not sg) device */
+static bool
+fld_prim(struct fld_ctx_t * fcp)
 {
-        bool get_wwn = false;
-        bool as_json;
-        bool json_transport_req = false;
-        int n;
-        int dec_pdt = 0;        /* decoded PDT; called 'type' in sysfs */
-        int q = 0;
-        int devname_len = 13;
-        sgj_state * jsp = &op->json_st;
-        sgj_opaque_p jo2p = NULL;
-        const char * cp = NULL;
-        char buff[LMAX_PATH];
-        char extra[LMAX_DEVPATH];
-        char value[LMAX_NAME];
-        char wd[LMAX_PATH];
-        char dev_node[LMAX_NAME] = "";
-        char b[512];
-        char e[256];
+        struct dev_ctx_t * dcp = fcp->dcp;
+        char extra[LMAX_NAME];
+
+        if (fcp->prim_done)
+                return fcp->prim_ok;
+        fcp->prim_done = true;
+        if (fcp->nvme) {
+                my_strcopy(fcp->prim, fcp->dir, sizeof(fcp->prim));
+                fcp->d_typ = BLK_DEV;
+                return (fcp->prim_ok = true);
+        }
+        if (1 != non_sg_scan(dcp->dev_fd, ".", fcp->op, dcp))
+                return false;
+        if (DT_DIR == dcp->non_sg.d_type) {
+                sg_scnpr(fcp->prim, sizeof(fcp->prim), "%s/%s", fcp->dir,
+                         dcp->non_sg.name);
+                if (1 != scan_for_first(dcp->dev_fd, dcp->non_sg.name,
+                                        fcp->op, dcp))
+                        return false;
+                my_strcopy(extra, dcp->aa_first.name, sizeof(extra));
+        } else {
+                my_strcopy(fcp->prim, fcp->dir, sizeof(fcp->prim));
+                my_strcopy(extra, dcp->non_sg.name, sizeof(extra));
+        }
+        if (! if_directory_canon(fcp->prim, extra, fcp->prim,
+                                 sizeof(fcp->prim)))
+                return false;
+        fcp->d_typ = (FT_BLOCK == dcp->non_sg.ft) ? BLK_DEV : CHR_DEV;
+        return (fcp->prim_ok = true);
+}
+
+/* Finds the node in /dev of the primary device */
+static bool
+fld_node(struct fld_ctx_t * fcp)
+{
+        if (fcp->node_done)
+                return fcp->node_ok;
+        fcp->node_done = true;
+        if (! fld_prim(fcp))
+                return false;
+        if (fcp->op->kname)
+                snprintf(fcp->node, sizeof(fcp->node), "%.80s/%s", devfsroot,
+                         basename(fcp->prim));
+        else if (! get_dev_node(fcp->prim, fcp->node, fcp->d_typ))
+                return false;
+        return (fcp->node_ok = true);
+}
+
+/* Places the tuple of the device in 'hctlp'. Returns false if its name
+ * is not a SCSI tuple. */
+static bool
+fld_tuple(const struct fld_ctx_t * fcp, struct addr_hctl * hctlp)
+{
+        if (fcp->nvme) {
+#if (HAVE_NVME && (! IGNORE_NVME))
+                int cdev_minor = 0;
+                int cntlid = 0;
+                unsigned int nsid = 0;
+                const char * cp = strrchr(fcp->devname, 'n');
+
+                sscanf(fcp->devname, "nvme%d", &cdev_minor);
+                if (fcp->ctl->as.av[NCA_CNTLID].vp)
+                        sscanf(fcp->ctl->as.av[NCA_CNTLID].vp, "%d", &cntlid);
+                if (cp && ('v' != *(cp + 1)))
+                        sscanf(cp + 1, "%u", &nsid);
+                mk_nvme_tuple(hctlp, cdev_minor, cntlid, nsid);
+#endif
+                return true;
+        }
+        return dev_hctl(fcp->dcp, fcp->devname, hctlp);
+}
+
+static bool
+fld_hctl(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        int sel_mask = 0xf;
         struct addr_hctl hctl;
-        static const int blen = sizeof(b);
-        static const int elen = sizeof(e);
-        static const int vlen = sizeof(value);
-        static const int lun_sz = sizeof(hctl.lun_arr);
-        static const int dev_node_sz = sizeof(dev_node);
-        /* If string used by another function, moved to file scope */
-        static const char * hi_s = "host_index";
-        static const char * ci_s = "controller_index";
-        static const char * ti_s = "target_index";
-        static const char * llun_s = "linux_lun";
-        static const char * t10_lun_s = "t10_lun_array";
-        static const char * hctl_s = "hctl_string";
-        static const char * sp32_s = "                                ";
+        char e[64];
 
-        as_json = jsp->pr_as_json;
-        if (op->classic) {
-                one_classic_sdev_entry(dir_name, devname, op);
-                return;
+        if (fcp->op->lunhex)
+                sel_mask |= (1 == fcp->op->lunhex) ? 0x10 : 0x20;
+        if (! fld_tuple(fcp, &hctl)) {
+                snprintf(b, blen, "[%s]", fcp->devname);
+                return true;
         }
-        snprintf(buff, sizeof(buff), "%s/%s", dir_name, devname);
-        if (op->lunhex && parse_colon_list(devname, &hctl)) {
-                int sel_mask = 0xf;
+        snprintf(b, blen, "[%s]", tuple2string(&hctl, sel_mask,
+                                               sizeof(e), e));
+        return true;
+}
 
-                sel_mask |= (1 == op->lunhex) ? 0x10 : 0x20;
-                cp = tuple2string(&hctl, sel_mask, elen, e);
-                snprintf(value, vlen, "[%s]", cp);
-                if (as_json) {
-                        sgj_js_nv_s_nex(jsp, jop, lsscsi_loc_s, value,
-                                        hctl_s);
-                        sgj_js_nv_i(jsp, jop, hi_s, hctl.h);
-                        sgj_js_nv_i(jsp, jop, ci_s, hctl.c);
-                        sgj_js_nv_i(jsp, jop, ti_s, hctl.t);
-                        jo2p = sgj_named_subobject_r(jsp, jop, lun_s);
-                        sgj_js_nv_ihex(jsp, jo2p, llun_s, hctl.l);
-                        sgj_js_nv_hex_bytes(jsp, jo2p, t10_lun_s,
-                                            hctl.lun_arr, lun_sz);
-                        if (op->long_opt > 0)
-                                sgj_js_nv_s_nex(jsp, jo2p, nm_s,
-                                                "Logical Unit Number",
-                                                "usually expressed as LUN");
-                }
-                devname_len = 28;
-        } else {
-                snprintf(value, vlen, "[%s]", devname);
-                if (as_json) {
-                        sgj_js_nv_s_nex(jsp, jop, lsscsi_loc_s, value,
-                                        hctl_s);
-                        if (parse_colon_list(devname, &hctl)) {
-                                sgj_js_nv_i(jsp, jop, hi_s, hctl.h);
-                                sgj_js_nv_i(jsp, jop, ci_s, hctl.c);
-                                sgj_js_nv_i(jsp, jop, ti_s, hctl.t);
-                                jo2p = sgj_named_subobject_r(jsp, jop, lun_s);
-                                sgj_js_nv_ihex(jsp, jo2p, llun_s, hctl.l);
-                                sgj_js_nv_hex_bytes(jsp, jo2p, t10_lun_s,
-                                                    hctl.lun_arr, lun_sz);
-                                if (op->long_opt > 0)
-                                        sgj_js_nv_s(jsp, jo2p, nm_s,
-                                                    "Logical Unit Number");
-                        }
-                }
+static bool
+fld_type(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        int pdt;
+        char value[32];
+
+        if (fcp->nvme) {
+                snprintf(b, blen, "disk");
+                return true;
         }
+        if (! (get_value_at(fcp->dcp->dev_fd, "type", value, sizeof(value))
+               && (1 == sscanf(value, "%d", &pdt)) && (pdt >= 0) &&
+               (pdt < 32)))
+                return false;
+        my_strcopy(b, scsi_short_device_types[pdt], blen);
+        trim_lead_trail(b, false, true);
+        return true;
+}
 
-        if ((int)strlen(value) >= devname_len) /* if long, append a space */
-                q += sg_scn3pr(b, blen, q, "%s ", value);
-        else /* left justified with field length of devname_len */
-                q += sg_scn3pr(b, blen, q, "%-*s", devname_len, value);
-        if (op->pdt) {
-                if (get_value(buff, "type", value, vlen) &&
-                    (1 == sscanf(value, "%d", &dec_pdt)) &&
-                    (dec_pdt >= 0) && (dec_pdt < 32))
-                        snprintf(e, elen, "0x%x", dec_pdt);
-                else
-                        snprintf(e, elen, "-1");
-                q += sg_scn3pr(b, blen, q, "%-8s", e);
-        } else if (op->brief)
-                ;
-        else if (! get_value(buff, "type", value, vlen)) {
-                q += sg_scn3pr(b, blen, q, "type?   ");
-        } else if (1 != sscanf(value, "%d", &dec_pdt)) {
-                q += sg_scn3pr(b, blen, q, "type??  ");
-        } else if ((dec_pdt < 0) || (dec_pdt > 31)) {
-                q += sg_scn3pr(b, blen, q, "type??? ");
-        } else {
-                cp = scsi_short_device_types[dec_pdt];
-                q += sg_scn3pr(b, blen, q, "%s ", cp);
-                sgj_js_nv_ihexstr(jsp, jop, pdt_sn, dec_pdt, NULL, cp);
+static bool
+fld_vendor(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        if (fcp->nvme)
+                return false;
+        return get_value_at(fcp->dcp->dev_fd, vend_s, b, blen);
+}
+
+/* 'sdev_name' is the attribute of a SCSI device, 'ctl_name' that of an
+ * NVMe controller */
+static bool
+fld_attr2(struct fld_ctx_t * fcp, const char * sdev_name,
+          const char * ctl_name, char * b, int blen)
+{
+        if (fcp->nvme) {
+#if (HAVE_NVME && (! IGNORE_NVME))
+                const char * vp;
+
+                if (NULL == ctl_name)
+                        return false;
+                if ((vp = attr_get(&fcp->ctl->as, ctl_name)))
+                        my_strcopy(b, vp, blen);
+                else if (! get_value(fcp->ctl_dir, ctl_name, b, blen))
+                        return false;
+                trim_lead_trail(b, true, true);
+                return true;
+#else
+                return false;
+#endif
         }
+        return sdev_name && get_value_at(fcp->dcp->dev_fd, sdev_name, b,
+                                         blen);
+}
 
-        if (op->wwn)
-                get_wwn = true;
-        if (op->transport_info) {
-                /* This code replaces the vendor/product/revision string on
+static bool
+fld_model(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        return fld_attr2(fcp, model_s, model_s, b, blen);
+}
+
+static bool
+fld_rev(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        return fld_attr2(fcp, rev_s, fr_s, b, blen);
+}
+
+static bool
+fld_state(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        return fld_attr2(fcp, "state", "state", b, blen);
+}
+
+static bool
+fld_qdepth(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        return fld_attr2(fcp, "queue_depth", NULL, b, blen);
+}
+
+static bool
+fld_transport(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        if (fcp->nvme)
+                return fld_attr2(fcp, NULL, trans_s, b, blen);
+        if (! transport_sdev_tport(fcp->devname, fcp->op, fcp->dcp, blen, b))
+                return false;
+        trim_lead_trail(b, false, true);
+        return true;
+}
+
+static bool
+fld_dev(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        if (! fld_node(fcp))
+                return false;
+        my_strcopy(b, fcp->node, blen);
+        return true;
+}
+
+static bool
+fld_maj_min(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        return fld_prim(fcp) && get_value(fcp->prim, dv_s, b, blen);
+}
+
+static bool
+fld_sg(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        char wd[LMAX_PATH];
+
+        if (fcp->nvme) {
+                /* generic char device of "nvme0n1" is "ng0n1" */
+                if (strncmp(fcp->devname, "nvme", 4))
+                        return false;
+                snprintf(wd, sizeof(wd), "%s/ng%s", fcp->ctl_dir,
+                         fcp->devname + 4);
+        } else if (! if_directory_2generic(fcp->dir, fcp->dcp, wd,
+                                           sizeof(wd)))
+                return false;
+        if (fcp->op->kname) {
+                snprintf(b, blen, "%.80s/%s", devfsroot, basename(wd));
+                return true;
+        }
+        return get_dev_node(wd, b, CHR_DEV);
+}
+
+static bool
+fld_wwn(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        if (fcp->nvme)
+                return get_value(fcp->dir, wwid_s, b, blen);
+        return fld_prim(fcp) && (BLK_DEV == fcp->d_typ) &&
+               get_disk_wwn(fcp->prim, b, blen, fcp->op->wwn_twice);
+}
+
+static bool
+fld_lu_name(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        if (fcp->nvme)
+                return false;
+        get_lu_name(fcp->devname, fcp->dcp, b, blen,
+                    fcp->op->unit > 3);
+        return !! b[0];
+}
+
+static bool
+fld_scsi_id(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        char * scsi_id;
+
+        if (fcp->nvme || (! fld_node(fcp)))
+                return false;
+        scsi_id = get_disk_scsi_id(fcp->node, fcp->op->scsi_id_twice);
+        if (NULL == scsi_id)
+                return false;
+        my_strcopy(b, scsi_id, blen);
+        free(scsi_id);
+        return true;
+}
+
+static bool
+fld_size(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        int pdt;
+        char value[32];
+        char blkdir[LMAX_PATH];
+        enum string_size_units unit_val = (2 == fcp->op->ssize) ?
+                                          STRING_UNITS_2 : STRING_UNITS_10;
+
+        if (fcp->nvme)
+                my_strcopy(blkdir, fcp->dir, sizeof(blkdir));
+        else {
+                if (! (get_value_at(fcp->dcp->dev_fd, "type", value,
+                                    sizeof(value)) &&
+                       (1 == sscanf(value, "%d", &pdt)) &&
+                       is_direct_access_dev(pdt)))
+                        return false;
+                /* the primary device, if a block device, is the disk */
+                if (fcp->prim_ok && (BLK_DEV == fcp->d_typ))
+                        my_strcopy(blkdir, fcp->prim, sizeof(blkdir));
+                else {
+                        my_strcopy(blkdir, fcp->dir, sizeof(blkdir));
+                        if (! (block_scan(blkdir) &&
+                               if_directory_canon(blkdir, NULL, NULL, 0)))
+                                return false;
+                }
+        }
+        if (! get_value(blkdir, "size", value, sizeof(value)))
+                return false;
+        if (fcp->op->ssize > 2) {       /* number of 512 byte blocks */
+                my_strcopy(b, value, blen);
+                return true;
+        }
+        return (atoll(value) > 0) &&
+               size2string((uint64_t)atoll(value) << 9, unit_val, b, blen);
+}
+
+static bool
+fld_enclosure(struct fld_ctx_t * fcp, char * b, int blen)
+{
+        const struct encl_slot_rec * rp;
+
+        if (fcp->nvme || (NULL == (rp = get_encl_slot(fcp->devname))))
+                return false;
+        snprintf(b, blen, "%s,%s", encl_slot_index.pool.p + rp->encl_off,
+                 encl_slot_index.pool.p + rp->comp_off);
+        return true;
+}
+
+static const struct fld_t fld_tbl[] = {
+        {"hctl", 13, fld_hctl, "[h:c:t:l] tuple (or [N:c:t:n] for NVMe)"},
+        {"type", 8, fld_type, "abridged peripheral device type"},
+        {"vendor", 8, fld_vendor, "T10 vendor identification"},
+        {"model", 16, fld_model, "product (or NVMe controller model)"},
+        {"rev", 8, fld_rev, "revision (or NVMe firmware revision)"},
+        {"dev", 13, fld_dev, "primary device node (e.g. /dev/sda)"},
+        {"sg", 13, fld_sg, "generic device node (e.g. /dev/sg0)"},
+        {"maj_min", 8, fld_maj_min, "primary device's major:minor"},
+        {"wwn", 35, fld_wwn, "disk WWN as for --wwn (NVMe: wwid)"},
+        {"lu_name", 34, fld_lu_name, "logical unit name as for --unit"},
+        {"scsi_id", 34, fld_scsi_id, "udev derived SCSI id as for "
+         "--scsi_id"},
+        {"size", 7, fld_size, "disk size as for --size"},
+        {"state", 8, fld_state, "device (or NVMe controller) state"},
+        {"queue_depth", 4, fld_qdepth, "SCSI device queue depth"},
+        {"transport", 30, fld_transport, "abridged transport as for "
+         "--transport"},
+        {"enclosure", 20, fld_enclosure, "enclosure and component (slot) "
+         "as for --enclosure"},
+};
+
+/* Parses the comma separated names in 'arg' into op->fields[]. Returns
+ * false (after reporting, if 'noisy') if a name is unknown or there are
+ * too many. */
+static bool
+fields_parse(const char * arg, struct lsscsi_opts * op, bool noisy)
+{
+        int k, n;
+        const char * cp;
+        const char * ep;
+
+        op->num_fields = 0;
+        for (cp = arg; *cp; cp = *ep ? (ep + 1) : ep) {
+                ep = strchr(cp, ',');
+                if (NULL == ep)
+                        ep = cp + strlen(cp);
+                n = ep - cp;
+                if (0 == n)
+                        continue;
+                for (k = 0; k < (int)SG_ARRAY_SIZE(fld_tbl); ++k) {
+                        if ((n == (int)strlen(fld_tbl[k].name)) &&
+                            (0 == strncmp(cp, fld_tbl[k].name, n)))
+                                break;
+                }
+                if (k >= (int)SG_ARRAY_SIZE(fld_tbl)) {
+                        if (noisy)
+                                pr2serr("--fields=: unknown field: %.*s, "
+                                        "use --fields=? to list them\n", n,
+                                        cp);
+                        return false;
+                }
+                if (op->num_fields >= MAX_FIELDS) {
+                        if (noisy)
+                                pr2serr("--fields=: no more than %d "
+                                        "fields\n", MAX_FIELDS);
+                        return false;
+                }
+                op->fields[op->num_fields++] = k;
+        }
+        if (0 == op->num_fields) {
+                if (noisy)
+                        pr2serr("--fields= expects one or more field "
+                                "names\n");
+                return false;
+        }
+        return true;
+}
+
+static void
+fields_usage(void)
+{
+        int k;
+
+        pr2serr("--fields=LIST where LIST is a comma separated list of:\n");
+        for (k = 0; k < (int)SG_ARRAY_SIZE(fld_tbl); ++k)
+                pr2serr("    %-12s %s\n", fld_tbl[k].name, fld_tbl[k].desc);
+        pr2serr("Only the sysfs files that the given fields need are read. "
+                "Each device\nis output on a line (or as a JSON object) "
+                "with just those fields,\nthose without a value are shown "
+                "as '-' (or omitted from JSON).\n");
+}
+
+/* Output one device with the fields given to --fields= */
+static void
+fields_entry(struct fld_ctx_t * fcp, sgj_opaque_p jop)
+{
+        int k, q;
+        const struct fld_t * fp;
+        struct lsscsi_opts * op = fcp->op;
+        sgj_state * jsp = &op->json_st;
+        char value[LMAX_NAME];
+        char b[1024];
+        static const int blen = sizeof(b);
+
+        for (k = 0, q = 0; k < op->num_fields; ++k) {
+                fp = fld_tbl + op->fields[k];
+                if (fp->fn(fcp, value, sizeof(value))) {
+                        if (jsp->pr_as_json)
+                                sgj_js_nv_s(jsp, jop, fp->name, value);
+                } else
+                        memcpy(value, "-", 2);
+                if (k + 1 < op->num_fields)
+                        q += sg_scn3pr(b, blen, q, "%-*s ", fp->width,
+                                       value);
+                else
+                        q += sg_scn3pr(b, blen, q, "%s", value);
+        }
+        sgj_pr_hr(jsp, "%s\n", b);
+}
+
+/* List one SCSI device (LU) with the fields given to --fields= */
+static void
+fields_sdev_entry(const char * dir_name, const char * devname,
+                  struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+                  sgj_opaque_p jop)
+{
+        struct fld_ctx_t fc;
+
+        memset(&fc, 0, sizeof(fc));
+        fc.devname = devname;
+        fc.op = op;
+        fc.dcp = dcp;
+        snprintf(fc.dir, sizeof(fc.dir), "%s/%s", dir_name, devname);
+        if (dcp->parent_fd >= 0)
+                dcp->dev_fd = opendir_fd(dcp->parent_fd, devname);
+        else
+                dcp->dev_fd = opendir_fd(AT_FDCWD, fc.dir);
+        fields_entry(&fc, jop);
+        if (dcp->dev_fd >= 0) {
+                vfs_close(dcp->dev_fd);
+                dcp->dev_fd = -1;
+        }
+}
+
+/* Replaces the names given to JSON members of (nearly) every device with
+ * their interned copies (see sgj_key_intern()), so adding those members
+ * takes no lookup of the name. */
+static void
+js_keys_intern(void)
+{
+        int k;
+        const char * kp;
+        const char ** const keys[] = {
+                &pdt_sn, &vend_sn, &product_sn, &lbs_sn, &pbs_sn,
+                &lsscsi_loc_s, &lun_s, &sas_ad_s, &trans_s, &wwn_s,
+        };
+
+        for (k = 0; k < (int)SG_ARRAY_SIZE(keys); ++k) {
+                kp = sgj_key_intern(*keys[k], false);
+                if (kp)
+                        *keys[k] = kp;
+        }
+}
+
+/* Adds 'name' for a device number given as "MAJ:MIN" in 'value'. With
+ * CBOR output (JSON option 'c') it is an array of the two integers. */
+static void
+js_maj_min(sgj_state * jsp, sgj_opaque_p jop, const char * name,
+           const char * value)
+{
+        unsigned int maj, min;
+        sgj_opaque_p jap;
+
+        if (('c' == jsp->pr_format) &&
+            (2 == sscanf(value, "%u:%u", &maj, &min)) &&
+            (jap = sgj_named_subarray_r(jsp, jop, name))) {
+                sgj_js_nv_i(jsp, jap, NULL, maj);
+                sgj_js_nv_i(jsp, jap, NULL, min);
+        } else
+                sgj_js_nv_s(jsp, jop, name, value);
+}
+
+/* Adds "size" from the number of 512 byte blocks in 'value'. JSON has
+ * that as a string (as sysfs does), CBOR as an integer. */
+static void
+js_size512(sgj_state * jsp, sgj_opaque_p jop, const char * value)
+{
+        static const char * nex_s = "[unit: 512 bytes]";
+
+        if ('c' == jsp->pr_format)
+                sgj_js_nv_ihex_nex(jsp, jop, "size", atoll(value), false,
+                                   nex_s);
+        else
+                sgj_js_nv_s_nex(jsp, jop, "size", value, nex_s);
+}
+
+/* List one SCSI device (LU) on a line. */
+static void
+one_sdev_entry(const char * dir_name, const char * devname,
+               struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+               sgj_opaque_p jop)
+{
+        bool get_wwn = false;
+        bool as_json;
+        bool json_transport_req = false;
+        int n;
+        int dec_pdt = 0;        /* decoded PDT; called 'type' in sysfs */
+        int q = 0;
+        int devname_len = 13;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jo2p = NULL;
+        const char * cp = NULL;
+        char buff[LMAX_PATH];
+        char extra[LMAX_DEVPATH];
+        char value[LMAX_NAME];
+        char wd[LMAX_PATH];
+        char dev_node[LMAX_NAME] = "";
+        char b[512];
+        char e[256];
+        struct addr_hctl hctl;
+        static const int blen = sizeof(b);
+        static const int elen = sizeof(e);
+        static const int vlen = sizeof(value);
+        static const int lun_sz = sizeof(hctl.lun_arr);
+        static const int dev_node_sz = sizeof(dev_node);
+        /* If string used by another function, moved to file scope */
+        static const char * hi_s = "host_index";
+        static const char * ci_s = "controller_index";
+        static const char * ti_s = "target_index";
+        static const char * llun_s = "linux_lun";
+        static const char * t10_lun_s = "t10_lun_array";
+        static const char * hctl_s = "hctl_string";
+        static const char * sp32_s = "                                ";
+
+        as_json = jsp->pr_as_json;
+        if (op->num_fields > 0) {
+                fields_sdev_entry(dir_name, devname, op, dcp, jop);
+                return;
+        }
+        if (op->classic) {
+                one_classic_sdev_entry(dir_name, devname, op, dcp);
+                return;
+        }
+        snprintf(buff, sizeof(buff), "%s/%s", dir_name, devname);
+        if (dcp->parent_fd >= 0)
+                dcp->dev_fd = opendir_fd(dcp->parent_fd, devname);
+        else
+                dcp->dev_fd = opendir_fd(AT_FDCWD, buff);
+        if (op->lunhex && dev_hctl(dcp, devname, &hctl)) {
+                int sel_mask = 0xf;
+
+                sel_mask |= (1 == op->lunhex) ? 0x10 : 0x20;
+                cp = tuple2string(&hctl, sel_mask, elen, e);
+                snprintf(value, vlen, "[%s]", cp);
+                if (as_json) {
+                        sgj_js_nv_s_nex(jsp, jop, lsscsi_loc_s, value,
+                                        hctl_s);
+                        sgj_js_nv_i(jsp, jop, hi_s, hctl.h);
+                        sgj_js_nv_i(jsp, jop, ci_s, hctl.c);
+                        sgj_js_nv_i(jsp, jop, ti_s, hctl.t);
+                        jo2p = sgj_named_subobject_r(jsp, jop, lun_s);
+                        sgj_js_nv_ihex(jsp, jo2p, llun_s, hctl.l);
+                        sgj_js_nv_hex_bytes(jsp, jo2p, t10_lun_s,
+                                            hctl.lun_arr, lun_sz);
+                        if (op->long_opt > 0)
+                                sgj_js_nv_s_nex(jsp, jo2p, nm_s,
+                                                "Logical Unit Number",
+                                                "usually expressed as LUN");
+                }
+                devname_len = 28;
+        } else {
+                snprintf(value, vlen, "[%s]", devname);
+                if (as_json) {
+                        sgj_js_nv_s_nex(jsp, jop, lsscsi_loc_s, value,
+                                        hctl_s);
+                        if (dev_hctl(dcp, devname, &hctl)) {
+                                sgj_js_nv_i(jsp, jop, hi_s, hctl.h);
+                                sgj_js_nv_i(jsp, jop, ci_s, hctl.c);
+                                sgj_js_nv_i(jsp, jop, ti_s, hctl.t);
+                                jo2p = sgj_named_subobject_r(jsp, jop, lun_s);
+                                sgj_js_nv_ihex(jsp, jo2p, llun_s, hctl.l);
+                                sgj_js_nv_hex_bytes(jsp, jo2p, t10_lun_s,
+                                                    hctl.lun_arr, lun_sz);
+                                if (op->long_opt > 0)
+                                        sgj_js_nv_s(jsp, jo2p, nm_s,
+                                                    "Logical Unit Number");
+                        }
+                }
+        }
+
+        if ((int)strlen(value) >= devname_len) /* if long, append a space */
+                q += sg_scn3pr(b, blen, q, "%s ", value);
+        else /* left justified with field length of devname_len */
+                q += sg_scn3pr(b, blen, q, "%-*s", devname_len, value);
+        if (op->pdt) {
+                if (dev_value_at(dcp, dcp->dev_fd, "type", value, vlen) &&
+                    (1 == sscanf(value, "%d", &dec_pdt)) &&
+                    (dec_pdt >= 0) && (dec_pdt < 32))
+                        snprintf(e, elen, "0x%x", dec_pdt);
+                else
+                        snprintf(e, elen, "-1");
+                q += sg_scn3pr(b, blen, q, "%-8s", e);
+        } else if (op->brief)
+                ;
+        else if (! dev_value_at(dcp, dcp->dev_fd, "type", value, vlen)) {
+                q += sg_scn3pr(b, blen, q, "type?   ");
+        } else if (1 != sscanf(value, "%d", &dec_pdt)) {
+                q += sg_scn3pr(b, blen, q, "type??  ");
+        } else if ((dec_pdt < 0) || (dec_pdt > 31)) {
+                q += sg_scn3pr(b, blen, q, "type??? ");
+        } else {
+                cp = scsi_short_device_types[dec_pdt];
+                q += sg_scn3pr(b, blen, q, "%s ", cp);
+                sgj_js_nv_ihexstr(jsp, jop, pdt_sn, dec_pdt, NULL, cp);
+        }
+
+        if (op->wwn)
+                get_wwn = true;
+        if (op->transport_info) {
+                /* This code replaces the vendor/product/revision string on
                  * the single line output with abridged transport info.
                  * However this doesn't help when JSON output is active, set
                  * flag so longer_sdev_entry() is called later. */
-                if (transport_sdev_tport(devname, op, vlen, value)) {
+                if (transport_sdev_tport(devname, op, dcp, vlen, value)) {
                         q += sg_scn3pr(b, blen, q, "%-30s  ", value);
                         if (as_json)
                                 json_transport_req = true;
@@ -3945,7 +7159,7 @@ one_sdev_entry(const char * dir_name, const char * devname,
                         q += sg_scn3pr(b, blen, q,
                                        "                                ");
         } else if (op->unit) {
-                get_lu_name(devname, value, vlen, op->unit > 3);
+                get_lu_name(devname, dcp, value, vlen, op->unit > 3);
                 n = strlen(value);
                 if (n < 1)      /* left justified "none" means no lu name */
                         q += sg_scn3pr(b, blen, q, "%-32s  ", none_s);
@@ -3972,21 +7186,21 @@ one_sdev_entry(const char * dir_name, const char * devname,
                 if (as_json)
                         jo2p = sgj_named_subobject_r(jsp, jop,
                                                      "t10_id_strings");
-                if (get_value(buff, vend_s, value, vlen)) {
+                if (dev_value_at(dcp, dcp->dev_fd, vend_s, value, vlen)) {
                         q += sg_scn3pr(b, blen, q, "%-8s ", value);
                         if (as_json)
                                 sgj_js_nv_s(jsp, jo2p, vend_sn, value);
                 } else
                         q += sg_scn3pr(b, blen, q, "vendor?  ");
 
-                if (get_value(buff, model_s, value, vlen)) {
+                if (dev_value_at(dcp, dcp->dev_fd, model_s, value, vlen)) {
                         q += sg_scn3pr(b, blen, q, "%-16s ", value);
                         if (as_json)
                                 sgj_js_nv_s(jsp, jo2p, product_sn, value);
                 } else
                         q += sg_scn3pr(b, blen, q, "model?           ");
 
-                if (get_value(buff, rev_s, value, vlen)) {
+                if (dev_value_at(dcp, dcp->dev_fd, rev_s, value, vlen)) {
                         q += sg_scn3pr(b, blen, q, "%-4s  ", value);
                         if (as_json)
                                 sgj_js_nv_s(jsp, jo2p, revis_s, value);
@@ -3994,11 +7208,13 @@ one_sdev_entry(const char * dir_name, const char * devname,
                         q += sg_scn3pr(b, blen, q, "rev?  ");
         }
 
-        if (1 == non_sg_scan(buff, op)) {       /* expect 1 or 0 */
-                if (DT_DIR == non_sg.d_type) {
-                        sg_scnpr(wd, sizeof(wd), "%s/%s", buff, non_sg.name);
-                        if (1 == scan_for_first(wd, op))
-                                my_strcopy(extra, aa_first.name,
+        if (1 == non_sg_scan(dcp->dev_fd, ".", op, dcp)) {  /* 1 or 0 */
+                if (DT_DIR == dcp->non_sg.d_type) {
+                        sg_scnpr(wd, sizeof(wd), "%s/%s", buff,
+                                 dcp->non_sg.name);
+                        if (1 == scan_for_first(dcp->dev_fd,
+                                                dcp->non_sg.name, op, dcp))
+                                my_strcopy(extra, dcp->aa_first.name,
                                            sizeof(extra));
                         else {
                                 q += sg_scn3pr(b, blen, q, "unexpected "
@@ -4007,19 +7223,16 @@ one_sdev_entry(const char * dir_name, const char * devname,
                         }
                 } else {
                         my_strcopy(wd, buff, sizeof(wd));
-                        my_strcopy(extra, non_sg.name, sizeof(extra));
-                }
-                if (wd[0] && (if_directory_chdir(wd, extra))) {
-                        if (NULL == getcwd(wd, sizeof(wd))) {
-                                q += sg_scn3pr(b, blen, q, "getcwd error");
-                                wd[0] = '\0';
-                        }
+                        my_strcopy(extra, dcp->non_sg.name, sizeof(extra));
                 }
+                if (wd[0])
+                        if_directory_canon(wd, extra, wd, sizeof(wd));
                 if (wd[0]) {
                         enum dev_type d_typ;
                         char wwn_str[DSK_WWN_MXLEN];
 
-                        d_typ = (FT_BLOCK == non_sg.ft) ? BLK_DEV : CHR_DEV;
+                        d_typ = (FT_BLOCK == dcp->non_sg.ft) ? BLK_DEV :
+                                                               CHR_DEV;
                         if (get_wwn) {
                                 if ((BLK_DEV == d_typ) &&
                                     get_disk_wwn(wd, wwn_str, sizeof(wwn_str),
@@ -4044,6 +7257,8 @@ one_sdev_entry(const char * dir_name, const char * devname,
                                                  "-       ");
                         }
                         q += sg_scn3pr(b, blen, q, "%-9s", dev_node);
+                        if (cp)
+                                dev_part_note(dcp, cp, dev_node);
                         if (cp && as_json)
                                 sgj_js_nv_s(jsp, jop, cp, dev_node);
 
@@ -4052,9 +7267,9 @@ one_sdev_entry(const char * dir_name, const char * devname,
                                         q += sg_scn3pr(b, blen, q, "[%s]",
                                                        value);
                                         if (as_json)
-                                                sgj_js_nv_s(jsp, jop,
-                                                            "major_minor",
-                                                            value);
+                                                js_maj_min(jsp, jop,
+                                                           "major_minor",
+                                                           value);
                                 } else
                                         q += sg_scn3pr(b, blen, q, "[dev?]");
                         }
@@ -4082,43 +7297,33 @@ one_sdev_entry(const char * dir_name, const char * devname,
         }
 
         if (op->generic) {
-                if (if_directory_ch2generic(buff)) {
-                        if (NULL == getcwd(wd, sizeof(wd)))
-                                q += sg_scn3pr(b, blen, q,
-                                               "  generic_dev error");
-                        else {
-                                cp = NULL;
-                                dev_node[0] = '\0';
-                                if (op->kname) {
-                                        cp = "sg_kernel_node";
+                if (if_directory_2generic(buff, dcp, wd, sizeof(wd))) {
+                        cp = NULL;
+                        dev_node[0] = '\0';
+                        if (op->kname) {
+                                cp = "sg_kernel_node";
+                                snprintf(dev_node, dev_node_sz, "%.80s/%s",
+                                         devfsroot, basename(wd));
+                        } else {
+                                if (get_dev_node(wd, dev_node, CHR_DEV))
+                                        cp = "sg_node";
+                                else
                                         snprintf(dev_node, dev_node_sz,
-                                                 "%.80s/%s", devfsroot,
-                                                 basename(wd));
-                                } else {
-                                        if (get_dev_node(wd, dev_node,
-                                                         CHR_DEV))
-                                                cp = "sg_node";
-                                        else
-                                                snprintf(dev_node,
-                                                         dev_node_sz, "-");
-                                }
-                                q += sg_scn3pr(b, blen, q, "  %-9s",
-                                               dev_node);
-                                if (cp && as_json)
-                                        sgj_js_nv_s(jsp, jop, cp, dev_node);
-                                if (op->dev_maj_min) {
-                                        if (get_value(wd, dv_s, value,
-                                                      vlen)) {
-                                                q += sg_scn3pr(b, blen, q,
-                                                               "[%s]", value);
-                                                if (as_json)
-                                                        sgj_js_nv_s(jsp, jop,
-                                                            "sg_major_minor",
-                                                                    value);
-                                        } else
-                                                q += sg_scn3pr(b, blen, q,
-                                                               "[dev?]");
-                                }
+                                                 "-");
+                        }
+                        q += sg_scn3pr(b, blen, q, "  %-9s", dev_node);
+                        if (cp && as_json)
+                                sgj_js_nv_s(jsp, jop, cp, dev_node);
+                        if (op->dev_maj_min) {
+                                if (get_value(wd, dv_s, value, vlen)) {
+                                        q += sg_scn3pr(b, blen, q, "[%s]",
+                                                       value);
+                                        if (as_json)
+                                                js_maj_min(jsp, jop,
+                                                           "sg_major_minor",
+                                                           value);
+                                } else
+                                        q += sg_scn3pr(b, blen, q, "[dev?]");
                         }
                 } else
                         q += sg_scn3pr(b, blen, q, "  %-9s", "-");
@@ -4126,6 +7331,8 @@ one_sdev_entry(const char * dir_name, const char * devname,
         if (op->protection || op->protmode)
                 q += rend_prot_protmode(buff, b + q, blen - q, true, " ",
                                         op, jop);
+        if (op->enclosure)
+                q += rend_encl_slot(devname, b + q, blen - q, jsp, jop);
 
         if (op->ssize) {
                 uint64_t blk512s;
@@ -4137,16 +7344,15 @@ one_sdev_entry(const char * dir_name, const char * devname,
                 value[0] = 0;
                 if (! (is_direct_access_dev(dec_pdt) &&
                        block_scan(blkdir) &&
-                       if_directory_chdir(blkdir, ".") &&
-                       get_value(".", "size", vp, vlen))) {
+                       if_directory_canon(blkdir, NULL, NULL, 0) &&
+                       get_value(blkdir, "size", vp, vlen))) {
                         /* q += */ sg_scn3pr(b, blen, q, "  %6s", "-");
                         goto fini_line;
                 }
                 blk512s = atoll(vp);
                 num_by = blk512s * 512;
                 if (as_json) {
-                        sgj_js_nv_s_nex(jsp, jop, "size", vp,
-                                        "[unit: 512 bytes]");
+                        js_size512(jsp, jop, vp);
                         jo2p = sgj_named_subobject_r(jsp, jop, "size_decomp");
                         sgj_js_nv_ihex_nex(jsp, jo2p, "blocks_512",
                                            blk512s, true,
@@ -4158,7 +7364,7 @@ one_sdev_entry(const char * dir_name, const char * devname,
                         char bb[32];
                         static const int bblen = sizeof(bb);
 
-                        if (get2_value(".", qu_s, lbs_sn, bb, bblen))
+                        if (get2_value(blkdir, qu_s, lbs_sn, bb, bblen))
                                 lbs = atoi(bb);
                         if (512 == lbs)
                                 q += sg_scn3pr(b, blen, q, "  %12s%s", vp,
@@ -4177,7 +7383,7 @@ one_sdev_entry(const char * dir_name, const char * devname,
                                 sgj_js_nv_ihex_nex(jsp, jo2p, lbs_sn, lbs,
                                                    true, "t10 name: Logical "
                                                    "block length in bytes");
-                                if (get2_value(".", qu_s, pbs_sn, bb, bblen)) {
+                                if (get2_value(blkdir, qu_s, pbs_sn, bb, bblen)) {
                                         lbs = atoi(bb);
                                         sgj_js_nv_ihex(jsp, jo2p, pbs_sn, lbs);
                                 }
@@ -4205,55 +7411,67 @@ one_sdev_entry(const char * dir_name, const char * devname,
 fini_line:
         sgj_pr_hr(jsp, "%s\n", b);
         if ((op->long_opt > 0) || json_transport_req)
-                longer_sdev_entry(buff, devname, op, jop);
+                longer_sdev_entry(buff, devname, op, dcp, jop);
         if (op->verbose > 0) {
                 q = sg_scn3pr(b, blen, 0, "  dir: %s  [", buff);
-                if (if_directory_chdir(buff, "")) {
-                        if (NULL == getcwd(wd, sizeof(wd)))
-                                sg_scn3pr(b, blen, q, "?");
-                        else
-                                sg_scn3pr(b, blen, q, "%s", wd);
-                }
+                if (if_directory_canon(buff, "", wd, sizeof(wd)))
+                        sg_scn3pr(b, blen, q, "%s", wd);
                 sgj_pr_hr(jsp, "%s]\n", b);
         }
+        if (dcp->dev_fd >= 0) {
+                vfs_close(dcp->dev_fd);
+                dcp->dev_fd = -1;
+        }
 }
 
-static int
-sdev_dir_scan_select(const struct dirent * s)
+/* Returns true if 'name' (in /sys/bus/scsi/devices) is that of a SCSI
+ * device (LU) rather than of a host, target or auxiliary device */
+static bool
+sdev_name_ok(const char * name)
 {
 /* Following no longer needed but leave for early lk 2.6 series */
-        if (strstr(s->d_name, "mt"))
-                return 0;       /* st auxiliary device names */
-        if (strstr(s->d_name, "ot"))
-                return 0;       /* osst auxiliary device names */
-        if (strstr(s->d_name, "gen"))
-                return 0;
+        if (strstr(name, "mt"))
+                return false;   /* st auxiliary device names */
+        if (strstr(name, "ot"))
+                return false;   /* osst auxiliary device names */
+        if (strstr(name, "gen"))
+                return false;
 /* Above no longer needed but leave for early lk 2.6 series */
-        if (!strncmp(s->d_name, "host", 4)) /* SCSI host */
-                return 0;
-        if (!strncmp(s->d_name, "target", 6)) /* SCSI target */
-                return 0;
-        if (strchr(s->d_name, ':')) {
-                if (filter_active) {
-                        struct addr_hctl s_hctl;
+        if (!strncmp(name, "host", 4)) /* SCSI host */
+                return false;
+        if (!strncmp(name, "target", 6)) /* SCSI target */
+                return false;
+        /* Still need to filter out "." and ".." */
+        return !! strchr(name, ':');
+}
 
-                        if (! parse_colon_list(s->d_name, &s_hctl)) {
-                                pr2serr("%s: parse failed\n", __func__);
-                                return 0;
-                        }
-                        if (((-1 == filter.h) || (s_hctl.h == filter.h)) &&
-                            ((-1 == filter.c) || (s_hctl.c == filter.c)) &&
-                            ((-1 == filter.t) || (s_hctl.t == filter.t)) &&
-                            ((UINT64_LAST == filter.l) ||
-                             (s_hctl.l == filter.l)))
-                                return 1;
-                        else
-                                return 0;
-                } else
-                        return 1;
+/* Returns true if the filter (if any) selects the SCSI device at 'hp' */
+static bool
+sdev_hctl_wanted(const struct addr_hctl * hp)
+{
+        if (! filter_active)
+                return true;
+        return ((-1 == filter.h) || (hp->h == filter.h)) &&
+               ((-1 == filter.c) || (hp->c == filter.c)) &&
+               ((-1 == filter.t) || (hp->t == filter.t)) &&
+               ((UINT64_LAST == filter.l) || (hp->l == filter.l));
+}
+
+static int
+sdev_dir_scan_select(const struct dirent * s)
+{
+        struct addr_hctl s_hctl;
+
+        if (! sdev_name_ok(s->d_name))
+                return 0;
+        if (filter_active) {
+                if (! parse_colon_list(s->d_name, &s_hctl)) {
+                        pr2serr("%s: parse failed\n", __func__);
+                        return 0;
+                }
+                return sdev_hctl_wanted(&s_hctl);
         }
-        /* Still need to filter out "." and ".." */
-        return 0;
+        return 1;
 }
 
 #if (HAVE_NVME && (! IGNORE_NVME))
@@ -4264,7 +7482,7 @@ get_major_minor(const char * fname, int * majp, int * minp,
 {
         struct stat a_stat;
 
-        if (stat(fname, &a_stat) >= 0) {
+        if (vfs_stat(fname, &a_stat) >= 0) {
                 if (S_ISBLK(a_stat.st_mode))
                         *d_typp = BLK_DEV;
                 else if (S_ISCHR(a_stat.st_mode))
@@ -4278,10 +7496,90 @@ get_major_minor(const char * fname, int * majp, int * minp,
         return false;
 }
 
+/* Reads the attributes of the NVMe controller whose sysfs directory is
+ * 'dir_name' into 'ctlp'. */
+static void
+nvme_ctl_init(struct nvme_ctl_t * ctlp, const char * dir_name,
+              const struct lsscsi_opts * op)
+{
+        int k;
+        const char * vp;
+        char b[LMAX_DEVPATH];
+        const char * names[] = {svp_s, sdp_s};
+        struct attr_set as;
+
+        ctlp->have_cntlid = false;
+        ctlp->cntlid = 0;
+        ctlp->pcie_ids[0] = '\0';
+        my_strcopy(ctlp->dir, dir_name, sizeof(ctlp->dir));
+        fetch_attrs(-1, dir_name, nvme_ctl_names, NCA_NUM, &ctlp->as);
+        for (k = NCA_MODEL; k <= NCA_FW_REV; ++k) {
+                /* the views are const to readers, the arena is ours */
+                if (ctlp->as.av[k].vp)
+                        ctlp->as.av[k].len = trim_lead_trail(
+                                        (char *)ctlp->as.av[k].vp, true, true);
+        }
+        if ((vp = ctlp->as.av[NCA_CNTLID].vp)) {
+                ctlp->have_cntlid = true;
+                if (1 != sscanf(vp, "%d", &ctlp->cntlid))
+                        ctlp->cntlid = 0;
+        }
+        vp = ctlp->as.av[NCA_TRANSPORT].vp;
+        if (op->transport_info && vp && (0 == strcmp(pcie_s, vp))) {
+                snprintf(b, sizeof(b), "%s/%s", dir_name, dvc_s);
+                fetch_attrs(-1, b, names, SG_ARRAY_SIZE(names), &as);
+                if (as.av[0].vp && as.av[1].vp)
+                        snprintf(ctlp->pcie_ids, sizeof(ctlp->pcie_ids),
+                                 "%s:%s", as.av[0].vp, as.av[1].vp);
+        }
+}
+
+/* Copies *src to *dst, with the views in dst->as pointing into its own
+ * arena */
+static void
+nvme_ctl_copy(struct nvme_ctl_t * dst, const struct nvme_ctl_t * src)
+{
+        int k;
+
+        memcpy(dst, src, sizeof(*dst));
+        for (k = 0; k < src->as.num; ++k) {
+                if (src->as.av[k].vp)
+                        dst->as.av[k].vp = dst->as.arena +
+                                           (src->as.av[k].vp - src->as.arena);
+        }
+}
+
+/* List one NVMe namespace (NS) with the fields given to --fields= */
+static void
+fields_ndev_entry(const struct nvme_ctl_t * ctlp, const char * nvme_ns_rel,
+                  struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+                  sgj_opaque_p jop)
+{
+        int cntlid;
+        const char * vp = ctlp->as.av[NCA_CNTLID].vp;
+        struct fld_ctx_t fc;
+
+        if (filter_active && (-1 != filter.t)) {
+                if (! (vp && (1 == sscanf(vp, "%d", &cntlid)) &&
+                       (cntlid == filter.t)))
+                        return;         /* doesn't meet filter condition */
+        }
+        memset(&fc, 0, sizeof(fc));
+        fc.nvme = true;
+        fc.devname = nvme_ns_rel;
+        fc.ctl_dir = ctlp->dir;
+        fc.ctl = ctlp;
+        fc.op = op;
+        fc.dcp = dcp;
+        snprintf(fc.dir, sizeof(fc.dir), "%s/%s", ctlp->dir, nvme_ns_rel);
+        fields_entry(&fc, jop);
+}
+
 /* List one NVMe namespace (NS) on a line. */
 static void
 one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
-               struct lsscsi_opts * op, sgj_opaque_p jop)
+               struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+               sgj_opaque_p jop)
 {
         bool as_json;
         bool has_alt_ns_rel = false;
@@ -4299,10 +7597,12 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
         char * cp;
         const char * ccp;
         const char * cposp;
+        const struct nvme_ctl_t * ctlp = dcp->nvme_ctl;
         sgj_state * jsp = &op->json_st;
         sgj_opaque_p jo2p = NULL;
+        struct nvme_ctl_t * ctl_alloc = NULL;
         char buff[LMAX_DEVPATH];
-        char value[LMAX_NAME];
+        char value[LMAX_NAME + 8];      /* room for pcie_s, pcie_ids */
         char dev_node[LMAX_NAME + 16] = "";
         char wd[LMAX_PATH];
         char devname[64];
@@ -4310,7 +7610,6 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
         char b[256];
         char bb[80];
         char d[80];
-        char e[80];
         char alt_ns_rel[196];
         char alt_ns_ng[120];
         const int bufflen = sizeof(buff);
@@ -4321,9 +7620,21 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
         static const int bblen = sizeof(bb);
         static const int devnlen = sizeof(dev_node);
         static const int dlen = sizeof(d);
-        static const int elen = sizeof(e);
 
         as_json = jsp->pr_as_json;
+        if (NULL == ctlp) {     /* not from list_ndevices() */
+                ctl_alloc = (struct nvme_ctl_t *)malloc(sizeof(*ctl_alloc));
+                if (NULL == ctl_alloc) {
+                        pr2serr("%s: out of memory\n", __func__);
+                        return;
+                }
+                nvme_ctl_init(ctl_alloc, nvme_ctl_abs, op);
+                ctlp = ctl_alloc;
+        }
+        if (op->num_fields > 0) {
+                fields_ndev_entry(ctlp, nvme_ns_rel, op, dcp, jop);
+                goto fini;
+        }
         b[0] = '\0';
         cposp = strrchr(nvme_ns_rel, 'c');
         if (cposp && (isdigit(*(cposp + 1)))) {
@@ -4369,14 +7680,14 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
                 pr2serr("%s: unable to find %s in %s\n", __func__,
                         "cdev_minor", nvme_ns_rel);
 
-        if (get_value(nvme_ctl_abs, cntlid_s, value, vlen)) {
-                if (1 != sscanf(value, "%d", &cntlid)) {
+        if ((ccp = ctlp->as.av[NCA_CNTLID].vp)) {
+                if (1 != sscanf(ccp, "%d", &cntlid)) {
                         if (vb)
                                 pr2serr("%s: trying to decode: %s as %s\n",
-                                        __func__, value, cntlid_s);
+                                        __func__, ccp, cntlid_s);
                 }
                 if (filter_active && (-1 != filter.t) && (cntlid != filter.t))
-                        return;         /* doesn't meet filter condition */
+                        goto fini;      /* doesn't meet filter condition */
         } else if (vb)
                 pr2serr("%s: unable to find %s under %s\n", __func__,
                         cntlid_s, nvme_ctl_abs);
@@ -4404,23 +7715,17 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
                 sgj_js_nv_s(jsp, jop, lsscsi_loc_s, value);
                 if (cntlid > 0)
                         sgj_js_nv_i(jsp, jop, cntlid_s, cntlid);
-                if (get_value(buff, nsid_s, b, blen))
+                if (dev_value(dcp, buff, nsid_s, b, blen))
                         sgj_js_nv_s(jsp, jop, nsid_s, b);
                 ccp = name_eq2value(buff, "uevent", "DEVTYPE", blen, b);
                 if (ccp)
                         sgj_js_nv_s(jsp, jop, "devtype", ccp);
-                if (get_value(nvme_ctl_abs, model_s, b, blen)) {
-                        trim_lead_trail(b, true, true);
-                        sgj_js_nv_s(jsp, jop, model_s, b);
-                }
-                if (get_value(nvme_ctl_abs, ser_s, b, blen)) {
-                        trim_lead_trail(b, true, true);
-                        sgj_js_nv_s(jsp, jop, ser_s, b);
-                }
-                if (get_value(nvme_ctl_abs, fr_s, b, blen)) {
-                        trim_lead_trail(b, true, true);
-                        sgj_js_nv_s(jsp, jop, fr_s, b);
-                }
+                if ((ccp = ctlp->as.av[NCA_MODEL].vp))
+                        sgj_js_nv_s(jsp, jop, model_s, ccp);
+                if ((ccp = ctlp->as.av[NCA_SERIAL].vp))
+                        sgj_js_nv_s(jsp, jop, ser_s, ccp);
+                if ((ccp = ctlp->as.av[NCA_FW_REV].vp))
+                        sgj_js_nv_s(jsp, jop, fr_s, ccp);
         }
 
         if ((int)strlen(value) >= devname_len) /* if long, append a space */
@@ -4439,16 +7744,12 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
 
         if (op->transport_info) {
                 value[0] = '\0';
-                if (get2_value(buff, dvc_s, trans_s, value, vlen)) {
-                        const char * bp = buff;
-                        static const char * dev2_s = "device/device";
-
+                if ((ccp = ctlp->as.av[NCA_TRANSPORT].vp)) {
+                        my_strcopy(value, ccp, vlen);
                         if (0 == strcmp(pcie_s, value)) {
-
-                                if (get2_value(bp, dev2_s, svp_s, d, dlen) &&
-                                    get2_value(bp, dev2_s, sdp_s, e, elen)) {
-                                        snprintf(value , vlen, "%s %s:%s",
-                                                 pcie_s, d, e);
+                                if (ctlp->pcie_ids[0]) {
+                                        snprintf(value , vlen, "%s %s",
+                                                 pcie_s, ctlp->pcie_ids);
                                         q += sg_scn3pr(b, blen, q, "%-*s  ",
                                                        model_len, value);
                                 } else
@@ -4464,7 +7765,7 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
                 if (as_json && value[0])
                         sgj_js_nv_s(jsp, jop, trans_s, value);
         } else if (op->unit) {
-                if (get_value(buff, wwid_s, value, vlen)) {
+                if (dev_value(dcp, buff, wwid_s, value, vlen)) {
                         if ((op->unit < 4) &&
                             (0 == strncmp("eui.", value, 4))) {
                                 q += sg_scn3pr(b, blen, q, "%-*s  ",
@@ -4479,8 +7780,10 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
                         q += sg_scn3pr(b, blen, q, "%-*s?  ", model_len,
                                        wwid_s);
         } else if (! op->brief) {
-                if (! get_value(nvme_ctl_abs, model_s, ctl_model,
-                                sizeof(ctl_model)))
+                if (ctlp->as.av[NCA_MODEL].vp)
+                        my_strcopy(ctl_model, ctlp->as.av[NCA_MODEL].vp,
+                                   sizeof(ctl_model));
+                else
                         snprintf(ctl_model, sizeof(ctl_model), "-    ");
                 n = trim_lead_trail(ctl_model, true, true);
                 snprintf(d, dlen, "__%u", nsid);
@@ -4493,7 +7796,7 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
         }
 
         if (op->wwn) {
-                if (get_value(buff, wwid_s, value, vlen)) {
+                if (dev_value(dcp, buff, wwid_s, value, vlen)) {
                         q += sg_scn3pr(b, blen, q, "%-*s  ", model_len,
                                        value);
                         if (as_json)
@@ -4512,6 +7815,7 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
                 if (as_json)
                         sgj_js_nv_s(jsp, jop, dev_node_s, dev_node);
         } else if (get_dev_node(buff, dev_node, BLK_DEV)) {
+                dev_part_note(dcp, dev_node_s, dev_node);
                 if (as_json)
                         sgj_js_nv_s(jsp, jop, dev_node_s, dev_node);
 
@@ -4525,19 +7829,20 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
                         snprintf(value, vlen, "%d:%d", alt_maj, alt_min);
                         q += sg_scn3pr(b, blen, q, " [%s]", value);
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, dv_s, value);
-                } else if (get_value(buff, dv_s, value, vlen)) {
+                                js_maj_min(jsp, jop, dv_s, value);
+                } else if (dev_value(dcp, buff, dv_s, value, vlen)) {
                         q += sg_scn3pr(b, blen, q, " [%s]", value);
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, dv_s, value);
+                                js_maj_min(jsp, jop, dv_s, value);
                 } else
                         q += sg_scn3pr(b, blen, q, " [dev?]");
         }
         if (op->generic && has_alt_ns_rel)
                 q += sg_scn3pr(b, blen, q, "  %-9s", alt_ns_ng);
-        else if (op->generic && (1 == ng_scan(nvme_ctl_abs))) {
+        else if (op->generic &&
+                 (1 == ng_ns_scan(nvme_ctl_abs, nvme_ns_rel, dcp))) {
                 /* found a <nvme_ctl_abs>/ng* 'nvme-generic' device */
-                const char * ngp = aa_ng.name;
+                const char * ngp = dcp->aa_ng.name;
 
                 sg_scnpr(dev_node, devnlen, "%s/%s", nvme_ctl_abs, ngp);
                 // if (get2_value(nvme_ctl_abs, ngp, dv_s, e, elen)) {
@@ -4560,15 +7865,14 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
                 uint64_t blk512s;
                 int64_t num_by = 0;
 
-                if (! get_value(buff, "size", value, vlen)) {
+                if (! dev_value(dcp, buff, "size", value, vlen)) {
                         sg_scn3pr(b, blen, q, "  %6s", "-");
                         goto fini_line;
                 }
                 blk512s = atoll(value);
                 num_by = blk512s * 512;
                 if (as_json) {
-                        sgj_js_nv_s_nex(jsp, jop, "size", value,
-                                        "[unit: 512 bytes]");
+                        js_size512(jsp, jop, value);
                         jo2p = sgj_named_subobject_r(jsp, jop, "size_decomp");
                         sgj_js_nv_ihex_nex(jsp, jo2p, "blocks_512",
                                            blk512s, true,
@@ -4625,38 +7929,77 @@ one_ndev_entry(const char * nvme_ctl_abs, const char * nvme_ns_rel,
 fini_line:
         sgj_pr_hr(jsp, "%s\n", b);
         if (op->long_opt > 0)
-                longer_nd_entry(buff, devname, op, jop);
+                longer_nd_entry(buff, devname, op, dcp, jop);
         if (vb > 0) {
                 q = 0;
                 q += sg_scn3pr(b, blen, q, "  dir: %s  [", buff);
-                if (if_directory_chdir(buff, "")) {
-                        if (NULL == getcwd(wd, sizeof(wd)))
-                                sg_scn3pr(b, blen, q, "?");
-                        else
-                                sg_scn3pr(b, blen, q, "%s", wd);
-                }
+                if (if_directory_canon(buff, "", wd, sizeof(wd)))
+                        sg_scn3pr(b, blen, q, "%s", wd);
                 sgj_pr_hr(jsp, "%s]\n", b);
         }
+fini:
+        free(ctl_alloc);
+}
+
+/* Returns true if the filter (if any) selects the NVMe controller whose
+ * char device minor is 'cdev_minor' */
+static bool
+nctl_wanted(int cdev_minor)
+{
+        if (! filter_active)
+                return true;
+        return ((-1 == filter.h) || (NVME_HOST_NUM == filter.h)) &&
+               ((-1 == filter.c) || (cdev_minor == filter.c));
+}
+
+/* As nctl_wanted() for namespace 'nsid' of that controller. The filter's
+ * cntlid (.t) is applied by the caller. */
+static bool
+ndev_wanted(int cdev_minor, uint64_t nsid)
+{
+        if (! nctl_wanted(cdev_minor))
+                return false;
+        return (! filter_active) || (UINT64_LAST == filter.l) ||
+               (nsid == filter.l);
+}
+
+/* Returns true if 'name' (in /sys/class/nvme) is that of a controller */
+static bool
+nctl_name_ok(const char * name)
+{
+        int cdev_minor; /* /dev/nvme<n> char device minor */
+
+        return (0 == strncmp(name, "nvme", 4)) &&
+               (1 == sscanf(name + 4, "%d", &cdev_minor));
+}
+
+/* Returns true if 'name' (in a controller's directory) is that of a
+ * namespace, placing its controller's minor in *cminp and its id in
+ * *nsidp */
+static bool
+ndev_name_ok(const char * name, int * cminp, uint32_t * nsidp)
+{
+        const char * cp;
+
+        /* What to do about NVMe controller CNTLID field? */
+        if (strncmp(name, "nvme", 4))
+                return false;
+        cp = strchr(name + 4, 'n');
+        if (NULL == cp)
+                return false;
+        return (1 == sscanf(name + 4, "%d", cminp)) &&
+               (1 == sscanf(cp + 1, "%u", nsidp));
 }
 
 static int
 ndev_dir_scan_select(const struct dirent * s)
 {
-        int cdev_minor; /* /dev/nvme<n> char device minor */
+        int cdev_minor;
 
-        if ((0 == strncmp(s->d_name, "nvme", 4)) &&
-            (1 == sscanf(s->d_name + 4, "%d", &cdev_minor))) {
-                if (filter_active) {
-                        if (((-1 == filter.h) ||
-                             (NVME_HOST_NUM == filter.h)) &&
-                            ((-1 == filter.c) || (cdev_minor == filter.c)))
-                                return 1;
-                        else
-                                return 0;
-                } else
-                        return 1;
-        }
-        return 0;
+        return nctl_name_ok(s->d_name) &&
+               ((! filter_active) ||
+                ((1 == sscanf(s->d_name + 4, "%d", &cdev_minor)) &&
+                 nctl_wanted(cdev_minor)));
 }
 
 static int
@@ -4664,33 +8007,9 @@ ndev_dir_scan_select2(const struct dirent * s)
 {
         int cdev_minor;
         uint32_t nsid;
-        char * cp;
 
-        /* What to do about NVMe controller CNTLID field? */
-        if (strncmp(s->d_name, "nvme", 4))
-                return 0;
-#ifdef __cplusplus
-        cp = strchr((char *)s->d_name + 4, 'n');
-#else
-        cp = strchr(s->d_name + 4, 'n');
-#endif
-        if (NULL == cp)
-                return 0;
-        if ((1 == sscanf(s->d_name + 4, "%d", &cdev_minor)) &&
-            (1 == sscanf(cp + 1, "%u", &nsid))) {
-                if (filter_active) {    /* filter cntlid (.t) in caller */
-                        if (((-1 == filter.h) ||
-                             (NVME_HOST_NUM == filter.h)) &&
-                            ((-1 == filter.c) || (cdev_minor == filter.c)) &&
-                      /*    ((-1 == filter.t) || (s_hctl.t == filter.t)) && */
-                            ((UINT64_LAST == filter.l) || (nsid == filter.l)))
-                                return 1;
-                        else
-                                return 0;
-                } else
-                        return 1;
-        }
-        return 0;
+        return ndev_name_ok(s->d_name, &cdev_minor, &nsid) &&
+               ndev_wanted(cdev_minor, nsid);
 }
 
 static void
@@ -4763,7 +8082,7 @@ one_nhost_entry(const char * dir_name, const char * nvme_ctl_rel,
 
                         sg_scn3pr(value, vlen, 0, "%s:%s", bp, b2p);
                         if (as_json)
-                                sgj_js_nv_s(jsp, jop, dv_s, value);
+                                js_maj_min(jsp, jop, dv_s, value);
                         n += sg_scn3pr(a, alen, n, " [%s]", value);
                 } else
                         n += sg_scn3pr(a, alen, n, " [dev?]");
@@ -4910,804 +8229,5012 @@ one_nhost_entry(const char * dir_name, const char * nvme_ctl_rel,
                 sgj_pr_hr(jsp, "%s\n", a);
         if (vb > 0) {
                 n = sg_scn3pr(a, alen, 0, "  dir: %s\n  device dir: ", buff);
-                if (if_directory_chdir(buff, dvc_s)) {
-                        if (NULL == getcwd(wd, sizeof(wd)))
-                                sg_scn3pr(a, alen, n, "?");
-                        else
-                                sg_scn3pr(a, alen, n, "%s", wd);
-                }
+                if (if_directory_canon(buff, dvc_s, wd, sizeof(wd)))
+                        sg_scn3pr(a, alen, n, "%s", wd);
                 sgj_pr_hr(jsp, "%s\n", a);
         }
 }
 
 #endif          /* (HAVE_NVME && (! IGNORE_NVME)) */
 
-/* This is a compare function for numeric sort based on hctl tuple.
- * Returns -1 if (a->d_name < b->d_name) ; 0 if they are equal
- * and 1 otherwise. */
+/* Kinds of node in the topology, see struct topo_t */
+enum topo_kind {
+        TK_SHOST = 0,           /* SCSI host, e.g. "host2" */
+        TK_TARGET,              /* SCSI target, e.g. "target2:0:1" */
+        TK_SDEV,                /* SCSI device (LU), e.g. "2:0:1:0" */
+        TK_NCTL,                /* NVMe controller, e.g. "nvme0" */
+        TK_NDEV,                /* NVMe namespace, e.g. "nvme0n1" */
+        TK_NUM
+};
+
+/* A host, target, LU, NVMe controller or namespace. Its address is parsed
+ * from its name once, when it is found, and is its sort key: a SCSI host
+ * has only 'h' valid (-1 if its name has no number) and a target 'h', 'c'
+ * and 't'. The children of a node (the targets of a host, the LUs of a
+ * target, the namespaces of a controller) are contiguous in the array of
+ * their kind. */
+struct topo_node {
+        bool addr_ok;           /* false if the name did not parse */
+        int parent;             /* index in the parent's array, or -1 */
+        int first_child;
+        int num_children;
+        int err;                /* errno if its directory can't be read */
+        unsigned int name_off;  /* in topo.pool */
+        struct addr_hctl hctl;
+};
+
+#define TOPO_SHOST 0x1          /* SCSI hosts */
+#define TOPO_SDEV 0x2           /* SCSI targets and LUs, and their hosts */
+#define TOPO_NVME 0x4           /* controllers and namespaces */
+
+/* What is attached, as found by one pass over /sys/class/scsi_host,
+ * /sys/bus/scsi/devices and /sys/class/nvme (and each controller below
+ * it). Each kind is sorted by address so hosts and targets are found by
+ * number with a binary search (see topo_find()). Every listing but
+ * --sas-tree (which starts from /sys/class/sas_host) walks this rather
+ * than scanning and sorting those directories itself. Built on
+ * the calling thread by topo_get(), each part when first needed, and kept
+ * until free_topo(). The children of hosts are only known once the LUs
+ * are. */
+static struct topo_t {
+        int parts;              /* TOPO_SHOST and so on, those built */
+        int dir_err[TK_NUM];    /* errno if the directory holding a kind
+                                 * (hosts, LUs or controllers) can't be
+                                 * read */
+        int num[TK_NUM];
+        int max_num[TK_NUM];
+        struct topo_node * nodes[TK_NUM];
+        struct str_pool pool;
+} topo;
+
+/* Used by topo_scan() to pass its arguments to the select function */
+struct topo_scan_t {
+        enum topo_kind kind;
+        int parent;
+        bool oom;
+};
+
+static const char *
+topo_name(const struct topo_node * np)
+{
+        return topo.pool.p + np->name_off;
+}
+
 static int
-sdev_scandir_sort(const struct dirent ** a, const struct dirent ** b)
+topo_node_cmp(const void * a, const void * b)
 {
-        const char * lnam = (*a)->d_name;
-        const char * rnam = (*b)->d_name;
-        struct addr_hctl left_hctl;
-        struct addr_hctl right_hctl;
+        return cmp_hctl(&((const struct topo_node *)a)->hctl,
+                        &((const struct topo_node *)b)->hctl);
+}
+
+/* Returns the index of the node of 'kind' whose address is 'hp' (as
+ * struct topo_node has it), or -1 if none */
+static int
+topo_find(enum topo_kind kind, const struct addr_hctl * hp)
+{
+        struct topo_node key;
+        const struct topo_node * np;
 
-        if (! parse_colon_list(lnam, &left_hctl)) {
-                pr2serr("%s: left parse failed: %.20s\n", __func__,
-                        (lnam ? lnam : "<null>"));
+        if (0 == topo.num[kind])
                 return -1;
-        }
-        if (! parse_colon_list(rnam, &right_hctl)) {
-                pr2serr("%s: right parse failed: %.20s\n", __func__,
-                        (rnam ? rnam : "<null>"));
-                return 1;
-        }
-        return cmp_hctl(&left_hctl, &right_hctl);
+        key.hctl = *hp;
+        np = (const struct topo_node *)bsearch(&key, topo.nodes[kind],
+                                               topo.num[kind], sizeof(key),
+                                               topo_node_cmp);
+        return np ? (int)(np - topo.nodes[kind]) : -1;
 }
 
-#if (HAVE_NVME && (! IGNORE_NVME))
+/* Appends a node of 'kind' named 'name' to topo. Returns NULL if out of
+ * memory. */
+static struct topo_node *
+topo_add(enum topo_kind kind, const char * name)
+{
+        int n;
+        struct topo_node * np;
+
+        if (topo.num[kind] >= topo.max_num[kind]) {
+                n = topo.max_num[kind] ? (2 * topo.max_num[kind]) : 16;
+                np = (struct topo_node *)realloc(topo.nodes[kind],
+                                                 n * sizeof(*np));
+                if (NULL == np)
+                        return NULL;
+                topo.nodes[kind] = np;
+                topo.max_num[kind] = n;
+        }
+        np = topo.nodes[kind] + topo.num[kind];
+        memset(np, 0, sizeof(*np));
+        if (! str_pool_add(&topo.pool, name, &np->name_off))
+                return NULL;
+        np->parent = -1;
+        ++topo.num[kind];
+        return np;
+}
 
-/* This is a compare function for numeric sort based on hctl tuple. Similar
- * to sdev_scandir_sort() but converts entries like "nvme2" into a hctl tuple.
- * Returns -1 if (a->d_name < b->d_name) ; 0 if they are equal
- * and 1 otherwise. */
 static int
-nhost_scandir_sort(const struct dirent ** a, const struct dirent ** b)
+topo_dir_scan_select(const struct dirent * s, void * ctx)
 {
-        const char * lnam = (*a)->d_name;
-        const char * rnam = (*b)->d_name;
-        struct addr_hctl left_hctl;
-        struct addr_hctl right_hctl;
+        int h;
+        struct topo_scan_t * tsp = (struct topo_scan_t *)ctx;
+        struct topo_node * np;
+#if (HAVE_NVME && (! IGNORE_NVME))
+        int cdev_minor;
+        uint32_t nsid;
+#endif
 
-        if (strchr(lnam, ':')) {
-                if (! parse_colon_list(lnam, &left_hctl)) {
-                        pr2serr("%s: left parse failed: %.20s\n", __func__,
-                                (lnam ? lnam : "<null>"));
-                        return -1;
-                }
-        } else {
-                if (1 == sscanf(lnam, "nvme%d", &left_hctl.c)) {
-                        left_hctl.h = NVME_HOST_NUM;
-                        left_hctl.t = 0;
-                        left_hctl.l = 0;
-                } else {
-                        pr2serr("%s: left sscanf failed: %.20s\n", __func__,
-                                (lnam ? lnam : "<null>"));
-                        return -1;
-                }
+        if (tsp->oom)
+                return 0;
+        switch (tsp->kind) {
+        case TK_SHOST:
+                if (strncmp("host", s->d_name, 4))
+                        return 0;
+                break;
+        case TK_SDEV:
+                if (! sdev_name_ok(s->d_name))
+                        return 0;
+                break;
+#if (HAVE_NVME && (! IGNORE_NVME))
+        case TK_NCTL:
+                if (! nctl_name_ok(s->d_name))
+                        return 0;
+                break;
+        case TK_NDEV:
+                if (! ndev_name_ok(s->d_name, &cdev_minor, &nsid))
+                        return 0;
+                break;
+#endif
+        default:
+                return 0;
         }
-        if (strchr(rnam, ':')) {
-                if (! parse_colon_list(rnam, &right_hctl)) {
-                        pr2serr("%s: right parse failed: %.20s\n", __func__,
-                                (rnam ? rnam : "<null>"));
-                        return 1;
-                }
+        np = topo_add(tsp->kind, s->d_name);
+        if (NULL == np) {
+                tsp->oom = true;
+                return 0;
+        }
+        np->parent = tsp->parent;
+        if (TK_SHOST == tsp->kind) {
+                invalidate_hctl(&np->hctl);
+                np->addr_ok = (1 == sscanf(s->d_name + 4, "%d", &h));
+                if (np->addr_ok)
+                        np->hctl.h = h;
         } else {
-                if (1 == sscanf(rnam, "nvme%d", &right_hctl.c)) {
-                        right_hctl.h = NVME_HOST_NUM;
-                        right_hctl.t = 0;
-                        right_hctl.l = 0;
-                } else {
-                        pr2serr("%s: right sscanf failed: %.20s\n", __func__,
-                                (rnam ? rnam : "<null>"));
-                        return -1;
+                np->addr_ok = parse_colon_list(s->d_name, &np->hctl);
+                if ((! np->addr_ok) && (TK_SDEV == tsp->kind))
+                        pr2serr("%s: parse failed: %.20s\n", __func__,
+                                s->d_name);
+        }
+        return 0;       /* nothing for scandir_ctx() to copy */
+}
+
+/* Adds the nodes of 'kind' in 'dir_name' to topo, sorted, with 'parent'
+ * as their parent. Returns 0 or an errno value. */
+static int
+topo_scan(enum topo_kind kind, const char * dir_name, int parent)
+{
+        int first = topo.num[kind];
+        struct topo_scan_t ts;
+
+        ts.kind = kind;
+        ts.parent = parent;
+        ts.oom = false;
+        if (scandir_ctx(AT_FDCWD, dir_name, NULL, topo_dir_scan_select,
+                        &ts) < 0)
+                return errno ? errno : EIO;
+        if (ts.oom) {
+                pr2serr("%s: out of memory\n", __func__);
+                topo.num[kind] = first;
+                return ENOMEM;
+        }
+        qsort(topo.nodes[kind] + first, topo.num[kind] - first,
+              sizeof(struct topo_node), topo_node_cmp);
+        return 0;
+}
+
+/* Finds the SCSI LUs (after the hosts), then makes a target for each run
+ * of LUs with the same h:c:t, placed below its host */
+static void
+topo_build_sdevs(void)
+{
+        int k, t_idx;
+        struct topo_node * np;
+        struct topo_node * tnp = NULL;
+        struct addr_hctl hctl;
+        char b[LMAX_DEVPATH];
+
+        snprintf(b, sizeof(b), "%s%s", sysfsroot, bus_scsi_dev_s);
+        topo.dir_err[TK_SDEV] = topo_scan(TK_SDEV, b, -1);
+
+        for (k = 0; k < topo.num[TK_SDEV]; ++k) {
+                np = topo.nodes[TK_SDEV] + k;
+                if (! np->addr_ok)
+                        continue;
+                if ((NULL == tnp) || (np->hctl.h != tnp->hctl.h) ||
+                    (np->hctl.c != tnp->hctl.c) ||
+                    (np->hctl.t != tnp->hctl.t)) {
+                        snprintf(b, sizeof(b), "target%d:%d:%d", np->hctl.h,
+                                 np->hctl.c, np->hctl.t);
+                        if (NULL == (tnp = topo_add(TK_TARGET, b)))
+                                break;
+                        tnp->addr_ok = true;
+                        tnp->hctl = np->hctl;
+                        tnp->hctl.l = 0;
+                        memset(tnp->hctl.lun_arr, 0,
+                               sizeof(tnp->hctl.lun_arr));
+                        tnp->first_child = k;
+                        invalidate_hctl(&hctl);
+                        hctl.h = np->hctl.h;
+                        tnp->parent = topo_find(TK_SHOST, &hctl);
                 }
+                np->parent = topo.num[TK_TARGET] - 1;
+                ++tnp->num_children;
+        }
+        for (t_idx = 0; t_idx < topo.num[TK_TARGET]; ++t_idx) {
+                tnp = topo.nodes[TK_TARGET] + t_idx;
+                if (tnp->parent < 0)
+                        continue;
+                np = topo.nodes[TK_SHOST] + tnp->parent;
+                if (0 == np->num_children++)
+                        np->first_child = t_idx;
+        }
+}
+
+#if (HAVE_NVME && (! IGNORE_NVME))
+
+/* Finds the NVMe controllers, then the namespaces of each */
+static void
+topo_build_nvme(void)
+{
+        int k, n;
+        struct topo_node * np;
+        char b[LMAX_DEVPATH];
+        char cdir[LMAX_DEVPATH];
+
+        n = sg_scn3pr(b, sizeof(b), 0, "%s", sysfsroot);
+        sg_scn3pr(b, sizeof(b), n, "%s", class_nvme);
+        topo.dir_err[TK_NCTL] = topo_scan(TK_NCTL, b, -1);
+        for (k = 0; k < topo.num[TK_NCTL]; ++k) {
+                np = topo.nodes[TK_NCTL] + k;
+                snprintf(cdir, sizeof(cdir), "%s%s", b, topo_name(np));
+                np->first_child = topo.num[TK_NDEV];
+                np->err = topo_scan(TK_NDEV, cdir, k);
+                np->num_children = topo.num[TK_NDEV] - np->first_child;
+        }
+}
+
+#endif          /* (HAVE_NVME && (! IGNORE_NVME)) */
+
+/* Returns topo with 'parts' (TOPO_SHOST, TOPO_SDEV and TOPO_NVME OR-ed
+ * together) built */
+static const struct topo_t *
+topo_get(int parts)
+{
+        struct stats_mark sm;
+        char b[LMAX_DEVPATH];
+
+        if (TOPO_SDEV & parts)
+                parts |= TOPO_SHOST;
+        if (parts == (topo.parts & parts))
+                return &topo;
+        stats_begin(&sm, false);
+        if ((TOPO_SHOST & parts) && (! (TOPO_SHOST & topo.parts))) {
+                snprintf(b, sizeof(b), "%s%s", sysfsroot, scsi_host_s);
+                topo.dir_err[TK_SHOST] = topo_scan(TK_SHOST, b, -1);
+        }
+        if ((TOPO_SDEV & parts) && (! (TOPO_SDEV & topo.parts)))
+                topo_build_sdevs();
+#if (HAVE_NVME && (! IGNORE_NVME))
+        if ((TOPO_NVME & parts) && (! (TOPO_NVME & topo.parts)))
+                topo_build_nvme();
+#endif
+        topo.parts |= parts;
+        stats_end(STP_TOPOLOGY, &sm, false);
+        return &topo;
+}
+
+/* Free topo. */
+static void
+free_topo(void)
+{
+        int k;
+
+        if (dev_tasks_stray())
+                return;
+        for (k = 0; k < TK_NUM; ++k)
+                free(topo.nodes[k]);
+        free(topo.pool.p);
+        memset(&topo, 0, sizeof(topo));
+}
+
+/* Readies 'dcp' for the next device whose sysfs directory is in the one
+ * open on 'parent_fd' (-1 if none). */
+static void
+dev_ctx_init(struct dev_ctx_t * dcp, int parent_fd)
+{
+        memset(dcp, 0, sizeof(*dcp));
+        dcp->transport_id = TRANSPORT_UNKNOWN;
+        dcp->parent_fd = parent_fd;
+        dcp->dev_fd = -1;
+}
+
+/* Kinds of device list given to run_dev_jobs(); each has its own --cache
+ * file. */
+enum dev_list_kind {
+        DLIST_SDEV = 0,         /* SCSI devices (LUs) */
+        DLIST_NDEV,             /* NVMe namespaces */
+        DLIST_SHOST,            /* SCSI hosts */
+};
+
+static const char * const dlist_cache_names[] = {
+        "scsi_devices", "nvme_devices", "scsi_hosts",
+};
+
+/* What a --cache record is checked against; any difference means the
+ * device is walked again. The volatile attributes (e.g. state, queue_depth
+ * and link rates) are read every time and only their hash is kept. */
+struct cache_stamp {
+        uint64_t ino;           /* of the device's sysfs directory */
+        uint64_t mtime_ns;
+        uint64_t ctime_ns;
+        uint64_t dev_hash;      /* names and major:minor of its dev nodes */
+        uint64_t vol_hash;      /* volatile attribute values */
+};
+
+/* One record from a --cache file; the pointers are into dev_cache::img */
+struct cache_rec {
+        const char * key;       /* e.g. "2:0:1:0", "nvme0n1" or "host2" */
+        struct cache_stamp st;
+        const char * hr_bp;
+        uint32_t hr_len;
+        const uint8_t * js_bp;
+        uint32_t js_len;
+};
+
+/* One SCSI device or NVMe namespace to be listed, possibly by a --jobs=N
+ * worker thread. Its plain text output is collected in hr_bp so that it
+ * can be emitted in scandir() order after all jobs are finished. */
+struct dev_job_t {
+        int dir_fd;             /* open on dir_name, or -1 */
+        bool cst_ok;            /* cst is valid (only with --cache) */
+        const char * dir_name;
+        const char * name;
+#if (HAVE_NVME && (! IGNORE_NVME))
+        const struct nvme_ctl_t * nvme_ctl;     /* set for namespaces */
+#endif
+        const struct addr_hctl * hctlp; /* set for SCSI devices */
+        sgj_opaque_p jop;
+        char * hr_bp;
+        size_t hr_len;
+        char * js_bp;           /* jop packed for the --cache */
+        size_t js_len;
+        struct cache_stamp cst;
+        const struct cache_rec * crp;   /* --cache hit, else NULL */
+        uint64_t ns;            /* time taken, for --stats */
+        struct io_counts io;    /* work done, for --stats */
+        struct attr_memo * pre;         /* see dev_jobs_prefetch() */
+        const char * const * pre_names;
+        struct dev_part * part;         /* see struct dev_task_t */
+};
+
+typedef void (* dev_job_fn) (const char * dir_name, const char * name,
+                             struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+                             sgj_opaque_p jop);
+
+struct dev_pool_t {
+        pthread_mutex_t mtx;
+        int next;               /* index of next job to hand out */
+        int num;
+        struct dev_job_t * jobs;
+        const struct lsscsi_opts * op;
+        sgj_state * jsp;        /* makes each job's object, if JSON */
+        dev_job_fn fn;
+};
+
+/* Calls fn() for one job, timing it and counting its work for --stats */
+static void
+dev_job_call(struct dev_job_t * jp, dev_job_fn fn, struct lsscsi_opts * op,
+             struct dev_ctx_t * dcp)
+{
+        struct stats_mark sm;
+
+        stats_begin(&sm, false);
+#if (HAVE_NVME && (! IGNORE_NVME))
+        dcp->nvme_ctl = jp->nvme_ctl;
+#endif
+        dcp->hctlp = jp->hctlp;
+        dcp->pre = jp->pre;
+        dcp->pre_names = jp->pre_names;
+        dcp->part = jp->part;
+        fn(jp->dir_name, jp->name, op, dcp, jp->jop);
+        if (stats.on) {
+                jp->ns = stats_now_ns() - sm.ns;
+                io_snap(&jp->io, false);
+                io_add(&jp->io, &sm.io, true);
+        }
+}
+
+/* Calls fn() for one job with its plain text output collected in
+ * jp->hr_bp rather than sent to stdout. When the result is to go in the
+ * --cache, its JSON object is packed now since a streaming JSON backend
+ * frees it once it has been output. */
+static void
+dev_job_run(struct dev_job_t * jp, dev_job_fn fn,
+            const struct lsscsi_opts * op)
+{
+        bool ok;
+        FILE * fp;
+        struct lsscsi_opts opts;  /* private copy, each has its own sink */
+        struct dev_ctx_t dc;
+
+        memcpy(&opts, op, sizeof(opts));
+        dev_ctx_init(&dc, jp->dir_fd);
+        /* if sgj_sink_begin() fails, output goes straight to stdout which
+         * may lose the ordering but not the information */
+        sgj_sink_begin(&opts.json_st, -1);
+        dev_job_call(jp, fn, &opts, &dc);
+        jp->hr_bp = sgj_sink_take(&opts.json_st, &jp->hr_len);
+        sgj_sink_end(&opts.json_st);
+        if ((! jp->cst_ok) || (NULL == jp->jop))
+                return;
+        fp = open_memstream(&jp->js_bp, &jp->js_len);
+        if (NULL == fp) {
+                jp->cst_ok = false;     /* so not saved in the --cache */
+                return;
+        }
+        ok = sgj_pack(jp->jop, fp);
+        if (fclose(fp) || (! ok))
+                jp->cst_ok = false;
+}
+
+static void *
+dev_pool_worker(void * arg)
+{
+        struct dev_pool_t * pp = (struct dev_pool_t *)arg;
+        struct dev_job_t * jp;
+
+        while (true) {
+                pthread_mutex_lock(&pp->mtx);
+                jp = (pp->next < pp->num) ? (pp->jobs + pp->next++) : NULL;
+                pthread_mutex_unlock(&pp->mtx);
+                if (NULL == jp)
+                        break;
+                if (jp->crp)            /* taken from --cache */
+                        continue;
+                /* made by this thread so that a worker's values come from
+                 * the heap, not the unlocked arena of the calling thread */
+                jp->jop = sgj_new_unattached_object_r(pp->jsp);
+                dev_job_run(jp, pp->fn, pp->op);
+        }
+        return NULL;
+}
+
+/* Start routine of the threads other than the caller of run_dev_jobs() */
+static void *
+dev_pool_thread(void * arg)
+{
+        struct io_counts ic;
+
+        dev_pool_worker(arg);
+        if (stats.on) {
+                io_snap(&ic, false);
+                pthread_mutex_lock(&stats.mtx);
+                io_add(&stats.io_pooled, &ic, false);
+                pthread_mutex_unlock(&stats.mtx);
+        }
+        return NULL;
+}
+
+#define CACHE_MAGIC "lsscsi cache 1\n"  /* change when the layout changes */
+#define CACHE_MAX_FILE_SZ (64 * 1024 * 1024)
+#define CACHE_HASH_INIT 14695981039346656037ULL        /* FNV-1a, 64 bit */
+
+struct dev_cache {
+        char * img;             /* the file as read */
+        int num;
+        int hint;               /* where the next cache_find() starts */
+        struct cache_rec * recs;
+        char path[LMAX_PATH];
+        char sig[LMAX_PATH];    /* options that shape the output */
+        char world[128];        /* state outside sysfs, e.g. /dev */
+};
+
+static uint64_t
+cache_hash(uint64_t h, const void * p, size_t len)
+{
+        const uint8_t * bp = (const uint8_t *)p;
+
+        for ( ; len > 0; --len, ++bp)
+                h = (h ^ *bp) * 1099511628211ULL;
+        return (h ^ 0xff) * 1099511628211ULL;   /* end of field marker */
+}
+
+/* Mixes the attributes found in 'asp' (and which were not found) into h */
+static uint64_t
+cache_hash_attrs(uint64_t h, const struct attr_set * asp)
+{
+        int k;
+
+        for (k = 0; k < asp->num; ++k)
+                h = asp->av[k].vp ? cache_hash(h, asp->av[k].vp,
+                                               asp->av[k].len) :
+                                    cache_hash(h, "?", 1);
+        return h;
+}
+
+/* Mixes into 'h' the name and 'attr' value of each entry in the directory
+ * 'rel' (e.g. "block") of the directory open on 'dir_fd'. If 'attr2' is
+ * not NULL that attribute of each entry is added too. */
+static uint64_t
+cache_hash_subdir(uint64_t h, int dir_fd, const char * rel,
+                  const char * attr, const char * attr2)
+{
+        int fd;
+        DIR * dirp;
+        struct dirent * dep;
+        char b[LMAX_DEVPATH];
+        char value[LMAX_NAME];
+
+        fd = opendir_fd(dir_fd, rel);
+        if (fd < 0)
+                return h;
+        dirp = fdopendir(fd);
+        if (NULL == dirp) {
+                close(fd);
+                return h;
+        }
+        ++tl_io.dirs;
+        h = cache_hash(h, rel, strlen(rel));
+        while ((dep = readdir(dirp))) {
+                if ('.' == dep->d_name[0])
+                        continue;
+                h = cache_hash(h, dep->d_name, strlen(dep->d_name));
+                snprintf(b, sizeof(b), "%s/%s", dep->d_name, attr);
+                if (get_value_at(fd, b, value, sizeof(value)))
+                        h = cache_hash(h, value, strlen(value));
+                if (NULL == attr2)
+                        continue;
+                snprintf(b, sizeof(b), "%s/%s", dep->d_name, attr2);
+                if (get_value_at(fd, b, value, sizeof(value)))
+                        h = cache_hash(h, value, strlen(value));
+        }
+        closedir(dirp);         /* also closes fd */
+        return h;
+}
+
+/* Mixes the volatile parts of a SCSI host's transport into 'h': the link
+ * rates and error counts of SAS phys and the FC port state and speed. The
+ * host's directory is open on 'dir_fd'. */
+static uint64_t
+cache_hash_host_transport(uint64_t h, int dir_fd, const char * hname)
+{
+        int fd, p_fd, n;
+        DIR * dirp;
+        struct dirent * dep;
+        struct attr_set as;
+        char b[LMAX_DEVPATH];
+        const char * phy_names[] = {neg_lr_s,
+                "invalid_dword_count", "loss_of_dword_sync_count",
+                "phy_reset_problem_count", "running_disparity_error_count"};
+        const char * fc_names[] = {pts_s, "speed"};
+
+        snprintf(b, sizeof(b), "%s/%s/%s", dvc_s, fc_h_s, hname);
+        fd = opendir_fd(dir_fd, b);
+        if (fd >= 0) {
+                fetch_attrs(fd, NULL, fc_names, SG_ARRAY_SIZE(fc_names), &as);
+                h = cache_hash_attrs(h, &as);
+                close(fd);
+        }
+        fd = opendir_fd(dir_fd, dvc_s);
+        if (fd < 0)
+                return h;
+        dirp = fdopendir(fd);
+        if (NULL == dirp) {
+                close(fd);
+                return h;
+        }
+        ++tl_io.dirs;
+        while ((dep = readdir(dirp))) {
+                if (strncmp(dep->d_name, "phy-", 4))
+                        continue;
+                n = snprintf(b, sizeof(b), "%s/sas_phy/%s", dep->d_name,
+                             dep->d_name);
+                if ((n < 0) || (n >= (int)sizeof(b)))
+                        continue;
+                h = cache_hash(h, dep->d_name, strlen(dep->d_name));
+                p_fd = opendir_fd(fd, b);
+                if (p_fd < 0)
+                        continue;
+                fetch_attrs(p_fd, NULL, phy_names, SG_ARRAY_SIZE(phy_names),
+                            &as);
+                close(p_fd);
+                h = cache_hash_attrs(h, &as);
+        }
+        closedir(dirp);
+        return h;
+}
+
+/* Fills 'csp' for the device named jp->name in jp->dir_name. Returns false
+ * if its sysfs directory can not be opened, then it is walked as usual. */
+static bool
+cache_stamp_get(enum dev_list_kind kind, const struct dev_job_t * jp,
+                const struct lsscsi_opts * op, struct cache_stamp * csp)
+{
+        int k, n, d_fd, fd;
+        uint64_t h;
+        struct stat a_stat;
+        struct attr_set as;
+        /* the io counters change all the time so only when shown */
+        const char * sdev_names[] = {stat_s, "queue_depth",
+                "device_blocked", "iodone_cnt", "ioerr_cnt",
+                "iorequest_cnt"};
+        const char * ndev_dev_names[] = {dv_s, "../dev"};
+        const char * ndev_names[] = {"size", "../state"};
+        const char * shost_names[] = {stat_s, "host_busy"};
+        const char * sdev_subdirs[] = {"block", "scsi_generic",
+                "scsi_tape", "scsi_changer", "enclosure"};
+
+        d_fd = (jp->dir_fd >= 0) ? jp->dir_fd :
+                                   opendir_fd(AT_FDCWD, jp->dir_name);
+        if (d_fd < 0)
+                return false;
+        fd = opendir_fd(d_fd, jp->name);
+        if (d_fd != jp->dir_fd)
+                close(d_fd);
+        if (fd < 0)
+                return false;
+        if (fstat(fd, &a_stat) < 0) {
+                close(fd);
+                return false;
+        }
+        memset(csp, 0, sizeof(*csp));
+        csp->ino = a_stat.st_ino;
+        csp->mtime_ns = (uint64_t)a_stat.st_mtim.tv_sec * 1000000000ULL +
+                        a_stat.st_mtim.tv_nsec;
+        csp->ctime_ns = (uint64_t)a_stat.st_ctim.tv_sec * 1000000000ULL +
+                        a_stat.st_ctim.tv_nsec;
+        h = CACHE_HASH_INIT;
+        switch (kind) {
+        case DLIST_SDEV:
+                for (k = 0; k < (int)SG_ARRAY_SIZE(sdev_subdirs); ++k)
+                        h = cache_hash_subdir(h, fd, sdev_subdirs[k], dv_s,
+                                              (k || (! op->ssize)) ? NULL :
+                                                                     "size");
+                csp->dev_hash = h;
+                n = (op->long_opt > 1) ? (int)SG_ARRAY_SIZE(sdev_names) : 3;
+                fetch_attrs(fd, NULL, sdev_names, n, &as);
+                break;
+        case DLIST_NDEV:
+                /* the namespace's and its controller's major:minor */
+                fetch_attrs(fd, NULL, ndev_dev_names,
+                            SG_ARRAY_SIZE(ndev_dev_names), &as);
+                csp->dev_hash = cache_hash_attrs(h, &as);
+                fetch_attrs(fd, NULL, ndev_names, SG_ARRAY_SIZE(ndev_names),
+                            &as);
+                break;
+        case DLIST_SHOST:
+        default:
+                n = (op->long_opt > 0) ? (int)SG_ARRAY_SIZE(shost_names) : 1;
+                fetch_attrs(fd, NULL, shost_names, n, &as);
+                break;
+        }
+        h = cache_hash_attrs(CACHE_HASH_INIT, &as);
+        if ((DLIST_SHOST == kind) && op->transport_info)
+                h = cache_hash_host_transport(h, fd, jp->name);
+        csp->vol_hash = h;
+        close(fd);
+        return true;
+}
+
+/* Places in cp->sig the options (and filter) that shape the output of one
+ * device and in cp->world the modification times of the /dev directories
+ * that device node names and disk links are taken from. */
+static void
+cache_sig(struct dev_cache * cp, const struct lsscsi_opts * op)
+{
+        int n, k;
+        struct stat a_stat;
+        const char * dirs[] = {devfsroot, dev_disk_byid_dir,
+                               dev_disk_bypath_dir};
+        static const int slen = sizeof(cp->sig);
+        static const int wlen = sizeof(cp->world);
+
+        n = sg_scn3pr(cp->sig, slen, 0, "%s|%s|%s|", release_str, sysfsroot,
+                      devfsroot);
+        n += sg_scn3pr(cp->sig, slen, n, "%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d|",
+                       op->brief, op->dev_maj_min, op->generic, op->do_json,
+                       op->kname, op->pdt, op->protection, op->protmode,
+                       op->scsi_id, op->scsi_id_twice, op->transport_info,
+                       op->wwn, op->wwn_twice, op->no_nvme, op->enclosure);
+        n += sg_scn3pr(cp->sig, slen, n, "%d,%d,%d,%d,%d|%s|", op->long_opt,
+                       op->lunhex, op->ssize, op->unit, op->verbose,
+                       op->json_arg ? op->json_arg : "");
+        n += sg_scn3pr(cp->sig, slen, n, "%s|",
+                       op->fields_arg ? op->fields_arg : "");
+        if (filter_active)
+                sg_scn3pr(cp->sig, slen, n, "%d:%d:%d:%" PRIu64, filter.h,
+                          filter.c, filter.t, filter.l);
+        for (k = 0, n = 0; k < (int)SG_ARRAY_SIZE(dirs); ++k) {
+                if (stat(dirs[k], &a_stat) < 0)
+                        memset(&a_stat, 0, sizeof(a_stat));
+                n += sg_scn3pr(cp->world, wlen, n, "%" PRIu64 ".%ld,%" PRIu64
+                               "|", (uint64_t)a_stat.st_mtim.tv_sec,
+                               (long)a_stat.st_mtim.tv_nsec,
+                               (uint64_t)a_stat.st_ino);
+        }
+}
+
+/* Copies 'n' bytes at *bpp to 'out' (if not NULL) and steps over them.
+ * Returns false if fewer than 'n' bytes remain before 'endp'. */
+static bool
+cache_get(const char ** bpp, const char * endp, void * out, size_t n)
+{
+        if ((size_t)(endp - *bpp) < n)
+                return false;
+        if (out)
+                memcpy(out, *bpp, n);
+        *bpp += n;
+        return true;
+}
+
+/* Sets *spp to a string (with its trailing null) of *lenp bytes at *bpp */
+static bool
+cache_get_str(const char ** bpp, const char * endp, const char ** spp,
+              uint32_t * lenp)
+{
+        if (! cache_get(bpp, endp, lenp, sizeof(*lenp)))
+                return false;
+        *spp = *bpp;
+        return cache_get(bpp, endp, NULL, *lenp);
+}
+
+/* Readies the --cache for the given kind of list and reads the records
+ * left by a previous run with the same options. A missing, stale or
+ * malformed file simply gives no records. */
+static void
+cache_load(struct dev_cache * cp, enum dev_list_kind kind,
+           const struct lsscsi_opts * op)
+{
+        int fd;
+        uint32_t k, n, len;
+        struct stat a_stat;
+        const char * bp;
+        const char * endp;
+        const char * sp;
+        struct cache_rec * rp;
+
+        memset(cp, 0, sizeof(*cp));
+        cache_sig(cp, op);
+        snprintf(cp->path, sizeof(cp->path), "%s/%s-%016" PRIx64 ".cache",
+                 op->cache_dir, dlist_cache_names[kind],
+                 cache_hash(CACHE_HASH_INIT, cp->sig, strlen(cp->sig)));
+        fd = open(cp->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return;
+        if ((fstat(fd, &a_stat) < 0) || (a_stat.st_size < 1) ||
+            (a_stat.st_size > CACHE_MAX_FILE_SZ) ||
+            (NULL == (cp->img = (char *)malloc(a_stat.st_size))) ||
+            (a_stat.st_size != read(fd, cp->img, a_stat.st_size))) {
+                close(fd);
+                goto bad;
+        }
+        close(fd);
+        bp = cp->img;
+        endp = bp + a_stat.st_size;
+        len = sizeof(CACHE_MAGIC) - 1;
+        if ((! cache_get(&bp, endp, NULL, len)) ||
+            memcmp(cp->img, CACHE_MAGIC, len))
+                goto bad;
+        if ((! cache_get_str(&bp, endp, &sp, &len)) ||
+            (len != strlen(cp->sig) + 1) || memcmp(sp, cp->sig, len))
+                goto bad;       /* hash collision on the file name */
+        if ((! cache_get_str(&bp, endp, &sp, &len)) ||
+            (len != strlen(cp->world) + 1) || memcmp(sp, cp->world, len))
+                goto bad;       /* something in /dev changed */
+        if ((! cache_get(&bp, endp, &n, sizeof(n))) || (n > 0x100000))
+                goto bad;
+        cp->recs = (struct cache_rec *)calloc(n ? n : 1, sizeof(*cp->recs));
+        if (NULL == cp->recs)
+                goto bad;
+        for (k = 0, rp = cp->recs; k < n; ++k, ++rp) {
+                if ((! cache_get_str(&bp, endp, &rp->key, &len)) ||
+                    (len < 1) || rp->key[len - 1] ||
+                    (! cache_get(&bp, endp, &rp->st, sizeof(rp->st))) ||
+                    (! cache_get_str(&bp, endp, &rp->hr_bp, &rp->hr_len)) ||
+                    (! cache_get_str(&bp, endp, &sp, &rp->js_len)))
+                        goto bad;
+                rp->js_bp = (const uint8_t *)sp;
+        }
+        cp->num = n;
+        return;
+bad:
+        if (op->verbose > 2)
+                pr2serr("%s: ignoring %s\n", __func__, cp->path);
+        free(cp->recs);
+        free(cp->img);
+        cp->recs = NULL;
+        cp->img = NULL;
+        cp->num = 0;
+}
+
+/* Returns the record for 'key' if it matches 'csp', else NULL. Devices
+ * are usually listed in the order that they were saved so the search
+ * starts after the last record found. */
+static const struct cache_rec *
+cache_find(struct dev_cache * cp, const char * key,
+           const struct cache_stamp * csp)
+{
+        int k, j;
+        struct cache_rec * rp;
+
+        for (k = 0; k < cp->num; ++k) {
+                j = (cp->hint + k) % cp->num;
+                rp = cp->recs + j;
+                if (strcmp(rp->key, key))
+                        continue;
+                cp->hint = j + 1;
+                return memcmp(&rp->st, csp, sizeof(*csp)) ? NULL : rp;
+        }
+        return NULL;
+}
+
+static bool
+cache_put_str(FILE * fp, const void * p, uint32_t len)
+{
+        return (1 == fwrite(&len, sizeof(len), 1, fp)) &&
+               (len == fwrite(p, 1, len, fp));
+}
+
+static void
+cache_free(struct dev_cache * cp)
+{
+        free(cp->recs);
+        free(cp->img);
+        cp->recs = NULL;
+        cp->img = NULL;
+        cp->num = 0;
+}
+
+/* Replaces the --cache file with a record for each of the 'num' jobs that
+ * has a stamp. A temporary file is written then renamed over the old one
+ * so that another lsscsi reading it sees one or the other. */
+static void
+cache_save(const struct dev_cache * cp, const struct dev_job_t * jobs,
+           int num, const struct lsscsi_opts * op)
+{
+        int k, fd;
+        uint32_t n;
+        bool ok;
+        FILE * fp;
+        const struct dev_job_t * jp;
+        char tmp[LMAX_PATH + 8];
+
+        if ((mkdir(op->cache_dir, 0755) < 0) && (EEXIST != errno)) {
+                if (op->verbose > 0)
+                        pr2serr("%s: mkdir(%s): %s\n", __func__,
+                                op->cache_dir, strerror(errno));
+                return;
+        }
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cp->path);
+        fd = mkstemp(tmp);
+        if (fd < 0) {
+                if (op->verbose > 0)
+                        pr2serr("%s: mkstemp(%s): %s\n", __func__, tmp,
+                                strerror(errno));
+                return;
+        }
+        fp = fdopen(fd, "w");
+        if (NULL == fp) {
+                close(fd);
+                unlink(tmp);
+                return;
+        }
+        for (k = 0, n = 0, jp = jobs; k < num; ++k, ++jp)
+                n += jp->cst_ok;
+        ok = (1 == fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1, 1, fp)) &&
+             cache_put_str(fp, cp->sig, strlen(cp->sig) + 1) &&
+             cache_put_str(fp, cp->world, strlen(cp->world) + 1) &&
+             (1 == fwrite(&n, sizeof(n), 1, fp));
+        for (k = 0, jp = jobs; ok && (k < num); ++k, ++jp) {
+                if (! jp->cst_ok)
+                        continue;
+                ok = cache_put_str(fp, jp->name, strlen(jp->name) + 1) &&
+                     (1 == fwrite(&jp->cst, sizeof(jp->cst), 1, fp));
+                if (! ok)
+                        break;
+                if (jp->crp) {
+                        ok = cache_put_str(fp, jp->crp->hr_bp,
+                                           jp->crp->hr_len) &&
+                             cache_put_str(fp, jp->crp->js_bp,
+                                           jp->crp->js_len);
+                        continue;
+                }
+                ok = cache_put_str(fp, jp->hr_bp ? jp->hr_bp : "",
+                                   jp->hr_len) &&
+                     cache_put_str(fp, jp->js_bp ? jp->js_bp : "",
+                                   jp->js_len);
+        }
+        if (fclose(fp))
+                ok = false;
+        if (ok && (0 == rename(tmp, cp->path)))
+                return;
+        if (op->verbose > 0)
+                pr2serr("%s: unable to write %s\n", __func__, cp->path);
+        unlink(tmp);
+}
+
+/* Gets the stamp of each job and, where it matches a record in 'cp',
+ * points the job at that record and takes its JSON object from there.
+ * Returns true if the cache file needs to be written again. */
+static bool
+cache_lookup(struct dev_cache * cp, struct dev_job_t * jobs, int num,
+             enum dev_list_kind kind, struct lsscsi_opts * op)
+{
+        int k;
+        int hits = 0;
+        bool in_order = true;
+        sgj_state * jsp = &op->json_st;
+        const struct cache_rec * rp;
+        struct dev_job_t * jp;
+        sgj_opaque_p jop;
+
+        for (k = 0, jp = jobs; k < num; ++k, ++jp) {
+                jp->cst_ok = cache_stamp_get(kind, jp, op, &jp->cst);
+                if (! jp->cst_ok)
+                        continue;
+                rp = cache_find(cp, jp->name, &jp->cst);
+                if (NULL == rp)
+                        continue;
+                if (jsp->pr_as_json) {
+                        jop = sgj_unpack_r(jsp, rp->js_bp, rp->js_len);
+                        if (NULL == jop)
+                                continue;
+                        sgj_free_unattached(jp->jop);
+                        jp->jop = jop;
+                }
+                jp->crp = rp;
+                if (rp != (cp->recs + k))
+                        in_order = false;
+                ++hits;
+        }
+        if (op->verbose > 1)
+                pr2serr("%s: %d of %d %s from %s\n", __func__, hits, num,
+                        dlist_cache_names[kind], cp->path);
+        return ! (in_order && (hits == num) && (hits == cp->num));
+}
+
+/* Returns true if the plain text output of each job given to
+ * run_dev_jobs() can be collected apart from that of the others, as the
+ * thread pool and --cache need. Options that write plain text in other
+ * places (e.g. '--classic' uses printf() and '--json=o' collects lines in
+ * a shared JSON array) can not. */
+static bool
+dev_jobs_separable(const struct lsscsi_opts * op)
+{
+        const sgj_state * jsp = &op->json_st;
+
+        if (op->classic)
+                return false;
+        return ! (jsp->pr_as_json && jsp->pr_out_hr);
+}
+
+/* Adds the JSON object 'jop' to the array 'jap'. With the streaming
+ * backend that may write out the previous element, so --stats counts the
+ * time taken as JSON output. */
+static void
+dev_js_add(sgj_state * jsp, sgj_opaque_p jap, sgj_opaque_p jop)
+{
+        struct stats_mark sm;
+
+        if (! jsp->pr_as_json)
+                return;
+        stats_begin(&sm, false);
+        sgj_js_nv_o(jsp, jap, NULL /* implies an array add */, jop);
+        stats_end(STP_JSON_OUT, &sm, false);
+}
+
+/* Outputs the plain text collected for a job (or kept in the --cache)
+ * and adds its JSON object to 'jap'. With the sink of run_dev_jobs() the
+ * text is not copied, just queued until the jobs are freed. */
+static void
+dev_job_emit(const struct dev_job_t * jp, sgj_state * jsp, sgj_opaque_p jap)
+{
+        if (jp->crp)
+                sgj_sink_ref(jsp, jp->crp->hr_bp, jp->crp->hr_len);
+        else if (jp->hr_bp)
+                sgj_sink_ref(jsp, jp->hr_bp, jp->hr_len);
+        sgj_sink_flush(jsp, false);
+        dev_js_add(jsp, jap, jp->jop);
+}
+
+/* Adds the 'num' jobs that run_dev_jobs() was given for a 'kind' of list
+ * and the 'ns' it took to the --stats, keeping the slowest devices. */
+static void
+stats_note_jobs(const struct dev_job_t * jobs, int num,
+                enum dev_list_kind kind, uint64_t ns)
+{
+        int k, j;
+        const struct dev_job_t * jp;
+        struct stats_phase_rec * prp = stats.ph + kind;
+        struct stats_dev_rec * srp;
+
+        prp->devices += num;
+        prp->dev_ns += ns;
+        for (k = 0, jp = jobs; k < num; ++k, ++jp) {
+                if (jp->crp) {
+                        ++prp->cached;
+                        continue;
+                }
+                /* stats.slow[] is kept in descending order of time */
+                for (j = stats.num_slow; j > 0; --j) {
+                        if (stats.slow[j - 1].ns >= jp->ns)
+                                break;
+                }
+                if (j >= STATS_SLOWEST)
+                        continue;
+                if (stats.num_slow < STATS_SLOWEST)
+                        ++stats.num_slow;
+                srp = stats.slow + j;
+                memmove(srp + 1, srp,
+                        (stats.num_slow - 1 - j) * sizeof(*srp));
+                srp->phase = (enum stats_phase)kind;
+                srp->ns = jp->ns;
+                srp->io = jp->io;
+                my_strcopy(srp->name, jp->name, sizeof(srp->name));
+        }
+}
+
+/* Returns true if the jobs given to run_dev_jobs() may be spread over
+ * threads. */
+static bool
+dev_jobs_parallel(const struct lsscsi_opts * op)
+{
+        return (op->jobs > 1) && dev_jobs_separable(op);
+}
+
+#if HAVE_IO_URING
+
+/* Attributes that dev_jobs_prefetch() reads from each device's directory
+ * for each kind of list: the ones that the first few options need, in
+ * the order that one_sdev_entry(), longer_sdev_entry() and so on read
+ * them. Others are still read when they are wanted. */
+static const char * const sdev_pre_names[] = {
+        "type", "vendor", "model", "rev",
+        /* longer_sdev_entry(): five more for -l, the rest for -ll */
+        "state", "queue_depth", "scsi_level", "device_blocked", "timeout",
+        "iocounterbits", "iodone_cnt", "ioerr_cnt", "iorequest_cnt",
+        "queue_type", "dh_state", "unique_id",
+};
+
+static const char * const classic_pre_names[] = {
+        "vendor", "model", "rev", "type", "scsi_level",
+};
+
+static const char * const ndev_pre_names[] = {
+        "nsid", "wwid", "dev", "size",
+        /* longer_nd_entry() */
+        "capability", "ext_range", "hidden", "range", "removable",
+};
+
+static const char * const shost_pre_names[] = {
+        "proc_name",
+        /* longer_sh_entry(): four for -l, the rest for -ll */
+        "cmd_per_lun", "host_busy", "sg_tablesize", "active_mode",
+        "can_queue", "state", "unique_id", "use_blk_mq", "nr_hw_queues",
+};
+
+/* Places the names of the attributes to prefetch for a 'kind' of list in
+ * '*namesp' and returns how many there are (0 for none). */
+static int
+prefetch_names(enum dev_list_kind kind, const struct lsscsi_opts * op,
+               const char * const ** namesp)
+{
+        bool longer = (op->long_opt > 0) && (! op->transport_info);
+
+        if (op->num_fields > 0)
+                return 0;
+        switch (kind) {
+        case DLIST_SDEV:
+                if (op->classic) {
+                        *namesp = classic_pre_names;
+                        return SG_ARRAY_SIZE(classic_pre_names);
+                }
+                *namesp = sdev_pre_names;
+                if (! longer)
+                        return 4;
+                return (op->long_opt > 1) ? SG_ARRAY_SIZE(sdev_pre_names) :
+                                            9;
+        case DLIST_NDEV:
+                *namesp = ndev_pre_names;
+                return (op->long_opt > 0) ? SG_ARRAY_SIZE(ndev_pre_names) :
+                                            4;
+        case DLIST_SHOST:
+                if (op->classic)
+                        return 0;
+                *namesp = shost_pre_names;
+                if (! longer)
+                        return 1;
+                return (op->long_opt > 1) ? SG_ARRAY_SIZE(shost_pre_names) :
+                                            5;
+        }
+        return 0;
+}
+
+#endif          /* HAVE_IO_URING */
+
+/* With --io-uring, reads the attributes given by prefetch_names() for
+ * every job not taken from the --cache, as many at a time as the ring
+ * holds, and gives each job a memo of them (see dev_value()). Jobs that
+ * don't get one read their attributes as before. */
+static void
+dev_jobs_prefetch(struct dev_job_t * jobs, int num, enum dev_list_kind kind,
+                  const struct lsscsi_opts * op)
+{
+#if HAVE_IO_URING
+        int k, j, n, nn, first, used, end;
+        int start[URING_SLOTS];
+        const char * const * names = NULL;
+        char * bp;
+        struct attr_rd * rds;
+        struct attr_rd * rdp;
+        struct attr_memo * mp;
+        struct dev_job_t * jp;
+        struct uring_t * up;
+        struct stats_mark sm;
+
+        if ((! op->io_uring) || (num < 1))
+                return;
+        nn = prefetch_names(kind, op, &names);
+        if ((nn < 1) || (NULL == (up = uring_get(op))))
+                return;
+        rds = (struct attr_rd *)malloc(URING_SLOTS * sizeof(*rds));
+        if (NULL == rds)
+                return;
+        stats_begin(&sm, false);
+        for (k = 0; k < num; ) {
+                for (first = k, used = 0;
+                     (k < num) && ((used + nn) <= URING_SLOTS); ++k) {
+                        jp = jobs + k;
+                        start[k - first] = -1;
+                        if (jp->crp)
+                                continue;
+                        for (j = 0; j < nn; ++j) {
+                                rdp = rds + used + j;
+                                if (jp->dir_fd >= 0) {
+                                        rdp->dir_fd = jp->dir_fd;
+                                        n = snprintf(rdp->path,
+                                                     sizeof(rdp->path),
+                                                     "%s/%s", jp->name,
+                                                     names[j]);
+                                } else {
+                                        rdp->dir_fd = AT_FDCWD;
+                                        n = snprintf(rdp->path,
+                                                     sizeof(rdp->path),
+                                                     "%s/%s/%s", jp->dir_name,
+                                                     jp->name, names[j]);
+                                }
+                                if (n >= (int)sizeof(rdp->path))
+                                        break;
+                        }
+                        if (j < nn)
+                                continue;       /* path too long */
+                        start[k - first] = used;
+                        used += nn;
+                }
+                if (used > 0)
+                        attr_rd_batch(up, rds, used, up->bufs);
+                for (j = first; j < k; ++j) {
+                        if (start[j - first] < 0)
+                                continue;
+                        rdp = rds + start[j - first];
+                        for (n = 0, end = 0; n < nn; ++n)
+                                end += (rdp[n].len >= 0) ? rdp[n].len + 1 : 0;
+                        mp = (struct attr_memo *)malloc(sizeof(*mp) + end);
+                        if (NULL == mp)
+                                continue;
+                        mp->num = nn;
+                        for (n = 0, end = 0; n < nn; ++n) {
+                                if (rdp[n].len < 0) {
+                                        mp->av[n].vp = NULL;
+                                        mp->av[n].len = 0;
+                                        continue;
+                                }
+                                bp = up->bufs +
+                                     ((start[j - first] + n) * LMAX_NAME);
+                                memcpy(mp->arena + end, bp, rdp[n].len + 1);
+                                mp->av[n].vp = mp->arena + end;
+                                mp->av[n].len = rdp[n].len;
+                                end += rdp[n].len + 1;
+                        }
+                        jobs[j].pre = mp;
+                        jobs[j].pre_names = names;
+                }
+        }
+        stats_end(STP_PREFETCH, &sm, false);
+        free(rds);
+#else
+        static bool warned = false;
+
+        if (jobs && num && kind) { ; }  /* suppress warning */
+        if (op->io_uring && (op->verbose > 0) && (! warned)) {
+                warned = true;
+                pr2serr("--io-uring: not built with io_uring support, "
+                        "reading attributes synchronously\n");
+        }
+#endif
+}
+
+/* --device-timeout=MS: each job runs as a task on a detached thread of its
+ * own (no more than op->jobs at a time) and its output is waited for until
+ * MS milliseconds after the task started. A task that misses its deadline
+ * is abandoned: it is reported as timed out and another task takes its
+ * place. Since it may finish (or stay blocked in a sysfs read) after
+ * lsscsi has moved on, a task has its own copies of what its job needs and
+ * frees itself if abandoned. While any abandoned task is still running the
+ * indexes shared by jobs (dev_node_map and the like) are not freed. What
+ * a task reads is also noted in its part, which is reported with the
+ * timed out marker should it be abandoned. */
+struct dev_task_t {
+        bool done;
+        bool abandoned;
+        uint64_t start_ns;
+        dev_job_fn fn;
+        struct dev_job_t job;
+        struct dev_part part;
+        struct lsscsi_opts opts;
+#if (HAVE_NVME && (! IGNORE_NVME))
+        struct nvme_ctl_t ctl;
+#endif
+        struct addr_hctl hctl;
+        char dir_name[LMAX_DEVPATH];
+        char name[LMAX_NAME];
+};
+
+static pthread_cond_t dev_task_cv;
+static pthread_once_t dev_task_once = PTHREAD_ONCE_INIT;
+
+static void
+dev_task_cv_init(void)
+{
+        pthread_condattr_t ca;
+
+        pthread_condattr_init(&ca);
+        pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+        pthread_cond_init(&dev_task_cv, &ca);
+        pthread_condattr_destroy(&ca);
+}
+
+static void
+dev_task_free(struct dev_task_t * tp)
+{
+        if (tp->job.dir_fd >= 0)
+                vfs_close(tp->job.dir_fd);
+        free(tp->job.hr_bp);
+        free(tp->job.js_bp);
+        free(tp->job.pre);
+        if (tp->job.jop)
+                sgj_free_unattached(tp->job.jop);
+        free(tp);
+}
+
+static void *
+dev_task_thread(void * arg)
+{
+        bool abandoned;
+        struct dev_task_t * tp = (struct dev_task_t *)arg;
+
+        /* made here so it comes from the heap, not the caller's arena */
+        tp->job.jop = sgj_new_unattached_object_r(&tp->opts.json_st);
+        dev_job_run(&tp->job, tp->fn, &tp->opts);
+        pthread_mutex_lock(&dev_task_mtx);
+        tp->done = true;
+        abandoned = tp->abandoned;
+        if (abandoned)
+                --dev_tasks_astray;
+        else {
+                --dev_tasks_running;
+                pthread_cond_broadcast(&dev_task_cv);
+        }
+        pthread_mutex_unlock(&dev_task_mtx);
+        if (abandoned)
+                dev_task_free(tp);
+        return NULL;
+}
+
+/* Makes a task for 'jp' and starts its thread. Returns NULL (and 'jp' is
+ * then run on the calling thread) if that fails. */
+static struct dev_task_t *
+dev_task_start(struct dev_job_t * jp, dev_job_fn fn,
+               const struct lsscsi_opts * op)
+{
+        pthread_t tid;
+        pthread_attr_t attr;
+        struct dev_task_t * tp;
+
+        tp = (struct dev_task_t *)calloc(1, sizeof(*tp));
+        if (NULL == tp)
+                return NULL;
+        tp->fn = fn;
+        memcpy(&tp->opts, op, sizeof(tp->opts));
+        memcpy(&tp->job, jp, sizeof(tp->job));
+        tp->job.jop = NULL;
+        tp->job.part = &tp->part;
+        tp->job.dir_fd = (jp->dir_fd >= 0) ? vfs_dupfd(jp->dir_fd) : -1;
+        my_strcopy(tp->dir_name, jp->dir_name, sizeof(tp->dir_name));
+        my_strcopy(tp->name, jp->name, sizeof(tp->name));
+        tp->job.dir_name = tp->dir_name;
+        tp->job.name = tp->name;
+        if (jp->hctlp) {
+                tp->hctl = *jp->hctlp;
+                tp->job.hctlp = &tp->hctl;
+        }
+#if (HAVE_NVME && (! IGNORE_NVME))
+        if (jp->nvme_ctl) {
+                nvme_ctl_copy(&tp->ctl, jp->nvme_ctl);
+                tp->job.nvme_ctl = &tp->ctl;
+        }
+#endif
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        tp->start_ns = stats_now_ns();
+        if (pthread_create(&tid, &attr, dev_task_thread, tp)) {
+                pthread_attr_destroy(&attr);
+                if (tp->job.dir_fd >= 0)
+                        vfs_close(tp->job.dir_fd);
+                free(tp);
+                return NULL;
+        }
+        pthread_attr_destroy(&attr);
+        jp->pre = NULL;         /* the task has it now */
+        ++dev_tasks_running;
+        return tp;
+}
+
+/* Outputs a job whose task missed its deadline: its name, that it timed
+ * out and what it had read by then ('pp'), plus what is known without
+ * reading sysfs */
+static void
+dev_job_emit_timed_out(const struct dev_job_t * jp, enum dev_list_kind kind,
+                       const struct dev_part * pp, sgj_state * jsp,
+                       sgj_opaque_p jap, const struct lsscsi_opts * op)
+{
+        int k, off;
+        int q = 0;
+        const char * nm;
+        const char * val;
+        sgj_opaque_p jo2p;
+        struct addr_hctl hctl;
+        char b[LMAX_NAME + 4];
+        char e[DEV_PART_SZ + 64];
+        static const int elen = sizeof(e);
+
+        if (DLIST_SDEV == kind)
+                snprintf(b, sizeof(b), "[%s]", jp->name);
+        else
+                my_strcopy(b, jp->name, sizeof(b));
+        if (! jsp->pr_as_json) {
+                q += sg_scn3pr(e, elen, q, "timed out after %d ms",
+                               op->dev_timeout_ms);
+                for (k = 0, off = 0; k < pp->num; ++k) {
+                        nm = pp->arena + off;
+                        off += strlen(nm) + 1;
+                        val = pp->arena + off;
+                        off += strlen(val) + 1;
+                        q += sg_scn3pr(e, elen, q, "%s %s=%s",
+                                       (0 == k) ? "," : "", nm, val);
+                }
+                sgj_pr_hr(jsp, "%-13s%s\n", b, e);
+                return;
+        }
+        if (NULL == jp->jop)
+                return;
+        sgj_js_nv_s(jsp, jp->jop, "kernel_name", jp->name);
+        if ((DLIST_SDEV == kind) && parse_colon_list(jp->name, &hctl)) {
+                sgj_js_nv_s(jsp, jp->jop, lsscsi_loc_s, b);
+                sgj_js_nv_i(jsp, jp->jop, "host_index", hctl.h);
+                sgj_js_nv_i(jsp, jp->jop, "controller_index", hctl.c);
+                sgj_js_nv_i(jsp, jp->jop, "target_index", hctl.t);
+        }
+        sgj_js_nv_b(jsp, jp->jop, "timed_out", true);
+        sgj_js_nv_i(jsp, jp->jop, "device_timeout_ms", op->dev_timeout_ms);
+        if (pp->num > 0) {
+                /* named as in sysfs since the task's output is not kept */
+                jo2p = sgj_named_subobject_r(jsp, jp->jop, "partial");
+                for (k = 0, off = 0; k < pp->num; ++k) {
+                        nm = pp->arena + off;
+                        off += strlen(nm) + 1;
+                        val = pp->arena + off;
+                        off += strlen(val) + 1;
+                        sgj_js_nv_s(jsp, jo2p, nm, val);
+                }
+        }
+        dev_js_add(jsp, jap, jp->jop);
+}
+
+/* run_dev_jobs() with --device-timeout=MS. Jobs taken from the --cache
+ * are output as they come. */
+static void
+run_dev_tasks(struct dev_job_t * jobs, int num, enum dev_list_kind kind,
+              dev_job_fn fn, struct lsscsi_opts * op, sgj_opaque_p jap)
+{
+        int k;
+        int next = 0;
+        int nthr = (op->jobs > 1) ? op->jobs : 1;
+        uint64_t ms_ns = (uint64_t)op->dev_timeout_ms * 1000000;
+        uint64_t deadline;
+        sgj_state * jsp = &op->json_st;
+        struct dev_job_t * jp;
+        struct dev_task_t * tp;
+        struct dev_task_t ** tasks;
+        struct dev_part * part;
+        struct timespec ts;
+
+        tasks = (struct dev_task_t **)calloc(num + 1, sizeof(*tasks));
+        part = (struct dev_part *)malloc(sizeof(*part));
+        if ((NULL == tasks) || (NULL == part)) {
+                pr2serr("%s: out of memory\n", __func__);
+                free(tasks);
+                free(part);
+                return;
+        }
+        pthread_once(&dev_task_once, dev_task_cv_init);
+        pthread_mutex_lock(&dev_task_mtx);
+        for (k = 0, jp = jobs; k < num; ) {
+                /* start as many as are allowed, in order */
+                for ( ; (next < num) && (dev_tasks_running < nthr); ++next) {
+                        if (jobs[next].crp)
+                                continue;
+                        tasks[next] = dev_task_start(jobs + next, fn, op);
+                        if (NULL == tasks[next]) {
+                                pthread_mutex_unlock(&dev_task_mtx);
+                                dev_job_run(jobs + next, fn, op);
+                                pthread_mutex_lock(&dev_task_mtx);
+                        }
+                }
+                tp = tasks[k];
+                if (NULL == tp) {       /* from the --cache or run here */
+                        pthread_mutex_unlock(&dev_task_mtx);
+                        dev_job_emit(jp, jsp, jap);
+                        pthread_mutex_lock(&dev_task_mtx);
+                } else if (tp && tp->done) {
+                        pthread_mutex_unlock(&dev_task_mtx);
+                        sgj_free_unattached(jp->jop);
+                        jp->jop = tp->job.jop;
+                        jp->hr_bp = tp->job.hr_bp;
+                        jp->hr_len = tp->job.hr_len;
+                        jp->js_bp = tp->job.js_bp;
+                        jp->js_len = tp->job.js_len;
+                        jp->cst_ok = tp->job.cst_ok;
+                        jp->ns = tp->job.ns;
+                        jp->io = tp->job.io;
+                        tp->job.jop = NULL;
+                        tp->job.hr_bp = NULL;
+                        tp->job.js_bp = NULL;
+                        dev_task_free(tp);
+                        dev_job_emit(jp, jsp, jap);
+                        pthread_mutex_lock(&dev_task_mtx);
+                } else if (tp) {
+                        deadline = tp->start_ns + ms_ns;
+                        if (stats_now_ns() < deadline) {
+                                ts.tv_sec = deadline / 1000000000;
+                                ts.tv_nsec = deadline % 1000000000;
+                                pthread_cond_timedwait(&dev_task_cv,
+                                                       &dev_task_mtx, &ts);
+                                continue;
+                        }
+                        tp->abandoned = true;
+                        --dev_tasks_running;
+                        ++dev_tasks_astray;
+                        /* once unlocked the task may free itself */
+                        part->num = tp->part.num;
+                        part->used = tp->part.used;
+                        memcpy(part->arena, tp->part.arena, part->used);
+                        pthread_mutex_unlock(&dev_task_mtx);
+                        if (op->verbose > 0)
+                                pr2serr("%s: %s timed out\n", __func__,
+                                        jp->name);
+                        jp->cst_ok = false;     /* not for the --cache */
+                        jp->ns = ms_ns;
+                        dev_job_emit_timed_out(jp, kind, part, jsp, jap, op);
+                        pthread_mutex_lock(&dev_task_mtx);
+                }
+                ++k;
+                ++jp;
+        }
+        pthread_mutex_unlock(&dev_task_mtx);
+        free(part);
+        free(tasks);
+}
+
+/* Calls fn() for each of the 'num' jobs, using up to op->jobs threads (the
+ * calling thread being one of them). Then outputs the plain text of each
+ * job and adds its JSON object to 'jap', both in jobs[] order. So the
+ * output is the same as if the jobs had been run one after another. With
+ * --cache, jobs whose device is unchanged since the last run of this
+ * 'kind' of list take their output from the cache instead. Plain text
+ * goes to stdout through a sink (see sgj_sink_begin()) that is written
+ * with writev(2) at device boundaries, once enough has been collected. */
+static void
+run_dev_jobs(struct dev_job_t * jobs, int num, enum dev_list_kind kind,
+             dev_job_fn fn, struct lsscsi_opts * op, sgj_opaque_p jap)
+{
+        int k, nthr;
+        bool use_cache = (NULL != op->cache_dir) && dev_jobs_separable(op);
+        bool dirty = false;
+        uint64_t t0 = stats.on ? stats_now_ns() : 0;
+        sgj_state * jsp = &op->json_st;
+        struct dev_job_t * jp;
+        struct dev_pool_t pool;
+        struct dev_ctx_t dc;
+        struct dev_cache cache;
+        pthread_t tids[MAX_JOBS];
+
+        if (use_cache) {
+                cache_load(&cache, kind, op);
+                dirty = cache_lookup(&cache, jobs, num, kind, op);
+        }
+        if ((! jsp->pr_as_json) && dev_jobs_separable(op)) {
+                fflush(stdout);         /* what came before goes first */
+                sgj_sink_begin(jsp, fileno(stdout));
+        }
+        /* a batch read can't be given up on a device at a time */
+        if ((op->dev_timeout_ms > 0) && dev_jobs_separable(op)) {
+                run_dev_tasks(jobs, num, kind, fn, op, jap);
+                goto fini;
+        }
+        dev_jobs_prefetch(jobs, num, kind, op);
+        if (! dev_jobs_parallel(op)) {
+                for (k = 0, jp = jobs; k < num; ++k, ++jp) {
+                        if (use_cache) {
+                                if (NULL == jp->crp)
+                                        dev_job_run(jp, fn, op);
+                                dev_job_emit(jp, jsp, jap);
+                                continue;
+                        }
+                        dev_ctx_init(&dc, jp->dir_fd);
+                        dev_job_call(jp, fn, op, &dc);
+                        sgj_sink_flush(jsp, false);
+                        dev_js_add(jsp, jap, jp->jop);
+                }
+                goto fini;
+        }
+        for (k = 0, jp = jobs; k < num; ++k, ++jp) {
+                if (NULL == jp->crp) {  /* dev_pool_worker() makes another */
+                        sgj_free_unattached(jp->jop);
+                        jp->jop = NULL;
+                }
+        }
+        memset(&pool, 0, sizeof(pool));
+        pthread_mutex_init(&pool.mtx, NULL);
+        pool.num = num;
+        pool.jobs = jobs;
+        pool.op = op;
+        pool.jsp = jsp;
+        pool.fn = fn;
+        nthr = (op->jobs < num) ? op->jobs : num;
+        for (k = 1; k < nthr; ++k) {
+                if (pthread_create(tids + k, NULL, dev_pool_thread, &pool)) {
+                        if (op->verbose > 0)
+                                pr2serr("%s: pthread_create() failed, using "
+                                        "%d thread%s\n", __func__, k,
+                                        (k > 1) ? "s" : "");
+                        break;
+                }
+        }
+        nthr = k;
+        dev_pool_worker(&pool);
+        for (k = 1; k < nthr; ++k)
+                pthread_join(tids[k], NULL);
+        pthread_mutex_destroy(&pool.mtx);
+
+        for (k = 0, jp = jobs; k < num; ++k, ++jp)
+                dev_job_emit(jp, jsp, jap);
+fini:
+        sgj_sink_end(jsp);      /* before the text it refers to is freed */
+        if (use_cache) {
+                if (dirty)
+                        cache_save(&cache, jobs, num, op);
+                cache_free(&cache);
+        }
+        if (stats.on)
+                stats_note_jobs(jobs, num, kind, stats_now_ns() - t0);
+        for (k = 0, jp = jobs; k < num; ++k, ++jp) {
+                free(jp->hr_bp);
+                free(jp->js_bp);
+                free(jp->pre);
+                jp->hr_bp = NULL;
+                jp->js_bp = NULL;
+                jp->pre = NULL;
+        }
+}
+
+/* List SCSI devices (LUs). */
+static void
+list_sdevices(struct lsscsi_opts * op, sgj_opaque_p jop)
+{
+        int num, k, n, blen, nlen, dir_fd;
+        struct dev_job_t * jobs;
+        const struct topo_t * tp = topo_get(TOPO_SDEV);
+        const struct topo_node * np;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jap = NULL;
+        char buff[LMAX_DEVPATH];
+        char name[LMAX_NAME];
+
+        blen = sizeof(buff);
+        nlen = sizeof(name);
+        snprintf(buff, blen, "%s%s", sysfsroot, bus_scsi_dev_s);
+
+        if (tp->dir_err[TK_SDEV]) {  /* scsi mid level may not be loaded */
+                if (op->verbose > 1) {
+                        n = 0;
+                        n += sg_scn3pr(name, nlen, n, "%s: scandir: ",
+                                       __func__);
+                        sg_scn3pr(name, nlen, n, "%s", buff);
+                        errno = tp->dir_err[TK_SDEV];
+                        perror(name);
+                        sgj_pr_hr(jsp, "SCSI mid level %s\n", mmnbl_s);
+                }
+                if (op->classic)
+                        sgj_pr_hr(jsp, "Attached devices: %s\n", none_s);
+                return;
+        }
+        jobs = (struct dev_job_t *)calloc(tp->num[TK_SDEV] ?
+                                          tp->num[TK_SDEV] : 1,
+                                          sizeof(*jobs));
+        if (NULL == jobs) {
+                pr2serr("%s: out of memory\n", __func__);
+                return;
+        }
+        for (k = 0, num = 0, np = tp->nodes[TK_SDEV]; k < tp->num[TK_SDEV];
+             ++k, ++np) {
+                if (filter_active && ((! np->addr_ok) ||
+                                      (! sdev_hctl_wanted(&np->hctl))))
+                        continue;
+                jobs[num].name = topo_name(np);
+                jobs[num++].hctlp = np->addr_ok ? &np->hctl : NULL;
+        }
+        if (op->classic)
+                sgj_pr_hr(jsp, "Attached devices: %s\n", (num ? "" : none_s));
+
+        if (jsp->pr_as_json) {
+                sgj_js_nv_i(jsp, jsp->basep,
+                            "number_of_attached_scsi_devices", num);
+                jap = sgj_named_subarray_r(jsp, jop,
+                                           "attached_scsi_device_list");
+        }
+
+        dir_fd = opendir_fd(AT_FDCWD, buff);
+        if (filter_active && (op->wwn || op->scsi_id) && (dir_fd >= 0)) {
+                struct disk_want_ctx wc = {dir_fd, name};
+
+                /* only read the by-id and by-path links to these disks */
+                for (k = 0; k < num; ++k) {
+                        snprintf(name, nlen, "%s/block", jobs[k].name);
+                        scandir_ctx(dir_fd, name, NULL,
+                                    disk_want_dir_scan_select, &wc);
+                }
+                disk_link_index.want_only = true;
+        }
+        for (k = 0; k < num; ++k) {
+                jobs[k].dir_fd = dir_fd;
+                jobs[k].dir_name = buff;
+                jobs[k].jop = sgj_new_unattached_object_r(jsp);
+        }
+        run_dev_jobs(jobs, num, DLIST_SDEV, one_sdev_entry, op, jap);
+        if (dir_fd >= 0)
+                vfs_close(dir_fd);
+        free(jobs);
+        if (op->wwn || op->scsi_id)
+                free_disk_link_index();
+}
+
+#if (HAVE_NVME && (! IGNORE_NVME))
+
+/* List NVME devices (namespaces). */
+static void
+list_ndevices(struct lsscsi_opts * op, sgj_opaque_p jop)
+{
+        int num, k, j, n, blen, elen;
+        int num_jobs = 0;
+        struct nvme_ctl_t * ctls = NULL;
+        struct dev_job_t * jobs = NULL;
+        struct dev_job_t * j2p;
+        const struct topo_t * tp = topo_get(TOPO_NVME);
+        const struct topo_node * np;
+        const struct topo_node * nnp;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jap = NULL;
+        char buff[LMAX_DEVPATH];
+        char cdir[LMAX_DEVPATH];
+        char ebuf[120];
+
+        blen = sizeof(buff);
+        elen = sizeof(ebuf);
+        n = sg_scn3pr(buff, blen, 0, "%s", sysfsroot);
+        sg_scn3pr(buff, blen, n, "%s", class_nvme);
+
+        if (tp->dir_err[TK_NCTL]) {  /* NVMe module may not be loaded */
+                if (op->verbose > 1) {
+                        n = sg_scn3pr(ebuf, elen, 0, "%s: scandir: ",
+                                      __func__);
+                        sg_scn3pr(ebuf, elen, n, "%s", buff);
+                        errno = tp->dir_err[TK_NCTL];
+                        perror(ebuf);
+                        sgj_pr_hr(jsp, "NVMe %s\n", mmnbl_s);
+                }
+                return;
+        }
+        for (k = 0, num = 0, np = tp->nodes[TK_NCTL]; k < tp->num[TK_NCTL];
+             ++k, ++np) {
+                if (nctl_wanted(np->hctl.c))
+                        ++num;
+        }
+        if (jsp->pr_as_json) {
+                sgj_js_nv_i(jsp, jsp->basep,
+                            "number_of_attached_nvme_devices", num);
+                jap = sgj_named_subarray_r(jsp, jop,
+                                           "attached_nvme_device_list");
+        }
+        if (0 == num)
+                return;
+        ctls = (struct nvme_ctl_t *)calloc(tp->num[TK_NCTL], sizeof(*ctls));
+        jobs = (struct dev_job_t *)calloc(tp->num[TK_NDEV] ?
+                                          tp->num[TK_NDEV] : 1,
+                                          sizeof(*jobs));
+        if ((NULL == ctls) || (NULL == jobs)) {
+                pr2serr("%s: out of memory\n", __func__);
+                goto fini;
+        }
+
+        /* gather the namespaces of every controller, then list them */
+        for (k = 0, np = tp->nodes[TK_NCTL]; k < tp->num[TK_NCTL];
+             ++k, ++np) {
+                if (! nctl_wanted(np->hctl.c))
+                        continue;
+                n = sg_scn3pr(cdir, blen, 0, "%s", buff);
+                sg_scn3pr(cdir, blen, n, "%s", topo_name(np));
+                nvme_ctl_init(ctls + k, cdir, op);
+                if (filter_active && (-1 != filter.t) &&
+                    ctls[k].have_cntlid && (ctls[k].cntlid != filter.t))
+                        continue;       /* none of its namespaces wanted */
+                if (np->err) {
+                        if (op->verbose > 0) {
+                                n = sg_scn3pr(ebuf, elen, 0,
+                                              "%s: scandir(2): ", __func__);
+                                sg_scn3pr(ebuf, elen, n, "%s", buff);
+                                errno = np->err;
+                                perror(ebuf);
+                        }
+                        break;
+                }
+                nnp = tp->nodes[TK_NDEV] + np->first_child;
+                for (j = 0; j < np->num_children; ++j, ++nnp) {
+                        if (! ndev_wanted(nnp->hctl.c, nnp->hctl.l))
+                                continue;
+                        j2p = jobs + num_jobs++;
+                        j2p->dir_fd = -1;
+                        j2p->dir_name = ctls[k].dir;
+                        j2p->nvme_ctl = ctls + k;
+                        j2p->name = topo_name(nnp);
+                        j2p->jop = sgj_new_unattached_object_r(jsp);
+                }
+        }
+        if (num_jobs > 0)
+                run_dev_jobs(jobs, num_jobs, DLIST_NDEV, one_ndev_entry, op,
+                             jap);
+fini:
+        free(jobs);
+        free(ctls);
+        if (op->wwn || op->scsi_id)
+                free_disk_link_index();
+}
+
+#endif          /* (HAVE_NVME && (! IGNORE_NVME)) */
+
+/* List SCSI host (initiator) attributes when --long given (one or more
+ * times). */
+static void
+longer_sh_entry(const char * path_name, struct lsscsi_opts * op,
+                struct dev_ctx_t * dcp, sgj_opaque_p jop)
+{
+        int n;
+        sgj_state * jsp = &op->json_st;
+        const char * vp;
+        char b[168];
+        static const int blen = sizeof(b);
+        static const char * am_s = "active_mode";
+        static const char * cq_s = "can_queue";
+        static const char * cpl_s = "cmd_per_lun";
+        static const char * hb_s = "host_busy";
+        static const char * nhq_s = "nr_hw_queues";
+        static const char * sgt_s = "sg_tablesize";
+        static const char * state_s = "state";
+        static const char * ubm_s = "use_blk_mq";
+        /* the first four are all that a single --long needs */
+        const char * names[] = {cpl_s, hb_s, sgt_s, am_s, cq_s, state_s,
+                                uniqi_s, ubm_s, nhq_s};
+        struct attr_set as;
+
+        if (op->transport_info) {
+                transport_init_longer(path_name, op, dcp, jop);
+                return;
+        }
+        dev_fetch_attrs(dcp, -1, path_name, names,
+                        (op->long_opt > 1) ? (int)SG_ARRAY_SIZE(names) : 4,
+                        &as);
+        if (op->long_opt >= 3) {
+                if ((vp = attr_get(&as, am_s)))
+                        sgj_haj_vs(jsp, jop, 2, am_s, SEP_EQ_NO_SP, vp);
+                if ((vp = attr_get(&as, cq_s)))
+                        sgj_haj_vs(jsp, jop, 2, cq_s, SEP_EQ_NO_SP, vp);
+                else if (op->verbose)
+                        sgj_pr_hr(jsp, "  %s=?\n", cq_s);
+                if ((vp = attr_get(&as, cpl_s)))
+                        sgj_haj_vs(jsp, jop, 2, cpl_s, SEP_EQ_NO_SP, vp);
+                else if (op->verbose)
+                        sgj_pr_hr(jsp, "  %s=?\n", cpl_s);
+                if ((vp = attr_get(&as, hb_s)))
+                        sgj_haj_vs(jsp, jop, 2, hb_s, SEP_EQ_NO_SP, vp);
+                else if (op->verbose)
+                        sgj_pr_hr(jsp, "  %s=?\n", hb_s);
+                if ((vp = attr_get(&as, nhq_s)))
+                        sgj_haj_vs(jsp, jop, 2, nhq_s, SEP_EQ_NO_SP, vp);
+                else if (op->verbose)
+                        sgj_pr_hr(jsp, "  %s=?\n", nhq_s);
+                if ((vp = attr_get(&as, sgt_s)))
+                        sgj_haj_vs(jsp, jop, 2, sgt_s, SEP_EQ_NO_SP, vp);
+                else if (op->verbose)
+                        sgj_pr_hr(jsp, "  %s=?\n", sgt_s);
+                if ((vp = attr_get(&as, state_s)))
+                        sgj_haj_vs(jsp, jop, 2, state_s, SEP_EQ_NO_SP, vp);
+                else if (op->verbose)
+                        sgj_pr_hr(jsp, "  %s=?\n", state_s);
+                if ((vp = attr_get(&as, uniqi_s)))
+                        sgj_haj_vs(jsp, jop, 2, uniqi_s, SEP_EQ_NO_SP, vp);
+                else if (op->verbose)
+                        sgj_pr_hr(jsp, "  %s=?\n", uniqi_s);
+                if ((vp = attr_get(&as, ubm_s)))
+                        sgj_haj_vs(jsp, jop, 2, ubm_s, SEP_EQ_NO_SP, vp);
+        } else if (op->long_opt > 0) {
+                n = 0;
+                if ((vp = attr_get(&as, cpl_s))) {
+                        n += sg_scn3pr(b, blen, n, "  %s=%-4s ", cpl_s,
+                                       vp);
+                        if (jsp->pr_as_json)
+                                sgj_js_nv_s(jsp, jop, cpl_s, vp);
+                } else if (op->verbose)
+                        n += sg_scn3pr(b, blen, n, "  %s=????\n", cpl_s);
+
+                if ((vp = attr_get(&as, hb_s))) {
+                        n += sg_scn3pr(b, blen, n, "%s=%-4s ", hb_s, vp);
+                        if (jsp->pr_as_json)
+                                sgj_js_nv_s(jsp, jop, hb_s, vp);
+                } else if (op->verbose)
+                        n += sg_scn3pr(b, blen, n, "%s=????\n", hb_s);
+
+                if ((vp = attr_get(&as, sgt_s))) {
+                        n += sg_scn3pr(b, blen, n, "%s=%-4s ", sgt_s, vp);
+                        if (jsp->pr_as_json)
+                                sgj_js_nv_s(jsp, jop, sgt_s, vp);
+                } else if (op->verbose)
+                        n += sg_scn3pr(b, blen, n, "%s=????\n", sgt_s);
+
+                if ((vp = attr_get(&as, am_s))) {
+                        sg_scn3pr(b, blen, n, "%s=%-4s ", am_s, vp);
+                        if (jsp->pr_as_json)
+                                sgj_js_nv_s(jsp, jop, am_s, vp);
+                }
+                sgj_pr_hr(jsp, "%s\n", b);
+
+                if (2 == op->long_opt) {
+                        n = 0;
+                        if ((vp = attr_get(&as, cq_s))) {
+                                n += sg_scn3pr(b, blen, n, "  %s=%-4s ", cq_s,
+                                               vp);
+                                if (jsp->pr_as_json)
+                                        sgj_js_nv_s(jsp, jop, cq_s, vp);
+                        }
+                        if ((vp = attr_get(&as, state_s))) {
+                                n += sg_scn3pr(b, blen, n, "  %s=%-8s ",
+                                               state_s, vp);
+                                if (jsp->pr_as_json)
+                                        sgj_js_nv_s(jsp, jop, state_s, vp);
+                        }
+                        if ((vp = attr_get(&as, uniqi_s))) {
+                                n += sg_scn3pr(b, blen, n, "  %s=%-8s ",
+                                               uniqi_s, vp);
+                                if (jsp->pr_as_json)
+                                        sgj_js_nv_s(jsp, jop, uniqi_s, vp);
+                        }
+                        if ((vp = attr_get(&as, ubm_s))) {
+                                sg_scn3pr(b, blen, n, "  %s=%-8s ", ubm_s,
+                                          vp);
+                                if (jsp->pr_as_json)
+                                        sgj_js_nv_s(jsp, jop, ubm_s, vp);
+                        }
+                        sgj_pr_hr(jsp, "%s\n", b);
+                }
+        }
+}
+
+static void
+one_shost_entry(const char * dir_name, const char * devname,
+                struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+                sgj_opaque_p jop)
+{
+        int n, q;
+        unsigned int host_id;
+        sgj_state * jsp = &op->json_st;
+        char b[LMAX_PATH];
+        char value[LMAX_NAME];
+        char wd[LMAX_PATH];
+        char o[144];
+        static const int blen = sizeof(b);
+        static const int vlen = sizeof(value);
+        static const int olen = sizeof(o);
+        static const char * host_id_s = "host_id";
+
+        if (op->classic) {
+                // one_classic_host_entry(dir_name, devname, op);
+                sgj_pr_hr(jsp, "  <'--classic' not supported for hosts>\n");
+                return;
+        }
+        n = 0;
+        q = 0;
+        if (1 == sscanf(devname, "host%u", &host_id)) {
+                q += sg_scn3pr(o, olen, q, "[%u]", host_id);
+                if (jsp->pr_as_json) {
+                        sgj_js_nv_s(jsp, jop, lsscsi_loc_s, o);
+                        sgj_js_nv_i(jsp, jop, host_id_s, host_id);
+                }
+                q += sg_scn3pr(o, olen, q, "  ");
+        } else
+                q += sg_scn3pr(o, olen, q, "[?]  ");
+        n += sg_scn3pr(b, blen, n, "%s", dir_name);
+        // n += sg_scn3pr(b, blen, n, "%s", "/");
+        sg_scn3pr(b, blen, n, "%s", devname);
+        if ((dev_value(dcp, b, "proc_name", value, vlen)) &&
+            (strncmp(value, nulln1_s, 6)) && (strncmp(value, nulln2_s, 6))) {
+                q += sg_scn3pr(o, olen, q, "  %-12s  ", value);
+                if (jsp->pr_as_json)
+                        sgj_js_nv_s(jsp, jop, "driver_name", value);
+        } else if (if_directory_canon(b, "device/../driver", wd,
+                                      sizeof(wd))) {
+                q += sg_scn3pr(o, olen, q, "  %-12s  ", basename(wd));
+        } else
+                q += sg_scn3pr(o, olen, q, "  proc_name=????  ");
+        if (op->transport_info) {
+                if (! transport_h_init(devname, dcp, olen - q, o + q)) {
+                        if (op->verbose > 3)
+                                pr2serr("%s: transport_h_init() failed\n",
+                                        __func__);
+                }
+                if (jsp->pr_as_json && (strlen(o + q) > 1))
+                        sgj_js_nv_s(jsp, jop, "transport_summary", o + q);
+        }
+        sgj_pr_hr(jsp, "%s\n", o);
+
+        if (op->long_opt > 0)
+                longer_sh_entry(b, op, dcp, jop);
+
+        if (op->verbose > 0) {
+                char b2[LMAX_DEVPATH];
+                static const int b2len = sizeof(b2);
+
+                n = sg_scn3pr(b2, b2len, 0, "  dir: %s\n  device dir: ", b);
+                if (if_directory_canon(b, dvc_s, wd, sizeof(wd)))
+                        sg_scn3pr(b2, b2len, n, "%s", wd);
+                sgj_pr_hr(jsp, "%s\n", b2);
+        }
+}
+
+/* Returns true if the filter (if any) selects SCSI host 'h' (-1 if its
+ * number is not known) */
+static bool
+shost_num_wanted(int h)
+{
+        return (! filter_active) || (-1 == filter.h) || (h == filter.h);
+}
+
+static int
+shost_dir_scan_select(const struct dirent * s)
+{
+        int h;
+
+        if (0 == strncmp("host", s->d_name, 4)) {
+                if (1 != sscanf(s->d_name + 4, "%d", &h))
+                        h = -1;
+                return shost_num_wanted(h);
+        }
+        return 0;
+}
+
+/* Returns -1 if (a->d_name < b->d_name) ; 0 if they are equal
+ * and 1 otherwise.
+ */
+static int
+shost_scandir_sort(const struct dirent ** a, const struct dirent ** b)
+{
+        unsigned int l, r;
+        const char * lnam = (*a)->d_name;
+        const char * rnam = (*b)->d_name;
+
+        if (1 != sscanf(lnam, "host%u", &l))
+                return -1;
+        if (1 != sscanf(rnam, "host%u", &r))
+                return 1;
+        if (l < r)
+                return -1;
+        else if (r < l)
+                return 1;
+        return 0;
+}
+
+static void
+list_shosts(struct lsscsi_opts * op, sgj_opaque_p jop)
+{
+        int num, k, dir_fd;
+        struct dev_job_t * jobs;
+        const struct topo_t * tp = topo_get(TOPO_SHOST);
+        const struct topo_node * np;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jap = NULL;
+        char buff[LMAX_DEVPATH];
+        char name[LMAX_NAME];
+        static const int namelen = sizeof(name);
+
+        snprintf(buff, sizeof(buff), "%s%s", sysfsroot, scsi_host_s);
+
+        if (tp->dir_err[TK_SHOST]) {
+                int n = 0;
+
+                n += sg_scn3pr(name, namelen, n, "%s: scandir: ", __func__);
+                sg_scn3pr(name, namelen, n, "%s", buff);
+                errno = tp->dir_err[TK_SHOST];
+                perror(name);
+                return;
+        }
+        jobs = (struct dev_job_t *)calloc(tp->num[TK_SHOST] ?
+                                          tp->num[TK_SHOST] : 1,
+                                          sizeof(*jobs));
+        if (NULL == jobs) {
+                pr2serr("%s: out of memory\n", __func__);
+                return;
+        }
+        for (k = 0, num = 0, np = tp->nodes[TK_SHOST];
+             k < tp->num[TK_SHOST]; ++k, ++np) {
+                if (shost_num_wanted(np->hctl.h))
+                        jobs[num++].name = topo_name(np);
+        }
+        if (op->classic)
+                sgj_pr_hr(jsp, "Attached hosts: %s\n", (num ? "" : none_s));
+
+        if (jsp->pr_as_json) {
+                sgj_js_nv_i(jsp, jsp->basep,
+                            "number_of_attached_scsi_hosts", num);
+                jap = sgj_named_subarray_r(jsp, jop,
+                                           "attached_scsi_host_list");
+        }
+        dir_fd = opendir_fd(AT_FDCWD, buff);
+        for (k = 0; k < num; ++k) {
+                jobs[k].dir_fd = dir_fd;
+                jobs[k].dir_name = buff;
+                jobs[k].jop = sgj_new_unattached_object_r(jsp);
+        }
+        run_dev_jobs(jobs, num, DLIST_SHOST, one_shost_entry, op, jap);
+        if (dir_fd >= 0)
+                vfs_close(dir_fd);
+        free(jobs);
+}
+
+static const char * const sas_node_kind_names[] = {
+        "host", "phy", "port", "expander", "end_device", "target",
+        "logical_unit",
+};
+
+/* qsort(3) helper for sas_tree_node(): by kind, then name with numbers
+ * in it compared by value */
+static int
+sas_node_cmp(const void * a, const void * b)
+{
+        const struct sas_node * lp = *(const struct sas_node * const *)a;
+        const struct sas_node * rp = *(const struct sas_node * const *)b;
+
+        if (lp->kind != rp->kind)
+                return (lp->kind < rp->kind) ? -1 : 1;
+        return strverscmp(lp->name, rp->name);
+}
+
+/* Outputs node 'k' of 'tp', indented by 'ind', then its children. Phys of
+ * a host or expander are only shown when it has no ports, otherwise they
+ * are shown under the port they belong to. */
+static void
+sas_tree_node(const struct sas_topo * tp, int k, int ind, sgj_state * jsp,
+              sgj_opaque_p jop)
+{
+        int j, n, num, num_phys;
+        bool no_phys;
+        const struct sas_node * np = tp->nodes + k;
+        const struct sas_node ** arr;
+        sgj_opaque_p jap = NULL;
+        sgj_opaque_p jo2p;
+        char b[160];
+        static const int blen = sizeof(b);
+
+        n = sg_scn3pr(b, blen, 0, (SNK_LU == np->kind) ? "%*s[%s]" : "%*s%s",
+                      ind, "", np->name);
+        sgj_js_nv_s(jsp, jop, "type", sas_node_kind_names[np->kind]);
+        sgj_js_nv_s(jsp, jop, "name", np->name);
+        if (np->sas_address[0]) {
+                n += sg_scn3pr(b, blen, n, "  %s=%s", sas_ad_s,
+                               np->sas_address);
+                sgj_js_nv_s(jsp, jop, sas_ad_s, np->sas_address);
+        }
+        if (np->linkrate[0]) {
+                n += sg_scn3pr(b, blen, n, "  %s=%s", neg_lr_s,
+                               np->linkrate);
+                sgj_js_nv_s(jsp, jop, neg_lr_s, np->linkrate);
+        }
+        if (SNK_PORT == np->kind) {
+                num_phys = sas_topo_count(tp, k, SNK_PHY);
+                sg_scn3pr(b, blen, n, "  num_phys=%d", num_phys);
+                sgj_js_nv_i(jsp, jop, "num_phys", num_phys);
+        }
+        sgj_pr_hr(jsp, "%s\n", b);
+
+        no_phys = ((SNK_HOST == np->kind) || (SNK_EXPANDER == np->kind)) &&
+                  (sas_topo_count(tp, k, SNK_PORT) > 0);
+        for (num = 0, j = np->child; j >= 0; j = tp->nodes[j].next)
+                ++num;
+        if (0 == num)
+                return;
+        arr = (const struct sas_node **)malloc(num * sizeof(*arr));
+        if (NULL == arr) {
+                pr2serr("%s: out of memory\n", __func__);
+                return;
+        }
+        for (num = 0, j = np->child; j >= 0; j = tp->nodes[j].next) {
+                if (no_phys && (SNK_PHY == tp->nodes[j].kind))
+                        continue;
+                arr[num++] = tp->nodes + j;
+        }
+        qsort(arr, num, sizeof(*arr), sas_node_cmp);
+        if (num > 0)
+                jap = sgj_named_subarray_r(jsp, jop, "node_list");
+        for (j = 0; j < num; ++j) {
+                jo2p = sgj_new_unattached_object_r(jsp);
+                sas_tree_node(tp, arr[j] - tp->nodes, ind + 2, jsp, jo2p);
+                sgj_js_nv_o(jsp, jap, NULL, jo2p);
+        }
+        free(arr);
+}
+
+/* List the SAS fabric below each SAS host: its ports and their phys, then
+ * expanders, end devices, targets and logical units. */
+static void
+list_sas_tree(struct lsscsi_opts * op, sgj_opaque_p jop)
+{
+        int num, k, h;
+        struct dirent ** namelist;
+        const struct sas_topo * tp;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jo2p;
+        sgj_opaque_p jap = NULL;
+        char buff[LMAX_DEVPATH];
+        char ebuf[LMAX_DEVPATH + 32];
+
+        snprintf(buff, sizeof(buff), "%s%s", sysfsroot, sas_host_s);
+        num = scandir_cnt(buff, &namelist, shost_dir_scan_select,
+                          shost_scandir_sort);
+        if (num < 0) {  /* SAS transport module may not be loaded */
+                if (op->verbose > 1) {
+                        snprintf(ebuf, sizeof(ebuf), "%s: scandir: %s",
+                                 __func__, buff);
+                        perror(ebuf);
+                }
+                return;
+        }
+        if (jsp->pr_as_json)
+                jap = sgj_named_subarray_r(jsp, jop, "sas_tree");
+        for (k = 0; k < num; ++k) {
+                if ((1 == sscanf(namelist[k]->d_name, "host%d", &h)) &&
+                    (tp = sas_topo_get(h, true))) {
+                        jo2p = sgj_new_unattached_object_r(jsp);
+                        sas_tree_node(tp, 0, 0, jsp, jo2p);
+                        sgj_js_nv_o(jsp, jap, NULL, jo2p);
+                }
+                free(namelist[k]);
+        }
+        free(namelist);
+}
+
+#if (HAVE_NVME && (! IGNORE_NVME))
+
+/* List NVME hosts (controllers). */
+static void
+list_nhosts(struct lsscsi_opts * op, sgj_opaque_p jop)
+{
+        int k, n;
+        const struct topo_t * tp = topo_get(TOPO_NVME);
+        const struct topo_node * np;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jo2p = NULL;
+        sgj_opaque_p jap = NULL;
+        char buff[LMAX_DEVPATH];
+        char ebuf[120];
+        static const int blen = sizeof(buff);
+        static const int elen = sizeof(ebuf);
+
+        n = sg_scn3pr(buff, blen, 0, "%s", sysfsroot);
+        sg_scn3pr(buff, blen, n, "%s", class_nvme);
+
+        if (tp->dir_err[TK_NCTL]) {  /* NVMe module may not be loaded */
+                if (op->verbose > 1) {
+                        n = sg_scn3pr(ebuf, elen, 0, "%s: scandir: ",
+                                      __func__);
+                        sg_scn3pr(ebuf, elen, n, "%s", buff);
+                        errno = tp->dir_err[TK_NCTL];
+                        perror(ebuf);
+                        sgj_pr_hr(jsp, "NVMe %s\n", mmnbl_s);
+                }
+                return;
+        }
+        if (jsp->pr_as_json)
+                jap = sgj_named_subarray_r(jsp, jop,
+                                           "attached_nvme_controller_list");
+        for (k = 0, np = tp->nodes[TK_NCTL]; k < tp->num[TK_NCTL];
+             ++k, ++np) {
+                if (! nctl_wanted(np->hctl.c))
+                        continue;
+                if (jsp->pr_as_json)
+                        jo2p = sgj_new_unattached_object_r(jsp);
+                one_nhost_entry(buff, topo_name(np), op, jo2p);
+                dev_js_add(jsp, jap, jo2p);
+        }
+        if (op->wwn || op->scsi_id)
+                free_disk_link_index();
+}
+
+#endif          /* (HAVE_NVME && (! IGNORE_NVME)) */
+
+/* --watch: after the usual listing, kernel uevents (NETLINK_KOBJECT_UEVENT)
+ * name the devices that came, went or changed and only those are listed
+ * again. A burst of uevents (e.g. from a SAS expander reset) is collected
+ * until WATCH_SETTLE_MS passes without one, then each device it touched
+ * is reported once. */
+#define WATCH_SETTLE_MS 100
+#define WATCH_MAX_BURST_MS 1000 /* report at least this often in a storm */
+#define WATCH_RCVBUF_SZ (4 * 1024 * 1024)
+#define WATCH_UEVENT_SZ 8192
+
+enum watch_kind {
+        WK_SDEV = 0,            /* name like "2:0:1:0" */
+        WK_NDEV,                /* name like "nvme0/nvme0n1" */
+        WK_SHOST,               /* name like "host2" */
+        WK_NHOST,               /* name like "nvme0" */
+};
+
+static const char * const watch_obj_names[] = {
+        "attached_scsi_device", "attached_nvme_device",
+        "attached_scsi_host", "attached_nvme_controller",
+};
+
+struct watch_key {
+        enum watch_kind kind;
+        char name[64];
+};
+
+/* A set of devices; an array suffices for the few hundred expected */
+struct watch_set {
+        int num;
+        int max;
+        struct watch_key * keys;
+};
+
+static int
+watch_set_find(const struct watch_set * wsp, enum watch_kind kind,
+               const char * name)
+{
+        int k;
+
+        for (k = 0; k < wsp->num; ++k) {
+                if ((kind == wsp->keys[k].kind) &&
+                    (0 == strcmp(name, wsp->keys[k].name)))
+                        return k;
+        }
+        return -1;
+}
+
+static void
+watch_set_add(struct watch_set * wsp, enum watch_kind kind,
+              const char * name)
+{
+        struct watch_key * kp;
+
+        if (watch_set_find(wsp, kind, name) >= 0)
+                return;
+        if (wsp->num >= wsp->max) {
+                int n_max = wsp->max ? (2 * wsp->max) : 64;
+
+                kp = (struct watch_key *)realloc(wsp->keys,
+                                                 n_max * sizeof(*kp));
+                if (NULL == kp) {
+                        pr2serr("%s: out of memory\n", __func__);
+                        return;
+                }
+                wsp->keys = kp;
+                wsp->max = n_max;
+        }
+        kp = wsp->keys + wsp->num++;
+        kp->kind = kind;
+        my_strcopy(kp->name, name, sizeof(kp->name));
+}
+
+/* Calls the scandir() select function 'fn' on 'name' */
+static bool
+watch_select(dirent_select_fn fn, const char * name)
+{
+        struct dirent de;
+
+        memset(&de, 0, sizeof(de));
+        my_strcopy(de.d_name, name, sizeof(de.d_name));
+        return fn(&de);
+}
+
+#if (HAVE_NVME && (! IGNORE_NVME))
+
+static void
+one_nhost_job(const char * dir_name, const char * devname,
+              struct lsscsi_opts * op, struct dev_ctx_t * dcp,
+              sgj_opaque_p jop)
+{
+        if (dcp) { ; }          /* suppress warning */
+        one_nhost_entry(dir_name, devname, op, jop);
+}
+
+#endif
+
+/* Places the directory holding the device named in 'kp' in 'dir_name' and
+ * points *namepp at its name within that directory. Returns true if the
+ * device exists and is one that the options and filter select. */
+static bool
+watch_key_dir(const struct lsscsi_opts * op, const struct watch_key * kp,
+              char * dir_name, int dlen, const char ** namepp)
+{
+        struct stat a_stat;
+        char b[LMAX_DEVPATH];
+
+        *namepp = kp->name;
+        if (op->no_nvme && ((WK_NDEV == kp->kind) || (WK_NHOST == kp->kind)))
+                return false;
+        switch (kp->kind) {
+        case WK_SDEV:
+                if (! watch_select(sdev_dir_scan_select, kp->name))
+                        return false;
+                snprintf(dir_name, dlen, "%s%s", sysfsroot, bus_scsi_dev_s);
+                break;
+        case WK_SHOST:
+                if (! watch_select(shost_dir_scan_select, kp->name))
+                        return false;
+                snprintf(dir_name, dlen, "%s%s", sysfsroot, scsi_host_s);
+                break;
+#if (HAVE_NVME && (! IGNORE_NVME))
+        case WK_NDEV:
+                *namepp = strchr(kp->name, '/');
+                if ((NULL == *namepp) ||
+                    (! watch_select(ndev_dir_scan_select2, *namepp + 1)))
+                        return false;
+                snprintf(dir_name, dlen, "%s%s%.*s", sysfsroot, class_nvme,
+                         (int)(*namepp - kp->name), kp->name);
+                ++*namepp;
+                break;
+        case WK_NHOST:
+                if (! watch_select(ndev_dir_scan_select, kp->name))
+                        return false;
+                snprintf(dir_name, dlen, "%s%s", sysfsroot, class_nvme);
+                break;
+#endif
+        default:
+                return false;
+        }
+        snprintf(b, sizeof(b), "%s/%s", dir_name, *namepp);
+        return 0 == stat(b, &a_stat);
+}
+
+/* Adds every device that the listing shows to 'wsp' */
+static void
+watch_scan_all(const struct lsscsi_opts * op, struct watch_set * wsp)
+{
+        int k;
+        const struct topo_t * tp = topo_get(op->do_hosts ? TOPO_SHOST :
+                                                           TOPO_SDEV);
+        const struct topo_node * np;
+
+        if (op->do_hosts) {
+                for (k = 0, np = tp->nodes[TK_SHOST];
+                     k < tp->num[TK_SHOST]; ++k, ++np) {
+                        if (shost_num_wanted(np->hctl.h))
+                                watch_set_add(wsp, WK_SHOST, topo_name(np));
+                }
+        } else {
+                for (k = 0, np = tp->nodes[TK_SDEV]; k < tp->num[TK_SDEV];
+                     ++k, ++np) {
+                        if ((! filter_active) ||
+                            (np->addr_ok && sdev_hctl_wanted(&np->hctl)))
+                                watch_set_add(wsp, WK_SDEV, topo_name(np));
+                }
+        }
+#if (HAVE_NVME && (! IGNORE_NVME))
+        if (op->no_nvme)
+                return;
+        tp = topo_get(TOPO_NVME);
+        for (k = 0, np = tp->nodes[TK_NCTL]; k < tp->num[TK_NCTL];
+             ++k, ++np) {
+                int j;
+                const struct topo_node * nnp;
+                char b[LMAX_DEVPATH];
+
+                if (! nctl_wanted(np->hctl.c))
+                        continue;
+                if (op->do_hosts) {
+                        watch_set_add(wsp, WK_NHOST, topo_name(np));
+                        continue;
+                }
+                nnp = tp->nodes[TK_NDEV] + np->first_child;
+                for (j = 0; j < np->num_children; ++j, ++nnp) {
+                        if (! ndev_wanted(nnp->hctl.c, nnp->hctl.l))
+                                continue;
+                        snprintf(b, sizeof(b), "%s/%s", topo_name(np),
+                                 topo_name(nnp));
+                        watch_set_add(wsp, WK_NDEV, b);
+                }
+        }
+#endif
+}
+
+/* True if a uevent from 'subsys' (of 'devtype') may change a listing */
+static bool
+watch_subsys_wanted(const char * subsys, const char * devtype)
+{
+        if (strcmp(subsys, "scsi") && strcmp(subsys, "scsi_host") &&
+            strcmp(subsys, "scsi_generic") && strcmp(subsys, "block") &&
+            strcmp(subsys, "nvme") && strncmp(subsys, "sas_", 4))
+                return false;
+        /* partitions are not listed */
+        return ! ((0 == strcmp(subsys, "block")) && devtype &&
+                  strcmp(devtype, "disk"));
+}
+
+/* Adds to 'pend' the device (if any) whose listing may be changed by a
+ * uevent from 'subsys' for the kernel object at 'devpath' (which is
+ * altered). Events in a SCSI device's sysfs subtree (e.g. its block or sg
+ * device coming or going) are taken as a change to that device. */
+static void
+watch_map_uevent(const struct lsscsi_opts * op, char * devpath,
+                 const char * subsys, const char * devtype,
+                 struct watch_set * pend)
+{
+        int n;
+        unsigned int u;
+        char * cp;
+        char * parent = NULL;
+        char * base = NULL;
+
+        if (! watch_subsys_wanted(subsys, devtype))
+                return;
+        for (cp = strtok(devpath, "/"); cp; cp = strtok(NULL, "/")) {
+                parent = base;
+                base = cp;
+                n = 0;
+                if (op->do_hosts) {
+                        if ((1 == sscanf(cp, "host%u%n", &u, &n)) &&
+                            ('\0' == cp[n]) && strcmp(subsys, "block") &&
+                            strcmp(subsys, "scsi_generic")) {
+                                watch_set_add(pend, WK_SHOST, cp);
+                                return;
+                        }
+                } else if (strchr(cp, ':') && isdigit((uint8_t)*cp) &&
+                           (3 == sscanf(cp, "%u:%*u:%u:%u%n", &u, &u, &u,
+                                        &n)) && (n > 0) && ('\0' == cp[n])) {
+                        watch_set_add(pend, WK_SDEV, cp);
+                        return;
+                }
+        }
+        if ((NULL == base) || (NULL == parent))
+                return;
+#if (HAVE_NVME && (! IGNORE_NVME))
+        if (! watch_select(ndev_dir_scan_select, op->do_hosts ? base :
+                                                                parent))
+                return;
+        if (op->do_hosts) {
+                if (0 == strcmp(subsys, "nvme"))
+                        watch_set_add(pend, WK_NHOST, base);
+        } else if (0 == strcmp(subsys, "block")) {
+                char b[LMAX_DEVPATH];
+
+                snprintf(b, sizeof(b), "%s/%s", parent, base);
+                watch_set_add(pend, WK_NDEV, b);
+        }
+#endif
+}
+
+/* Outputs one add, change or remove record for the device named in 'kp'.
+ * Plain text is the action followed by what the listing shows for the
+ * device; JSON is one line (i.e. JSON Lines) per record. */
+static void
+watch_emit(struct lsscsi_opts * op, const struct watch_key * kp,
+           const char * action, bool gone)
+{
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jop;
+        sgj_state js;
+        struct dev_job_t job;
+        char dir_name[LMAX_DEVPATH];
+        static const dev_job_fn fns[] = {
+                one_sdev_entry,
+#if (HAVE_NVME && (! IGNORE_NVME))
+                one_ndev_entry,
+#else
+                NULL,
+#endif
+                one_shost_entry,
+#if (HAVE_NVME && (! IGNORE_NVME))
+                one_nhost_job,
+#else
+                NULL,
+#endif
+        };
+
+        memset(&job, 0, sizeof(job));
+        job.dir_fd = -1;
+        if ((! gone) && fns[kp->kind] &&
+            watch_key_dir(op, kp, dir_name, sizeof(dir_name), &job.name)) {
+                job.dir_name = dir_name;
+                job.jop = sgj_new_unattached_object_r(jsp);
+                dev_job_run(&job, fns[kp->kind], op);
+        }
+        if (jsp->pr_as_json) {
+                jop = sgj_new_unattached_object_r(jsp);
+                sgj_js_nv_s(jsp, jop, "uevent_action", action);
+                sgj_js_nv_s(jsp, jop, "kernel_name", kp->name);
+                if (job.jop &&
+                    (NULL == sgj_js_nv_o(jsp, jop, watch_obj_names[kp->kind],
+                                         job.jop)))
+                        sgj_free_unattached(job.jop);
+                memcpy(&js, jsp, sizeof(js));
+                js.pr_pretty = false;
+                if (jop)
+                        sgj_js2file_estr(&js, jop, 0, NULL, stdout);
+                sgj_free_unattached(jop);
+        } else if (job.hr_bp && (job.hr_len > 0)) {
+                printf("%s: ", action);
+                fwrite(job.hr_bp, 1, job.hr_len, stdout);
+        } else
+                printf("%s: %s\n", action, kp->name);
+        free(job.hr_bp);
+}
+
+/* Reports each device in 'pend' by comparing it with 'known' (the devices
+ * reported so far) which is then updated. 'pend' is emptied. */
+static void
+watch_report(struct lsscsi_opts * op, struct watch_set * known,
+             struct watch_set * pend)
+{
+        int k, j;
+        bool here;
+        const struct watch_key * kp;
+        const char * name;
+        char dir_name[LMAX_DEVPATH];
+
+        /* /dev and /dev/disk/by-id have probably changed too, as may have
+         * the topology, the transports of hosts and targets and enclosure
+         * slots */
+        free_dev_node_list();
+        free_tport_memo();
+        free_encl_slot_index();
+        free_topo();
+        /* the JSON of this burst's reports is all freed in one go */
+        if (op->json_st.pr_as_json)
+                sgj_arena_begin(&op->json_st);
+        for (k = 0, kp = pend->keys; k < pend->num; ++k, ++kp) {
+                here = watch_key_dir(op, kp, dir_name, sizeof(dir_name),
+                                     &name);
+                j = watch_set_find(known, kp->kind, kp->name);
+                if (here) {
+                        watch_emit(op, kp, (j < 0) ? "add" : "change", false);
+                        if (j < 0)
+                                watch_set_add(known, kp->kind, kp->name);
+                } else if (j >= 0) {
+                        watch_emit(op, kp, "remove", true);
+                        known->keys[j] = known->keys[--known->num];
+                }
+        }
+        pend->num = 0;
+        sgj_arena_end(&op->json_st);
+        if (op->wwn || op->scsi_id)
+                free_disk_link_index();
+        fflush(stdout);
+}
+
+/* Returns a socket bound to the kernel's uevent multicast group, or -1 */
+static int
+watch_open(const struct lsscsi_opts * op)
+{
+        int fd;
+        int sz = WATCH_RCVBUF_SZ;
+        struct sockaddr_nl snl;
+
+        fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT);
+        if (fd < 0) {
+                perror("--watch: socket(NETLINK_KOBJECT_UEVENT)");
+                return -1;
+        }
+        /* try to ride out large bursts, root may exceed rmem_max */
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof(sz)))
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+        memset(&snl, 0, sizeof(snl));
+        snl.nl_family = AF_NETLINK;
+        snl.nl_groups = 1;      /* kernel events, not those from udevd */
+        if (bind(fd, (struct sockaddr *)&snl, sizeof(snl))) {
+                perror("--watch: bind(NETLINK_KOBJECT_UEVENT)");
+                close(fd);
+                return -1;
+        }
+        if (op->verbose > 1)
+                pr2serr("%s: listening for kernel uevents\n", __func__);
+        return fd;
+}
+
+/* Receives one uevent from 'fd' and maps it into 'pend'. Returns -1 on a
+ * fatal error; 1 if uevents were lost, so everything must be checked;
+ * otherwise 0. If 'pend' is NULL (lsscsid) returns 2 for a uevent that
+ * may change any listing. */
+static int
+watch_recv(int fd, const struct lsscsi_opts * op, struct watch_set * pend)
+{
+        int k;
+        ssize_t len;
+        const char * action = NULL;
+        char * devpath = NULL;
+        const char * subsys = NULL;
+        const char * devtype = NULL;
+        const char * cp;
+        struct sockaddr_nl snl;
+        struct iovec iov;
+        struct msghdr msg;
+        char b[WATCH_UEVENT_SZ];
+
+        iov.iov_base = b;
+        iov.iov_len = sizeof(b) - 1;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &snl;
+        msg.msg_namelen = sizeof(snl);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        len = recvmsg(fd, &msg, 0);
+        if (len < 0) {
+                if (ENOBUFS == errno)
+                        return 1;
+                if ((EINTR == errno) || (EAGAIN == errno))
+                        return 0;
+                perror("--watch: recvmsg");
+                return -1;
+        }
+        if ((0 != snl.nl_pid) || (len < 1))
+                return 0;       /* only trust messages from the kernel */
+        b[len] = '\0';
+        /* "ACTION@DEVPATH" then "KEY=VALUE" strings, each null terminated */
+        for (k = 0; k < len; k += strlen(b + k) + 1) {
+                cp = b + k;
+                if (0 == strncmp(cp, "ACTION=", 7))
+                        action = cp + 7;
+                else if (0 == strncmp(cp, "DEVPATH=", 8))
+                        devpath = b + k + 8;
+                else if (0 == strncmp(cp, "SUBSYSTEM=", 10))
+                        subsys = cp + 10;
+                else if (0 == strncmp(cp, "DEVTYPE=", 8))
+                        devtype = cp + 8;
+        }
+        if ((NULL == action) || (NULL == devpath) || (NULL == subsys))
+                return 0;
+        if (op->verbose > 2)
+                pr2serr("uevent: %s %s [%s]\n", action, devpath, subsys);
+        if (NULL == pend)
+                return watch_subsys_wanted(subsys, devtype) ? 2 : 0;
+        watch_map_uevent(op, devpath, subsys, devtype, pend);
+        return 0;
+}
+
+static uint64_t
+watch_now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Reports uevent driven changes until interrupted or an error occurs.
+ * 'fd' is from watch_open(), opened before the listing so that nothing
+ * is missed. Returns the exit status. */
+static int
+watch_uevents(struct lsscsi_opts * op, int fd)
+{
+        int res, k, timeout;
+        uint64_t burst_start = 0;
+        struct watch_set known;
+        struct watch_set pend;
+        struct pollfd pfd;
+
+        memset(&known, 0, sizeof(known));
+        memset(&pend, 0, sizeof(pend));
+        op->json_st.pr_out_hr = false;  /* no document to hold the lines */
+        watch_scan_all(op, &known);
+        fflush(stdout);
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while (true) {
+                if (0 == pend.num)
+                        timeout = -1;
+                else {
+                        k = (int)(watch_now_ms() - burst_start);
+                        timeout = (k >= WATCH_MAX_BURST_MS) ? 0 :
+                                                             WATCH_SETTLE_MS;
+                }
+                res = (timeout != 0) ? poll(&pfd, 1, timeout) : 0;
+                if (res < 0) {
+                        if (EINTR == errno)
+                                continue;
+                        perror("--watch: poll");
+                        break;
+                }
+                if (0 == res) {         /* quiet for a while */
+                        watch_report(op, &known, &pend);
+                        continue;
+                }
+                if (0 == pend.num)
+                        burst_start = watch_now_ms();
+                res = watch_recv(fd, op, &pend);
+                if (res < 0)
+                        break;
+                if (res > 0) {          /* lost some, check all */
+                        if (op->verbose > 0)
+                                pr2serr("--watch: uevents lost, "
+                                        "rescanning\n");
+                        for (k = 0; k < known.num; ++k)
+                                watch_set_add(&pend, known.keys[k].kind,
+                                              known.keys[k].name);
+                        free_topo();
+                        watch_scan_all(op, &pend);
+                }
+        }
+        close(fd);
+        free(known.keys);
+        free(pend.keys);
+        return 1;
+}
+
+/* Return true if able to decode, otherwise false */
+static bool
+one_filter_arg(const char * arg, struct addr_hctl * filtp)
+{
+        int val, k, n, res;
+        uint64_t val64;
+        const char * cp;
+        const char * cpe;
+        char buff[64];
+
+        cp = arg;
+        while ((*cp == ' ') || (*cp == '\t') || (*cp == '['))
+                ++cp;
+        if ('\0' == *cp)
+                return true;
+        for (k = 0; *cp; cp = cpe + 1, ++k) {
+                cpe = strchr(cp, ':');
+                if (cpe)
+                        n = cpe - cp;
+                else {
+                        n = strlen(cp);
+                        cpe = cp + n - 1;
+                }
+                val = -1;
+                val64 = UINT64_LAST;
+                if (n > ((int)sizeof(buff) - 1)) {
+                        pr2serr("intermediate string in %s too long (n=%d)\n",
+                                arg, n);
+                        return false;
+                }
+                if ((n > 0) && ('-' != *cp) && ('*' != *cp) && ('?' != *cp)) {
+                        memcpy(buff, cp, n);
+                        buff[n] = '\0';
+                        if (3 == k) {
+                                if (('0' == buff[0]) &&
+                                    ('X' == toupper((uint8_t)buff[1])))
+                                        res = sscanf(buff, "%" SCNx64 ,
+                                                     &val64);
+                                else
+                                        res = sscanf(buff, "%" SCNu64 ,
+                                                     &val64);
+                        } else {
+                                res = sscanf(buff, "%d", &val);
+                                if ((0 == res) && (0 == k) && (1 == n) &&
+                                    ('N' == toupper((uint8_t)buff[0]))) {
+                                        /* take 'N' as NVMe indication */
+                                        res = 1;
+                                        val = NVME_HOST_NUM;
+                                }
+                        }
+                        if ((1 != res) && (NULL == strchr(buff, ']'))) {
+                                pr2serr("cannot decode %s as an integer\n",
+                                        buff);
+                                return false;
+                        }
+                }
+                switch (k) {
+                case 0: filtp->h = val;
+                        break;
+                case 1: filtp->c = val;
+                        break;
+                case 2: filtp->t = val;
+                        break;
+                case 3: filtp->l = val64;
+                        break;
+                default:
+                        pr2serr("expect three colons at most in %s\n", arg);
+                        return false;
+                }
+        }
+        return true;
+}
+
+/* Return true if able to decode, otherwise false */
+static bool
+decode_filter_arg(const char * a1p, const char * a2p, const char * a3p,
+                  const char * a4p, struct addr_hctl * filtp)
+{
+        int n, rem;
+        char * b1p;
+        char b1[256];
+
+        if ((NULL == a1p) || (NULL == filtp)) {
+                pr2serr("bad call to decode_filter\n");
+                return false;
+        }
+        filtp->h = -1;
+        filtp->c = -1;
+        filtp->t = -1;
+        filtp->l = UINT64_LAST;
+        if ((0 == strncmp("host", a1p, 4)) &&
+            (1 == sscanf(a1p, "host%d", &n)) && (n >= 0)) {
+                filtp->h = n;
+                return true;
+        }
+        if ((NULL == a2p) || strchr(a1p, ':'))
+                return one_filter_arg(a1p, filtp);
+        else {
+                rem = sizeof(b1) - 5;
+                b1p = b1;
+                if ((n = strlen(a1p)) > rem)
+                        goto err_out;
+                my_strcopy(b1p, a1p, rem);
+                b1p += n;
+                *b1p++ = ':';
+                rem -= (n + 1);
+                if ((n = strlen(a2p)) > rem)
+                        goto err_out;
+                my_strcopy(b1p, a2p, rem);
+                if (a3p) {
+                        b1p += n;
+                        *b1p++ = ':';
+                        rem -= (n + 1);
+                        if ((n = strlen(a3p)) > rem)
+                                goto err_out;
+                        my_strcopy(b1p, a3p, rem);
+                        if (a4p) {
+                                b1p += n;
+                                *b1p++ = ':';
+                                rem -= (n + 1);
+                                if ((n = strlen(a4p)) > rem)
+                                        goto err_out;
+                                my_strcopy(b1p, a4p, rem);
+                        }
+                }
+                return one_filter_arg(b1, filtp);
+        }
+err_out:
+        pr2serr("filter arguments exceed internal buffer size (%d)\n",
+                (int)sizeof(b1));
+        return false;
+}
+
+/* Handles short options after '-j' including a sequence of short options
+ * that include one 'j' (for JSON). Want optional argument to '-j' to be
+ * prefixed by '='. Return 0 for good, 1 for syntax error and 2 for exit
+ * with no error. */
+static int
+chk_short_opts(const char sopt_ch, struct lsscsi_opts * op)
+{
+        switch (sopt_ch) {
+        case 'b':
+                op->brief = true;
+                break;
+        case 'c':
+                op->classic = true;
+                break;
+        case 'C':       /* synonym for --hosts, NVMe perspective */
+                op->do_hosts = true;
+                break;
+        case 'd':
+                op->dev_maj_min = true;
+                break;
+        case 'D':       /* --pdt */
+                op->pdt = true;
+                break;
+        case 'g':
+                op->generic = true;
+                break;
+        case 'h':
+                usage();
+                return 2;
+        case 'H':
+                op->do_hosts = true;
+                break;
+        case 'i':
+                if (op->scsi_id)
+                        op->scsi_id_twice = true;
+                else
+                        op->scsi_id = true;
+                break;
+        case 'j':
+                break;  /* simply ignore second 'j' (e.g. '-jxj') */
+        case 'k':
+                op->kname = true;
+                break;
+        case 'l':
+                ++op->long_opt;
+                break;
+        case 'L':
+                op->long_opt += 3;
+                break;
+        case 'N':
+                op->no_nvme = true;
+                break;
+        case 'p':
+                op->protection = true;
+                break;
+        case 'P':
+                op->protmode = true;
+                break;
+        case 's':
+                ++op->ssize;
+                break;
+        case 'S':
+                op->ssize += 3;
+                break;
+        case 't':
+                op->transport_info = true;
+                break;
+        case 'u':
+                ++op->unit;
+                break;
+        case 'U':
+                op->unit += 3;
+                break;
+        case 'v':
+                ++op->verbose;
+                break;
+        case 'V':
+                ++op->version_count;
+                break;
+        case 'w':
+                if (op->wwn)
+                        op->wwn_twice = true;
+                else
+                        op->wwn = true;
+                break;
+        case 'x':
+                ++op->lunhex;
+                break;
+        case '?':
+                usage();
+                return 1;
+        default:
+                pr2serr("unrecognised option code: '%c' [0x%x]\n\n", sopt_ch,
+                        sopt_ch);
+                usage();
+                return 1;
+        }
+        return 0;
+}
+
+
+static const char * const stats_phase_names[STP_NUM] = {
+        "scsi_devices", "nvme_devices", "scsi_hosts", "nvme_hosts",
+        "sas_tree", "dev_nodes", "disk_links", "encl_slots",
+        "topology", "prefetch", "json_output",
+};
+
+/* Adds the counts in 'icp' to the JSON object 'jop' */
+static void
+stats_js_io(sgj_state * jsp, sgj_opaque_p jop, const struct io_counts * icp)
+{
+        sgj_js_nv_i(jsp, jop, "directories_read", icp->dirs);
+        sgj_js_nv_i(jsp, jop, "files_read", icp->attrs);
+        sgj_js_nv_i(jsp, jop, "bytes_read", icp->bytes);
+        sgj_js_nv_i(jsp, jop, "symlinks_read", icp->links);
+        sgj_js_nv_i(jsp, jop, "realpath_calls", icp->canon);
+        sgj_js_nv_i(jsp, jop, "json_values", icp->nodes);
+}
+
+static void
+stats_pr_io(const char * name, double ms, const struct io_counts * icp)
+{
+        pr2serr("  %-13s %10.3f %6" PRIu64 " %7" PRIu64 " %9" PRIu64 " %6"
+                PRIu64 " %6" PRIu64 " %7" PRIu64 "\n", name, ms, icp->dirs,
+                icp->attrs, icp->bytes, icp->links, icp->canon, icp->nodes);
+}
+
+/* Outputs what --stats gathered: as a "lsscsi_stats" object in the JSON
+ * output if there is any, otherwise to stderr. The JSON output (so its
+ * time) is not complete at this point. */
+static void
+stats_report(struct lsscsi_opts * op)
+{
+        int k;
+        uint64_t elapsed = stats_now_ns() - stats.start_ns;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jop;
+        sgj_opaque_p jap;
+        sgj_opaque_p jo2p;
+        const struct stats_phase_rec * prp;
+        const struct stats_dev_rec * srp;
+        struct io_counts total;
+
+        io_snap(&total, true);
+        if (jsp->pr_as_json) {
+                jop = sgj_named_subobject_r(jsp, jsp->basep, "lsscsi_stats");
+                sgj_js_nv_i(jsp, jop, "elapsed_us", elapsed / 1000);
+                stats_js_io(jsp, jop, &total);
+                jap = sgj_named_subarray_r(jsp, jop, "phase_list");
+                for (k = 0, prp = stats.ph; k < STP_NUM; ++k, ++prp) {
+                        if (0 == prp->runs)
+                                continue;
+                        jo2p = sgj_new_unattached_object_r(jsp);
+                        sgj_js_nv_s(jsp, jo2p, "phase", stats_phase_names[k]);
+                        sgj_js_nv_i(jsp, jo2p, "runs", prp->runs);
+                        sgj_js_nv_i(jsp, jo2p, "elapsed_us", prp->ns / 1000);
+                        if (k < STP_NHOSTS) {
+                                sgj_js_nv_i(jsp, jo2p, "devices",
+                                            prp->devices);
+                                sgj_js_nv_i(jsp, jo2p, "devices_cached",
+                                            prp->cached);
+                                sgj_js_nv_i(jsp, jo2p, "device_jobs_us",
+                                            prp->dev_ns / 1000);
+                        }
+                        stats_js_io(jsp, jo2p, &prp->io);
+                        sgj_js_nv_o(jsp, jap, NULL, jo2p);
+                }
+                jap = sgj_named_subarray_r(jsp, jop, "slowest_device_list");
+                for (k = 0, srp = stats.slow; k < stats.num_slow;
+                     ++k, ++srp) {
+                        jo2p = sgj_new_unattached_object_r(jsp);
+                        sgj_js_nv_s(jsp, jo2p, "name", srp->name);
+                        sgj_js_nv_s(jsp, jo2p, "phase",
+                                    stats_phase_names[srp->phase]);
+                        sgj_js_nv_i(jsp, jo2p, "elapsed_us", srp->ns / 1000);
+                        stats_js_io(jsp, jo2p, &srp->io);
+                        sgj_js_nv_o(jsp, jap, NULL, jo2p);
+                }
+                return;
+        }
+        pr2serr("lsscsi stats:\n  %-13s %10s %6s %7s %9s %6s %6s %7s\n",
+                "phase", "ms", "dirs", "files", "bytes", "links", "canon",
+                "values");
+        for (k = 0, prp = stats.ph; k < STP_NUM; ++k, ++prp) {
+                if (prp->runs)
+                        stats_pr_io(stats_phase_names[k], prp->ns / 1e6,
+                                    &prp->io);
+        }
+        stats_pr_io("total", elapsed / 1e6, &total);
+        for (k = 0, prp = stats.ph; k < STP_NHOSTS; ++k, ++prp) {
+                if (prp->devices)
+                        pr2serr("  %s: %d listed (%d from cache), jobs took "
+                                "%.3f ms\n", stats_phase_names[k],
+                                prp->devices, prp->cached, prp->dev_ns / 1e6);
+        }
+        if (stats.num_slow > 0)
+                pr2serr("  slowest:\n");
+        for (k = 0, srp = stats.slow; k < stats.num_slow; ++k, ++srp)
+                stats_pr_io(srp->name, srp->ns / 1e6, &srp->io);
+}
+
+
+/* Lists what 'op' asks for: SCSI devices or hosts then their NVMe
+ * counterparts, or the SAS fabric */
+static void
+list_all(struct lsscsi_opts * op, sgj_opaque_p jop)
+{
+        struct stats_mark sm;
+
+        if (op->sas_tree) {
+                stats_begin(&sm, true);
+                list_sas_tree(op, jop);
+                stats_end(STP_SAS_TREE, &sm, true);
+        } else if (op->do_hosts) {
+                stats_begin(&sm, true);
+                list_shosts(op, jop);
+                stats_end(STP_SHOSTS, &sm, true);
+#if (HAVE_NVME && (! IGNORE_NVME))
+                if ((! op->no_nvme) && (! op->classic)) {
+                        stats_begin(&sm, true);
+                        list_nhosts(op, jop);
+                        stats_end(STP_NHOSTS, &sm, true);
+                }
+#endif
+        } else {
+                stats_begin(&sm, true);
+                list_sdevices(op, jop);
+                stats_end(STP_SDEVS, &sm, true);
+#if (HAVE_NVME && (! IGNORE_NVME))
+                if ((! op->no_nvme) && (! op->classic)) {
+                        stats_begin(&sm, true);
+                        list_ndevices(op, jop);
+                        stats_end(STP_NDEVS, &sm, true);
+                }
+#endif
+        }
+}
+
+/* lsscsid (--daemon[=SOCK]): one process keeps what lsscsi finds in
+ * memory (the device node map, /dev/disk links, transports, enclosure
+ * slots and recent answers) and answers the JSON queries of lsscsi
+ * invocations on a Unix stream socket. A kernel uevent that may change a
+ * listing (see watch_subsys_wanted()) drops all of that before the next
+ * query is answered; an answer is also redone once DAEMON_MEMO_MS old.
+ * A query is the argv[] of an lsscsi invocation, each string null
+ * terminated, then an empty string. Only --json[=JO], --fields=LIST,
+ * --hosts (or --controllers), --no-nvme and a <h:c:t:l> filter may be in
+ * it. The answer is the exit status in decimal and a newline, then what
+ * lsscsi would have written to stdout; a status of -1 means the query is
+ * declined and lsscsi scans for itself. */
+#define DAEMON_REQ_SZ 8192
+#define DAEMON_MAX_ARGS 64
+#define DAEMON_MEMO_NUM 32      /* answers kept */
+#define DAEMON_MEMO_MS 30000    /* then an answer is redone */
+#define DAEMON_IO_MS 2000       /* lsscsid's limit on each client */
+#define DAEMON_CLIENT_MS 10000  /* lsscsi waits this long for an answer */
+#define DAEMON_CONNS 16         /* clients served at once */
+
+struct daemon_memo {
+        int req_len;
+        char * req;             /* query as received */
+        size_t ans_len;
+        char * ans;             /* with its status line */
+        uint64_t made_ms;
+};
+
+/* A client of lsscsid: its query as it arrives, then a copy of the
+ * answer as it is sent. The socket is non-blocking so that a slow client
+ * holds up no other. */
+struct daemon_conn {
+        int fd;                 /* -1 when not in use */
+        int n;                  /* bytes of req[] received */
+        uint64_t end_ms;        /* dropped if not done by then */
+        size_t ans_off;         /* bytes of ans[] sent */
+        size_t ans_len;
+        char * ans;             /* NULL until the query is answered */
+        char req[DAEMON_REQ_SZ];
+};
+
+struct daemon_state {
+        bool stale;             /* a uevent since the last query */
+        int num;                /* memo[] entries in use */
+        int next;               /* replaced next, when all are in use */
+        struct daemon_memo memo[DAEMON_MEMO_NUM];
+        struct daemon_conn conn[DAEMON_CONNS];
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+/* The socket lsscsid serves: LSSCSID_SOCKET from the environment, if
+ * set, else the default. An empty name means none. */
+static const char *
+daemon_sock_name(void)
+{
+        const char * cp = getenv("LSSCSID_SOCKET");
+
+        return cp ? cp : def_daemon_sock;
+}
+
+/* Places argv[1] to argv[argc - 1] in 'op' and 'filtp' if they are a
+ * query that lsscsid answers. Returns true if so. Says nothing about a bad
+ * --fields= since the caller falls back to the option parser for that. */
+static bool
+daemon_query_parse(int argc, char ** argv, struct lsscsi_opts * op,
+                   struct addr_hctl * filtp)
+{
+        int k;
+        int num_fa = 0;
+        const char * ap;
+        const char * fa[4] = {NULL, NULL, NULL, NULL};
+
+        invalidate_hctl(filtp);
+        for (k = 1; k < argc; ++k) {
+                ap = argv[k];
+                if ((0 == strcmp(ap, "-j")) || (0 == strcmp(ap, "--json")))
+                        op->do_json = true;
+                else if ((0 == strncmp(ap, "-j=", 3)) ||
+                         (0 == strncmp(ap, "--json=", 7))) {
+                        op->do_json = true;
+                        op->json_arg = strchr(ap, '=') + 1;
+                } else if ((0 == strcmp(ap, "-H")) ||
+                           (0 == strcmp(ap, "-C")) ||
+                           (0 == strcmp(ap, "--hosts")) ||
+                           (0 == strcmp(ap, "--controllers")))
+                        op->do_hosts = true;
+                else if ((0 == strcmp(ap, "-N")) ||
+                         (0 == strcmp(ap, "--no-nvme")) ||
+                         (0 == strcmp(ap, "--no_nvme")))
+                        op->no_nvme = true;
+                else if (0 == strncmp(ap, "--fields=", 9)) {
+                        if (! fields_parse(ap + 9, op, false))
+                                return false;
+                        op->fields_arg = ap + 9;
+                } else if (('-' != ap[0]) && (num_fa < 4))
+                        fa[num_fa++] = ap;
+                else
+                        return false;
+        }
+        if (num_fa > 0) {
+                ap = fa[0];
+                if ((0 == strncmp("host", ap, 4)) ||
+                    (0 == strncmp("HOST", ap, 4)))
+                        ap += 4;
+                if (! decode_filter_arg(ap, fa[1], fa[2], fa[3], filtp))
+                        return false;
+        }
+        return op->do_json;
+}
+
+/* Returns the exit status of the invocation in argv[] as answered by
+ * lsscsid or -1 if it isn't (no lsscsid, or one that declines). */
+static int
+daemon_client(int argc, char ** argv, const struct lsscsi_opts * op)
+{
+        int fd, k, status, off;
+        int n = 0;
+        ssize_t got;
+        size_t len = 0;
+        size_t sz = 0;
+        char * b = NULL;
+        char * bp;
+        const char * sock = daemon_sock_name();
+        struct sockaddr_un sun;
+        struct timeval tv;
+        struct lsscsi_opts qo;
+        struct addr_hctl qf;
+        char req[DAEMON_REQ_SZ];
+
+        if (('\0' == *sock) || (strlen(sock) >= sizeof(sun.sun_path)))
+                return -1;
+        memset(&qo, 0, sizeof(qo));
+        if (! daemon_query_parse(argc, argv, &qo, &qf))
+                return -1;
+        for (k = 0; k < argc; ++k) {
+                len = strlen(argv[k]) + 1;
+                if ((n + len + 1) > sizeof(req))
+                        return -1;
+                memcpy(req + n, argv[k], len);
+                n += len;
+        }
+        req[n++] = '\0';
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return -1;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        my_strcopy(sun.sun_path, sock, sizeof(sun.sun_path));
+        if (connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+                if (op->verbose > 1)
+                        pr2serr("no lsscsid at %s, scanning\n", sock);
+                close(fd);
+                return -1;
+        }
+        tv.tv_sec = DAEMON_CLIENT_MS / 1000;
+        tv.tv_usec = (DAEMON_CLIENT_MS % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        for (k = 0; k < n; k += got) {
+                got = send(fd, req + k, n - k, MSG_NOSIGNAL);
+                if (got <= 0)
+                        goto fail;
+        }
+        /* all of the answer is read before any is output, so that lsscsi
+         * can still scan for itself if lsscsid goes away part way */
+        for (len = 0; ; len += got) {
+                if ((len + 1) >= sz) {
+                        sz = sz ? (2 * sz) : 65536;
+                        bp = (char *)realloc(b, sz);
+                        if (NULL == bp)
+                                goto fail;
+                        b = bp;
+                }
+                got = recv(fd, b + len, sz - len - 1, 0);
+                if (got < 0) {
+                        if (EINTR == errno) {
+                                got = 0;
+                                continue;
+                        }
+                        goto fail;
+                }
+                if (0 == got)
+                        break;
+        }
+        close(fd);
+        b[len] = '\0';
+        if ((1 != sscanf(b, "%d\n%n", &status, &off)) || (status < 0)) {
+                free(b);
+                return -1;
+        }
+        if (op->verbose > 1)
+                pr2serr("answered by lsscsid at %s\n", sock);
+        fwrite(b + off, 1, len - off, stdout);
+        free(b);
+        return status;
+fail:
+        if (op->verbose > 1)
+                pr2serr("lsscsid at %s: %s, scanning\n", sock,
+                        strerror(errno));
+        close(fd);
+        free(b);
+        return -1;
+}
+
+static void
+daemon_sig_handler(int sig)
+{
+        daemon_stop = sig;
+}
+
+/* Returns a listening socket bound to 'sock', or -1 */
+static int
+daemon_listen(const char * sock)
+{
+        int fd;
+        const char * gname = getenv("LSSCSID_GROUP");
+        struct group * grp = NULL;
+        struct sockaddr_un sun;
+        char d[sizeof(sun.sun_path)];
+
+        if (('\0' == *sock) || (strlen(sock) >= sizeof(sun.sun_path))) {
+                pr2serr("--daemon: bad socket name: %s\n", sock);
+                return -1;
+        }
+        if (gname && *gname && (NULL == (grp = getgrnam(gname)))) {
+                pr2serr("--daemon: unknown LSSCSID_GROUP: %s\n", gname);
+                return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        my_strcopy(sun.sun_path, sock, sizeof(sun.sun_path));
+        /* remove a socket left by an lsscsid that died, not a live one */
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("--daemon: socket");
+                return -1;
+        }
+        if (0 == connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+                pr2serr("--daemon: lsscsid already serving %s\n", sock);
+                close(fd);
+                return -1;
+        }
+        close(fd);
+        unlink(sock);
+        my_strcopy(d, sock, sizeof(d));
+        if ((mkdir(dirname(d), 0755) < 0) && (EEXIST != errno))
+                pr2serr("--daemon: unable to make directory for %s: %s\n",
+                        sock, strerror(errno));
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("--daemon: socket");
+                return -1;
+        }
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+            listen(fd, 64)) {
+                pr2serr("--daemon: unable to serve %s: %s\n", sock,
+                        strerror(errno));
+                close(fd);
+                return -1;
+        }
+        /* only the owner and members of LSSCSID_GROUP, if set, may ask */
+        if (grp && chown(sock, (uid_t)-1, grp->gr_gid))
+                pr2serr("--daemon: unable to give %s to group %s: %s\n",
+                        sock, gname, strerror(errno));
+        chmod(sock, 0660);
+        return fd;
+}
+
+static void
+daemon_drop(struct daemon_state * dsp)
+{
+        int k;
+
+        for (k = 0; k < dsp->num; ++k) {
+                free(dsp->memo[k].req);
+                free(dsp->memo[k].ans);
+        }
+        dsp->num = 0;
+        dsp->next = 0;
+        free_dev_node_list();
+        free_disk_link_index();
+        free_tport_memo();
+        free_encl_slot_index();
+        free_topo();
+}
+
+/* Answers the query in 'req' (of 'req_len' bytes) into 'mp' */
+static void
+daemon_answer(const struct lsscsi_opts * dop, char * req, int req_len,
+              struct daemon_memo * mp)
+{
+        int k;
+        int argc = 0;
+        FILE * fp;
+        sgj_state * jsp;
+        sgj_opaque_p jop;
+        struct lsscsi_opts qo;
+        char * argv[DAEMON_MAX_ARGS + 1];
+
+        mp->ans = NULL;
+        mp->ans_len = 0;
+        for (k = 0; (k < req_len) && req[k] && (argc < DAEMON_MAX_ARGS);
+             k += strlen(req + k) + 1)
+                argv[argc++] = req + k;
+        argv[argc] = NULL;
+        fp = open_memstream(&mp->ans, &mp->ans_len);
+        if (NULL == fp)
+                return;
+        memset(&qo, 0, sizeof(qo));
+        qo.jobs = dop->jobs;
+        qo.io_uring = dop->io_uring;
+        jsp = &qo.json_st;
+        if ((argc > 0) && daemon_query_parse(argc, argv, &qo, &filter) &&
+            sgj_init_state(jsp, qo.json_arg)) {
+                if ((filter.h != -1) || (filter.c != -1) ||
+                    (filter.t != -1) || (filter.l != UINT64_LAST))
+                        filter_active = true;
+                fprintf(fp, "0\n");
+                jop = sgj_start_r("lsscsi", release_str, argc, argv, jsp);
+                sgj_stream_start(jsp, fp);
+                list_all(&qo, jop);
+                sgj_js2file_estr(jsp, NULL, 0, NULL, fp);
+                sgj_finish(jsp);
+        } else
+                fprintf(fp, "-1\n");
+        invalidate_hctl(&filter);
+        filter_active = false;
+        fclose(fp);
+}
+
+/* Returns the answer to the query in 'req' (of 'n' bytes), from memory
+ * if recent. Its ans is NULL if it could not be made. */
+static const struct daemon_memo *
+daemon_query(struct lsscsi_opts * op, struct daemon_state * dsp, char * req,
+             int n)
+{
+        int k;
+        uint64_t now;
+        struct daemon_memo * mp = NULL;
+
+        if (dsp->stale) {
+                if (op->verbose > 1)
+                        pr2serr("lsscsid: uevents, dropping what is held\n");
+                daemon_drop(dsp);
+                dsp->stale = false;
+        }
+        now = watch_now_ms();
+        for (k = 0; k < dsp->num; ++k) {
+                mp = dsp->memo + k;
+                if ((n == mp->req_len) && (0 == memcmp(req, mp->req, n)))
+                        break;
+        }
+        if (k >= dsp->num) {
+                if (dsp->num < DAEMON_MEMO_NUM)
+                        mp = dsp->memo + dsp->num++;
+                else {
+                        mp = dsp->memo + dsp->next;
+                        dsp->next = (dsp->next + 1) % DAEMON_MEMO_NUM;
+                        free(mp->req);
+                        free(mp->ans);
+                }
+                mp->req = (char *)malloc(n);
+                mp->req_len = mp->req ? n : 0;
+                if (mp->req)
+                        memcpy(mp->req, req, n);
+                mp->ans = NULL;
+                mp->made_ms = 0;
+        }
+        if ((NULL == mp->ans) || ((now - mp->made_ms) >= DAEMON_MEMO_MS)) {
+                free(mp->ans);
+                daemon_answer(op, req, n, mp);
+                mp->made_ms = now;
+                if (op->verbose > 1)
+                        pr2serr("lsscsid: answered a query in %d ms\n",
+                                (int)(watch_now_ms() - now));
+        } else if (op->verbose > 1)
+                pr2serr("lsscsid: answered a query from memory\n");
+        return mp;
+}
+
+static void
+daemon_conn_end(struct daemon_conn * cp)
+{
+        close(cp->fd);
+        free(cp->ans);
+        cp->fd = -1;
+        cp->ans = NULL;
+}
+
+/* Sends what the socket of 'cp' takes of its answer. Returns true while
+ * there is more to send. */
+static bool
+daemon_conn_send(struct daemon_conn * cp)
+{
+        ssize_t got;
+
+        while (cp->ans_off < cp->ans_len) {
+                got = send(cp->fd, cp->ans + cp->ans_off,
+                           cp->ans_len - cp->ans_off, MSG_NOSIGNAL);
+                if (got < 0)
+                        return (EAGAIN == errno) || (EINTR == errno);
+                if (0 == got)
+                        return false;
+                cp->ans_off += got;
+        }
+        return false;
+}
+
+/* Takes in what has arrived of the query on 'cp' and, once all of it has,
+ * answers it. Returns true while there is more to receive or send. */
+static bool
+daemon_conn_recv(struct daemon_conn * cp, struct lsscsi_opts * op,
+                 struct daemon_state * dsp)
+{
+        ssize_t got;
+        const struct daemon_memo * mp;
+
+        while ((cp->n < 2) || cp->req[cp->n - 1] || cp->req[cp->n - 2]) {
+                if (cp->n >= (int)sizeof(cp->req))
+                        return false;
+                got = recv(cp->fd, cp->req + cp->n, sizeof(cp->req) - cp->n,
+                           0);
+                if (got < 0)
+                        return (EAGAIN == errno) || (EINTR == errno);
+                if (0 == got)
+                        return false;
+                cp->n += got;
+        }
+        mp = daemon_query(op, dsp, cp->req, cp->n);
+        if ((NULL == mp->ans) ||
+            (NULL == (cp->ans = (char *)malloc(mp->ans_len + 1))))
+                return false;
+        memcpy(cp->ans, mp->ans, mp->ans_len);
+        cp->ans_len = mp->ans_len;
+        cp->ans_off = 0;
+        return daemon_conn_send(cp);
+}
+
+/* Takes a client from 'lfd', in place of the one that has waited longest
+ * when DAEMON_CONNS are being served */
+static void
+daemon_accept(int lfd, struct daemon_state * dsp, int vb)
+{
+        int fd, k;
+        int j = 0;
+        struct daemon_conn * cp;
+
+        fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0)
+                return;
+        for (k = 0; k < DAEMON_CONNS; ++k) {
+                if (dsp->conn[k].fd < 0)
+                        break;
+                if (dsp->conn[k].end_ms < dsp->conn[j].end_ms)
+                        j = k;
+        }
+        if (k < DAEMON_CONNS)
+                j = k;
+        else {
+                if (vb > 1)
+                        pr2serr("lsscsid: busy, dropping the oldest "
+                                "client\n");
+                daemon_conn_end(dsp->conn + j);
+        }
+        cp = dsp->conn + j;
+        cp->fd = fd;
+        cp->n = 0;
+        cp->ans = NULL;
+        cp->end_ms = watch_now_ms() + DAEMON_IO_MS;
+}
+
+/* --daemon[=SOCK]: serves queries until SIGINT or SIGTERM. Returns the
+ * exit status. */
+static int
+daemon_serve(struct lsscsi_opts * op)
+{
+        int ufd, lfd, res, k, np, tmo;
+        uint64_t now;
+        struct daemon_state * dsp;
+        struct daemon_conn * cp;
+        struct sigaction sa;
+        int ci[2 + DAEMON_CONNS];       /* conn[] index of each pfd[] */
+        struct pollfd pfd[2 + DAEMON_CONNS];
+
+        dsp = (struct daemon_state *)calloc(1, sizeof(*dsp));
+        if (NULL == dsp) {
+                pr2serr("--daemon: out of memory\n");
+                return 1;
+        }
+        for (k = 0; k < DAEMON_CONNS; ++k)
+                dsp->conn[k].fd = -1;
+        /* uevents are collected before the first query is answered */
+        ufd = watch_open(op);
+        if (ufd < 0) {
+                free(dsp);
+                return 1;
+        }
+        lfd = daemon_listen(op->daemon_sock);
+        if (lfd < 0) {
+                close(ufd);
+                free(dsp);
+                return 1;
+        }
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = daemon_sig_handler;     /* without SA_RESTART */
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN);
+        if (op->verbose > 0)
+                pr2serr("lsscsid: serving %s\n", op->daemon_sock);
+        pfd[0].fd = ufd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = lfd;
+        pfd[1].events = POLLIN;
+        res = 0;
+        while (! daemon_stop) {
+                /* a client is given DAEMON_IO_MS to send its query and
+                 * take the answer, each being served as it is ready */
+                now = watch_now_ms();
+                tmo = -1;
+                for (np = 2, k = 0; k < DAEMON_CONNS; ++k) {
+                        cp = dsp->conn + k;
+                        if (cp->fd < 0)
+                                continue;
+                        if (now >= cp->end_ms) {
+                                if (op->verbose > 1)
+                                        pr2serr("lsscsid: dropping a slow "
+                                                "client\n");
+                                daemon_conn_end(cp);
+                                continue;
+                        }
+                        if ((tmo < 0) || ((int)(cp->end_ms - now) < tmo))
+                                tmo = (int)(cp->end_ms - now);
+                        pfd[np].fd = cp->fd;
+                        pfd[np].events = cp->ans ? POLLOUT : POLLIN;
+                        pfd[np].revents = 0;
+                        ci[np++] = k;
+                }
+                if (poll(pfd, np, tmo) < 0) {
+                        if (EINTR == errno)
+                                continue;
+                        perror("--daemon: poll");
+                        res = 1;
+                        break;
+                }
+                /* take in all pending uevents before any query */
+                while (pfd[0].revents & POLLIN) {
+                        int r = watch_recv(ufd, op, NULL);
+
+                        if (r < 0) {
+                                res = 1;
+                                goto fini;
+                        }
+                        if (r > 0)
+                                dsp->stale = true;
+                        if (poll(pfd, 1, 0) <= 0)
+                                break;
+                }
+                for (k = 2; k < np; ++k) {
+                        if (0 == pfd[k].revents)
+                                continue;
+                        cp = dsp->conn + ci[k];
+                        if (! (cp->ans ? daemon_conn_send(cp) :
+                                         daemon_conn_recv(cp, op, dsp)))
+                                daemon_conn_end(cp);
+                }
+                if (pfd[1].revents & POLLIN)
+                        daemon_accept(lfd, dsp, op->verbose);
+        }
+fini:
+        if (op->verbose > 0)
+                pr2serr("lsscsid: stopping\n");
+        for (k = 0; k < DAEMON_CONNS; ++k) {
+                if (dsp->conn[k].fd >= 0)
+                        daemon_conn_end(dsp->conn + k);
+        }
+        close(lfd);
+        unlink(op->daemon_sock);
+        close(ufd);
+        daemon_drop(dsp);
+        free(dsp);
+        return res;
+}
+
+/* Sets sysfsroot from 'l_sysfsroot' or, if that is NULL, sysfsroot,
+ * devfsroot and the /dev/disk directories below 'l_sysroot' which may also
+ * be NULL (for "/"). Both have been checked: absolute and not too long. */
+static void
+set_fsroots(const char * l_sysfsroot, const char * l_sysroot, int vb)
+{
+        int n;
+
+        if (l_sysfsroot) {
+                if (strlen(l_sysfsroot) > 1)
+                        my_strcopy(sysfsroot, l_sysfsroot, sizeof(sysfsroot));
+        } else {
+                if (NULL == l_sysroot)
+                        l_sysroot = "";
+                n = strlen(l_sysroot);
+                if ((n > 0) && ('/' == l_sysroot[n - 1]))
+                        --n;
+                snprintf(sysfsroot, sizeof(sysfsroot), "%.*s/sys", n,
+                         l_sysroot);
+                snprintf(devfsroot, sizeof(devfsroot), "%.*s/dev", n,
+                         l_sysroot);
+                snprintf(dev_disk_byid_dir, sizeof(dev_disk_byid_dir),
+                         "%s/disk/by-id", devfsroot);
+                snprintf(dev_disk_bypath_dir, sizeof(dev_disk_bypath_dir),
+                         "%s/disk/by-path", devfsroot);
+                if ((vb > 1) && (n > 0))
+                        pr2serr("Alternate devfs root: %s\n", devfsroot);
+        }
+        if (vb > 1)
+                pr2serr("Alternate sysfs root: %s\n", sysfsroot);
+}
+
+/* Maps the file 'fn' read only, placing its length in *lenp. Returns NULL
+ * (with errno set) if it can't be mapped or is empty. */
+static const uint8_t *
+vfs_map(const char * fn, size_t * lenp)
+{
+        int fd;
+        void * p;
+        struct stat a_stat;
+
+        fd = open(fn, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return NULL;
+        if (fstat(fd, &a_stat) < 0) {
+                close(fd);
+                return NULL;
+        }
+        if (a_stat.st_size < 1) {
+                close(fd);
+                errno = ENODATA;
+                return NULL;
+        }
+        p = mmap(NULL, a_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (MAP_FAILED == p)
+                return NULL;
+        *lenp = a_stat.st_size;
+        return (const uint8_t *)p;
+}
+
+/* Checks the archive 'img' of 'len' bytes: its header, its roots (placed
+ * in *sysfspp and *devfspp) and that each record lies within it, in key
+ * order. Returns NULL if it is sound, else what is wrong with it. */
+static const char *
+vfs_img_check(const uint8_t * img, size_t len, const char ** sysfspp,
+              const char ** devfspp)
+{
+        uint32_t k;
+        const char * sp;
+        const char * dp;
+        const char * ep = (const char *)img + len;
+        const struct vfs_rec * rp;
+        struct vfs_hdr hdr;
+
+        if (len < sizeof(hdr))
+                return "not a capture archive";
+        memcpy(&hdr, img, sizeof(hdr));
+        if (memcmp(hdr.magic, VFS_MAGIC, sizeof(hdr.magic)))
+                return "not a capture archive";
+        if (VFS_BOM != hdr.bom)
+                return "captured on a machine of the other byte order";
+        if ((hdr.size != len) || (hdr.index_off % sizeof(uint32_t)) ||
+            (hdr.index_off > len) || (hdr.roots_off >= len) ||
+            (hdr.num > (len - hdr.index_off) / sizeof(*rp)) ||
+            (hdr.num > (uint32_t)(0x7fffffff - VFS_FD_BASE)))
+                return "truncated or malformed";
+        sp = (const char *)img + hdr.roots_off;
+        dp = (const char *)memchr(sp, '\0', ep - sp);
+        if ((NULL == dp) || (++dp >= ep) || (NULL == memchr(dp, '\0', ep - dp))
+            || (strlen(sp) >= sizeof(sysfsroot)) ||
+            (strlen(dp) >= sizeof(devfsroot)))
+                return "malformed sysfs or /dev root";
+        rp = (const struct vfs_rec *)(img + hdr.index_off);
+        for (k = 0; k < hdr.num; ++k, ++rp) {
+                if ((rp->key_len < 1) || (rp->key_off >= len) ||
+                    (rp->key_len >= len - rp->key_off) ||
+                    img[rp->key_off + rp->key_len] || (rp->val_off > len) ||
+                    (rp->val_len > len - rp->val_off))
+                        return "a record lies outside the archive";
+                if ((k > 0) &&
+                    (vfs_key_cmp((const char *)img + rp[-1].key_off,
+                                 rp[-1].key_len,
+                                 (const char *)img + rp->key_off,
+                                 rp->key_len) >= 0))
+                        return "records out of order";
+        }
+        *sysfspp = sp;
+        *devfspp = dp;
+        return NULL;
+}
+
+/* Maps the --replay= archive 'fn' and takes the sysfs and /dev roots from
+ * it. Returns false (after a message) if it can't be used. */
+static bool
+vfs_replay_open(const char * fn, int vb)
+{
+        size_t len = 0;
+        const uint8_t * img;
+        const char * why;
+        const char * sp = NULL;
+        const char * dp = NULL;
+        struct vfs_hdr hdr;
+
+        img = vfs_map(fn, &len);
+        if (NULL == img) {
+                pr2serr("--replay: unable to map %s: %s\n", fn,
+                        strerror(errno));
+                return false;
+        }
+        if ((why = vfs_img_check(img, len, &sp, &dp))) {
+                pr2serr("--replay: %s: %s\n", fn, why);
+                munmap((void *)img, len);
+                return false;
+        }
+        memcpy(&hdr, img, sizeof(hdr));
+        vfs.fn = fn;
+        vfs.img = img;
+        vfs.img_len = len;
+        vfs.recs = (const struct vfs_rec *)(img + hdr.index_off);
+        vfs.num_recs = hdr.num;
+        vfs.mode = VFS_REPLAY;
+        my_strcopy(sysfsroot, sp, sizeof(sysfsroot));
+        my_strcopy(devfsroot, dp, sizeof(devfsroot));
+        snprintf(dev_disk_byid_dir, sizeof(dev_disk_byid_dir),
+                 "%s/disk/by-id", devfsroot);
+        snprintf(dev_disk_bypath_dir, sizeof(dev_disk_bypath_dir),
+                 "%s/disk/by-path", devfsroot);
+        if (vb > 1)
+                pr2serr("Replaying %u records of %s, captured below %s and "
+                        "%s\n", vfs.num_recs, fn, sysfsroot, devfsroot);
+        return true;
+}
+
+/* qsort(3) helper: struct vfs_ent by key */
+static int
+vfs_ent_cmp(const void * a, const void * b)
+{
+        const struct vfs_ent * aep = (const struct vfs_ent *)a;
+        const struct vfs_ent * bep = (const struct vfs_ent *)b;
+
+        return vfs_key_cmp(aep->kv, aep->key_len, bep->kv, bep->key_len);
+}
+
+/* Writes the --capture= archive. If one of the same roots is there already
+ * its records are added to this run's first, so one archive can hold the
+ * reads of several invocations. The archive is written beside the old one
+ * then renamed over it. Returns false (after a message) on failure. */
+static bool
+vfs_capture_write(int vb)
+{
+        bool ok;
+        uint32_t k, n;
+        uint64_t off, roots_len;
+        size_t len = 0;
+        const uint8_t * img;
+        const char * sp;
+        const char * dp;
+        const struct vfs_rec * rp;
+        struct vfs_ent * ents = NULL;
+        FILE * fp;
+        struct vfs_hdr hdr;
+        struct vfs_rec rec;
+        char b[LMAX_PATH];
+        static const char pad[8];
+
+        if ((img = vfs_map(vfs.fn, &len))) {
+                if ((NULL == vfs_img_check(img, len, &sp, &dp)) &&
+                    (0 == strcmp(sp, sysfsroot)) &&
+                    (0 == strcmp(dp, devfsroot))) {
+                        memcpy(&hdr, img, sizeof(hdr));
+                        rp = (const struct vfs_rec *)(img + hdr.index_off);
+                        for (k = 0; k < hdr.num; ++k, ++rp)
+                                vfs_put((const char *)img + rp->key_off,
+                                        rp->key_len, img + rp->val_off,
+                                        rp->val_len);
+                } else if (vb > 0)
+                        pr2serr("--capture: replacing %s\n", vfs.fn);
+                munmap((void *)img, len);
+        }
+        /* a task abandoned by --device-timeout may still be adding */
+        pthread_mutex_lock(&vfs.mtx);
+        if (vfs.num > 0)
+                ents = (struct vfs_ent *)malloc(vfs.num * sizeof(*ents));
+        for (k = 0, n = 0; ents && (k < vfs.size); ++k) {
+                if (vfs.ents[k].kv)
+                        ents[n++] = vfs.ents[k];
+        }
+        pthread_mutex_unlock(&vfs.mtx);
+        if (n > 1)
+                qsort(ents, n, sizeof(*ents), vfs_ent_cmp);
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, VFS_MAGIC, sizeof(hdr.magic));
+        hdr.bom = VFS_BOM;
+        hdr.num = n;
+        hdr.roots_off = sizeof(hdr);
+        roots_len = strlen(sysfsroot) + 1 + strlen(devfsroot) + 1;
+        off = hdr.roots_off + roots_len;
+        for (k = 0; k < n; ++k)
+                off += ents[k].key_len + 1 + ents[k].val_len;
+        hdr.size = ((off + 7) & ~(uint64_t)7) + (uint64_t)n * sizeof(rec);
+        if (hdr.size > UINT32_MAX) {
+                pr2serr("--capture: too much captured for %s\n", vfs.fn);
+                free(ents);
+                return false;
+        }
+        hdr.index_off = (off + 7) & ~(uint64_t)7;
+
+        snprintf(b, sizeof(b), "%s.tmp", vfs.fn);
+        fp = fopen(b, "w");
+        if (NULL == fp) {
+                pr2serr("--capture: unable to open %s: %s\n", b,
+                        strerror(errno));
+                free(ents);
+                return false;
         }
-        return cmp_hctl(&left_hctl, &right_hctl);
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        fwrite(sysfsroot, strlen(sysfsroot) + 1, 1, fp);
+        fwrite(devfsroot, strlen(devfsroot) + 1, 1, fp);
+        for (k = 0; k < n; ++k)     /* key, its null then the value */
+                fwrite(ents[k].kv, ents[k].key_len + 1 + ents[k].val_len,
+                       1, fp);
+        fwrite(pad, hdr.index_off - off, 1, fp);
+        off = hdr.roots_off + roots_len;
+        for (k = 0; k < n; ++k) {
+                rec.key_off = off;
+                rec.key_len = ents[k].key_len;
+                rec.val_off = off + ents[k].key_len + 1;
+                rec.val_len = ents[k].val_len;
+                fwrite(&rec, sizeof(rec), 1, fp);
+                off = rec.val_off + rec.val_len;
+        }
+        free(ents);
+        ok = (0 == ferror(fp));
+        ok = (0 == fclose(fp)) && ok;
+        if (ok && (rename(b, vfs.fn) < 0))
+                ok = false;
+        if (! ok) {
+                pr2serr("--capture: unable to write %s: %s\n", vfs.fn,
+                        strerror(errno));
+                unlink(b);
+        } else if (vb > 0)
+                pr2serr("--capture: %u records in %s\n", n, vfs.fn);
+        return ok;
 }
 
-#endif          /* (HAVE_NVME && (! IGNORE_NVME)) */
-
-/* List SCSI devices (LUs). */
+/* Frees what capture or replay holds (and goes back to live), unless a
+ * task abandoned by --device-timeout may still use it */
 static void
-list_sdevices(struct lsscsi_opts * op, sgj_opaque_p jop)
+vfs_end(void)
 {
-        int num, k, n, blen, nlen;
-        struct dirent ** namelist;
-        sgj_state * jsp = &op->json_st;
-        sgj_opaque_p jap = NULL;
-        sgj_opaque_p jo2p = NULL;
-        char buff[LMAX_DEVPATH];
-        char name[LMAX_NAME];
-
-        blen = sizeof(buff);
-        nlen = sizeof(name);
-        snprintf(buff, blen, "%s%s", sysfsroot, bus_scsi_dev_s);
+        int k;
 
-        num = scandir(buff, &namelist, sdev_dir_scan_select,
-                      sdev_scandir_sort);
-        if (num < 0) {  /* scsi mid level may not be loaded */
-                if (op->verbose > 1) {
-                        n = 0;
-                        n += sg_scn3pr(name, nlen, n, "%s: scandir: ",
-                                       __func__);
-                        sg_scn3pr(name, nlen, n, "%s", buff);
-                        perror(name);
-                        sgj_pr_hr(jsp, "SCSI mid level %s\n", mmnbl_s);
-                }
-                if (op->classic)
-                        sgj_pr_hr(jsp, "Attached devices: %s\n", none_s);
+        if (dev_tasks_stray())
                 return;
-        }
-        if (op->classic)
-                sgj_pr_hr(jsp, "Attached devices: %s\n", (num ? "" : none_s));
+        if (VFS_REPLAY == vfs.mode)
+                munmap((void *)vfs.img, vfs.img_len);
+        for (k = 0; k < (int)vfs.size; ++k)
+                free(vfs.ents[k].kv);
+        free(vfs.ents);
+        for (k = 0; k < vfs.num_fds; ++k)
+                free(vfs.fd_paths[k]);
+        free(vfs.fd_paths);
+        vfs.mode = VFS_LIVE;
+        vfs.num = 0;
+        vfs.size = 0;
+        vfs.ents = NULL;
+        vfs.num_fds = 0;
+        vfs.fd_paths = NULL;
+        vfs.fn = NULL;
+        vfs.img = NULL;
+        vfs.img_len = 0;
+        vfs.recs = NULL;
+        vfs.num_recs = 0;
+}
 
-        if (jsp->pr_as_json) {
-                sgj_js_nv_i(jsp, jsp->basep,
-                            "number_of_attached_scsi_devices", num);
-                jap = sgj_named_subarray_r(jsp, jop,
-                                           "attached_scsi_device_list");
-        }
+/* liblsscsi: the records of lsscsi_scan() are filled by the same resolvers
+ * as --fields= uses. See liblsscsi.h . */
+struct lsscsi_ctx {
+        int num;                /* entries from the last scan */
+        int max;                /* allocated in ents */
+        int next;               /* of lsscsi_next() */
+        struct lsscsi_entry * ents;
+        struct lsscsi_opts opts;        /* as if no options were given */
+};
 
-        for (k = 0; k < num; ++k) {
-                my_strcopy(name, namelist[k]->d_name, nlen);
-                transport_id = TRANSPORT_UNKNOWN;
-                jo2p = sgj_new_unattached_object_r(jsp);
-                one_sdev_entry(buff, name, op, jo2p);
-                sgj_js_nv_o(jsp, jap, NULL /* implies an array add */, jo2p);
-                free(namelist[k]);
-        }
-        free(namelist);
-        if (op->wwn)
-                free_disk_wwn_node_list();
+/* Returns a new (zeroed) entry at the end of ctxp->ents, NULL if out of
+ * memory */
+static struct lsscsi_entry *
+lib_new_entry(struct lsscsi_ctx * ctxp, int kind, const char * name)
+{
+        struct lsscsi_entry * ep;
+
+        if (ctxp->num >= ctxp->max) {
+                int max = ctxp->max ? (2 * ctxp->max) : 64;
+
+                ep = (struct lsscsi_entry *)realloc(ctxp->ents,
+                                                    max * sizeof(*ep));
+                if (NULL == ep)
+                        return NULL;
+                ctxp->ents = ep;
+                ctxp->max = max;
+        }
+        ep = ctxp->ents + ctxp->num++;
+        memset(ep, 0, sizeof(*ep));
+        ep->kind = kind;
+        invalidate_hctl(&ep->hctl);
+        ep->pdt = -1;
+        ep->transport_id = TRANSPORT_UNKNOWN;
+        my_strcopy(ep->name, name, sizeof(ep->name));
+        return ep;
 }
 
-#if (HAVE_NVME && (! IGNORE_NVME))
+/* Copies what 'fn' resolves into 'out', leaves it empty if nothing */
+static void
+lib_fld(fld_resolver_fn fn, struct fld_ctx_t * fcp, char * out, int out_len)
+{
+        char b[LMAX_DEVPATH];
 
-/* List NVME devices (namespaces). */
+        if (fn(fcp, b, sizeof(b)))
+                my_strcopy(out, b, out_len);
+}
+
+/* Fills 'ep' for the SCSI device or NVMe namespace readied in 'fcp' */
 static void
-list_ndevices(struct lsscsi_opts * op, sgj_opaque_p jop)
+lib_dev_entry(struct fld_ctx_t * fcp, struct lsscsi_entry * ep)
 {
-        int num, num2, k, j, n, blen, b2len, elen;
-        struct dirent ** name_list;
-        struct dirent ** namelist2;
-        sgj_state * jsp = &op->json_st;
-        sgj_opaque_p jap = NULL;
-        sgj_opaque_p jo2p = NULL;
-        char buff[LMAX_DEVPATH];
-        char buff2[LMAX_DEVPATH];
-        char ebuf[120];
+        int pdt;
+        char b[LMAX_NAME];
 
-        blen = sizeof(buff);
-        b2len = sizeof(buff2);
-        elen = sizeof(ebuf);
-        n = sg_scn3pr(buff, blen, 0, "%s", sysfsroot);
-        sg_scn3pr(buff, blen, n, "%s", class_nvme);
+        fld_tuple(fcp, &ep->hctl);
+        if (fcp->nvme)
+                ep->pdt = 0;             /* disk */
+        else if (get_value_at(fcp->dcp->dev_fd, "type", b, sizeof(b)) &&
+                 (1 == sscanf(b, "%d", &pdt)))
+                ep->pdt = pdt;
+        lib_fld(fld_vendor, fcp, ep->vendor, sizeof(ep->vendor));
+        lib_fld(fld_model, fcp, ep->model, sizeof(ep->model));
+        lib_fld(fld_rev, fcp, ep->rev, sizeof(ep->rev));
+        if (fcp->nvme && fld_attr2(fcp, NULL, ser_s, b, sizeof(b)))
+                my_strcopy(ep->serial, b, sizeof(ep->serial));
+        lib_fld(fld_dev, fcp, ep->dev_node, sizeof(ep->dev_node));
+        if (ep->dev_node[0] && fld_maj_min(fcp, b, sizeof(b)))
+                sscanf(b, "%u:%u", &ep->dev_major, &ep->dev_minor);
+        lib_fld(fld_sg, fcp, ep->sg_node, sizeof(ep->sg_node));
+        lib_fld(fld_wwn, fcp, ep->wwn, sizeof(ep->wwn));
+        lib_fld(fld_lu_name, fcp, ep->lu_name, sizeof(ep->lu_name));
+        if (fld_size(fcp, b, sizeof(b)))        /* opts.ssize is 3 */
+                ep->size_512 = strtoull(b, NULL, 10);
+        lib_fld(fld_transport, fcp, ep->transport, sizeof(ep->transport));
+        if (fcp->nvme)
+                ep->transport_id = (0 == strcmp(pcie_s, ep->transport)) ?
+                                   TRANSPORT_PCIE : TRANSPORT_UNKNOWN;
+        else
+                ep->transport_id = fcp->dcp->transport_id;
+}
 
-        num = scandir(buff, &name_list, ndev_dir_scan_select,
-                      nhost_scandir_sort);
-        if (num < 0) {  /* NVMe module may not be loaded */
-                if (op->verbose > 1) {
-                        n = sg_scn3pr(ebuf, elen, 0, "%s: scandir: ",
-                                      __func__);
-                        sg_scn3pr(ebuf, elen, n, "%s", buff);
-                        perror(ebuf);
-                        sgj_pr_hr(jsp, "NVMe %s\n", mmnbl_s);
-                }
-                return;
-        }
-        if (jsp->pr_as_json) {
-                sgj_js_nv_i(jsp, jsp->basep,
-                            "number_of_attached_nvme_devices", num);
-                jap = sgj_named_subarray_r(jsp, jop,
-                                           "attached_nvme_device_list");
-        }
+static int
+lib_scan_sdevs(struct lsscsi_ctx * ctxp)
+{
+        int k, dir_fd;
+        int res = 0;
+        const struct topo_t * tp = topo_get(TOPO_SDEV);
+        const struct topo_node * np;
+        struct lsscsi_entry * ep;
+        struct dev_ctx_t dc;
+        struct fld_ctx_t fc;
+        char buff[LMAX_DEVPATH];
 
-        for (k = 0; k < num; ++k) {
-                n = sg_scn3pr(buff2, b2len, 0, "%s", buff);
-                sg_scn3pr(buff2, b2len, n, "%s", name_list[k]->d_name);
-                free(name_list[k]);
-                num2 = scandir(buff2, &namelist2, ndev_dir_scan_select2,
-                               sdev_scandir_sort);
-                if (num2 < 0) {
-                        if (op->verbose > 0) {
-                                n = sg_scn3pr(ebuf, elen, 0,
-                                              "%s: scandir(2): ", __func__);
-                                sg_scn3pr(ebuf, elen, n, "%s", buff);
-                                perror(ebuf);
-                        }
-                        /* already freed name_list[k] so move to next */
-                        ++k;
+        if (tp->dir_err[TK_SDEV])       /* scsi mid level may not be loaded */
+                return 0;
+        snprintf(buff, sizeof(buff), "%s%s", sysfsroot, bus_scsi_dev_s);
+        dir_fd = opendir_fd(AT_FDCWD, buff);
+        for (k = 0, np = tp->nodes[TK_SDEV]; (0 == res) &&
+             (k < tp->num[TK_SDEV]); ++k, ++np) {
+                if (filter_active && ((! np->addr_ok) ||
+                                      (! sdev_hctl_wanted(&np->hctl))))
+                        continue;
+                if (NULL == (ep = lib_new_entry(ctxp, LSSCSI_SDEV,
+                                                topo_name(np)))) {
+                        res = -ENOMEM;
                         break;
                 }
-                for (j = 0; j < num2; ++j) {
-                        transport_id = TRANSPORT_UNKNOWN;
-                        jo2p = sgj_new_unattached_object_r(jsp);
-                        one_ndev_entry(buff2, namelist2[j]->d_name, op, jo2p);
-                        sgj_js_nv_o(jsp, jap, NULL /* implies an array add */,
-                                    jo2p);
-                        free(namelist2[j]);
-                }
-                free(namelist2);
-        }
-        for ( ; k < num; ++k) /* clean out rest of name_list[] */
-                free(name_list[k]);
-
-        free(name_list);
-        if (op->wwn)
-                free_disk_wwn_node_list();
+                dev_ctx_init(&dc, dir_fd);
+                dc.hctlp = np->addr_ok ? &np->hctl : NULL;
+                memset(&fc, 0, sizeof(fc));
+                fc.devname = topo_name(np);
+                fc.op = &ctxp->opts;
+                fc.dcp = &dc;
+                snprintf(fc.dir, sizeof(fc.dir), "%s/%s", buff, fc.devname);
+                dc.dev_fd = opendir_fd(AT_FDCWD, fc.dir);
+                lib_dev_entry(&fc, ep);
+                if (dc.dev_fd >= 0)
+                        vfs_close(dc.dev_fd);
+        }
+        if (dir_fd >= 0)
+                vfs_close(dir_fd);
+        return res;
 }
 
-#endif          /* (HAVE_NVME && (! IGNORE_NVME)) */
-
-/* List SCSI host (initiator) attributes when --long given (one or more
- * times). */
-static void
-longer_sh_entry(const char * path_name, struct lsscsi_opts * op,
-                sgj_opaque_p jop)
+static int
+lib_scan_shosts(struct lsscsi_ctx * ctxp)
 {
-        int n;
-        sgj_state * jsp = &op->json_st;
-        char value[LMAX_NAME];
-        char b[168];
-        static const int vlen = sizeof(value);
-        static const int blen = sizeof(b);
-        static const char * am_s = "active_mode";
-        static const char * cq_s = "can_queue";
-        static const char * cpl_s = "cmd_per_lun";
-        static const char * hb_s = "host_busy";
-        static const char * nhq_s = "nr_hw_queues";
-        static const char * sgt_s = "sg_tablesize";
-        static const char * state_s = "state";
-        static const char * ubm_s = "use_blk_mq";
+        int k;
+        int res = 0;
+        const struct topo_t * tp = topo_get(TOPO_SHOST);
+        const struct topo_node * np;
+        struct lsscsi_entry * ep;
+        struct dev_ctx_t dc;
+        char buff[LMAX_DEVPATH];
+        char b[LMAX_PATH];
 
-        if (op->transport_info) {
-                transport_init_longer(path_name, op, jop);
-                return;
-        }
-        if (op->long_opt >= 3) {
-                if (get_value(path_name, am_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, am_s, SEP_EQ_NO_SP, value);
-                if (get_value(path_name, cq_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, cq_s, SEP_EQ_NO_SP, value);
-                else if (op->verbose)
-                        sgj_pr_hr(jsp, "  %s=?\n", cq_s);
-                if (get_value(path_name, cpl_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, cpl_s, SEP_EQ_NO_SP, value);
-                else if (op->verbose)
-                        sgj_pr_hr(jsp, "  %s=?\n", cpl_s);
-                if (get_value(path_name, hb_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, hb_s, SEP_EQ_NO_SP, value);
-                else if (op->verbose)
-                        sgj_pr_hr(jsp, "  %s=?\n", hb_s);
-                if (get_value(path_name, nhq_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, nhq_s, SEP_EQ_NO_SP, value);
-                else if (op->verbose)
-                        sgj_pr_hr(jsp, "  %s=?\n", nhq_s);
-                if (get_value(path_name, sgt_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, sgt_s, SEP_EQ_NO_SP, value);
-                else if (op->verbose)
-                        sgj_pr_hr(jsp, "  %s=?\n", sgt_s);
-                if (get_value(path_name, state_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, state_s, SEP_EQ_NO_SP, value);
-                else if (op->verbose)
-                        sgj_pr_hr(jsp, "  %s=?\n", state_s);
-                if (get_value(path_name, uniqi_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, uniqi_s, SEP_EQ_NO_SP, value);
-                else if (op->verbose)
-                        sgj_pr_hr(jsp, "  %s=?\n", uniqi_s);
-                if (get_value(path_name, ubm_s, value, vlen))
-                        sgj_haj_vs(jsp, jop, 2, ubm_s, SEP_EQ_NO_SP, value);
-        } else if (op->long_opt > 0) {
-                n = 0;
-                if (get_value(path_name, cpl_s, value, vlen)) {
-                        n += sg_scn3pr(b, blen, n, "  %s=%-4s ", cpl_s,
-                                       value);
-                        if (jsp->pr_as_json)
-                                sgj_js_nv_s(jsp, jop, cpl_s, value);
-                } else if (op->verbose)
-                        n += sg_scn3pr(b, blen, n, "  %s=????\n", cpl_s);
+        snprintf(buff, sizeof(buff), "%s%s", sysfsroot, scsi_host_s);
+        for (k = 0, np = tp->nodes[TK_SHOST]; k < tp->num[TK_SHOST];
+             ++k, ++np) {
+                const char * devname = topo_name(np);
 
-                if (get_value(path_name, hb_s, value, vlen)) {
-                        n += sg_scn3pr(b, blen, n, "%s=%-4s ", hb_s, value);
-                        if (jsp->pr_as_json)
-                                sgj_js_nv_s(jsp, jop, hb_s, value);
-                } else if (op->verbose)
-                        n += sg_scn3pr(b, blen, n, "%s=????\n", hb_s);
+                if (! shost_num_wanted(np->hctl.h))
+                        continue;
+                if (NULL == (ep = lib_new_entry(ctxp, LSSCSI_SHOST,
+                                                devname))) {
+                        res = -ENOMEM;
+                        break;
+                }
+                if (np->addr_ok)
+                        ep->hctl.h = np->hctl.h;
+                snprintf(b, sizeof(b), "%s%s", buff, devname);
+                if (get_value(b, "proc_name", ep->driver,
+                              sizeof(ep->driver)) &&
+                    ((0 == strncmp(ep->driver, nulln1_s, 6)) ||
+                     (0 == strncmp(ep->driver, nulln2_s, 6))))
+                        ep->driver[0] = '\0';
+                dev_ctx_init(&dc, -1);
+                if (transport_h_init(devname, &dc, sizeof(ep->transport),
+                                     ep->transport))
+                        trim_lead_trail(ep->transport, false, true);
+                else
+                        ep->transport[0] = '\0';
+                ep->transport_id = dc.transport_id;
+        }
+        return res;
+}
 
-                if (get_value(path_name, sgt_s, value, vlen)) {
-                        n += sg_scn3pr(b, blen, n, "%s=%-4s ", sgt_s, value);
-                        if (jsp->pr_as_json)
-                                sgj_js_nv_s(jsp, jop, sgt_s, value);
-                } else if (op->verbose)
-                        n += sg_scn3pr(b, blen, n, "%s=????\n", sgt_s);
+#if (HAVE_NVME && (! IGNORE_NVME))
 
-                if (get_value(path_name, am_s, value, vlen)) {
-                        sg_scn3pr(b, blen, n, "%s=%-4s ", am_s, value);
-                        if (jsp->pr_as_json)
-                                sgj_js_nv_s(jsp, jop, am_s, value);
-                }
-                sgj_pr_hr(jsp, "%s\n", b);
+/* NVMe namespaces ('kind' LSSCSI_NDEV) or controllers (LSSCSI_NHOST) */
+static int
+lib_scan_nvme(struct lsscsi_ctx * ctxp, int kind)
+{
+        int k, j;
+        int res = 0;
+        const struct topo_t * tp = topo_get(TOPO_NVME);
+        const struct topo_node * np;
+        const struct topo_node * nnp;
+        struct lsscsi_entry * ep;
+        struct nvme_ctl_t * ctlp;
+        struct dev_ctx_t dc;
+        struct fld_ctx_t fc;
+        const char * vp;
+        char buff[LMAX_DEVPATH];
+        char cdir[LMAX_DEVPATH];
 
-                if (2 == op->long_opt) {
-                        n = 0;
-                        if (get_value(path_name, cq_s, value, vlen)) {
-                                n += sg_scn3pr(b, blen, n, "  %s=%-4s ", cq_s,
-                                               value);
-                                if (jsp->pr_as_json)
-                                        sgj_js_nv_s(jsp, jop, cq_s, value);
-                        }
-                        if (get_value(path_name, state_s, value, vlen)) {
-                                n += sg_scn3pr(b, blen, n, "  %s=%-8s ",
-                                               state_s, value);
-                                if (jsp->pr_as_json)
-                                        sgj_js_nv_s(jsp, jop, state_s, value);
+        if (tp->dir_err[TK_NCTL])       /* NVMe module may not be loaded */
+                return 0;
+        snprintf(buff, sizeof(buff), "%s%s", sysfsroot, class_nvme);
+        ctlp = (struct nvme_ctl_t *)malloc(sizeof(*ctlp));
+        if (NULL == ctlp)
+                return -ENOMEM;
+        for (k = 0, np = tp->nodes[TK_NCTL]; (0 == res) &&
+             (k < tp->num[TK_NCTL]); ++k, ++np) {
+                if (! nctl_wanted(np->hctl.c))
+                        continue;
+                snprintf(cdir, sizeof(cdir), "%s%s", buff, topo_name(np));
+                nvme_ctl_init(ctlp, cdir, &ctxp->opts);
+                if (LSSCSI_NHOST == kind) {
+                        if (NULL == (ep = lib_new_entry(ctxp, kind,
+                                                        topo_name(np)))) {
+                                res = -ENOMEM;
+                                break;
                         }
-                        if (get_value(path_name, uniqi_s, value, vlen)) {
-                                n += sg_scn3pr(b, blen, n, "  %s=%-8s ",
-                                               uniqi_s, value);
-                                if (jsp->pr_as_json)
-                                        sgj_js_nv_s(jsp, jop, uniqi_s, value);
+                        mk_nvme_tuple(&ep->hctl, np->hctl.c, ctlp->cntlid,
+                                      0);
+                        if ((vp = ctlp->as.av[NCA_MODEL].vp))
+                                my_strcopy(ep->model, vp, sizeof(ep->model));
+                        if ((vp = ctlp->as.av[NCA_SERIAL].vp))
+                                my_strcopy(ep->serial, vp,
+                                           sizeof(ep->serial));
+                        if ((vp = ctlp->as.av[NCA_FW_REV].vp))
+                                my_strcopy(ep->rev, vp, sizeof(ep->rev));
+                        if ((vp = ctlp->as.av[NCA_TRANSPORT].vp)) {
+                                my_strcopy(ep->transport, vp,
+                                           sizeof(ep->transport));
+                                if (0 == strcmp(pcie_s, vp))
+                                        ep->transport_id = TRANSPORT_PCIE;
                         }
-                        if (get_value(path_name, ubm_s, value, vlen)) {
-                                sg_scn3pr(b, blen, n, "  %s=%-8s ", ubm_s,
-                                          value);
-                                if (jsp->pr_as_json)
-                                        sgj_js_nv_s(jsp, jop, ubm_s, value);
+                        if (! get_dev_node(cdir, ep->dev_node, CHR_DEV))
+                                ep->dev_node[0] = '\0';
+                        continue;
+                }
+                nnp = tp->nodes[TK_NDEV] + np->first_child;
+                for (j = 0; j < np->num_children; ++j, ++nnp) {
+                        if (! ndev_wanted(nnp->hctl.c, nnp->hctl.l))
+                                continue;
+                        if (NULL == (ep = lib_new_entry(ctxp, kind,
+                                                        topo_name(nnp)))) {
+                                res = -ENOMEM;
+                                break;
                         }
-                        sgj_pr_hr(jsp, "%s\n", b);
+                        dev_ctx_init(&dc, -1);
+                        memset(&fc, 0, sizeof(fc));
+                        fc.nvme = true;
+                        fc.devname = topo_name(nnp);
+                        fc.ctl_dir = ctlp->dir;
+                        fc.ctl = ctlp;
+                        fc.op = &ctxp->opts;
+                        fc.dcp = &dc;
+                        snprintf(fc.dir, sizeof(fc.dir), "%s/%s", cdir,
+                                 fc.devname);
+                        lib_dev_entry(&fc, ep);
                 }
         }
+        free(ctlp);
+        return res;
 }
 
-static void
-one_shost_entry(const char * dir_name, const char * devname,
-                struct lsscsi_opts * op, sgj_opaque_p jop)
+#endif          /* (HAVE_NVME && (! IGNORE_NVME)) */
+
+struct lsscsi_ctx *
+lsscsi_ctx_new(const char * sysroot)
 {
-        int n, q;
-        unsigned int host_id;
-        sgj_state * jsp = &op->json_st;
-        char b[LMAX_PATH];
-        char value[LMAX_NAME];
-        char wd[LMAX_PATH];
-        char o[144];
-        static const int blen = sizeof(b);
-        static const int vlen = sizeof(value);
-        static const int olen = sizeof(o);
-        static const char * host_id_s = "host_id";
+        struct lsscsi_ctx * ctxp;
 
-        if (op->classic) {
-                // one_classic_host_entry(dir_name, devname, op);
-                sgj_pr_hr(jsp, "  <'--classic' not supported for hosts>\n");
+        if (sysroot && (('/' != sysroot[0]) ||
+                        (strlen(sysroot) >= (sizeof(devfsroot) - 6))))
+                return NULL;
+        ctxp = (struct lsscsi_ctx *)calloc(1, sizeof(*ctxp));
+        if (NULL == ctxp)
+                return NULL;
+        ctxp->opts.ssize = 3;
+        set_fsroots(NULL, sysroot, 0);
+        lsscsi_ctx_refresh(ctxp);
+        return ctxp;
+}
+
+void
+lsscsi_ctx_free(struct lsscsi_ctx * ctxp)
+{
+        if (NULL == ctxp)
                 return;
-        }
-        n = 0;
-        q = 0;
-        if (1 == sscanf(devname, "host%u", &host_id)) {
-                q += sg_scn3pr(o, olen, q, "[%u]", host_id);
-                if (jsp->pr_as_json) {
-                        sgj_js_nv_s(jsp, jop, lsscsi_loc_s, o);
-                        sgj_js_nv_i(jsp, jop, host_id_s, host_id);
-                }
-                q += sg_scn3pr(o, olen, q, "  ");
-        } else
-                q += sg_scn3pr(o, olen, q, "[?]  ");
-        n += sg_scn3pr(b, blen, n, "%s", dir_name);
-        // n += sg_scn3pr(b, blen, n, "%s", "/");
-        sg_scn3pr(b, blen, n, "%s", devname);
-        if ((get_value(b, "proc_name", value, vlen)) &&
-            (strncmp(value, nulln1_s, 6)) && (strncmp(value, nulln2_s, 6))) {
-                q += sg_scn3pr(o, olen, q, "  %-12s  ", value);
-                if (jsp->pr_as_json)
-                        sgj_js_nv_s(jsp, jop, "driver_name", value);
-        } else if (if_directory_chdir(b, "device/../driver")) {
-                if (NULL == getcwd(wd, sizeof(wd)))
-                        q += sg_scn3pr(o, olen, q, "  %-12s  ", nulln2_s);
-                else
-                        q += sg_scn3pr(o, olen, q, "  %-12s  ", basename(wd));
+        lsscsi_ctx_refresh(ctxp);
+        free(ctxp->ents);
+        free(ctxp);
+}
 
-        } else
-                q += sg_scn3pr(o, olen, q, "  proc_name=????  ");
-        if (op->transport_info) {
-                if (! transport_h_init(devname, olen - q, o + q)) {
-                        if (op->verbose > 3)
-                                pr2serr("%s: transport_h_init() failed\n",
-                                        __func__);
-                }
-                if (jsp->pr_as_json && (strlen(o + q) > 1))
-                        sgj_js_nv_s(jsp, jop, "transport_summary", o + q);
+void
+lsscsi_ctx_refresh(struct lsscsi_ctx * ctxp)
+{
+        if (ctxp) {
+                free_dev_node_list();
+                free_disk_link_index();
+                free_tport_memo();
+                free_encl_slot_index();
+                free_topo();
         }
-        sgj_pr_hr(jsp, "%s\n", o);
+}
 
-        if (op->long_opt > 0)
-                longer_sh_entry(b, op, jop);
+int
+lsscsi_scan(struct lsscsi_ctx * ctxp, int kinds)
+{
+        int res = 0;
+
+        if (NULL == ctxp)
+                return -EINVAL;
+        ctxp->num = 0;
+        ctxp->next = 0;
+        if (kinds & LSSCSI_SDEV)
+                res = lib_scan_sdevs(ctxp);
+#if (HAVE_NVME && (! IGNORE_NVME))
+        if ((0 == res) && (kinds & LSSCSI_NDEV))
+                res = lib_scan_nvme(ctxp, LSSCSI_NDEV);
+#endif
+        if ((0 == res) && (kinds & LSSCSI_SHOST))
+                res = lib_scan_shosts(ctxp);
+#if (HAVE_NVME && (! IGNORE_NVME))
+        if ((0 == res) && (kinds & LSSCSI_NHOST))
+                res = lib_scan_nvme(ctxp, LSSCSI_NHOST);
+#endif
+        return res ? res : ctxp->num;
+}
 
-        if (op->verbose > 0) {
-                char b2[LMAX_DEVPATH];
-                static const int b2len = sizeof(b2);
+const struct lsscsi_entry *
+lsscsi_next(struct lsscsi_ctx * ctxp)
+{
+        if ((NULL == ctxp) || (ctxp->next >= ctxp->num))
+                return NULL;
+        return ctxp->ents + ctxp->next++;
+}
 
-                n = sg_scn3pr(b2, b2len, 0, "  dir: %s\n  device dir: ", b);
-                if (if_directory_chdir(b, dvc_s)) {
-                        if (getcwd(wd, sizeof(wd)))
-                                sg_scn3pr(b2, b2len, n, "%s", wd);
-                        else
-                                sg_scn3pr(b2, b2len, n, "?");
-                }
-                sgj_pr_hr(jsp, "%s\n", b2);
-        }
+void
+lsscsi_rewind(struct lsscsi_ctx * ctxp)
+{
+        if (ctxp)
+                ctxp->next = 0;
 }
 
+/* --snapshot=FILE and --diff=PREV: a snapshot is a text file with a line
+ * for each record that lsscsi_scan() finds, in lsscsi's order. Each line
+ * is the kind and name of the record then, tab separated, key=value for
+ * each of its fields that has a value. Bytes in values below 0x20, 0x7f
+ * and '%' are written as '%' and two hex digits. */
+#define SNAP_MAGIC "# lsscsi snapshot 1"
+#define SNAP_LINE_SZ 8192
+
+enum snap_fld_e {
+        SF_PDT = 0,
+        SF_VENDOR,
+        SF_MODEL,
+        SF_REV,
+        SF_SERIAL,
+        SF_DRIVER,
+        SF_DEV,
+        SF_MAJ_MIN,
+        SF_SG,
+        SF_WWN,
+        SF_LU_NAME,
+        SF_SIZE,
+        SF_TRANSPORT,
+        SF_NUM,                 /* number of fields */
+};
+
+/* Field names, as --fields= uses where it has the same field */
+static const char * const snap_fld_names[SF_NUM] = {
+        "pdt", "vendor", "model", "rev", "serial", "driver", "dev",
+        "maj_min", "sg", "wwn", "lu_name", "size", "transport",
+};
+
+static const char * const snap_kind_names[] = {        /* log2 of kind */
+        "sdev", "ndev", "shost", "nhost",
+};
+
+static const char * const snap_kind_jnames[] = {
+        "scsi_device", "nvme_namespace", "scsi_host", "nvme_controller",
+};
+
 static int
-shost_dir_scan_select(const struct dirent * s)
+snap_kind_index(int kind)
 {
-        int h;
+        int k;
 
-        if (0 == strncmp("host", s->d_name, 4)) {
-                if (filter_active) {
-                        if (-1 == filter.h)
-                                return 1;
-                        else if ((1 == sscanf(s->d_name + 4, "%d", &h) &&
-                                 (h == filter.h)))
-                                return 1;
-                        else
-                                return 0;
-                } else
-                        return 1;
+        for (k = 0; (k < 3) && (0 == (kind & 1)); ++k)
+                kind >>= 1;
+        return k;
+}
+
+/* Char array member of 'ep' holding field 'k', NULL if it is a number */
+static char *
+snap_fld_str(struct lsscsi_entry * ep, int k, int * szp)
+{
+        switch (k) {
+        case SF_VENDOR:
+                *szp = sizeof(ep->vendor);
+                return ep->vendor;
+        case SF_MODEL:
+                *szp = sizeof(ep->model);
+                return ep->model;
+        case SF_REV:
+                *szp = sizeof(ep->rev);
+                return ep->rev;
+        case SF_SERIAL:
+                *szp = sizeof(ep->serial);
+                return ep->serial;
+        case SF_DRIVER:
+                *szp = sizeof(ep->driver);
+                return ep->driver;
+        case SF_DEV:
+                *szp = sizeof(ep->dev_node);
+                return ep->dev_node;
+        case SF_SG:
+                *szp = sizeof(ep->sg_node);
+                return ep->sg_node;
+        case SF_WWN:
+                *szp = sizeof(ep->wwn);
+                return ep->wwn;
+        case SF_LU_NAME:
+                *szp = sizeof(ep->lu_name);
+                return ep->lu_name;
+        case SF_TRANSPORT:
+                *szp = sizeof(ep->transport);
+                return ep->transport;
+        default:
+                return NULL;
         }
-        return 0;
 }
 
-/* Returns -1 if (a->d_name < b->d_name) ; 0 if they are equal
- * and 1 otherwise.
- */
-static int
-shost_scandir_sort(const struct dirent ** a, const struct dirent ** b)
+/* Value of field 'k' of 'ep' as a string, empty if it has none */
+static const char *
+snap_fld_get(const struct lsscsi_entry * ep, int k, char * b, int blen)
 {
-        unsigned int l, r;
-        const char * lnam = (*a)->d_name;
-        const char * rnam = (*b)->d_name;
+        int sz;
+        const char * cp;
 
-        if (1 != sscanf(lnam, "host%u", &l))
-                return -1;
-        if (1 != sscanf(rnam, "host%u", &r))
-                return 1;
-        if (l < r)
-                return -1;
-        else if (r < l)
-                return 1;
-        return 0;
+        b[0] = '\0';
+        switch (k) {
+        case SF_PDT:
+                if (ep->pdt >= 0)
+                        snprintf(b, blen, "%d", ep->pdt);
+                return b;
+        case SF_MAJ_MIN:
+                if (ep->dev_node[0] && (ep->dev_major || ep->dev_minor))
+                        snprintf(b, blen, "%u:%u", ep->dev_major,
+                                 ep->dev_minor);
+                return b;
+        case SF_SIZE:
+                if (ep->size_512 > 0)
+                        snprintf(b, blen, "%" PRIu64, ep->size_512);
+                return b;
+        default:
+                cp = snap_fld_str((struct lsscsi_entry *)ep, k, &sz);
+                return cp ? cp : b;
+        }
 }
 
 static void
-list_shosts(struct lsscsi_opts * op, sgj_opaque_p jop)
+snap_fld_set(struct lsscsi_entry * ep, int k, const char * val)
 {
-        int num, k;
-        struct dirent ** namelist;
-        sgj_state * jsp = &op->json_st;
-        sgj_opaque_p jo2p = NULL;
-        sgj_opaque_p jap = NULL;
-        char buff[LMAX_DEVPATH];
-        char name[LMAX_NAME];
-        static const int namelen = sizeof(name);
-
-        snprintf(buff, sizeof(buff), "%s%s", sysfsroot, scsi_host_s);
-
-        num = scandir(buff, &namelist, shost_dir_scan_select,
-                      shost_scandir_sort);
-        if (num < 0) {
-                int n = 0;
+        int sz;
+        char * cp;
 
-                n += sg_scn3pr(name, namelen, n, "%s: scandir: ", __func__);
-                sg_scn3pr(name, namelen, n, "%s", buff);
-                perror(name);
-                return;
+        switch (k) {
+        case SF_PDT:
+                sscanf(val, "%d", &ep->pdt);
+                break;
+        case SF_MAJ_MIN:
+                sscanf(val, "%u:%u", &ep->dev_major, &ep->dev_minor);
+                break;
+        case SF_SIZE:
+                ep->size_512 = strtoull(val, NULL, 10);
+                break;
+        default:
+                if ((cp = snap_fld_str(ep, k, &sz)))
+                        my_strcopy(cp, val, sz);
+                break;
         }
-        if (op->classic)
-                sgj_pr_hr(jsp, "Attached hosts: %s\n", (num ? "" : none_s));
+}
 
-        if (jsp->pr_as_json) {
-                sgj_js_nv_i(jsp, jsp->basep,
-                            "number_of_attached_scsi_hosts", num);
-                jap = sgj_named_subarray_r(jsp, jop,
-                                           "attached_scsi_host_list");
-        }
-        for (k = 0; k < num; ++k) {
-                my_strcopy(name, namelist[k]->d_name, namelen);
-                transport_id = TRANSPORT_UNKNOWN;
-                jo2p = sgj_new_unattached_object_r(jsp);
-                one_shost_entry(buff, name, op, jo2p);
-                sgj_js_nv_o(jsp, jap, NULL /* implies an array add */, jo2p);
-                free(namelist[k]);
+static bool
+snap_put_val(FILE * fp, const char * cp)
+{
+        for ( ; *cp; ++cp) {
+                uint8_t u = (uint8_t)*cp;
+
+                if ((u < 0x20) || (0x7f == u) || ('%' == u)) {
+                        if (fprintf(fp, "%%%02x", u) < 0)
+                                return false;
+                } else if (EOF == fputc(u, fp))
+                        return false;
         }
-        free(namelist);
+        return true;
 }
 
-#if (HAVE_NVME && (! IGNORE_NVME))
-
-/* List NVME hosts (controllers). */
-static void
-list_nhosts(struct lsscsi_opts * op, sgj_opaque_p jop)
+/* Writes the 'num' records at 'ents' to 'fname' ("-" for stdout) by way
+ * of a temporary file, so that FILE may also be the --diff= argument */
+static int
+snap_save(const char * fname, const struct lsscsi_entry * ents, int num,
+          const struct lsscsi_opts * op)
 {
-        int num, k, n;
-        struct dirent ** namelist;
-        sgj_state * jsp = &op->json_st;
-        sgj_opaque_p jo2p = NULL;
-        sgj_opaque_p jap = NULL;
-        char buff[LMAX_DEVPATH];
-        char ebuf[120];
-        static const int blen = sizeof(buff);
-        static const int elen = sizeof(ebuf);
-
-        n = sg_scn3pr(buff, blen, 0, "%s", sysfsroot);
-        sg_scn3pr(buff, blen, n, "%s", class_nvme);
+        int j, k, fd;
+        bool ok;
+        bool to_stdout = (0 == strcmp("-", fname));
+        mode_t um;
+        FILE * fp = stdout;
+        const struct lsscsi_entry * ep;
+        char tmp[LMAX_PATH + 8];
+        char b[LMAX_NAME];
 
-        num = scandir(buff, &namelist, ndev_dir_scan_select,
-                      nhost_scandir_sort);
-        if (num < 0) {  /* NVMe module may not be loaded */
-                if (op->verbose > 1) {
-                        n = sg_scn3pr(ebuf, elen, 0, "%s: scandir: ",
-                                      __func__);
-                        sg_scn3pr(ebuf, elen, n, "%s", buff);
-                        perror(ebuf);
-                        sgj_pr_hr(jsp, "NVMe %s\n", mmnbl_s);
+        if (! to_stdout) {
+                snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fname);
+                fd = mkstemp(tmp);
+                if (fd < 0) {
+                        pr2serr("--snapshot: mkstemp(%s): %s\n", tmp,
+                                strerror(errno));
+                        return 1 /* SG_LIB_FILE_ERROR */;
+                }
+                /* mkstemp() makes it 0600; give FILE the mode that
+                 * fopen() would have */
+                um = umask(0);
+                umask(um);
+                if (fchmod(fd, 0666 & ~um) < 0) {
+                        pr2serr("--snapshot: fchmod(%s): %s\n", tmp,
+                                strerror(errno));
+                        close(fd);
+                        unlink(tmp);
+                        return 1;
+                }
+                fp = fdopen(fd, "w");
+                if (NULL == fp) {
+                        close(fd);
+                        unlink(tmp);
+                        return 1;
                 }
-                return;
         }
-        if (jsp->pr_as_json)
-                jap = sgj_named_subarray_r(jsp, jop,
-                                           "attached_nvme_controller_list");
-        for (k = 0; k < num; ++k) {
-                transport_id = TRANSPORT_UNKNOWN;
-                if (jsp->pr_as_json)
-                        jo2p = sgj_new_unattached_object_r(jsp);
-                one_nhost_entry(buff, namelist[k]->d_name, op, jo2p);
-                if (jsp->pr_as_json)
-                        sgj_js_nv_o(jsp, jap, NULL, jo2p);
-                free(namelist[k]);
+        ok = (fprintf(fp, "%s\n", SNAP_MAGIC) > 0);
+        for (j = 0, ep = ents; ok && (j < num); ++j, ++ep) {
+                ok = (fprintf(fp, "%s %s", snap_kind_names[
+                                snap_kind_index(ep->kind)], ep->name) > 0);
+                for (k = 0; ok && (k < SF_NUM); ++k) {
+                        const char * vp = snap_fld_get(ep, k, b, sizeof(b));
+
+                        if (*vp)
+                                ok = (fprintf(fp, "\t%s=",
+                                              snap_fld_names[k]) > 0) &&
+                                     snap_put_val(fp, vp);
+                }
+                ok = ok && (EOF != fputc('\n', fp));
+        }
+        if (to_stdout)
+                return (ok && (0 == fflush(fp))) ? 0 : 1;
+        if (fclose(fp))
+                ok = false;
+        if (ok && (0 == rename(tmp, fname))) {
+                if (op->verbose > 0)
+                        pr2serr("--snapshot: %d records written to %s\n",
+                                num, fname);
+                return 0;
         }
-        free(namelist);
-        if (op->wwn)
-                free_disk_wwn_node_list();
+        pr2serr("--snapshot: unable to write %s\n", fname);
+        unlink(tmp);
+        return 1;
 }
 
-#endif          /* (HAVE_NVME && (! IGNORE_NVME)) */
-
-/* Return true if able to decode, otherwise false */
-static bool
-one_filter_arg(const char * arg, struct addr_hctl * filtp)
+/* Undoes what snap_put_val() did, in place */
+static void
+snap_unescape(char * cp)
 {
-        int val, k, n, res;
-        uint64_t val64;
-        const char * cp;
-        const char * cpe;
-        char buff[64];
+        unsigned int u;
+        char * op = cp;
+
+        for ( ; *cp; ++cp) {
+                if (('%' == *cp) && isxdigit((uint8_t)cp[1]) &&
+                    isxdigit((uint8_t)cp[2]) &&
+                    (1 == sscanf(cp + 1, "%2x", &u))) {
+                        *op++ = (char)u;
+                        cp += 2;
+                } else
+                        *op++ = *cp;
+        }
+        *op = '\0';
+}
 
-        cp = arg;
-        while ((*cp == ' ') || (*cp == '\t') || (*cp == '['))
-                ++cp;
-        if ('\0' == *cp)
-                return true;
-        for (k = 0; *cp; cp = cpe + 1, ++k) {
-                cpe = strchr(cp, ':');
-                if (cpe)
-                        n = cpe - cp;
-                else {
-                        n = strlen(cp);
-                        cpe = cp + n - 1;
-                }
-                val = -1;
-                val64 = UINT64_LAST;
-                if (n > ((int)sizeof(buff) - 1)) {
-                        pr2serr("intermediate string in %s too long (n=%d)\n",
-                                arg, n);
-                        return false;
+/* Reads the snapshot 'fname' into a new array at *entsp (to be freed by
+ * the caller). Returns the number of records or -1 (after reporting). */
+static int
+snap_load(const char * fname, struct lsscsi_entry ** entsp)
+{
+        int k, n, kind;
+        int num = 0;
+        int max = 0;
+        int lnum = 0;
+        FILE * fp;
+        char * cp;
+        char * np;
+        char * vp;
+        struct lsscsi_entry * ents = NULL;
+        struct lsscsi_entry * ep;
+        char line[SNAP_LINE_SZ];
+
+        *entsp = NULL;
+        fp = fopen(fname, "r");
+        if (NULL == fp) {
+                pr2serr("--diff: unable to open %s: %s\n", fname,
+                        strerror(errno));
+                return -1;
+        }
+        if ((NULL == fgets(line, sizeof(line), fp)) ||
+            strncmp(line, SNAP_MAGIC, sizeof(SNAP_MAGIC) - 1)) {
+                pr2serr("--diff: %s is not an lsscsi snapshot\n", fname);
+                goto err;
+        }
+        while (fgets(line, sizeof(line), fp)) {
+                ++lnum;
+                n = strlen(line);
+                if ((n > 0) && ('\n' == line[n - 1]))
+                        line[--n] = '\0';
+                if ((0 == n) || ('#' == line[0]))
+                        continue;
+                np = strchr(line, ' ');
+                if (NULL == np)
+                        goto bad_line;
+                *np++ = '\0';
+                for (k = 0; k < (int)SG_ARRAY_SIZE(snap_kind_names); ++k) {
+                        if (0 == strcmp(line, snap_kind_names[k]))
+                                break;
                 }
-                if ((n > 0) && ('-' != *cp) && ('*' != *cp) && ('?' != *cp)) {
-                        memcpy(buff, cp, n);
-                        buff[n] = '\0';
-                        if (3 == k) {
-                                if (('0' == buff[0]) &&
-                                    ('X' == toupper((uint8_t)buff[1])))
-                                        res = sscanf(buff, "%" SCNx64 ,
-                                                     &val64);
-                                else
-                                        res = sscanf(buff, "%" SCNu64 ,
-                                                     &val64);
-                        } else {
-                                res = sscanf(buff, "%d", &val);
-                                if ((0 == res) && (0 == k) && (1 == n) &&
-                                    ('N' == toupper((uint8_t)buff[0]))) {
-                                        /* take 'N' as NVMe indication */
-                                        res = 1;
-                                        val = NVME_HOST_NUM;
-                                }
+                if (k >= (int)SG_ARRAY_SIZE(snap_kind_names))
+                        goto bad_line;
+                kind = 1 << k;
+                if (num >= max) {
+                        max = max ? (2 * max) : 64;
+                        ep = (struct lsscsi_entry *)realloc(ents,
+                                                       max * sizeof(*ep));
+                        if (NULL == ep) {
+                                pr2serr("--diff: out of memory\n");
+                                goto err;
                         }
-                        if ((1 != res) && (NULL == strchr(buff, ']'))) {
-                                pr2serr("cannot decode %s as an integer\n",
-                                        buff);
-                                return false;
+                        ents = ep;
+                }
+                ep = ents + num++;
+                memset(ep, 0, sizeof(*ep));
+                ep->kind = kind;
+                invalidate_hctl(&ep->hctl);
+                ep->pdt = -1;
+                cp = strchr(np, '\t');
+                if (cp)
+                        *cp++ = '\0';
+                my_strcopy(ep->name, np, sizeof(ep->name));
+                while (cp) {    /* each key=value */
+                        np = strchr(cp, '\t');
+                        if (np)
+                                *np++ = '\0';
+                        vp = strchr(cp, '=');
+                        if (vp) {
+                                *vp++ = '\0';
+                                snap_unescape(vp);
+                                for (k = 0; k < SF_NUM; ++k) {
+                                        if (0 == strcmp(cp,
+                                                        snap_fld_names[k])) {
+                                                snap_fld_set(ep, k, vp);
+                                                break;
+                                        }
+                                }       /* ignore unknown keys */
                         }
+                        cp = np;
                 }
-                switch (k) {
-                case 0: filtp->h = val;
-                        break;
-                case 1: filtp->c = val;
-                        break;
-                case 2: filtp->t = val;
-                        break;
-                case 3: filtp->l = val64;
-                        break;
-                default:
-                        pr2serr("expect three colons at most in %s\n", arg);
-                        return false;
+        }
+        fclose(fp);
+        *entsp = ents;
+        return num;
+bad_line:
+        pr2serr("--diff: %s: bad record at line %d\n", fname, lnum + 1);
+err:
+        fclose(fp);
+        free(ents);
+        return -1;
+}
+
+/* Identity of the logical unit (or namespace) of 'ep' that survives it
+ * being renumbered, empty if it has none */
+static const char *
+snap_ident(const struct lsscsi_entry * ep)
+{
+        if (! (ep->kind & (LSSCSI_SDEV | LSSCSI_NDEV)))
+                return "";
+        return ep->lu_name[0] ? ep->lu_name : ep->wwn;
+}
+
+/* qsort(3) helpers, sort pointers to records by kind then name ... */
+static int
+snap_name_cmp(const void * l, const void * r)
+{
+        const struct lsscsi_entry * lp = *(const struct lsscsi_entry **)l;
+        const struct lsscsi_entry * rp = *(const struct lsscsi_entry **)r;
+
+        if (lp->kind != rp->kind)
+                return (lp->kind < rp->kind) ? -1 : 1;
+        return strcmp(lp->name, rp->name);
+}
+
+/* ... or by kind then identity */
+static int
+snap_ident_cmp(const void * l, const void * r)
+{
+        const struct lsscsi_entry * lp = *(const struct lsscsi_entry **)l;
+        const struct lsscsi_entry * rp = *(const struct lsscsi_entry **)r;
+
+        if (lp->kind != rp->kind)
+                return (lp->kind < rp->kind) ? -1 : 1;
+        return strcmp(snap_ident(lp), snap_ident(rp));
+}
+
+/* Returns an array of 'num' pointers into 'ents' sorted by 'cmp' */
+static const struct lsscsi_entry **
+snap_index(const struct lsscsi_entry * ents, int num,
+           int (*cmp)(const void *, const void *))
+{
+        int k;
+        const struct lsscsi_entry ** arr;
+
+        arr = (const struct lsscsi_entry **)malloc((num + 1) * sizeof(*arr));
+        if (NULL == arr)
+                return NULL;
+        for (k = 0; k < num; ++k)
+                arr[k] = ents + k;
+        qsort(arr, num, sizeof(*arr), cmp);
+        return arr;
+}
+
+/* Outputs a record that was added or removed, with all its fields */
+static void
+snap_pr_whole(const char * change, const struct lsscsi_entry * ep,
+              sgj_state * jsp, sgj_opaque_p jap)
+{
+        int k, n;
+        sgj_opaque_p jop, jo2p;
+        const char * vp;
+        char b[LMAX_NAME];
+        char s[512];
+        static const int k_list[] = {SF_VENDOR, SF_MODEL, SF_REV, SF_DRIVER,
+                                     SF_DEV};
+
+        if (jsp->pr_as_json) {
+                jop = sgj_new_unattached_object_r(jsp);
+                sgj_js_nv_s(jsp, jop, "change", change);
+                sgj_js_nv_s(jsp, jop, "kind",
+                            snap_kind_jnames[snap_kind_index(ep->kind)]);
+                sgj_js_nv_s(jsp, jop, "name", ep->name);
+                jo2p = sgj_named_subobject_r(jsp, jop, "fields");
+                for (k = 0; k < SF_NUM; ++k) {
+                        vp = snap_fld_get(ep, k, b, sizeof(b));
+                        if (*vp)
+                                sgj_js_nv_s(jsp, jo2p, snap_fld_names[k], vp);
                 }
+                if (NULL == sgj_js_nv_o(jsp, jap, NULL, jop))
+                        sgj_free_unattached(jop);
+                return;
         }
-        return true;
+        s[0] = '\0';
+        for (k = 0, n = 0; k < (int)SG_ARRAY_SIZE(k_list); ++k) {
+                vp = snap_fld_get(ep, k_list[k], b, sizeof(b));
+                if (*vp)
+                        n += sg_scn3pr(s, sizeof(s), n, "  %s", vp);
+        }
+        if (LSSCSI_SDEV == ep->kind)
+                printf("%-8s [%s]%s\n", change, ep->name, s);
+        else
+                printf("%-8s %s%s\n", change, ep->name, s);
 }
 
-/* Return true if able to decode, otherwise false */
-static bool
-decode_filter_arg(const char * a1p, const char * a2p, const char * a3p,
-                  const char * a4p, struct addr_hctl * filtp)
+/* Outputs the fields that differ between 'pp' (previous) and 'cp' (now),
+ * which are the same record, perhaps renamed. Returns the number of
+ * changes output: the move (if renamed) and each field. */
+static int
+snap_pr_delta(const struct lsscsi_entry * pp, const struct lsscsi_entry * cp,
+              sgj_state * jsp, sgj_opaque_p jap)
 {
-        int n, rem;
-        char * b1p;
-        char b1[256];
+        int k;
+        int num = 0;
+        bool moved = (0 != strcmp(pp->name, cp->name));
+        bool differs[SF_NUM];
+        sgj_opaque_p jop = NULL;
+        sgj_opaque_p jo2p = NULL;
+        sgj_opaque_p jo3p;
+        const char * pvp;
+        const char * cvp;
+        const char * lb = (LSSCSI_SDEV == cp->kind) ? "[" : "";
+        const char * rb = (LSSCSI_SDEV == cp->kind) ? "]" : "";
+        char b1[LMAX_NAME];
+        char b2[LMAX_NAME];
+
+        for (k = 0; k < SF_NUM; ++k) {
+                pvp = snap_fld_get(pp, k, b1, sizeof(b1));
+                cvp = snap_fld_get(cp, k, b2, sizeof(b2));
+                differs[k] = (0 != strcmp(pvp, cvp));
+                num += differs[k];
+        }
+        if ((0 == num) && (! moved))
+                return 0;
+        if (jsp->pr_as_json) {
+                jop = sgj_new_unattached_object_r(jsp);
+                sgj_js_nv_s(jsp, jop, "change", moved ? "moved" : "changed");
+                sgj_js_nv_s(jsp, jop, "kind",
+                            snap_kind_jnames[snap_kind_index(cp->kind)]);
+                sgj_js_nv_s(jsp, jop, "name", cp->name);
+                if (moved)
+                        sgj_js_nv_s(jsp, jop, "previous_name", pp->name);
+                jo2p = sgj_named_subobject_r(jsp, jop, "fields");
+        } else if (moved)
+                printf("%-8s %s%s%s -> %s%s%s\n", "moved", lb, pp->name, rb,
+                       lb, cp->name, rb);
+        for (k = 0; k < SF_NUM; ++k) {
+                if (! differs[k])
+                        continue;
+                pvp = snap_fld_get(pp, k, b1, sizeof(b1));
+                cvp = snap_fld_get(cp, k, b2, sizeof(b2));
+                if (jsp->pr_as_json) {
+                        jo3p = sgj_named_subobject_r(jsp, jo2p,
+                                                     snap_fld_names[k]);
+                        sgj_js_nv_s(jsp, jo3p, "previous", pvp);
+                        sgj_js_nv_s(jsp, jo3p, "current", cvp);
+                } else
+                        printf("%-8s %s%s%s  %s: %s -> %s\n", "changed", lb,
+                               cp->name, rb, snap_fld_names[k],
+                               *pvp ? pvp : "-", *cvp ? cvp : "-");
+        }
+        if (jop && (NULL == sgj_js_nv_o(jsp, jap, NULL, jop)))
+                sgj_free_unattached(jop);
+        return num + moved;
+}
 
-        if ((NULL == a1p) || (NULL == filtp)) {
-                pr2serr("bad call to decode_filter\n");
-                return false;
+/* Reports the records of 'cur' that were added, removed, changed or moved
+ * since the snapshot 'prev'. Records are matched by kind and name (the
+ * H:C:T:L tuple for SCSI devices) unless each has an identity (LU name,
+ * else WWN) and those differ. Those left are then matched by identity so
+ * that a logical unit that has been renumbered (e.g. after a rescan) is
+ * reported as moved rather than as removed and added. */
+static int
+snap_diff(const struct lsscsi_entry * prev, int pnum,
+          const struct lsscsi_entry * cur, int cnum, struct lsscsi_opts * op,
+          sgj_opaque_p jop)
+{
+        int j, k;
+        int num = 0;
+        int * matchp;
+        bool * usedp;
+        sgj_state * jsp = &op->json_st;
+        sgj_opaque_p jap = NULL;
+        const struct lsscsi_entry * kp;
+        const struct lsscsi_entry ** by_name;
+        const struct lsscsi_entry ** by_ident;
+        const struct lsscsi_entry ** pp;
+
+        matchp = (int *)malloc((cnum + 1) * sizeof(*matchp));
+        usedp = (bool *)calloc(pnum + 1, sizeof(*usedp));
+        by_name = snap_index(prev, pnum, snap_name_cmp);
+        by_ident = snap_index(prev, pnum, snap_ident_cmp);
+        if ((NULL == matchp) || (NULL == usedp) || (NULL == by_name) ||
+            (NULL == by_ident)) {
+                pr2serr("--diff: out of memory\n");
+                num = -1;
+                goto fini;
         }
-        filtp->h = -1;
-        filtp->c = -1;
-        filtp->t = -1;
-        filtp->l = UINT64_LAST;
-        if ((0 == strncmp("host", a1p, 4)) &&
-            (1 == sscanf(a1p, "host%d", &n)) && (n >= 0)) {
-                filtp->h = n;
-                return true;
+        for (j = 0; j < cnum; ++j) {
+                const char * cip = snap_ident(cur + j);
+                const char * pip;
+
+                matchp[j] = -1;
+                kp = cur + j;
+                pp = (const struct lsscsi_entry **)bsearch(&kp, by_name,
+                                pnum, sizeof(*by_name), snap_name_cmp);
+                if (NULL == pp)
+                        continue;
+                k = *pp - prev;
+                pip = snap_ident(prev + k);
+                if ((! usedp[k]) &&
+                    (('\0' == *cip) || ('\0' == *pip) ||
+                     (0 == strcmp(cip, pip)))) {
+                        matchp[j] = k;
+                        usedp[k] = true;
+                }
         }
-        if ((NULL == a2p) || strchr(a1p, ':'))
-                return one_filter_arg(a1p, filtp);
-        else {
-                rem = sizeof(b1) - 5;
-                b1p = b1;
-                if ((n = strlen(a1p)) > rem)
-                        goto err_out;
-                my_strcopy(b1p, a1p, rem);
-                b1p += n;
-                *b1p++ = ':';
-                rem -= (n + 1);
-                if ((n = strlen(a2p)) > rem)
-                        goto err_out;
-                my_strcopy(b1p, a2p, rem);
-                if (a3p) {
-                        b1p += n;
-                        *b1p++ = ':';
-                        rem -= (n + 1);
-                        if ((n = strlen(a3p)) > rem)
-                                goto err_out;
-                        my_strcopy(b1p, a3p, rem);
-                        if (a4p) {
-                                b1p += n;
-                                *b1p++ = ':';
-                                rem -= (n + 1);
-                                if ((n = strlen(a4p)) > rem)
-                                        goto err_out;
-                                my_strcopy(b1p, a4p, rem);
+        for (j = 0; j < cnum; ++j) {
+                if ((matchp[j] >= 0) || ('\0' == *snap_ident(cur + j)))
+                        continue;
+                kp = cur + j;
+                pp = (const struct lsscsi_entry **)bsearch(&kp, by_ident,
+                                pnum, sizeof(*by_ident), snap_ident_cmp);
+                if (NULL == pp)
+                        continue;
+                while ((pp > by_ident) && (0 == snap_ident_cmp(pp - 1, &kp)))
+                        --pp;   /* first with that identity (multipath) */
+                for ( ; (pp < (by_ident + pnum)) &&
+                        (0 == snap_ident_cmp(pp, &kp)); ++pp) {
+                        k = *pp - prev;
+                        if (! usedp[k]) {
+                                matchp[j] = k;
+                                usedp[k] = true;
+                                break;
                         }
                 }
-                return one_filter_arg(b1, filtp);
         }
-err_out:
-        pr2serr("filter arguments exceed internal buffer size (%d)\n",
-                (int)sizeof(b1));
-        return false;
+        if (jsp->pr_as_json)
+                jap = sgj_named_subarray_r(jsp, jop, "device_changes");
+        for (j = 0; j < cnum; ++j) {
+                if (matchp[j] >= 0)
+                        num += snap_pr_delta(prev + matchp[j], cur + j, jsp,
+                                             jap);
+                else {
+                        snap_pr_whole("added", cur + j, jsp, jap);
+                        ++num;
+                }
+        }
+        for (k = 0; k < pnum; ++k) {
+                if (! usedp[k]) {
+                        snap_pr_whole("removed", prev + k, jsp, jap);
+                        ++num;
+                }
+        }
+        if (jsp->pr_as_json)
+                sgj_js_nv_i(jsp, jop, "number_of_changes", num);
+        else if (op->verbose > 0)
+                pr2serr("--diff: %d change%s since %s\n", num,
+                        (1 == num) ? "" : "s", op->diff_fn);
+fini:
+        free(by_ident);
+        free(by_name);
+        free(usedp);
+        free(matchp);
+        return (num < 0) ? 1 : 0;
 }
 
-/* Handles short options after '-j' including a sequence of short options
- * that include one 'j' (for JSON). Want optional argument to '-j' to be
- * prefixed by '='. Return 0 for good, 1 for syntax error and 2 for exit
- * with no error. */
+/* --snapshot=FILE and/or --diff=PREV. When both are given PREV is read
+ * before FILE is written, so they may be the same file. */
 static int
-chk_short_opts(const char sopt_ch, struct lsscsi_opts * op)
+snap_run(struct lsscsi_opts * op, sgj_opaque_p jop)
 {
-        switch (sopt_ch) {
-        case 'b':
-                op->brief = true;
-                break;
-        case 'c':
-                op->classic = true;
-                break;
-        case 'C':       /* synonym for --hosts, NVMe perspective */
-                op->do_hosts = true;
-                break;
-        case 'd':
-                op->dev_maj_min = true;
-                break;
-        case 'D':       /* --pdt */
-                op->pdt = true;
-                break;
-        case 'g':
-                op->generic = true;
-                break;
-        case 'h':
-                usage();
-                return 2;
-        case 'H':
-                op->do_hosts = true;
-                break;
-        case 'i':
-                if (op->scsi_id)
-                        op->scsi_id_twice = true;
-                else
-                        op->scsi_id = true;
-                break;
-        case 'j':
-                break;  /* simply ignore second 'j' (e.g. '-jxj') */
-        case 'k':
-                op->kname = true;
-                break;
-        case 'l':
-                ++op->long_opt;
-                break;
-        case 'L':
-                op->long_opt += 3;
-                break;
-        case 'N':
-                op->no_nvme = true;
-                break;
-        case 'p':
-                op->protection = true;
-                break;
-        case 'P':
-                op->protmode = true;
-                break;
-        case 's':
-                ++op->ssize;
-                break;
-        case 'S':
-                op->ssize += 3;
-                break;
-        case 't':
-                op->transport_info = true;
-                break;
-        case 'u':
-                ++op->unit;
-                break;
-        case 'U':
-                op->unit += 3;
-                break;
-        case 'v':
-                ++op->verbose;
-                break;
-        case 'V':
-                ++op->version_count;
-                break;
-        case 'w':
-                if (op->wwn)
-                        op->wwn_twice = true;
-                else
-                        op->wwn = true;
-                break;
-        case 'x':
-                ++op->lunhex;
-                break;
-        case '?':
-                usage();
-                return 1;
-        default:
-                pr2serr("unrecognised option code: '%c' [0x%x]\n\n", sopt_ch,
-                        sopt_ch);
-                usage();
-                return 1;
+        int num;
+        int pnum = 0;
+        int res = 0;
+        struct lsscsi_entry * prev = NULL;
+        struct lsscsi_ctx ctx;
+
+        if (op->diff_fn && ((pnum = snap_load(op->diff_fn, &prev)) < 0))
+                return 1 /* SG_LIB_FILE_ERROR */;
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.opts.ssize = 3;
+        num = lsscsi_scan(&ctx, op->no_nvme ? (LSSCSI_SDEV | LSSCSI_SHOST) :
+                                              LSSCSI_ALL);
+        if (num < 0) {
+                pr2serr("unable to list devices: %s\n", strerror(-num));
+                res = 1;
+                goto fini;
         }
-        return 0;
+        if (op->diff_fn)
+                res = snap_diff(prev, pnum, ctx.ents, num, op, jop);
+        if ((0 == res) && op->snapshot_fn)
+                res = snap_save(op->snapshot_fn, ctx.ents, num, op);
+fini:
+        free(ctx.ents);
+        free(prev);
+        return res;
 }
 
 
 int
-main(int argc, char **argv)
+lsscsi_main(int argc, char **argv)
 {
-        bool do_sdevices = true;  /* op->do_hosts checked before this */
         int c;
         int res = 0;
+        int watch_fd = -1;
         const char * cp;
+        const char * vfs_opt;
         const char * l_sysfsroot = NULL;
         const char * l_sysroot = NULL;
         sgj_state * jsp;
         sgj_opaque_p jop = NULL;
+        FILE * js_fp = stdout;
         struct lsscsi_opts * op;
         struct lsscsi_opts opts;
 
@@ -5715,6 +13242,8 @@ main(int argc, char **argv)
         cp = getenv("LSSCSI_LUNHEX_OPT");
         invalidate_hctl(&filter);
         memset(op, 0, sizeof(opts));
+        if (0 == strcmp("lsscsid", basename(argv[0])))
+                op->daemon_sock = daemon_sock_name();
         while (1) {
                 int option_index = 0;
 
@@ -5838,6 +13367,66 @@ main(int argc, char **argv)
                 case 'Y':       /* --sysroot=AR_PT */
                         l_sysroot = optarg;
                         break;
+                case LO_CACHE:  /* --cache[=DIR] */
+                        op->cache_dir = (optarg && *optarg) ? optarg :
+                                                              def_cache_dir;
+                        break;
+                case LO_WATCH:  /* --watch */
+                        op->watch = true;
+                        break;
+                case LO_STATS:  /* --stats */
+                        stats.on = true;
+                        break;
+                case LO_SAS_TREE:       /* --sas-tree */
+                        op->sas_tree = true;
+                        break;
+                case LO_ENCLOSURE:      /* --enclosure */
+                        op->enclosure = true;
+                        break;
+                case LO_IO_URING:       /* --io-uring */
+                        op->io_uring = true;
+                        break;
+                case LO_DAEMON: /* --daemon[=SOCK] */
+                        op->daemon_sock = (optarg && *optarg) ? optarg :
+                                                        daemon_sock_name();
+                        break;
+                case LO_SNAPSHOT:       /* --snapshot=FILE */
+                        op->snapshot_fn = optarg;
+                        break;
+                case LO_DIFF:   /* --diff=PREV */
+                        op->diff_fn = optarg;
+                        break;
+                case LO_CAPTURE:        /* --capture=FILE */
+                        op->capture_fn = optarg;
+                        break;
+                case LO_REPLAY: /* --replay=FILE */
+                        op->replay_fn = optarg;
+                        break;
+                case LO_FIELDS: /* --fields=LIST */
+                        if (0 == strcmp("?", optarg)) {
+                                fields_usage();
+                                return 0;
+                        }
+                        if (! fields_parse(optarg, op, true))
+                                return 1;
+                        op->fields_arg = optarg;
+                        break;
+                case LO_DEVICE_TIMEOUT: /* --device-timeout=MS */
+                        op->dev_timeout_ms = atoi(optarg);
+                        if (op->dev_timeout_ms < 1) {
+                                pr2serr("--device-timeout= expects a number "
+                                        "of milliseconds, 1 or more\n");
+                                return 1;
+                        }
+                        break;
+                case LO_JOBS:   /* --jobs=N */
+                        op->jobs = atoi(optarg);
+                        if ((op->jobs < 1) || (op->jobs > MAX_JOBS)) {
+                                pr2serr("--jobs= expects a number from 1 "
+                                        "to %d\n", MAX_JOBS);
+                                return 1;
+                        }
+                        break;
                 case '?':
                         usage();
                         return 1;
@@ -5847,6 +13436,8 @@ main(int argc, char **argv)
                         return 1;
                }
         }
+        if (stats.on)
+                stats.start_ns = stats_now_ns();
         if (op->version_count > 0) {
                 int yr, mon, day;
                 char * p;
@@ -5887,13 +13478,7 @@ main(int argc, char **argv)
                         pr2serr("%s", e);
                         return 1 /* SG_LIB_SYNTAX_ERROR */;
                 }
-                /* lsscsi changes directory a lot. If we need the current
-                 * working directory later (e.g. to store the JSON output
-                 * file) then we need to remember it. */
-                if (op->js_file) {
-                        if (NULL == getcwd(wd_at_start, sizeof(wd_at_start)))
-                                pr2serr("getcwd() failed\n");
-                }
+                js_keys_intern();
         }
 
         if (optind < argc) {
@@ -5986,29 +13571,7 @@ main(int argc, char **argv)
                                 return 1;
                         }
                 }
-                if (l_sysfsroot) {
-                        if (l_fsroot_sz > 1)
-                                strncpy(sysfsroot, l_sysfsroot, l_fsroot_sz);
-                } else if (l_root_sz > 1) {
-                        int n = l_root_sz;
-                        static const char * sysfs_dir = "/sys";
-                        static const char * devfs_dir = "/dev";
-
-                        strncpy(sysfsroot, l_sysroot, sysfsroot_sz - 1);
-                        if ((n > 1) && ('/' == sysfsroot[n - 1]))
-                            --n;
-                        memcpy(sysfsroot + n, sysfs_dir, 4);
-                        n = l_root_sz;
-                        strncpy(devfsroot, l_sysroot, devfsroot_sz - 1);
-                        if ((n > 1) && ('/' == devfsroot[n - 1]))
-                            --n;
-                        memcpy(devfsroot + n, devfs_dir, 4);
-                        if (op->verbose > 1)
-                                pr2serr("Alternate devfs root: %s\n",
-                                        devfsroot);
-                }
-                if (op->verbose > 1)
-                        pr2serr("Alternate sysfs root: %s\n", sysfsroot);
+                set_fsroots(l_sysfsroot, l_sysroot, op->verbose);
         }
 
         if (op->transport_info &&
@@ -6026,51 +13589,129 @@ main(int argc, char **argv)
                         return 1;
                 }
         }
+        if ((op->dev_timeout_ms > 0) && (! dev_jobs_separable(op)))
+                pr2serr("--device-timeout= ignored with --classic or "
+                        "--json=o\n");
+        else if ((op->dev_timeout_ms > 0) && op->io_uring)
+                pr2serr("--io-uring ignored with --device-timeout=\n");
+        if ((op->dev_timeout_ms > 0) && (op->watch || op->daemon_sock)) {
+                /* while an abandoned task runs the indexes are not freed,
+                 * so each later listing would reuse what the first found */
+                pr2serr("--device-timeout= can't be used with --watch or "
+                        "--daemon\n");
+                return 1;
+        }
+        if ((op->snapshot_fn || op->diff_fn) && op->watch) {
+                pr2serr("--watch does not support --snapshot= or --diff=\n");
+                return 1;
+        }
+        if (op->snapshot_fn && (0 == strcmp("-", op->snapshot_fn)) &&
+            (op->diff_fn || op->do_json)) {
+                pr2serr("--snapshot=- only without --diff= and --json\n");
+                return 1;
+        }
+        if (op->capture_fn || op->replay_fn) {
+                vfs_opt = op->capture_fn ? "--capture=" : "--replay=";
+                if (op->capture_fn && op->replay_fn) {
+                        pr2serr("use --capture= or --replay= but not "
+                                "both\n");
+                        return 1;
+                }
+                if (op->watch || op->daemon_sock) {
+                        pr2serr("%s does not support --watch or --daemon\n",
+                                vfs_opt);
+                        return 1;
+                }
+                /* the cache is keyed on inodes, the ring reads directly */
+                if (op->cache_dir) {
+                        pr2serr("--cache ignored with %s\n", vfs_opt);
+                        op->cache_dir = NULL;
+                }
+                if (op->io_uring) {
+                        pr2serr("--io-uring ignored with %s\n", vfs_opt);
+                        op->io_uring = false;
+                }
+        }
+        if (op->replay_fn) {
+                if (l_sysfsroot || l_sysroot)
+                        pr2serr("--sysfsroot= and --sysroot= ignored with "
+                                "--replay=, its archive has the roots\n");
+                if (! vfs_replay_open(op->replay_fn, op->verbose))
+                        return 1;
+        } else if (op->capture_fn) {
+                vfs.mode = VFS_CAPTURE;
+                vfs.fn = op->capture_fn;
+        }
         if (op->verbose > 1) {
                 printf(" sysfsroot: %s\n", sysfsroot);
         }
-        jsp = &op->json_st;
-        if (op->do_json)
-                jop = sgj_start_r("lsscsi", release_str, argc, argv, jsp);
-        if (op->do_hosts) {
-                list_shosts(op, jop);
-#if (HAVE_NVME && (! IGNORE_NVME))
-                if ((! op->no_nvme) && (! op->classic))
-                        list_nhosts(op, jop);
-#endif
-        } else if (do_sdevices) {
-                list_sdevices(op, jop);
-#if (HAVE_NVME && (! IGNORE_NVME))
-                if ((! op->no_nvme) && (! op->classic))
-                        list_ndevices(op, jop);
-#endif
+        if (op->daemon_sock)
+                return daemon_serve(op);
+        /* lsscsid may have the answer, but not from an archive */
+        if (op->do_json && (VFS_LIVE == vfs.mode)) {
+                res = daemon_client(argc, argv, op);
+                if (res >= 0)
+                        return res;
+                res = 0;
+        }
+        if (op->watch) {
+                if (op->classic) {
+                        pr2serr("--watch does not support --classic\n");
+                        return 1;
+                }
+                if (op->sas_tree) {
+                        pr2serr("--watch does not support --sas-tree\n");
+                        return 1;
+                }
+                watch_fd = watch_open(op);
+                if (watch_fd < 0)
+                        return 1;
         }
-        res = (res >= 0) ? res : 1 /* SG_LIB_CAT_OTHER */;
+        jsp = &op->json_st;
         if (op->do_json) {
-                FILE * fp = stdout;
-
+                jop = sgj_start_r("lsscsi", release_str, argc, argv, jsp);
                 /* '--js-file=-' will send JSON output to stdout */
-                if (op->js_file) {
-                        if ((1 != strlen(op->js_file)) ||
-                            ('-' != op->js_file[0])) {
-                                /* "w" truncate if exists */
-                                if (chdir(wd_at_start) < 0)
-                                        perror("failed to cd to wd_at_start");
-                                fp = fopen(op->js_file, "w");
-                                if (NULL == fp) {
-                                        pr2serr("unable to open file: %s\n",
-                                                op->js_file);
-                                        res = 1 /* SG_LIB_FILE_ERROR */;
-                                }
+                if (op->js_file && ((1 != strlen(op->js_file)) ||
+                                    ('-' != op->js_file[0]))) {
+                        /* "w" truncate if exists */
+                        js_fp = fopen(op->js_file, "w");
+                        if (NULL == js_fp) {
+                                pr2serr("unable to open file: %s\n",
+                                        op->js_file);
+                                res = 1 /* SG_LIB_FILE_ERROR */;
                         }
                 }
-                if (fp)
-                        sgj_js2file_estr(jsp, NULL, res, NULL, fp);
-                if (op->js_file && fp && (stdout != fp))
-                        fclose(fp);
+                /* output each device's JSON object once it is complete */
+                if (js_fp)
+                        sgj_stream_start(jsp, js_fp);
+        }
+        if (op->snapshot_fn || op->diff_fn) {
+                if (0 == res)
+                        res = snap_run(op, jop);
+        } else
+                list_all(op, jop);
+        res = (res >= 0) ? res : 1 /* SG_LIB_CAT_OTHER */;
+        if (stats.on)
+                stats_report(op);
+        if (op->do_json) {
+                if (js_fp)
+                        sgj_js2file_estr(jsp, NULL, res, NULL, js_fp);
+                if (js_fp && (stdout != js_fp))
+                        fclose(js_fp);
                 sgj_finish(jsp);
         }
+        if (watch_fd >= 0)
+                res = watch_uevents(op, watch_fd);
+        if ((VFS_CAPTURE == vfs.mode) && (! vfs_capture_write(op->verbose)))
+                res = 1;
         free_dev_node_list();
+        free_tport_memo();
+        free_encl_slot_index();
+        free_topo();
+        vfs_end();
+#if HAVE_IO_URING
+        uring_free(&uring);
+#endif
 
         return res;
 }
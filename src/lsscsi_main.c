@@ -0,0 +1,17 @@
+/*
+ *  Copyright (C) 2003-2023 D. Gilbert
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ */
+
+/* The lsscsi utility; all of it, bar this, is in liblsscsi */
+
+#include "liblsscsi.h"
+
+int
+main(int argc, char **argv)
+{
+        return lsscsi_main(argc, argv);
+}
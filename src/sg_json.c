@@ -8,12 +8,16 @@
  */
 
 #include <unistd.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "sg_pr2serr.h"
 #include "sg_json.h"
@@ -44,6 +48,148 @@ static const json_serialize_opts def_out_settings = {
 
 static int sgj_name_to_snake(const char * in, char * out, int maxlen_out);
 
+/* Interned keys: names of members are looked up (by content) in
+ * sgj_key_tab[] which gives a copy of their snake_case form held in the
+ * JSON builder's name pool. Members are then added by way of that copy
+ * with json_object_push_pooled(), so a name is converted and copied once
+ * per process rather than once per member. Slots are filled while holding
+ * sgj_key_mtx and are read without it. */
+#define SGJ_KEY_TAB_SZ 2048     /* a power of 2, at most 3/4 are used */
+#define SGJ_KEY_MAX_LEN 255
+
+struct sgj_key_ent {
+    uint32_t hash;
+    bool conv;                  /* sn is sgj_name_to_snake() of in */
+    int in_len;
+    int sn_len;
+    const char * in;            /* pooled */
+    const char * sn;            /* pooled, may be in */
+};
+
+static struct sgj_key_ent * sgj_key_tab[SGJ_KEY_TAB_SZ];
+static int sgj_key_num;
+static pthread_mutex_t sgj_key_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+sgj_key_hash(const char * name, int len, bool conv)
+{
+    uint32_t h = 2166136261U;           /* FNV-1a, 32 bit */
+
+    for ( ; len > 0; --len, ++name)
+        h = (h ^ (uint8_t)*name) * 16777619U;
+    return conv ? ~h : h;
+}
+
+/* Returns the slot holding 'name' (or the empty slot where it would go),
+ * NULL when every slot has been probed */
+static struct sgj_key_ent **
+sgj_key_find(const char * name, int len, bool conv, uint32_t h)
+{
+    int k, idx;
+    struct sgj_key_ent * ep;
+
+    for (k = 0, idx = h & (SGJ_KEY_TAB_SZ - 1); k < SGJ_KEY_TAB_SZ;
+         ++k, idx = (idx + 1) & (SGJ_KEY_TAB_SZ - 1)) {
+        ep = __atomic_load_n(sgj_key_tab + idx, __ATOMIC_ACQUIRE);
+        if ((NULL == ep) || ((ep->hash == h) && (ep->conv == conv) &&
+                             (ep->in_len == len) &&
+                             (0 == memcmp(ep->in, name, len))))
+            return sgj_key_tab + idx;
+    }
+    return NULL;
+}
+
+/* Returns the interned key of the 'len' bytes at 'name' (after conversion
+ * to snake_case when 'conv' is true, then 'name' must be null terminated)
+ * with its length in *lenp. Returns NULL if the key can't be interned. */
+static const char *
+sgj_key(const char * name, int len, bool conv, int * lenp)
+{
+    int n;
+    uint32_t h;
+    struct sgj_key_ent ** slotp;
+    struct sgj_key_ent * ep;
+    char b[SGJ_KEY_MAX_LEN + 1];
+
+    if ((len < 1) || (len > SGJ_KEY_MAX_LEN))
+        return NULL;
+    h = sgj_key_hash(name, len, conv);
+    slotp = sgj_key_find(name, len, conv, h);
+    if (slotp && *slotp) {
+        *lenp = (*slotp)->sn_len;
+        return (*slotp)->sn;
+    }
+    /* not there: look again while holding the lock, then add it */
+    pthread_mutex_lock(&sgj_key_mtx);
+    slotp = sgj_key_find(name, len, conv, h);
+    if ((NULL == slotp) || *slotp)
+        goto fini;
+    if (sgj_key_num >= (SGJ_KEY_TAB_SZ / 4) * 3)
+        goto fini;      /* full */
+    ep = (struct sgj_key_ent *)calloc(1, sizeof(*ep));
+    if (NULL == ep) {
+        slotp = NULL;
+        goto fini;
+    }
+    ep->hash = h;
+    ep->conv = conv;
+    ep->in_len = len;
+    ep->in = json_name_pool_add(name, len);
+    ep->sn = ep->in;
+    ep->sn_len = len;
+    if (ep->in && conv) {
+        n = sgj_name_to_snake(name, b, sizeof(b));
+        if ((n != len) || memcmp(b, name, n))
+            ep->sn = json_name_pool_add(b, n);
+        ep->sn_len = n;
+    }
+    if ((NULL == ep->in) || (NULL == ep->sn)) {  /* the pool is full */
+        free(ep);
+        slotp = NULL;
+        goto fini;
+    }
+    __atomic_store_n(slotp, ep, __ATOMIC_RELEASE);
+    ++sgj_key_num;
+fini:
+    pthread_mutex_unlock(&sgj_key_mtx);
+    if ((NULL == slotp) || (NULL == *slotp))
+        return NULL;
+    *lenp = (*slotp)->sn_len;
+    return (*slotp)->sn;
+}
+
+const char *
+sgj_key_intern(const char * name, bool to_snake)
+{
+    int len;
+
+    return name ? sgj_key(name, strlen(name), to_snake, &len) : NULL;
+}
+
+/* Like json_object_push_length() but the name is interned (or copied if
+ * that can't be done) */
+static json_value *
+sgj_obj_push_len(json_value * jvp, const char * sn_name, int len,
+                 json_value * value)
+{
+    int klen;
+    const char * kp;
+
+    if (json_name_pooled(sn_name))
+        return json_object_push_pooled(jvp, len, sn_name, value);
+    kp = sgj_key(sn_name, len, false, &klen);
+    if (kp)
+        return json_object_push_pooled(jvp, klen, kp, value);
+    return json_object_push_length(jvp, len, sn_name, value);
+}
+
+/* Like json_object_push() but the name is interned */
+static json_value *
+sgj_obj_push(json_value * jvp, const char * sn_name, json_value * value)
+{
+    return sgj_obj_push_len(jvp, sn_name, strlen(sn_name), value);
+}
+
 
 static bool
 sgj_parse_opts(sgj_state * jsp, const char * j_optarg)
@@ -86,6 +232,9 @@ sgj_parse_opts(sgj_state * jsp, const char * j_optarg)
         case '8':
             jsp->pr_indent_size = 8;
             break;
+        case 'c':
+            jsp->pr_format = prev_negate ? 0 : 'c';
+            break;
         case 'e':
             jsp->pr_exit_status = ! prev_negate;
             break;
@@ -137,6 +286,8 @@ sgj_parse_opts(sgj_state * jsp, const char * j_optarg)
         }
         prev_negate = negate ? ! prev_negate : false;
     }
+    if ('c' == jsp->pr_format)
+        jsp->pr_hex = false;    /* CBOR integers need no hex rendering */
     return ! bad_arg;
 }
 
@@ -158,6 +309,8 @@ sg_json_usage(int char_if_not_j, char * b, int blen)
     n += sg_scn3pr(b, blen, n, "      8    tab pretty output to 8 spaces\n");
     if (n >= (blen - 1))
         goto fini;
+    n += sg_scn3pr(b, blen, n, "      c    CBOR (binary) output rather than "
+                   "JSON text\n");
     n += sg_scn3pr(b, blen, n, "      e    show 'exit_status' field\n");
     n += sg_scn3pr(b, blen, n, "      h    show 'hex' fields\n");
     n += sg_scn3pr(b, blen, n,
@@ -194,12 +347,12 @@ fini:
 static char *
 sg_json_settings(sgj_state * jsp, char * b, int blen)
 {
-    snprintf(b, blen, "%d%se%sh%sk%sl%sn%so%sp%ss%sv", jsp->pr_indent_size,
+    snprintf(b, blen, "%d%se%sh%sk%sl%sn%so%sp%ss%sv%s", jsp->pr_indent_size,
              jsp->pr_exit_status ? "" : "-", jsp->pr_hex ? "" : "-",
              jsp->pr_packed ? "" : "-", jsp->pr_leadin ? "" : "-",
              jsp->pr_name_ex ? "" : "-", jsp->pr_out_hr ? "" : "-",
              jsp->pr_pretty ? "" : "-", jsp->pr_string ? "" : "-",
-             jsp->verbose ? "" : "-");
+             jsp->verbose ? "" : "-", ('c' == jsp->pr_format) ? "c" : "");
     return b;
 }
 
@@ -232,6 +385,10 @@ sgj_init_state(sgj_state * jsp, const char * j_optarg)
     jsp->basep = NULL;
     jsp->out_hrp = NULL;
     jsp->userp = NULL;
+    jsp->hr_fp = NULL;
+    jsp->streamp = NULL;
+    jsp->arenap = NULL;
+    jsp->sinkp = NULL;
 
     cp = getenv(sgj_opts_ev);
     if (cp) {
@@ -256,6 +413,7 @@ sgj_start_r(const char * util_name, const char * ver_str, int argc,
 
     if (NULL == jsp)
         return NULL;
+    sgj_arena_begin(jsp);
     jvp = json_object_new(0);
     if (NULL == jvp)
         return NULL;
@@ -270,8 +428,8 @@ sgj_start_r(const char * util_name, const char * ver_str, int argc,
         /* assume rest of json_*_new() calls succeed */
         json_array_push((json_value *)jap, json_integer_new(1));
         json_array_push((json_value *)jap, json_integer_new(0));
-        json_object_push((json_value *)jvp, "json_format_version",
-                         (json_value *)jap);
+        sgj_obj_push((json_value *)jvp, "json_format_version",
+                     (json_value *)jap);
         if (util_name) {
             jap = json_array_new(0);
             if (argv) {
@@ -279,39 +437,39 @@ sgj_start_r(const char * util_name, const char * ver_str, int argc,
                     json_array_push((json_value *)jap,
                                     json_string_new(argv[k]));
             }
-            jv2p = json_object_push((json_value *)jvp, "utility_invoked",
-                                    json_object_new(0));
-            json_object_push((json_value *)jv2p, "name",
-                             json_string_new(util_name));
+            jv2p = sgj_obj_push((json_value *)jvp, "utility_invoked",
+                                json_object_new(0));
+            sgj_obj_push((json_value *)jv2p, "name",
+                         json_string_new(util_name));
             if (ver_str)
-                json_object_push((json_value *)jv2p, "version_date",
-                                 json_string_new(ver_str));
+                sgj_obj_push((json_value *)jv2p, "version_date",
+                             json_string_new(ver_str));
             else
-                json_object_push((json_value *)jv2p, "version_date",
-                                 json_string_new("0.0"));
-            json_object_push((json_value *)jv2p, "argv", jap);
+                sgj_obj_push((json_value *)jv2p, "version_date",
+                             json_string_new("0.0"));
+            sgj_obj_push((json_value *)jv2p, "argv", jap);
         }
         if (jsp->verbose) {
             const char * cp = getenv(sgj_opts_ev);
             char b[32];
 
-            json_object_push((json_value *)jv2p, "environment_variable_name",
-                             json_string_new(sgj_opts_ev));
-            json_object_push((json_value *)jv2p, "environment_variable_value",
-                             json_string_new(cp ? cp : "no available"));
+            sgj_obj_push((json_value *)jv2p, "environment_variable_name",
+                         json_string_new(sgj_opts_ev));
+            sgj_obj_push((json_value *)jv2p, "environment_variable_value",
+                         json_string_new(cp ? cp : "no available"));
             sg_json_settings(jsp, b, sizeof(b));
-            json_object_push((json_value *)jv2p, "json_options",
-                             json_string_new(b));
+            sgj_obj_push((json_value *)jv2p, "json_options",
+                         json_string_new(b));
         }
     } else {
         if (jsp->pr_out_hr && util_name)
-            jv2p = json_object_push((json_value *)jvp, "utility_invoked",
-                                    json_object_new(0));
+            jv2p = sgj_obj_push((json_value *)jvp, "utility_invoked",
+                                json_object_new(0));
     }
     if (jsp->pr_out_hr && jv2p) {
-        jsp->out_hrp = json_object_push((json_value *)jv2p,
-                                         "plain_text_output",
-                                        json_array_new(0));
+        jsp->out_hrp = sgj_obj_push((json_value *)jv2p,
+                                     "plain_text_output",
+                                    json_array_new(0));
         if (jsp->pr_leadin && (jsp->verbose > 3)) {
             char * bp = (char *)calloc(4096, 1);
 
@@ -325,13 +483,586 @@ sgj_start_r(const char * util_name, const char * ver_str, int argc,
     return jvp;
 }
 
+static void
+sgj_out_settings(const sgj_state * jsp, json_serialize_opts * osp)
+{
+    memcpy(osp, &def_out_settings, sizeof(*osp));
+    if (jsp->pr_indent_size != def_out_settings.indent_size)
+        osp->indent_size = jsp->pr_indent_size;
+    if (! jsp->pr_pretty)
+        osp->mode = jsp->pr_packed ? json_serialize_mode_packed :
+                                     json_serialize_mode_single_line;
+}
+
+/* CBOR output (RFC 8949) keeps a table of the strings already written so
+ * that each one that is repeated (object member names in particular) is
+ * written in full once and after that as a reference to its index: the
+ * "stringref" extension (tags 25 and 256, see cbor.schmorp.de/stringref).
+ * A decoder adds each literal string that is at least as long as the
+ * reference to it would be, so the encoder must count those strings even
+ * after it stops remembering them. */
+#define SGJ_CB_TAB_SZ 4096      /* a power of 2, half of it is used */
+#define SGJ_CB_SB_MAX (256 * 1024)
+
+struct sgj_cb_ref {
+    uint32_t hash;
+    uint32_t len;
+    uint32_t off;       /* of the string's copy in sgj_cb_refs::sb */
+    uint32_t idx;       /* stringref index */
+};
+
+struct sgj_cb_refs {
+    uint64_t num;       /* strings in the decoder's table */
+    unsigned int used;  /* elements of tab[] holding a string */
+    unsigned int sb_len;
+    unsigned int sb_sz;
+    char * sb;
+    struct sgj_cb_ref tab[SGJ_CB_TAB_SZ];
+};
+
+/* Streaming backend state, see sgj_stream_start() */
+#define SGJ_STREAM_BUF_SZ 4096
+
+struct sgj_stream_t {
+    FILE * fp;
+    bool started;       /* root object's opening brace written */
+    bool arr_open;      /* first root member is an array, its opening
+                         * bracket written */
+    bool err;           /* a write to fp has failed */
+    int root_done;      /* number of root members written */
+    int arr_done;       /* number of elements written of that array */
+    int blen;           /* bytes held in b[] */
+    json_serialize_opts opts;
+    struct sgj_cb_refs * refsp;     /* non-NULL: CBOR rather than JSON */
+    char b[SGJ_STREAM_BUF_SZ];
+};
+
+static void
+sgj_st_drain(struct sgj_stream_t * ssp)
+{
+    if (ssp->blen > 0) {
+        if ((! ssp->err) &&
+            (1 != fwrite(ssp->b, ssp->blen, 1, ssp->fp)))
+            ssp->err = true;
+        ssp->blen = 0;
+    }
+}
+
+static void
+sgj_st_putc(struct sgj_stream_t * ssp, char c)
+{
+    if (ssp->blen >= SGJ_STREAM_BUF_SZ)
+        sgj_st_drain(ssp);
+    ssp->b[ssp->blen++] = c;
+}
+
+static void
+sgj_st_put(struct sgj_stream_t * ssp, const char * cp, int len)
+{
+    int n;
+
+    while (len > 0) {
+        if (ssp->blen >= SGJ_STREAM_BUF_SZ)
+            sgj_st_drain(ssp);
+        n = SGJ_STREAM_BUF_SZ - ssp->blen;
+        if (n > len)
+            n = len;
+        memcpy(ssp->b + ssp->blen, cp, n);
+        ssp->blen += n;
+        cp += n;
+        len -= n;
+    }
+}
+
+/* Writes the head of a CBOR data item: its 'major' type and argument */
+static void
+sgj_cb_head(struct sgj_stream_t * ssp, int major, uint64_t val)
+{
+    int k, n;
+    uint8_t b[9];
+
+    if (val < 24) {
+        sgj_st_putc(ssp, (char)((major << 5) | val));
+        return;
+    }
+    if (val <= 0xff)
+        n = 1;
+    else if (val <= 0xffff)
+        n = 2;
+    else if (val <= 0xffffffff)
+        n = 4;
+    else
+        n = 8;
+    b[0] = (major << 5) | ((1 == n) ? 24 : ((2 == n) ? 25 :
+                                            ((4 == n) ? 26 : 27)));
+    for (k = n; k > 0; --k, val >>= 8)
+        b[k] = val & 0xff;
+    sgj_st_put(ssp, (const char *)b, n + 1);
+}
+
+/* Shortest string the decoder adds to its table when it holds 'num' */
+static unsigned int
+sgj_cb_min_len(uint64_t num)
+{
+    if (num < 24)
+        return 3;
+    else if (num < 256)
+        return 4;
+    else if (num < 65536)
+        return 5;
+    else if (num < 0x100000000ULL)
+        return 7;
+    return 11;
+}
+
+static void
+sgj_cb_remember(struct sgj_cb_refs * rp, unsigned int k, uint32_t hash,
+                const char * cp, unsigned int len)
+{
+    char * bp;
+
+    if ((rp->used >= (SGJ_CB_TAB_SZ / 2)) ||
+        ((rp->sb_len + len) > SGJ_CB_SB_MAX))
+        return;
+    if ((rp->sb_len + len) > rp->sb_sz) {
+        unsigned int sz = rp->sb_sz ? rp->sb_sz : 4096;
+
+        while (sz < (rp->sb_len + len))
+            sz *= 2;
+        bp = (char *)realloc(rp->sb, sz);
+        if (NULL == bp)
+            return;
+        rp->sb = bp;
+        rp->sb_sz = sz;
+    }
+    memcpy(rp->sb + rp->sb_len, cp, len);
+    rp->tab[k].hash = hash;
+    rp->tab[k].len = len;
+    rp->tab[k].off = rp->sb_len;
+    rp->tab[k].idx = (uint32_t)rp->num;
+    rp->sb_len += len;
+    ++rp->used;
+}
+
+/* Writes a text string, or a reference to it if it has been written
+ * before (and is remembered) */
+static void
+sgj_cb_str(struct sgj_stream_t * ssp, const char * cp, unsigned int len)
+{
+    unsigned int j, k;
+    uint32_t hash = 2166136261U;        /* FNV-1a */
+    struct sgj_cb_refs * rp = ssp->refsp;
+    struct sgj_cb_ref * tp;
+
+    if (len < 3) {      /* shorter than any reference */
+        sgj_cb_head(ssp, 3, len);
+        sgj_st_put(ssp, cp, len);
+        return;
+    }
+    for (j = 0; j < len; ++j)
+        hash = (hash ^ (uint8_t)cp[j]) * 16777619U;
+    for (k = hash & (SGJ_CB_TAB_SZ - 1); rp->tab[k].len > 0;
+         k = (k + 1) & (SGJ_CB_TAB_SZ - 1)) {
+        tp = rp->tab + k;
+        if ((tp->hash == hash) && (tp->len == len) &&
+            (0 == memcmp(rp->sb + tp->off, cp, len))) {
+            sgj_cb_head(ssp, 6, 25);
+            sgj_cb_head(ssp, 0, tp->idx);
+            return;
+        }
+    }
+    sgj_cb_head(ssp, 3, len);
+    sgj_st_put(ssp, cp, len);
+    if (len >= sgj_cb_min_len(rp->num)) {
+        if (rp->num < 0xffffffffU)
+            sgj_cb_remember(rp, k, hash, cp, len);
+        ++rp->num;
+    }
+}
+
+/* Writes the tags that start a CBOR document: the self-described CBOR
+ * marker then the stringref namespace that its root is enclosed in */
+static void
+sgj_cb_start(struct sgj_stream_t * ssp)
+{
+    sgj_cb_head(ssp, 6, 55799);
+    sgj_cb_head(ssp, 6, 256);
+}
+
+static void
+sgj_cb_value(struct sgj_stream_t * ssp, const json_value * jvp)
+{
+    unsigned int k;
+    int64_t i;
+    uint64_t u;
+    uint8_t b[9];
+
+    switch (jvp->type) {
+    case json_array:
+        sgj_cb_head(ssp, 4, jvp->u.array.length);
+        for (k = 0; k < jvp->u.array.length; ++k)
+            sgj_cb_value(ssp, jvp->u.array.values[k]);
+        break;
+    case json_object:
+        sgj_cb_head(ssp, 5, jvp->u.object.length);
+        for (k = 0; k < jvp->u.object.length; ++k) {
+            sgj_cb_str(ssp, jvp->u.object.values[k].name,
+                       jvp->u.object.values[k].name_length);
+            sgj_cb_value(ssp, jvp->u.object.values[k].value);
+        }
+        break;
+    case json_string:
+        sgj_cb_str(ssp, jvp->u.string.ptr, jvp->u.string.length);
+        break;
+    case json_integer:
+        i = (int64_t)jvp->u.integer;
+        if (i >= 0)
+            sgj_cb_head(ssp, 0, (uint64_t)i);
+        else
+            sgj_cb_head(ssp, 1, (uint64_t)(-(i + 1)));
+        break;
+    case json_double:
+        memcpy(&u, &jvp->u.dbl, sizeof(u));
+        b[0] = 0xfb;            /* IEEE 754 binary64 */
+        for (k = 8; k > 0; --k, u >>= 8)
+            b[k] = u & 0xff;
+        sgj_st_put(ssp, (const char *)b, sizeof(b));
+        break;
+    case json_boolean:
+        sgj_st_putc(ssp, jvp->u.boolean ? (char)0xf5 : (char)0xf4);
+        break;
+    case json_null:
+        sgj_st_putc(ssp, (char)0xf6);
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+sgj_cb_free_refs(struct sgj_cb_refs * rp)
+{
+    if (rp) {
+        free(rp->sb);
+        free(rp);
+    }
+}
+
+/* The layout below follows what json_serialize_ex() does for each
+ * json_serialize_mode_* when no json_serialize_opt_* flags are given
+ * (as is the case in sgj_out_settings()). */
+static void
+sgj_st_newline(struct sgj_stream_t * ssp, int depth)
+{
+    int k;
+
+    if (json_serialize_mode_multiline != ssp->opts.mode)
+        return;
+    sgj_st_putc(ssp, '\n');
+    for (k = depth * ssp->opts.indent_size; k > 0; --k)
+        sgj_st_putc(ssp, ' ');
+}
+
+/* 'depth' is that of the array or object being opened or closed. For CBOR
+ * only the root object and its streamed array are opened and closed here,
+ * as items of indefinite length. */
+static void
+sgj_st_open(struct sgj_stream_t * ssp, char c, int depth)
+{
+    if (ssp->refsp) {
+        sgj_st_putc(ssp, ('{' == c) ? (char)0xbf : (char)0x9f);
+        return;
+    }
+    sgj_st_putc(ssp, c);
+    if (json_serialize_mode_single_line == ssp->opts.mode)
+        sgj_st_putc(ssp, ' ');
+    sgj_st_newline(ssp, depth + 1);
+}
+
+static void
+sgj_st_close(struct sgj_stream_t * ssp, char c, int depth)
+{
+    if (ssp->refsp) {
+        sgj_st_putc(ssp, (char)0xff);   /* "break" */
+        return;
+    }
+    sgj_st_newline(ssp, depth);
+    if (json_serialize_mode_single_line == ssp->opts.mode)
+        sgj_st_putc(ssp, ' ');
+    sgj_st_putc(ssp, c);
+}
+
+/* 'depth' is that of the elements being separated */
+static void
+sgj_st_comma(struct sgj_stream_t * ssp, int depth)
+{
+    if (ssp->refsp)
+        return;
+    sgj_st_putc(ssp, ',');
+    if (json_serialize_mode_single_line == ssp->opts.mode)
+        sgj_st_putc(ssp, ' ');
+    sgj_st_newline(ssp, depth);
+}
+
+static void
+sgj_st_str(struct sgj_stream_t * ssp, const char * cp, unsigned int len)
+{
+    unsigned int k;
+    char c;
+
+    sgj_st_putc(ssp, '"');
+    for (k = 0; k < len; ++k) {
+        c = cp[k];
+        switch (c) {
+        case '"':
+        case '\\':
+            break;
+        case '\b':
+            c = 'b';
+            break;
+        case '\f':
+            c = 'f';
+            break;
+        case '\n':
+            c = 'n';
+            break;
+        case '\r':
+            c = 'r';
+            break;
+        case '\t':
+            c = 't';
+            break;
+        default:
+            sgj_st_putc(ssp, c);
+            continue;
+        }
+        sgj_st_putc(ssp, '\\');
+        sgj_st_putc(ssp, c);
+    }
+    sgj_st_putc(ssp, '"');
+}
+
+static void
+sgj_st_key(struct sgj_stream_t * ssp, const json_object_entry * ep)
+{
+    if (ssp->refsp) {
+        sgj_cb_str(ssp, ep->name, ep->name_length);
+        return;
+    }
+    sgj_st_str(ssp, ep->name, ep->name_length);
+    sgj_st_putc(ssp, ':');
+    if (json_serialize_mode_packed != ssp->opts.mode)
+        sgj_st_putc(ssp, ' ');
+}
+
+static void
+sgj_st_value(struct sgj_stream_t * ssp, const json_value * jvp, int depth)
+{
+    unsigned int k;
+    int n;
+    char * cp;
+    char b[64];
+
+    if (ssp->refsp) {
+        sgj_cb_value(ssp, jvp);
+        return;
+    }
+    switch (jvp->type) {
+    case json_array:
+        if (0 == jvp->u.array.length) {
+            sgj_st_put(ssp, "[]", 2);
+            break;
+        }
+        sgj_st_open(ssp, '[', depth);
+        for (k = 0; k < jvp->u.array.length; ++k) {
+            if (k > 0)
+                sgj_st_comma(ssp, depth + 1);
+            sgj_st_value(ssp, jvp->u.array.values[k], depth + 1);
+        }
+        sgj_st_close(ssp, ']', depth);
+        break;
+    case json_object:
+        if (0 == jvp->u.object.length) {
+            sgj_st_put(ssp, "{}", 2);
+            break;
+        }
+        sgj_st_open(ssp, '{', depth);
+        for (k = 0; k < jvp->u.object.length; ++k) {
+            if (k > 0)
+                sgj_st_comma(ssp, depth + 1);
+            sgj_st_key(ssp, jvp->u.object.values + k);
+            sgj_st_value(ssp, jvp->u.object.values[k].value, depth + 1);
+        }
+        sgj_st_close(ssp, '}', depth);
+        break;
+    case json_string:
+        sgj_st_str(ssp, jvp->u.string.ptr, jvp->u.string.length);
+        break;
+    case json_integer:
+        n = snprintf(b, sizeof(b), "%" PRId64, (int64_t)jvp->u.integer);
+        sgj_st_put(ssp, b, n);
+        break;
+    case json_double:
+        n = snprintf(b, sizeof(b) - 2, "%g", jvp->u.dbl);
+        if ((cp = strchr(b, ',')))
+            *cp = '.';
+        else if ((NULL == strchr(b, '.')) && (NULL == strchr(b, 'e'))) {
+            b[n++] = '.';
+            b[n++] = '0';
+        }
+        sgj_st_put(ssp, b, n);
+        break;
+    case json_boolean:
+        if (jvp->u.boolean)
+            sgj_st_put(ssp, "true", 4);
+        else
+            sgj_st_put(ssp, "false", 5);
+        break;
+    case json_null:
+        sgj_st_put(ssp, "null", 4);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Writes the start of the root member at 'ep' */
+static void
+sgj_st_member(struct sgj_stream_t * ssp, const json_object_entry * ep)
+{
+    if (ssp->root_done > 0)
+        sgj_st_comma(ssp, 1);
+    sgj_st_key(ssp, ep);
+}
+
+/* Writes out, then frees, what is complete in the root object (see
+ * sgj_stream_start()). When 'final' is true all of it is complete and
+ * the root object is closed. */
+static void
+sgj_stream_flush(sgj_state * jsp, bool final)
+{
+    unsigned int k, n;
+    bool more;
+    struct sgj_stream_t * ssp = (struct sgj_stream_t *)jsp->streamp;
+    json_value * rootp = (json_value *)jsp->basep;
+    json_value * jvp;
+    json_object_entry * ep;
+
+    if (! ssp->started) {
+        ssp->started = true;
+        if (ssp->refsp)
+            sgj_cb_start(ssp);
+        if (final && (0 == rootp->u.object.length)) {
+            if (ssp->refsp)
+                sgj_cb_value(ssp, rootp);
+            else
+                sgj_st_put(ssp, "{}\n", 3);
+            goto fini;
+        }
+        sgj_st_open(ssp, '{', 0);
+    }
+    while (rootp->u.object.length > 0) {
+        ep = rootp->u.object.values;
+        jvp = ep->value;
+        more = final || (rootp->u.object.length > 1);
+        if (json_array == jvp->type) {
+            n = jvp->u.array.length;
+            if ((! more) && (n > 0))
+                --n;            /* last element may still be added to */
+            if ((n > 0) && (! ssp->arr_open)) {
+                sgj_st_member(ssp, ep);
+                sgj_st_open(ssp, '[', 1);
+                ssp->arr_open = true;
+            }
+            for (k = 0; k < n; ++k) {
+                if (ssp->arr_done++ > 0)
+                    sgj_st_comma(ssp, 2);
+                sgj_st_value(ssp, jvp->u.array.values[k], 2);
+            }
+            json_array_shift(jvp, n);
+            if (! more)
+                break;
+            if (ssp->arr_open)
+                sgj_st_close(ssp, ']', 1);
+            else {
+                sgj_st_member(ssp, ep);
+                sgj_st_value(ssp, jvp, 1);      /* empty array */
+            }
+            ssp->arr_open = false;
+            ssp->arr_done = 0;
+        } else {
+            if (! more)
+                break;
+            sgj_st_member(ssp, ep);
+            sgj_st_value(ssp, jvp, 1);
+        }
+        json_object_shift(rootp, 1);
+        ++ssp->root_done;
+    }
+    if (final) {
+        sgj_st_close(ssp, '}', 0);
+        if (NULL == ssp->refsp)
+            sgj_st_putc(ssp, '\n');
+    }
+fini:
+    sgj_st_drain(ssp);
+    fflush(ssp->fp);
+}
+
+/* Writes the tree at 'jvp' to 'fp' as a CBOR document */
+static void
+sgj_cb_js2file(const json_value * jvp, FILE * fp)
+{
+    struct sgj_stream_t * ssp;
+
+    ssp = (struct sgj_stream_t *)calloc(1, sizeof(*ssp));
+    if (NULL == ssp)
+        return;
+    ssp->refsp = (struct sgj_cb_refs *)calloc(1, sizeof(*ssp->refsp));
+    if (ssp->refsp) {
+        ssp->fp = fp;
+        sgj_cb_start(ssp);
+        sgj_cb_value(ssp, jvp);
+        sgj_st_drain(ssp);
+        sgj_cb_free_refs(ssp->refsp);
+    }
+    free(ssp);
+}
+
+bool
+sgj_stream_start(sgj_state * jsp, FILE * fp)
+{
+    struct sgj_stream_t * ssp;
+    json_arena * prev;
+
+    if ((NULL == jsp) || (NULL == jsp->basep) || (NULL == fp) ||
+        jsp->pr_out_hr)
+        return false;
+    ssp = (struct sgj_stream_t *)calloc(1, sizeof(*ssp));
+    if (NULL == ssp)
+        return false;
+    ssp->fp = fp;
+    sgj_out_settings(jsp, &ssp->opts);
+    if ('c' == jsp->pr_format) {
+        ssp->refsp = (struct sgj_cb_refs *)calloc(1, sizeof(*ssp->refsp));
+        if (NULL == ssp->refsp) {
+            free(ssp);
+            return false;
+        }
+    }
+    jsp->streamp = ssp;
+    /* values are freed as they are written so the arena would only grow */
+    prev = json_arena_use(NULL);
+    if (prev != (json_arena *)jsp->arenap)
+        json_arena_use(prev);
+    return true;
+}
+
 void
 sgj_js2file_estr(sgj_state * jsp, sgj_opaque_p jop, int exit_status,
                  const char * estr, FILE * fp)
 {
-    size_t len;
     const char * ccp;
-    char * b;
     json_value * jvp = (json_value *)(jop ? jop : jsp->basep);
     json_serialize_opts out_settings;
 
@@ -353,29 +1084,53 @@ sgj_js2file_estr(sgj_state * jsp, sgj_opaque_p jop, int exit_status,
         }
         sgj_js_nv_istr(jsp, jop, "exit_status", exit_status, NULL, ccp);
     }
-    memcpy(&out_settings, &def_out_settings, sizeof(out_settings));
-    if (jsp->pr_indent_size != def_out_settings.indent_size)
-        out_settings.indent_size = jsp->pr_indent_size;
-    if (! jsp->pr_pretty)
-        out_settings.mode = jsp->pr_packed ? json_serialize_mode_packed :
-                                json_serialize_mode_single_line;
-
-    len = json_measure_ex(jvp, out_settings);
-    if (len < 1)
+    if ((NULL == jop) && jsp->streamp) {
+        sgj_stream_flush(jsp, true);
         return;
-    if (jsp->verbose > 3)
-        fprintf(fp, "%s: serialization length: %zu bytes\n", __func__, len);
-    b = (char *)calloc(len, 1);
-    if (NULL == b) {
-        if (jsp->verbose > 3)
-            pr2serr("%s: unable to get %zu bytes on heap\n", __func__, len);
+    }
+    if ('c' == jsp->pr_format) {
+        sgj_cb_js2file(jvp, fp);
         return;
     }
-    json_serialize_ex(b, jvp, out_settings);
+    sgj_out_settings(jsp, &out_settings);
+
     if (jsp->verbose > 3)
         fprintf(fp, "json serialized:\n");
-    fprintf(fp, "%s\n", b);
-    free(b);
+    /* one walk of the tree, written out through a bounded buffer */
+    if (json_serialize_to_FILE(fp, jvp, out_settings) ||
+        (EOF == fputc('\n', fp))) {
+        if (jsp->verbose > 3)
+            pr2serr("%s: write failed: %s\n", __func__, strerror(errno));
+    }
+}
+
+bool
+sgj_arena_begin(sgj_state * jsp)
+{
+    if (NULL == jsp)
+        return false;
+    if (NULL == jsp->arenap) {
+        jsp->arenap = json_arena_new();
+        if (NULL == jsp->arenap)
+            return false;
+    }
+    json_arena_use((json_arena *)jsp->arenap);
+    return true;
+}
+
+void
+sgj_arena_end(sgj_state * jsp)
+{
+    if (jsp && jsp->arenap) {
+        json_arena_free((json_arena *)jsp->arenap);
+        jsp->arenap = NULL;
+    }
+}
+
+uint64_t
+sgj_values_made(void)
+{
+    return json_builder_values_made();
 }
 
 void
@@ -387,6 +1142,12 @@ sgj_finish(sgj_state * jsp)
         jsp->out_hrp = NULL;
         jsp->userp = NULL;
     }
+    if (jsp && jsp->streamp) {
+        sgj_cb_free_refs(((struct sgj_stream_t *)jsp->streamp)->refsp);
+        free(jsp->streamp);
+        jsp->streamp = NULL;
+    }
+    sgj_arena_end(jsp);
 }
 
 void
@@ -396,6 +1157,501 @@ sgj_free_unattached(sgj_opaque_p jop)
         json_builder_free((json_value *)jop);
 }
 
+/* Tags used by sgj_pack() and sgj_unpack_r(), one byte per value */
+#define SGJ_PK_OBJECT 'o'
+#define SGJ_PK_ARRAY 'a'
+#define SGJ_PK_STRING 's'
+#define SGJ_PK_INTEGER 'i'
+#define SGJ_PK_DOUBLE 'd'
+#define SGJ_PK_TRUE 't'
+#define SGJ_PK_FALSE 'f'
+#define SGJ_PK_NULL 'n'
+#define SGJ_PK_MAX_DEPTH 64
+
+static bool
+sgj_pack_len(FILE * fp, char tag, unsigned int len)
+{
+    uint32_t u = len;
+
+    return (EOF != fputc(tag, fp)) && (1 == fwrite(&u, sizeof(u), 1, fp));
+}
+
+bool
+sgj_pack(sgj_opaque_p jop, FILE * fp)
+{
+    unsigned int k;
+    json_value * jvp = (json_value *)jop;
+
+    if (NULL == jvp)
+        return false;
+    switch (jvp->type) {
+    case json_object:
+        if (! sgj_pack_len(fp, SGJ_PK_OBJECT, jvp->u.object.length))
+            return false;
+        for (k = 0; k < jvp->u.object.length; ++k) {
+            const json_object_entry * ep = jvp->u.object.values + k;
+
+            if ((! sgj_pack_len(fp, SGJ_PK_STRING, ep->name_length)) ||
+                (ep->name_length != fwrite(ep->name, 1, ep->name_length,
+                                           fp)) ||
+                (! sgj_pack(ep->value, fp)))
+                return false;
+        }
+        return true;
+    case json_array:
+        if (! sgj_pack_len(fp, SGJ_PK_ARRAY, jvp->u.array.length))
+            return false;
+        for (k = 0; k < jvp->u.array.length; ++k) {
+            if (! sgj_pack(jvp->u.array.values[k], fp))
+                return false;
+        }
+        return true;
+    case json_string:
+        return sgj_pack_len(fp, SGJ_PK_STRING, jvp->u.string.length) &&
+               (jvp->u.string.length == fwrite(jvp->u.string.ptr, 1,
+                                               jvp->u.string.length, fp));
+    case json_integer:
+        return (EOF != fputc(SGJ_PK_INTEGER, fp)) &&
+               (1 == fwrite(&jvp->u.integer, sizeof(jvp->u.integer), 1, fp));
+    case json_double:
+        return (EOF != fputc(SGJ_PK_DOUBLE, fp)) &&
+               (1 == fwrite(&jvp->u.dbl, sizeof(jvp->u.dbl), 1, fp));
+    case json_boolean:
+        return EOF != fputc(jvp->u.boolean ? SGJ_PK_TRUE : SGJ_PK_FALSE, fp);
+    case json_null:
+        return EOF != fputc(SGJ_PK_NULL, fp);
+    default:
+        return false;
+    }
+}
+
+/* Copies 'n' bytes from *bpp to 'out' (if non-NULL) and steps *bpp over
+ * them. Returns false if fewer than 'n' bytes remain before 'endp'. */
+static bool
+sgj_unpack_get(const uint8_t ** bpp, const uint8_t * endp, void * out,
+               size_t n)
+{
+    if ((size_t)(endp - *bpp) < n)
+        return false;
+    if (out)
+        memcpy(out, *bpp, n);
+    *bpp += n;
+    return true;
+}
+
+static json_value *
+sgj_unpack_val(const uint8_t ** bpp, const uint8_t * endp, int depth)
+{
+    uint8_t tag;
+    uint32_t k, len, nlen;
+    const uint8_t * np;
+    json_int_t ji;
+    double d;
+    json_value * jvp;
+    json_value * sub_jvp;
+
+    if ((depth > SGJ_PK_MAX_DEPTH) || (! sgj_unpack_get(bpp, endp, &tag, 1)))
+        return NULL;
+    switch (tag) {
+    case SGJ_PK_OBJECT:
+    case SGJ_PK_ARRAY:
+        if (! sgj_unpack_get(bpp, endp, &len, sizeof(len)))
+            return NULL;
+        jvp = (SGJ_PK_OBJECT == tag) ? json_object_new(0) : json_array_new(0);
+        if (NULL == jvp)
+            return NULL;
+        for (k = 0; k < len; ++k) {
+            np = NULL;
+            nlen = 0;
+            if (SGJ_PK_OBJECT == tag) {
+                if ((! sgj_unpack_get(bpp, endp, &tag, 1)) ||
+                    (SGJ_PK_STRING != tag) ||
+                    (! sgj_unpack_get(bpp, endp, &nlen, sizeof(nlen))))
+                    goto bad;
+                np = *bpp;
+                if (! sgj_unpack_get(bpp, endp, NULL, nlen))
+                    goto bad;
+                tag = SGJ_PK_OBJECT;
+            }
+            sub_jvp = sgj_unpack_val(bpp, endp, depth + 1);
+            if (NULL == sub_jvp)
+                goto bad;
+            if (np ? (! sgj_obj_push_len(jvp, (const char *)np, nlen,
+                                         sub_jvp)) :
+                     (! json_array_push(jvp, sub_jvp))) {
+                json_builder_free(sub_jvp);
+                goto bad;
+            }
+        }
+        return jvp;
+bad:
+        json_builder_free(jvp);
+        return NULL;
+    case SGJ_PK_STRING:
+        if (! sgj_unpack_get(bpp, endp, &len, sizeof(len)))
+            return NULL;
+        np = *bpp;
+        if (! sgj_unpack_get(bpp, endp, NULL, len))
+            return NULL;
+        return json_string_new_length(len, (const json_char *)np);
+    case SGJ_PK_INTEGER:
+        if (! sgj_unpack_get(bpp, endp, &ji, sizeof(ji)))
+            return NULL;
+        return json_integer_new(ji);
+    case SGJ_PK_DOUBLE:
+        if (! sgj_unpack_get(bpp, endp, &d, sizeof(d)))
+            return NULL;
+        return json_double_new(d);
+    case SGJ_PK_TRUE:
+    case SGJ_PK_FALSE:
+        return json_boolean_new(SGJ_PK_TRUE == tag);
+    case SGJ_PK_NULL:
+        return json_null_new();
+    default:
+        return NULL;
+    }
+}
+
+sgj_opaque_p
+sgj_unpack_r(sgj_state * jsp, const uint8_t * bp, int blen)
+{
+    const uint8_t * endp = bp + blen;
+    json_value * jvp;
+
+    if ((NULL == jsp) || (! jsp->pr_as_json) || (NULL == bp) || (blen < 1))
+        return NULL;
+    jvp = sgj_unpack_val(&bp, endp, 0);
+    if (jvp && (bp != endp)) {          /* trailing bytes: reject */
+        json_builder_free(jvp);
+        jvp = NULL;
+    }
+    return jvp;
+}
+
+/* Where plain text (human readable) output goes */
+static FILE *
+sgj_hr_fp(const sgj_state * jsp)
+{
+    return (jsp && jsp->hr_fp) ? jsp->hr_fp : stdout;
+}
+
+#define SGJ_SINK_INIT_SZ 8192
+#define SGJ_SINK_FLUSH_SZ (64 * 1024)   /* sgj_sink_flush(jsp, false) */
+#define SGJ_SINK_IOV_NUM 64     /* iovecs per writev(2), <= IOV_MAX */
+
+/* A piece of what a sink will write: either bp[off, off + len) of the
+ * sink or, when p is non-NULL, the caller's bytes given to sgj_sink_ref().
+ * Offsets rather than pointers are kept since bp may move as it grows. */
+struct sgj_sink_seg {
+    const char * p;
+    size_t off;
+    size_t len;
+};
+
+struct sgj_sink_t {
+    int fd;                     /* -1: only kept for sgj_sink_take() */
+    char * bp;
+    size_t len;                 /* of text in bp */
+    size_t cap;
+    size_t mark;                /* bp[0, mark) is in segs[] */
+    size_t queued;              /* bytes to be written, including refs */
+    int nsegs;
+    int max_segs;
+    struct sgj_sink_seg * segs;
+};
+
+/* Makes room for 'n' more bytes (and a trailing NUL) in the sink */
+static bool
+sgj_sink_grow(struct sgj_sink_t * skp, size_t n)
+{
+    size_t cap = skp->cap ? skp->cap : SGJ_SINK_INIT_SZ;
+    char * bp;
+
+    if (skp->len + n < skp->cap)
+        return true;
+    while (cap <= skp->len + n)
+        cap *= 2;
+    bp = (char *)realloc(skp->bp, cap);
+    if (NULL == bp)
+        return false;
+    skp->bp = bp;
+    skp->cap = cap;
+    return true;
+}
+
+/* Appends a segment, merging it with the last one when they are adjacent
+ * parts of the sink's buffer */
+static bool
+sgj_sink_seg_add(struct sgj_sink_t * skp, const char * p, size_t off,
+                 size_t len)
+{
+    struct sgj_sink_seg * sgp;
+
+    if (0 == len)
+        return true;
+    if ((NULL == p) && (skp->nsegs > 0)) {
+        sgp = skp->segs + skp->nsegs - 1;
+        if ((NULL == sgp->p) && (sgp->off + sgp->len == off)) {
+            sgp->len += len;
+            return true;
+        }
+    }
+    if (skp->nsegs >= skp->max_segs) {
+        int n = skp->max_segs ? (2 * skp->max_segs) : 64;
+
+        sgp = (struct sgj_sink_seg *)realloc(skp->segs, n * sizeof(*sgp));
+        if (NULL == sgp)
+            return false;
+        skp->segs = sgp;
+        skp->max_segs = n;
+    }
+    sgp = skp->segs + skp->nsegs++;
+    sgp->p = p;
+    sgp->off = off;
+    sgp->len = len;
+    return true;
+}
+
+/* Writes the bytes of 'iovp[0, n)' to 'fd', retrying after short writes.
+ * Returns 0 or an errno value. */
+static int
+sgj_sink_writev(int fd, struct iovec * iovp, int n)
+{
+    ssize_t got;
+
+    while (n > 0) {
+        got = writev(fd, iovp, n);
+        if (got < 0) {
+            if (EINTR == errno)
+                continue;
+            return errno;
+        }
+        for ( ; (n > 0) && ((size_t)got >= iovp->iov_len); ++iovp, --n)
+            got -= iovp->iov_len;
+        if (n > 0) {
+            iovp->iov_base = (char *)iovp->iov_base + got;
+            iovp->iov_len -= got;
+        }
+    }
+    return 0;
+}
+
+bool
+sgj_sink_begin(sgj_state * jsp, int fd)
+{
+    struct sgj_sink_t * skp;
+
+    if (NULL == jsp)
+        return false;
+    jsp->sinkp = NULL;
+    skp = (struct sgj_sink_t *)calloc(1, sizeof(*skp));
+    if (NULL == skp)
+        return false;
+    skp->fd = (fd < 0) ? -1 : fd;
+    if (! sgj_sink_grow(skp, 0)) {
+        free(skp);
+        return false;
+    }
+    jsp->sinkp = skp;
+    return true;
+}
+
+void
+sgj_sink_ref(sgj_state * jsp, const void * p, size_t len)
+{
+    struct sgj_sink_t * skp = jsp ? (struct sgj_sink_t *)jsp->sinkp : NULL;
+
+    if ((NULL == p) || (0 == len))
+        return;
+    if (NULL == skp) {
+        fwrite(p, 1, len, sgj_hr_fp(jsp));
+        return;
+    }
+    if (skp->fd < 0) {
+        if (sgj_sink_grow(skp, len)) {
+            memcpy(skp->bp + skp->len, p, len);
+            skp->len += len;
+        } else
+            fwrite(p, 1, len, sgj_hr_fp(jsp));
+        return;
+    }
+    if ((! sgj_sink_seg_add(skp, NULL, skp->mark, skp->len - skp->mark)) ||
+        (! sgj_sink_seg_add(skp, (const char *)p, 0, len))) {
+        struct iovec iov;
+
+        /* out of memory: write out what is held, then these, in order */
+        sgj_sink_flush(jsp, true);
+        iov.iov_base = (void *)p;
+        iov.iov_len = len;
+        sgj_sink_writev(skp->fd, &iov, 1);
+        return;
+    }
+    skp->mark = skp->len;
+    skp->queued += len;
+}
+
+int
+sgj_sink_flush(sgj_state * jsp, bool all)
+{
+    int k, n;
+    int err = 0;
+    struct sgj_sink_t * skp = jsp ? (struct sgj_sink_t *)jsp->sinkp : NULL;
+    const struct sgj_sink_seg * sgp;
+    struct iovec iov[SGJ_SINK_IOV_NUM];
+
+    if ((NULL == skp) || (skp->fd < 0))
+        return 0;
+    if ((! all) && (skp->queued + skp->len - skp->mark < SGJ_SINK_FLUSH_SZ))
+        return 0;
+    /* the segments then what followed the last sgj_sink_ref() */
+    for (k = 0, n = 0; k <= skp->nsegs; ++k) {
+        if (k < skp->nsegs) {
+            sgp = skp->segs + k;
+            iov[n].iov_base = (void *)(sgp->p ? sgp->p :
+                                       (skp->bp + sgp->off));
+            iov[n++].iov_len = sgp->len;
+        } else if (skp->len > skp->mark) {
+            iov[n].iov_base = skp->bp + skp->mark;
+            iov[n++].iov_len = skp->len - skp->mark;
+        }
+        if ((n > 0) && ((n >= SGJ_SINK_IOV_NUM) || (k == skp->nsegs))) {
+            if (0 == err)
+                err = sgj_sink_writev(skp->fd, iov, n);
+            n = 0;
+        }
+    }
+    skp->len = 0;
+    skp->mark = 0;
+    skp->queued = 0;
+    skp->nsegs = 0;
+    return err;
+}
+
+char *
+sgj_sink_take(sgj_state * jsp, size_t * lenp)
+{
+    char * bp;
+    struct sgj_sink_t * skp = jsp ? (struct sgj_sink_t *)jsp->sinkp : NULL;
+
+    *lenp = 0;
+    if ((NULL == skp) || (skp->fd >= 0) || (0 == skp->len))
+        return NULL;
+    bp = skp->bp;
+    bp[skp->len] = '\0';
+    *lenp = skp->len;
+    skp->bp = NULL;
+    skp->len = 0;
+    skp->cap = 0;
+    return bp;
+}
+
+void
+sgj_sink_end(sgj_state * jsp)
+{
+    struct sgj_sink_t * skp = jsp ? (struct sgj_sink_t *)jsp->sinkp : NULL;
+
+    if (NULL == skp)
+        return;
+    sgj_sink_flush(jsp, true);
+    free(skp->bp);
+    free(skp->segs);
+    free(skp);
+    jsp->sinkp = NULL;
+}
+
+/* The sink can't grow, so what it holds is written out ahead of what is
+ * then printed (and flushed) instead. With an 'fd' that keeps the order;
+ * without one, as with a failed open_memstream(3), the text is kept but
+ * perhaps not in order. */
+static void
+sgj_sink_oom(sgj_state * jsp)
+{
+    sgj_sink_flush(jsp, true);
+    fflush(sgj_hr_fp(jsp));
+}
+
+/* Formats into the sink of jsp, else prints to its plain text FILE */
+static void
+sgj_hr_vpr(const sgj_state * jsp, const char * fmt, va_list args)
+{
+    int n;
+    size_t room;
+    va_list args2;
+    struct sgj_sink_t * skp = jsp ? (struct sgj_sink_t *)jsp->sinkp : NULL;
+
+    if (NULL == skp) {
+        vfprintf(sgj_hr_fp(jsp), fmt, args);
+        return;
+    }
+    room = skp->cap - skp->len;
+    va_copy(args2, args);
+    n = vsnprintf(skp->bp + skp->len, room, fmt, args2);
+    va_end(args2);
+    if (n < 0)
+        return;
+    if ((size_t)n >= room) {
+        if (! sgj_sink_grow(skp, n)) {
+            sgj_sink_oom((sgj_state *)jsp);
+            vfprintf(sgj_hr_fp(jsp), fmt, args);
+            fflush(sgj_hr_fp(jsp));
+            return;
+        }
+        vsnprintf(skp->bp + skp->len, n + 1, fmt, args);
+    }
+    skp->len += n;
+}
+
+static void
+sgj_hr_line(const sgj_state * jsp, const char * line)
+{
+    struct sgj_sink_t * skp = jsp ? (struct sgj_sink_t *)jsp->sinkp : NULL;
+    size_t n;
+
+    if (NULL == skp) {
+        fprintf(sgj_hr_fp(jsp), "%s\n", line);
+        return;
+    }
+    n = strlen(line);
+    if (! sgj_sink_grow(skp, n + 1)) {
+        sgj_sink_oom((sgj_state *)jsp);
+        fprintf(sgj_hr_fp(jsp), "%s\n", line);
+        fflush(sgj_hr_fp(jsp));
+        return;
+    }
+    memcpy(skp->bp + skp->len, line, n);
+    skp->len += n;
+    skp->bp[skp->len++] = '\n';
+}
+
+/* Makes the 'ln' bytes at 'b' into one element of the plain_text_output
+ * array in a single pass: trailing newlines are dropped, a leading newline
+ * or tab is skipped, other newlines become semicolons and other tabs
+ * become semicolons (or spaces after a semicolon). Returns the start of
+ * the result whose length is placed in *lnp. */
+static char *
+sgj_hr_normalize(char * b, size_t ln, size_t * lnp)
+{
+    size_t k;
+    char * cp = b;
+
+    while ((ln > 0) && ('\n' == b[ln - 1]))
+        --ln;
+    if ((ln > 0) && (('\n' == b[0]) || ('\t' == b[0]))) {
+        ++cp;
+        --ln;
+    }
+    for (k = 0; k < ln; ++k) {
+        if ('\n' == cp[k])
+            cp[k] = ';';
+        else if ('\t' == cp[k])
+            cp[k] = ((cp > b) || (k > 0)) && (';' == *(cp + k - 1)) ?
+                    ' ' : ';';
+    }
+    cp[ln] = '\0';
+    *lnp = ln;
+    return cp;
+}
+
 void
 sgj_pr_hr(sgj_state * jsp, const char * fmt, ...)
 {
@@ -403,58 +1659,38 @@ sgj_pr_hr(sgj_state * jsp, const char * fmt, ...)
 
     if ((NULL == jsp) || (! jsp->pr_as_json)) {
         va_start(args, fmt);
-        vfprintf(stdout, fmt, args);
+        sgj_hr_vpr(jsp, fmt, args);
         va_end(args);
     } else if (jsp->pr_out_hr) {
-        bool step = false;
+        int n;
         size_t ln;
+        char * cp;
+        char * hp = NULL;
         char b[256];
         static const int blen = sizeof(b);
 
         va_start(args, fmt);
-        ln = vsnprintf(b, blen, fmt, args);
-        if ((ln > 0) && (ln < (size_t)blen)) {
-            char * cp;
-
-             /* deal with leading, trailing and embedded newlines */
-             while ( true ) {
-                cp = strrchr(b, '\n');
-                if (NULL == cp)
-                    break;
-                else if (cp == b) {
-                    if ('\0' == *(cp + 1))
-                        *cp = '\0';
-                    else
-                        step = true;
-                    break;
-                } else if ('\0' == *(cp + 1))
-                    *cp = '\0';
-                else
-                    *cp = ';';
-             }
-             /* replace any tabs with semicolons or spaces */
-             while ( true ) {
-                cp = strchr(b, '\t');
-                if (NULL == cp)
-                    break;
-                else if (cp == b) {
-                    if ('\0' == *(cp + 1))
-                        *cp = '\0';
-                    else {
-                        *cp = ' ';      /* so don't find \t again and again */
-                        step = true;
-                    }
-                } else {
-                    if (';' == *(cp - 1))
-                        *cp = ' ';
-                    else
-                        *cp = ';';
-                }
-            }
-        }
-        json_array_push((json_value *)jsp->out_hrp,
-                        json_string_new(step ? b + 1 : b));
+        n = vsnprintf(b, blen, fmt, args);
         va_end(args);
+        if (n < 0)
+            n = 0;
+        if (n < blen)
+            cp = sgj_hr_normalize(b, n, &ln);
+        else {          /* too long for b[], so format it again */
+            hp = (char *)malloc(n + 1);
+            if (NULL == hp)
+                return;
+            va_start(args, fmt);
+            vsnprintf(hp, n + 1, fmt, args);
+            va_end(args);
+            cp = sgj_hr_normalize(hp, n, &ln);
+            if (cp > hp)
+                memmove(hp, cp, ln + 1);
+        }
+        /* a heap buffer is handed over rather than copied again */
+        json_array_push((json_value *)jsp->out_hrp, hp ?
+                        json_string_new_nocopy(ln, hp) :
+                        json_string_new_length(ln, cp));
     } else {    /* do nothing, just consume arguments */
         va_start(args, fmt);
         va_end(args);
@@ -468,8 +1704,8 @@ sgj_named_subobject_r(sgj_state * jsp, sgj_opaque_p jop, const char * sn_name)
     sgj_opaque_p resp = NULL;
 
     if (jsp && jsp->pr_as_json && sn_name)
-        resp = json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                 sn_name, json_object_new(0));
+        resp = sgj_obj_push((json_value *)(jop ? jop : jsp->basep),
+                             sn_name, json_object_new(0));
     return resp;
 }
 
@@ -479,12 +1715,24 @@ sgj_snake_named_subobject_r(sgj_state * jsp, sgj_opaque_p jop,
 {
     if (jsp && jsp->pr_as_json && conv2sname) {
         int olen = strlen(conv2sname);
-        char * sname = (char *)malloc(olen + 8);
-        int nlen = sgj_name_to_snake(conv2sname, sname, olen + 8);
-
-        if (nlen > 0)
-            return json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                    sname, json_object_new(0));
+        int nlen;
+        const char * kp = sgj_key(conv2sname, olen, true, &nlen);
+        char * sname;
+        json_value * jvp;
+
+        if (kp)
+            return json_object_push_pooled((json_value *)(jop ? jop :
+                                                          jsp->basep),
+                                           nlen, kp, json_object_new(0));
+        sname = (char *)malloc(olen + 8);
+        if (NULL == sname)
+            return NULL;
+        nlen = sgj_name_to_snake(conv2sname, sname, olen + 8);
+        jvp = (nlen > 0) ?
+              json_object_push_length((json_value *)(jop ? jop : jsp->basep),
+                                      nlen, sname, json_object_new(0)) : NULL;
+        free(sname);
+        return jvp;
     }
     return NULL;
 }
@@ -496,8 +1744,8 @@ sgj_named_subarray_r(sgj_state * jsp, sgj_opaque_p jop, const char * sn_name)
     sgj_opaque_p resp = NULL;
 
     if (jsp && jsp->pr_as_json && sn_name)
-        resp = json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                sn_name, json_array_new(0));
+        resp = sgj_obj_push((json_value *)(jop ? jop : jsp->basep),
+                            sn_name, json_array_new(0));
     return resp;
 }
 
@@ -507,12 +1755,24 @@ sgj_snake_named_subarray_r(sgj_state * jsp, sgj_opaque_p jop,
 {
     if (jsp && jsp->pr_as_json && conv2sname) {
         int olen = strlen(conv2sname);
-        char * sname = (char *)malloc(olen + 8);
-        int nlen = sgj_name_to_snake(conv2sname, sname, olen + 8);
-
-        if (nlen > 0)
-            return json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                    sname, json_array_new(0));
+        int nlen;
+        const char * kp = sgj_key(conv2sname, olen, true, &nlen);
+        char * sname;
+        json_value * jvp;
+
+        if (kp)
+            return json_object_push_pooled((json_value *)(jop ? jop :
+                                                          jsp->basep),
+                                           nlen, kp, json_array_new(0));
+        sname = (char *)malloc(olen + 8);
+        if (NULL == sname)
+            return NULL;
+        nlen = sgj_name_to_snake(conv2sname, sname, olen + 8);
+        jvp = (nlen > 0) ?
+              json_object_push_length((json_value *)(jop ? jop : jsp->basep),
+                                      nlen, sname, json_array_new(0)) : NULL;
+        free(sname);
+        return jvp;
     }
     return NULL;
 }
@@ -574,8 +1834,8 @@ sgj_js_nv_s(sgj_state * jsp, sgj_opaque_p jop, const char * sn_name,
 {
     if (jsp && jsp->pr_as_json && value) {
         if (sn_name)
-            return json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                    sn_name, json_string_new(value));
+            return sgj_obj_push((json_value *)(jop ? jop : jsp->basep),
+                                sn_name, json_string_new(value));
         else
             return json_array_push((json_value *)(jop ? jop : jsp->basep),
                                    json_string_new(value));
@@ -595,8 +1855,8 @@ sgj_js_nv_s_len(sgj_state * jsp, sgj_opaque_p jop, const char * sn_name,
                 break;
         }
         if (sn_name)
-            return json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                    sn_name, json_string_new_length(k, value));
+            return sgj_obj_push((json_value *)(jop ? jop : jsp->basep),
+                                sn_name, json_string_new_length(k, value));
         else
             return json_array_push((json_value *)(jop ? jop : jsp->basep),
                                    json_string_new_length(k, value));
@@ -650,8 +1910,8 @@ sgj_js_nv_i(sgj_state * jsp, sgj_opaque_p jop, const char * sn_name,
 {
     if (jsp && jsp->pr_as_json) {
         if (sn_name)
-            return json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                    sn_name, json_integer_new(value));
+            return sgj_obj_push((json_value *)(jop ? jop : jsp->basep),
+                                sn_name, json_integer_new(value));
         else
             return json_array_push((json_value *)(jop ? jop : jsp->basep),
                                    json_integer_new(value));
@@ -666,8 +1926,8 @@ sgj_js_nv_b(sgj_state * jsp, sgj_opaque_p jop, const char * sn_name,
 {
     if (jsp && jsp->pr_as_json) {
         if (sn_name)
-            return json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                    sn_name, json_boolean_new(value));
+            return sgj_obj_push((json_value *)(jop ? jop : jsp->basep),
+                                sn_name, json_boolean_new(value));
         else
             return json_array_push((json_value *)(jop ? jop : jsp->basep),
                                    json_boolean_new(value));
@@ -680,13 +1940,18 @@ sgj_opaque_p
 sgj_js_nv_o(sgj_state * jsp, sgj_opaque_p jop, const char * sn_name,
             sgj_opaque_p ua_jop)
 {
+    json_value * jvp;
+
     if (jsp && jsp->pr_as_json && ua_jop) {
+        jvp = (json_value *)(jop ? jop : jsp->basep);
         if (sn_name)
-            return json_object_push((json_value *)(jop ? jop : jsp->basep),
-                                    sn_name, (json_value *)ua_jop);
-        else
-            return json_array_push((json_value *)(jop ? jop : jsp->basep),
-                                   (json_value *)ua_jop);
+            return sgj_obj_push(jvp, sn_name, (json_value *)ua_jop);
+        if (NULL == json_array_push(jvp, (json_value *)ua_jop))
+            return NULL;
+        /* a new element in an array of the root completes the last one */
+        if (jsp->streamp && jsp->basep && (jvp->parent == jsp->basep))
+            sgj_stream_flush(jsp, false);
+        return ua_jop;
     } else
         return NULL;
 }
@@ -1145,7 +2410,7 @@ sgj_haj_xx(sgj_state * jsp, sgj_opaque_p jop, int leadin_sp,
     if (NULL == aname) {
         if ((! as_json) || (jsp && jsp->pr_out_hr)) {
             sgj_jtype_to_s(b + n, blen - n, jvp, hex_haj);
-            printf("%s\n", b);
+            sgj_hr_line(jsp, b);
         }
         if (NULL == jop) {
             if (as_json && jsp->pr_out_hr) {
@@ -1164,10 +2429,15 @@ sgj_haj_xx(sgj_state * jsp, sgj_opaque_p jop, int leadin_sp,
     }
     if (as_json) {
         int k;
+        const char * kp;
 
         if (NULL == jop)
             jop = jsp->basep;
-        k = sgj_name_to_snake(aname, jname, sizeof(jname));
+        kp = sgj_key(aname, strlen(aname), true, &k);
+        if (NULL == kp) {
+            k = sgj_name_to_snake(aname, jname, sizeof(jname));
+            kp = jname;
+        }
         if (k > 0) {
             done = false;
             if (nex_s && (strlen(nex_s) > 0)) {
@@ -1175,12 +2445,12 @@ sgj_haj_xx(sgj_state * jsp, sgj_opaque_p jop, int leadin_sp,
                 case json_string:
                     break;
                 case json_integer:
-                    sgj_js_nv_ihexstr_nex(jsp, jop, jname, jvp->u.integer,
+                    sgj_js_nv_ihexstr_nex(jsp, jop, kp, jvp->u.integer,
                                           hex_haj, sc_mn_s, val_s, nex_s);
                     done = true;
                     break;
                 case json_boolean:
-                    sgj_js_nv_ihexstr_nex(jsp, jop, jname, jvp->u.boolean,
+                    sgj_js_nv_ihexstr_nex(jsp, jop, kp, jvp->u.boolean,
                                           false, sc_mn_s, val_s, nex_s);
                     done = true;
                     break;
@@ -1194,7 +2464,7 @@ sgj_haj_xx(sgj_state * jsp, sgj_opaque_p jop, int leadin_sp,
                     break;
                 case json_integer:
                     if (hex_haj) {
-                        sgj_js_nv_ihexstr(jsp, jop, jname, jvp->u.integer,
+                        sgj_js_nv_ihexstr(jsp, jop, kp, jvp->u.integer,
                                           sc_mn_s, val_s);
                         done = true;
                     }
@@ -1206,7 +2476,7 @@ sgj_haj_xx(sgj_state * jsp, sgj_opaque_p jop, int leadin_sp,
             }
             if (! done) {
                 eaten = true;
-                json_object_push((json_value *)jop, jname,
+                sgj_obj_push_len((json_value *)jop, kp, k,
                                  jvp ? jvp : json_null_new());
             }
         }
@@ -1217,7 +2487,7 @@ sgj_haj_xx(sgj_state * jsp, sgj_opaque_p jop, int leadin_sp,
     if (as_json && jsp->pr_out_hr)
         json_array_push((json_value *)jsp->out_hrp, json_string_new(b));
     if (! as_json)
-        printf("%s\n", b);
+        sgj_hr_line(jsp, b);
 fini:
     if (jvp && (! eaten))
         json_builder_free((json_value *)jvp);
@@ -1314,11 +2584,16 @@ sgj_haj_subo_r(sgj_state * jsp, sgj_opaque_p jop, int leadin_sp,
     if (as_json && jsp->pr_out_hr)
         json_array_push((json_value *)jsp->out_hrp, json_string_new(b));
     if (! as_json)
-        printf("%s\n", b);
+        sgj_hr_line(jsp, b);
 
     if (as_json) {
-        sgj_name_to_snake(aname, b, blen);
-        jo2p = sgj_named_subobject_r(jsp, jop, b);
+        const char * kp = sgj_key_intern(aname, true);
+
+        if (NULL == kp) {
+            sgj_name_to_snake(aname, b, blen);
+            kp = b;
+        }
+        jo2p = sgj_named_subobject_r(jsp, jop, kp);
         if (jo2p) {
             sgj_js_nv_i(jsp, jo2p, "i", value);
             if (hex_haj && jsp->pr_hex) {
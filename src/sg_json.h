@@ -21,6 +21,65 @@ extern "C" {
 /* JSON support functions and structures follow. The prefix "sgj_" is used
  * for sg3_utils JSON functions, types and values. */
 
+/* As with pr2serr() (see sg_pr2serr.h), the functions built into liblsscsi
+ * carry its prefix there, so a program that also links sg3_utils (which
+ * has its own sgj_* functions) gets no clash. Callers use the short names. */
+#define sg_json_usage lsscsi_sg_json_usage
+#define sgj_arena_begin lsscsi_sgj_arena_begin
+#define sgj_arena_end lsscsi_sgj_arena_end
+#define sgj_conv2json_string lsscsi_sgj_conv2json_string
+#define sgj_convert2snake lsscsi_sgj_convert2snake
+#define sgj_convert2snake_rm_parens lsscsi_sgj_convert2snake_rm_parens
+#define sgj_finish lsscsi_sgj_finish
+#define sgj_free_unattached lsscsi_sgj_free_unattached
+#define sgj_haj_subo_r lsscsi_sgj_haj_subo_r
+#define sgj_haj_vb lsscsi_sgj_haj_vb
+#define sgj_haj_vi lsscsi_sgj_haj_vi
+#define sgj_haj_vi_nex lsscsi_sgj_haj_vi_nex
+#define sgj_haj_vistr lsscsi_sgj_haj_vistr
+#define sgj_haj_vistr_nex lsscsi_sgj_haj_vistr_nex
+#define sgj_haj_vs lsscsi_sgj_haj_vs
+#define sgj_hr_str_out lsscsi_sgj_hr_str_out
+#define sgj_init_state lsscsi_sgj_init_state
+#define sgj_is_snake_name lsscsi_sgj_is_snake_name
+#define sgj_js2file_estr lsscsi_sgj_js2file_estr
+#define sgj_js_nv_b lsscsi_sgj_js_nv_b
+#define sgj_js_nv_hex_bytes lsscsi_sgj_js_nv_hex_bytes
+#define sgj_js_nv_i lsscsi_sgj_js_nv_i
+#define sgj_js_nv_ihex lsscsi_sgj_js_nv_ihex
+#define sgj_js_nv_ihex_nex lsscsi_sgj_js_nv_ihex_nex
+#define sgj_js_nv_ihexstr lsscsi_sgj_js_nv_ihexstr
+#define sgj_js_nv_ihexstr_nex lsscsi_sgj_js_nv_ihexstr_nex
+#define sgj_js_nv_istr lsscsi_sgj_js_nv_istr
+#define sgj_js_nv_o lsscsi_sgj_js_nv_o
+#define sgj_js_nv_s lsscsi_sgj_js_nv_s
+#define sgj_js_nv_s_len lsscsi_sgj_js_nv_s_len
+#define sgj_js_nv_s_len_chk lsscsi_sgj_js_nv_s_len_chk
+#define sgj_js_nv_s_nex lsscsi_sgj_js_nv_s_nex
+#define sgj_key_intern lsscsi_sgj_key_intern
+#define sgj_named_subarray_r lsscsi_sgj_named_subarray_r
+#define sgj_named_subobject_r lsscsi_sgj_named_subobject_r
+#define sgj_new_unattached_array_r lsscsi_sgj_new_unattached_array_r
+#define sgj_new_unattached_bool_r lsscsi_sgj_new_unattached_bool_r
+#define sgj_new_unattached_integer_r lsscsi_sgj_new_unattached_integer_r
+#define sgj_new_unattached_null_r lsscsi_sgj_new_unattached_null_r
+#define sgj_new_unattached_object_r lsscsi_sgj_new_unattached_object_r
+#define sgj_new_unattached_str_len_r lsscsi_sgj_new_unattached_str_len_r
+#define sgj_new_unattached_string_r lsscsi_sgj_new_unattached_string_r
+#define sgj_pack lsscsi_sgj_pack
+#define sgj_pr_hr lsscsi_sgj_pr_hr
+#define sgj_sink_begin lsscsi_sgj_sink_begin
+#define sgj_sink_end lsscsi_sgj_sink_end
+#define sgj_sink_flush lsscsi_sgj_sink_flush
+#define sgj_sink_ref lsscsi_sgj_sink_ref
+#define sgj_sink_take lsscsi_sgj_sink_take
+#define sgj_snake_named_subarray_r lsscsi_sgj_snake_named_subarray_r
+#define sgj_snake_named_subobject_r lsscsi_sgj_snake_named_subobject_r
+#define sgj_start_r lsscsi_sgj_start_r
+#define sgj_stream_start lsscsi_sgj_stream_start
+#define sgj_unpack_r lsscsi_sgj_unpack_r
+#define sgj_values_made lsscsi_sgj_values_made
+
 /* Following macro for sgj_pr_hr() which takes printf() like arguments */
 #if __USE_MINGW_ANSI_STDIO -0 == 1
 #define __printf(a, b) __attribute__((__format__(gnu_printf, a, b)))
@@ -60,7 +119,7 @@ typedef struct sgj_state_t {
     bool pr_packed;             /* 'k' (def: false) only when !pr_pretty */
     bool pr_pretty;             /* 'p' (def: true) */
     bool pr_string;             /* 's' (def: true) */
-    char pr_format;             /*  (def: '\0') */
+    char pr_format;             /* 'c' for CBOR (def: '\0') */
     int pr_indent_size;         /* digit (def: 4) */
     int verbose;                /* 'v' (def: 0) incremented each appearance */
     int q_counter;              /* 'q' (def: 0) extra, for using apps */
@@ -73,6 +132,10 @@ typedef struct sgj_state_t {
                                  * element contains a line of plain text. The
                                  * array's JSON name is 'plain_text_output' */
     sgj_opaque_p userp;         /* for temporary usage */
+    FILE * hr_fp;               /* plain text output sink, NULL -> stdout */
+    sgj_opaque_p streamp;       /* set by sgj_stream_start(), else NULL */
+    sgj_opaque_p arenap;        /* set by sgj_arena_begin(), else NULL */
+    sgj_opaque_p sinkp;         /* set by sgj_sink_begin(), else NULL */
 } sgj_state;
 
 /* This function tries to convert the in_name C string to the "snake_case"
@@ -93,6 +156,17 @@ char * sgj_convert2snake(const char * in, char * out, int maxlen_out);
 /* Is in_name made up of only lower case alphanumerics and underscores? */
 bool sgj_is_snake_name(const char * in_name);
 
+/* Returns the snake_case form of in_name (as sgj_convert2snake() gives)
+ * or, when to_snake is false, in_name itself, as a string that lasts as
+ * long as the process. The same name always gives the same pointer and
+ * a member given it as its name is added without the name being copied.
+ * The sgj_* functions that add named members intern their names this way
+ * so callers need not, but one that keeps the pointer (e.g. for a key
+ * that is used often) saves the lookup. Returns NULL if in_name is NULL,
+ * longer than 255 bytes or can't be interned (e.g. too many names), in
+ * which case in_name still works as before. Thread safe. */
+const char * sgj_key_intern(const char * in_name, bool to_snake);
+
 /* There are many variants of JSON supporting functions below and some
  * abbreviations are used to shorten their function names:
  *    sgj_  - prefix of all the functions related to (non-)JSON output
@@ -119,10 +193,44 @@ bool sgj_is_snake_name(const char * in_name);
  * like printf(fmt, ...); note that no LF is added. In the jsp->pr_out_hrp is
  * true case, nothing is printed to stdout but instead is placed into a JSON
  * array (jsp->out_hrp) after some preprocessing. That preprocessing involves
- * removing a leading LF from 'fmt' (if present) and up to two trailing LF
- * characters. */
+ * removing a leading LF from 'fmt' (if present) and any trailing LF
+ * characters; embedded LFs and tabs become semicolons. Lines of any length
+ * are kept whole. With a sink (see sgj_sink_begin()) and jsp->pr_as_json
+ * false, the output is formatted into the sink rather than printed. */
 void sgj_pr_hr(sgj_state * jsp, const char * fmt, ...) __printf(2, 3);
 
+/* Gives jsp a plain text output sink: what sgj_pr_hr() and the other
+ * plain text output functions would print is instead formatted straight
+ * into one growable buffer, that is written to 'fd' with writev(2) by
+ * sgj_sink_flush(). If 'fd' is negative the text is only kept, until
+ * taken with sgj_sink_take(). Replaces any sink jsp already has (without
+ * flushing or freeing it: jsp may be a copy). Returns false if jsp is
+ * NULL or a heap allocation fails, leaving jsp without a sink. */
+bool sgj_sink_begin(sgj_state * jsp, int fd);
+
+/* Queues 'len' bytes at 'p' to be written after what the sink already
+ * holds, without copying them; they must be left unchanged until the
+ * next sgj_sink_flush() or sgj_sink_end(). Without a sink they are
+ * printed; when the sink has no 'fd' they are copied. */
+void sgj_sink_ref(sgj_state * jsp, const void * p, size_t len);
+
+/* Writes what the sink holds (and the bytes queued by sgj_sink_ref()) to
+ * its 'fd' with as few writev(2) calls as it takes. If 'all' is false
+ * that is only done once enough has been collected to be worth a system
+ * call, so this can be called at every natural boundary (e.g. after each
+ * device). Returns 0, or the errno value of a failed write (what was not
+ * written is then dropped). */
+int sgj_sink_flush(sgj_state * jsp, bool all);
+
+/* Returns the text held by a sink without an 'fd' as a null terminated
+ * heap buffer (for free(3)), with its length in *lenp, and empties the
+ * sink. Returns NULL (and *lenp is 0) if nothing is held, or if jsp has
+ * no such sink. */
+char * sgj_sink_take(sgj_state * jsp, size_t * lenp);
+
+/* Flushes (all) then frees the sink of jsp, if any. */
+void sgj_sink_end(sgj_state * jsp);
+
 /* Initializes the state object pointed to by jsp based on the argument
  * given to the right of --json= pointed to by j_optarg. If it is NULL
  * then state object gets its default values. Returns true if argument
@@ -361,20 +469,75 @@ void sgj_hr_str_out(sgj_state * jsp, const char * sp, int slen);
  * or jsp->basep is NULL then this function does nothing. If jsp->exit_status
  * is true then a new JSON object named "exit_status" and the 'exit_status'
  * value rendered as a JSON integer is appended to jsp->basep. The in-core
- * JSON tree with jsp->basep as its root is streamed to 'fp'. */
+ * JSON tree with jsp->basep as its root is streamed to 'fp'. If
+ * jsp->pr_format is 'c' then it is written as CBOR (RFC 8949) rather than
+ * JSON text: a self-described CBOR tag then a stringref namespace (so
+ * each repeated name or string is written once) holding the root. The
+ * streaming backend writes the root object and its streamed array as
+ * items of indefinite length. */
 void sgj_js2file_estr(sgj_state * jsp, sgj_opaque_p jop, int exit_status,
                       const char * estr, FILE * fp);
 
+/* Selects the streaming backend: rather than holding the whole in-core
+ * JSON tree until sgj_js2file_estr() is called, members of the root object
+ * (jsp->basep) are written to 'fp' as they become complete and are then
+ * freed. A root member is complete once another one has been added after
+ * it. A root member that is an array is written an element at a time: an
+ * element is complete once another element has been added after it with
+ * sgj_js_nv_o(). So the caller must not add to a value after its next
+ * sibling (at those two levels) has been added. Output is written through
+ * a fixed size buffer and is the same as the in-core tree would give.
+ * sgj_js2file_estr(jsp, NULL, ...) then writes the rest, ignoring its 'fp'
+ * argument. Should be called soon after sgj_start_r(). Returns false (and
+ * the in-core tree is used as before) if jsp->basep is NULL, jsp->pr_out_hr
+ * is set (since that array is added to until the end) or a heap allocation
+ * fails. */
+bool sgj_stream_start(sgj_state * jsp, FILE * fp);
+
+/* JSON values (and their strings) made by the calling thread are taken
+ * from an arena kept in jsp, rather than each from the heap, until
+ * sgj_arena_end() is called. Then they are all freed at once, so freeing
+ * them one by one (e.g. sgj_free_unattached()) costs next to nothing.
+ * sgj_start_r() calls this and sgj_finish() calls sgj_arena_end(). Apart
+ * from that it is useful when many short lived JSON values are made, as
+ * in a loop that outputs one document per event. Calling it again with
+ * the same jsp selects the existing arena. Values made by other threads
+ * still come from the heap. Returns false if jsp is NULL or a heap
+ * allocation fails (and the heap is then used). */
+bool sgj_arena_begin(sgj_state * jsp);
+
+/* Frees every JSON value taken from the arena of jsp (if any): none of
+ * them may be used after this call. */
+void sgj_arena_end(sgj_state * jsp);
+
+/* Returns the number of JSON values (objects, arrays, strings, numbers
+ * and the like) that the calling thread has made so far. */
+uint64_t sgj_values_made(void);
+
 /* This function is only needed if the pointer returned from either
  * sgj_new_unattached_object_r() or sgj_new_unattached_array_r() has not
  * been attached into the in-core JSON tree whose root is jsp->basep . */
 void sgj_free_unattached(sgj_opaque_p jop);
 
+/* Writes the JSON value (typically an object) that 'jop' points to, and
+ * everything below it, to 'fp' in a compact binary form that
+ * sgj_unpack_r() can rebuild. Lengths and numbers are in host byte order
+ * so the output is only meant to be read back on the same machine (e.g.
+ * a cache). Returns false if 'jop' is NULL or a write to 'fp' fails. */
+bool sgj_pack(sgj_opaque_p jop, FILE * fp);
+
+/* Rebuilds what sgj_pack() wrote as a new unattached JSON value from the
+ * 'blen' bytes at 'bp'. Returns NULL if jsp is NULL, jsp->pr_as_json is
+ * false, those bytes are malformed or a heap allocation fails. */
+sgj_opaque_p sgj_unpack_r(sgj_state * jsp, const uint8_t * bp, int blen);
+
 /* If jsp is NULL or jsp->basep is NULL then this function does nothing.
  * This function does bottom up, heap freeing of all the in-core JSON
  * objects and arrays attached to the root JSON object assumed to be
- * found at jsp->basep . After this call jsp->basep, jsp->out_hrp and
- * jsp->userp will all be set to NULL.  */
+ * found at jsp->basep . When those came from an arena (see
+ * sgj_arena_begin()) that is simply freed. After this call jsp->basep,
+ * jsp->out_hrp, jsp->userp, jsp->streamp and jsp->arenap will all be set
+ * to NULL.  */
 void sgj_finish(sgj_state * jsp);
 
 /* Forms a string of the JSON command line options help and assumes,
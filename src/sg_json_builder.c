@@ -34,6 +34,11 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
 
 /* This code was fetched from https://github.com/json-parser/json-builder
  * and comes with the 2 clause BSD license (shown above) which is the same
@@ -41,6 +46,9 @@
 
 #ifdef _MSC_VER
     #define snprintf _snprintf
+    #define JSON_THREAD_LOCAL __declspec(thread)
+#else
+    #define JSON_THREAD_LOCAL __thread
 #endif
 
 static const json_serialize_opts default_opts =
@@ -60,11 +68,269 @@ typedef struct json_builder_value
    size_t additional_length_allocated;
    size_t length_iterated;
 
+   json_arena * arena;  /* this value, its string, names and arrays come
+                         * from here, or from the heap when NULL */
+
 } json_builder_value;
 
+/* Arena: memory is handed out from large chunks and only given back when
+ * the whole arena is reset or freed.
+ */
+#define JSON_ARENA_CHUNK_SZ (64 * 1024)
+#define JSON_ARENA_ALIGN 16
+#define JSON_ARENA_ROUND(n) \
+      (((n) + JSON_ARENA_ALIGN - 1) & ~((size_t) JSON_ARENA_ALIGN - 1))
+
+typedef struct json_arena_chunk
+{
+   struct json_arena_chunk * next;
+   size_t size;         /* usable bytes after the header */
+   size_t used;
+
+} json_arena_chunk;
+
+#define JSON_ARENA_CHUNK_HDR_SZ JSON_ARENA_ROUND (sizeof (json_arena_chunk))
+
+struct json_arena
+{
+   json_arena_chunk * chunks;   /* one being used first */
+   int mixed;   /* a value from elsewhere was put in one from here */
+};
+
+/* Arena that this thread's new values come from, see json_arena_use() */
+static JSON_THREAD_LOCAL json_arena * cur_arena;
+static JSON_THREAD_LOCAL unsigned long values_made;
+
 /* Use this to silence clang --analyze warning about 'unix.MallocSizeof' */
 static const int jbv_sz = sizeof (json_builder_value);
 
+json_arena * json_arena_new (void)
+{
+   return (json_arena *) calloc (1, sizeof (json_arena));
+}
+
+void json_arena_reset (json_arena * arena)
+{
+   json_arena_chunk * chunk, * next, * keep = NULL;
+
+   for (chunk = arena->chunks; chunk; chunk = next)
+   {
+      next = chunk->next;
+
+      if (!keep && chunk->size == JSON_ARENA_CHUNK_SZ)
+      {
+         keep = chunk;
+         continue;
+      }
+
+      free (chunk);
+   }
+
+   if (keep)
+   {
+      keep->next = NULL;
+      keep->used = 0;
+   }
+
+   arena->chunks = keep;
+   arena->mixed = 0;
+}
+
+void json_arena_free (json_arena * arena)
+{
+   if (!arena)
+      return;
+
+   json_arena_reset (arena);
+   free (arena->chunks);
+
+   if (cur_arena == arena)
+      cur_arena = NULL;
+
+   free (arena);
+}
+
+json_arena * json_arena_use (json_arena * arena)
+{
+   json_arena * prev = cur_arena;
+
+   cur_arena = arena;
+   return prev;
+}
+
+int json_arena_is_mixed (const json_arena * arena)
+{
+   return arena->mixed;
+}
+
+static void * arena_alloc (json_arena * arena, size_t size)
+{
+   json_arena_chunk * chunk = arena->chunks;
+   size_t need = JSON_ARENA_ROUND (size);
+   unsigned char * p;
+
+   if (!chunk || chunk->size - chunk->used < need)
+   {
+      size_t chunk_sz = need > JSON_ARENA_CHUNK_SZ / 4 ? need : JSON_ARENA_CHUNK_SZ;
+
+      if (! (chunk = (json_arena_chunk *) malloc (JSON_ARENA_CHUNK_HDR_SZ + chunk_sz)))
+         return NULL;
+
+      chunk->size = chunk_sz;
+      chunk->used = 0;
+
+      /* a large block gets a chunk of its own, behind the one being used */
+      if (arena->chunks && chunk_sz != JSON_ARENA_CHUNK_SZ)
+      {
+         chunk->next = arena->chunks->next;
+         arena->chunks->next = chunk;
+      }
+      else
+      {
+         chunk->next = arena->chunks;
+         arena->chunks = chunk;
+      }
+   }
+
+   p = (unsigned char *) chunk + JSON_ARENA_CHUNK_HDR_SZ + chunk->used;
+   chunk->used += need;
+
+   return p;
+}
+
+/* Name pool, see json_name_pool_add(). Being one static array, whether a
+ * name is from it is two comparisons; space is taken with an atomic add
+ * so threads need no lock.
+ */
+#define JSON_NAME_POOL_SZ (64 * 1024)
+
+static json_char name_pool [JSON_NAME_POOL_SZ];
+static size_t name_pool_used;
+
+const json_char * json_name_pool_add (const json_char * name,
+                                      unsigned int length)
+{
+#ifdef __GNUC__
+   size_t off = __atomic_fetch_add (&name_pool_used, length + 1,
+                                    __ATOMIC_RELAXED);
+
+   if (off + length + 1 > JSON_NAME_POOL_SZ)
+      return NULL;
+
+   memcpy (name_pool + off, name, length * sizeof (json_char));
+   name_pool [off + length] = 0;
+
+   return name_pool + off;
+#else
+   (void) name;
+   (void) length;
+   return NULL;      /* no pool */
+#endif
+}
+
+int json_name_pooled (const json_char * name)
+{
+   return (uintptr_t) name >= (uintptr_t) name_pool &&
+          (uintptr_t) name < (uintptr_t) (name_pool + JSON_NAME_POOL_SZ);
+}
+
+/* Blocks carry no size, so the caller gives it ('old_size') */
+static void * arena_realloc (json_arena * arena, void * ptr, size_t old_size,
+                             size_t size)
+{
+   json_arena_chunk * chunk = arena->chunks;
+   unsigned char * p = (unsigned char *) ptr;
+   size_t grow = JSON_ARENA_ROUND (size) - JSON_ARENA_ROUND (old_size);
+   void * ptr_new;
+
+   if (size <= old_size)
+      return ptr;
+
+   /* the last block taken can often grow where it is */
+   if (chunk && p + JSON_ARENA_ROUND (old_size) ==
+         (unsigned char *) chunk + JSON_ARENA_CHUNK_HDR_SZ + chunk->used &&
+       chunk->size - chunk->used >= grow)
+   {
+      chunk->used += grow;
+      return ptr;
+   }
+
+   if (! (ptr_new = arena_alloc (arena, size)))
+      return NULL;
+
+   memcpy (ptr_new, ptr, old_size);
+   return ptr_new;
+}
+
+static void * jb_malloc (json_arena * arena, size_t size)
+{
+   return arena ? arena_alloc (arena, size) : malloc (size);
+}
+
+static void * jb_calloc (json_arena * arena, size_t size)
+{
+   void * ptr;
+
+   if (!arena)
+      return calloc (1, size);
+
+   if ((ptr = arena_alloc (arena, size)))
+      memset (ptr, 0, size);
+
+   return ptr;
+}
+
+static void * jb_realloc (json_arena * arena, void * ptr, size_t old_size,
+                          size_t size)
+{
+   return arena ? arena_realloc (arena, ptr, old_size, size) : realloc (ptr, size);
+}
+
+static void jb_free (json_arena * arena, void * ptr)
+{
+   if (!arena)
+      free (ptr);
+}
+
+static json_arena * value_arena (const json_value * value)
+{
+   return ((json_builder_value *) value)->is_builder_value ?
+             ((json_builder_value *) value)->arena : NULL;
+}
+
+/* Once 'value' is put in 'container' the arena of the container (if any)
+ * no longer holds all that is below its values.
+ */
+static void note_mixed (const json_value * container, const json_value * value)
+{
+   json_arena * arena = ((json_builder_value *) container)->arena;
+
+   if (arena && value_arena (value) != arena)
+      arena->mixed = 1;
+}
+
+static json_value * value_new (json_type type)
+{
+   json_arena * arena = cur_arena;
+   json_value * value = (json_value *) jb_calloc (arena, jbv_sz);
+
+   if (!value)
+      return NULL;
+
+   ((json_builder_value *) value)->is_builder_value = 1;
+   ((json_builder_value *) value)->arena = arena;
+
+   value->type = type;
+   ++values_made;
+
+   return value;
+}
+
+unsigned long json_builder_values_made (void)
+{
+   return values_made;
+}
+
 
 static int builderize (json_value * value)
 {
@@ -103,10 +369,10 @@ const size_t json_builder_extra = sizeof(json_builder_value) - sizeof(json_value
 /* These flags are set up from the opts before serializing to make the
  * serializer conditions simpler.
  */
-const int f_spaces_around_brackets = (1 << 0);
-const int f_spaces_after_commas    = (1 << 1);
-const int f_spaces_after_colons    = (1 << 2);
-const int f_tabs                   = (1 << 3);
+static const int f_spaces_around_brackets = (1 << 0);
+static const int f_spaces_after_commas    = (1 << 1);
+static const int f_spaces_after_colons    = (1 << 2);
+static const int f_tabs                   = (1 << 3);
 
 static int get_serialize_flags (json_serialize_opts opts)
 {
@@ -135,21 +401,30 @@ static int get_serialize_flags (json_serialize_opts opts)
    return flags;
 }
 
+/* Once the preallocated length (if any) is used up, arrays and objects
+ * are grown to twice their length (but at least JSON_BUILDER_MIN_GROW)
+ * so that N pushes cost O(N) copying rather than the O(N^2) of growing
+ * by one each time.
+ */
+#define JSON_BUILDER_MIN_GROW 4
+
+static size_t grow_length (size_t length)
+{
+   return length < JSON_BUILDER_MIN_GROW ? JSON_BUILDER_MIN_GROW : 2 * length;
+}
+
 json_value * json_array_new (size_t length)
 {
     /* 'value' will be pointer to an instance of the base class json_value */
-    json_value * value = (json_value *) calloc (1, jbv_sz);
+    json_value * value = value_new (json_array);
 
     if (!value)
        return NULL;
 
-    ((json_builder_value *) value)->is_builder_value = 1;
-
-    value->type = json_array;
-
-    if (! (value->u.array.values = (json_value **) malloc (length * sizeof (json_value *))))
+    if (! (value->u.array.values = (json_value **) jb_malloc
+           (value_arena (value), length * sizeof (json_value *))))
     {
-       free (value);
+       jb_free (value_arena (value), value);
        return NULL;
     }
 
@@ -171,38 +446,40 @@ json_value * json_array_push (json_value * array, json_value * value)
    }
    else
    {
-      json_value ** values_new = (json_value **) realloc
-            (array->u.array.values, sizeof (json_value *) * (array->u.array.length + 1));
+      size_t length_new = grow_length (array->u.array.length);
+      json_value ** values_new = (json_value **) jb_realloc
+            (value_arena (array), array->u.array.values,
+             sizeof (json_value *) * array->u.array.length,
+             sizeof (json_value *) * length_new);
 
       if (!values_new)
          return NULL;
 
       array->u.array.values = values_new;
+      ((json_builder_value *) array)->additional_length_allocated =
+            length_new - array->u.array.length - 1;
    }
 
    array->u.array.values [array->u.array.length] = value;
    ++ array->u.array.length;
 
    value->parent = array;
+   note_mixed (array, value);
 
    return value;
 }
 
 json_value * json_object_new (size_t length)
 {
-    json_value * value = (json_value *) calloc (1, jbv_sz);
+    json_value * value = value_new (json_object);
 
     if (!value)
        return NULL;
 
-    ((json_builder_value *) value)->is_builder_value = 1;
-
-    value->type = json_object;
-
-    if (! (value->u.object.values = (json_object_entry *) calloc
-           (length, sizeof (*value->u.object.values))))
+    if (! (value->u.object.values = (json_object_entry *) jb_calloc
+           (value_arena (value), length * sizeof (*value->u.object.values))))
     {
-       free (value);
+       jb_free (value_arena (value), value);
        return NULL;
     }
 
@@ -211,6 +488,10 @@ json_value * json_object_new (size_t length)
     return value;
 }
 
+static json_value * object_push_entry (json_value * object,
+                                       unsigned int name_length, json_char * name,
+                                       json_value * value);
+
 json_value * json_object_push (json_value * object,
                                const json_char * name,
                                json_value * value)
@@ -223,32 +504,75 @@ json_value * json_object_push_length (json_value * object,
                                       json_value * value)
 {
    json_char * name_copy;
+   json_arena * arena;
 
    assert (object->type == json_object);
 
-   if (! (name_copy = (json_char *) malloc ((name_length + 1) * sizeof (json_char))))
+   if (!builderize (object))
+      return NULL;
+
+   arena = value_arena (object);
+
+   if (! (name_copy = (json_char *) jb_malloc (arena, (name_length + 1) * sizeof (json_char))))
       return NULL;
    
    memcpy (name_copy, name, name_length * sizeof (json_char));
    name_copy [name_length] = 0;
 
-   if (!json_object_push_nocopy (object, name_length, name_copy, value))
+   if (!object_push_entry (object, name_length, name_copy, value))
    {
-      free (name_copy);
+      jb_free (arena, name_copy);
       return NULL;
    }
 
    return value;
 }
 
+json_value * json_object_push_pooled (json_value * object,
+                                      unsigned int name_length,
+                                      const json_char * name,
+                                      json_value * value)
+{
+   assert (object->type == json_object);
+
+   if (!json_name_pooled (name))
+      return json_object_push_length (object, name_length, name, value);
+
+   if (!builderize (object))
+      return NULL;
+
+   return object_push_entry (object, name_length, (json_char *) name, value);
+}
+
 json_value * json_object_push_nocopy (json_value * object,
                                       unsigned int name_length, json_char * name,
                                       json_value * value)
 {
-   json_object_entry * entry;
-
    assert (object->type == json_object);
 
+   if (!builderize (object))
+      return NULL;
+
+   /* the name must be freed along with the object's other names */
+   if (value_arena (object))
+   {
+      if (!json_object_push_length (object, name_length, name, value))
+         return NULL;
+
+      free (name);
+      return value;
+   }
+
+   return object_push_entry (object, name_length, name, value);
+}
+
+/* 'name' must come from the same place as the object's values */
+static json_value * object_push_entry (json_value * object,
+                                       unsigned int name_length, json_char * name,
+                                       json_value * value)
+{
+   json_object_entry * entry;
+
    if (!builderize (object) || !builderize (value))
       return NULL;
 
@@ -258,14 +582,18 @@ json_value * json_object_push_nocopy (json_value * object,
    }
    else
    {
+      size_t length_new = grow_length (object->u.object.length);
       json_object_entry * values_new = (json_object_entry *)
-            realloc (object->u.object.values, sizeof (*object->u.object.values)
-                            * (object->u.object.length + 1));
+            jb_realloc (value_arena (object), object->u.object.values,
+                        sizeof (*object->u.object.values) * object->u.object.length,
+                        sizeof (*object->u.object.values) * length_new);
 
       if (!values_new)
          return NULL;
 
       object->u.object.values = values_new;
+      ((json_builder_value *) object)->additional_length_allocated =
+            length_new - object->u.object.length - 1;
    }
 
    entry = object->u.object.values + object->u.object.length;
@@ -277,6 +605,7 @@ json_value * json_object_push_nocopy (json_value * object,
    ++ object->u.object.length;
 
    value->parent = object;
+   note_mixed (object, value);
 
    return value;
 }
@@ -289,7 +618,7 @@ json_value * json_string_new (const json_char * buf)
 json_value * json_string_new_length (unsigned int length, const json_char * buf)
 {
    json_value * value;
-   json_char * copy = (json_char *) malloc ((length + 1) * sizeof (json_char));
+   json_char * copy = (json_char *) jb_malloc (cur_arena, (length + 1) * sizeof (json_char));
 
    if (!copy)
       return NULL;
@@ -297,25 +626,29 @@ json_value * json_string_new_length (unsigned int length, const json_char * buf)
    memcpy (copy, buf, length * sizeof (json_char));
    copy [length] = 0;
 
-   if (! (value = json_string_new_nocopy (length, copy)))
+   if (! (value = value_new (json_string)))
    {
-      free (copy);
+      jb_free (cur_arena, copy);
       return NULL;
    }
 
+   value->u.string.length = length;
+   value->u.string.ptr = copy;
+
    return value;
 }
 
 json_value * json_string_new_nocopy (unsigned int length, json_char * buf)
 {
-   json_value * value = (json_value *) calloc (1, jbv_sz);
+   /* 'buf' is from the heap so this value is too */
+   json_arena * prev = json_arena_use (NULL);
+   json_value * value = value_new (json_string);
+
+   json_arena_use (prev);
    
    if (!value)
       return NULL;
 
-   ((json_builder_value *) value)->is_builder_value = 1;
-
-   value->type = json_string;
    value->u.string.length = length;
    value->u.string.ptr = buf;
 
@@ -324,14 +657,10 @@ json_value * json_string_new_nocopy (unsigned int length, json_char * buf)
 
 json_value * json_integer_new (json_int_t integer)
 {
-   json_value * value = (json_value *) calloc (1, jbv_sz);
+   json_value * value = value_new (json_integer);
    
    if (!value)
       return NULL;
-
-   ((json_builder_value *) value)->is_builder_value = 1;
-
-   value->type = json_integer;
    value->u.integer = integer;
 
    return value;
@@ -339,14 +668,10 @@ json_value * json_integer_new (json_int_t integer)
 
 json_value * json_double_new (double dbl)
 {
-   json_value * value = (json_value *) calloc (1, jbv_sz);
+   json_value * value = value_new (json_double);
    
    if (!value)
       return NULL;
-
-   ((json_builder_value *) value)->is_builder_value = 1;
-
-   value->type = json_double;
    value->u.dbl = dbl;
 
    return value;
@@ -354,14 +679,10 @@ json_value * json_double_new (double dbl)
 
 json_value * json_boolean_new (int b)
 {
-   json_value * value = (json_value *) calloc (1, jbv_sz);
+   json_value * value = value_new (json_boolean);
    
    if (!value)
       return NULL;
-
-   ((json_builder_value *) value)->is_builder_value = 1;
-
-   value->type = json_boolean;
    value->u.boolean = b;
 
    return value;
@@ -369,15 +690,11 @@ json_value * json_boolean_new (int b)
 
 json_value * json_null_new (void)
 {
-   json_value * value = (json_value *) calloc (1, jbv_sz);
+   json_value * value = value_new (json_null);
    
    if (!value)
       return NULL;
 
-   ((json_builder_value *) value)->is_builder_value = 1;
-
-   value->type = json_null;
-
    return value;
 }
 
@@ -441,12 +758,16 @@ json_value * json_object_merge (json_value * objectA, json_value * objectB)
               + objectB->u.object.length;
 
       if (! (values_new = (json_object_entry *)
-            realloc (objectA->u.object.values, sizeof (json_object_entry) * alloc)))
+            jb_realloc (value_arena (objectA), objectA->u.object.values,
+                        sizeof (json_object_entry) * (alloc - objectB->u.object.length),
+                        sizeof (json_object_entry) * alloc)))
       {
           return NULL;
       }
 
       objectA->u.object.values = values_new;
+      ((json_builder_value *) objectA)->additional_length_allocated =
+          alloc - (objectA->u.object.length + objectB->u.object.length);
    }
 
    for (i = 0; i < objectB->u.object.length; ++ i)
@@ -455,12 +776,28 @@ json_value * json_object_merge (json_value * objectA, json_value * objectB)
 
       *entry = objectB->u.object.values[i];
       entry->value->parent = objectA;
+      note_mixed (objectA, entry->value);
+
+      /* names are freed along with the rest of objectA */
+      if (value_arena (objectA) != value_arena (objectB) &&
+          !json_name_pooled (entry->name))
+      {
+         json_char * name_copy = (json_char *) jb_malloc
+               (value_arena (objectA), (entry->name_length + 1) * sizeof (json_char));
+
+         if (name_copy)
+         {
+            memcpy (name_copy, entry->name, (entry->name_length + 1) * sizeof (json_char));
+            jb_free (value_arena (objectB), entry->name);
+            entry->name = name_copy;
+         }
+      }
    }
 
    objectA->u.object.length += objectB->u.object.length;
 
-   free (objectB->u.object.values);
-   free (objectB);
+   jb_free (value_arena (objectB), objectB->u.object.values);
+   jb_free (value_arena (objectB), objectB);
 
    return objectA;
 }
@@ -717,33 +1054,96 @@ void json_serialize (json_char * buf, json_value * value)
    json_serialize_ex (buf, value, default_opts);
 }
 
+/* Makes room for 'n' more characters when the output buffer is bounded */
+#define RESERVE(n) do {                               \
+   if (out->end && buf + (n) > out->end) {            \
+      out->buf = buf;                                 \
+      out_flush (out);                                \
+      buf = out->buf;                                 \
+   }                                                  \
+} while(0);                                           \
+
 #define PRINT_NEWLINE() do {                          \
    if (opts.mode == json_serialize_mode_multiline) {  \
+      RESERVE (2);                                    \
       if (opts.opts & json_serialize_opt_CRLF)        \
          *buf ++ = '\r';                              \
       *buf ++ = '\n';                                 \
       for(i = 0; i < indent; ++ i)                    \
+      {                                               \
+         RESERVE (1);                                 \
          *buf ++ = indent_char;                       \
+      }                                               \
    }                                                  \
 } while(0);                                           \
 
 #define PRINT_OPENING_BRACKET(c) do {                 \
+   RESERVE (2);                                       \
    *buf ++ = (c);                                     \
    if (flags & f_spaces_around_brackets)              \
       *buf ++ = ' ';                                  \
 } while(0);                                           \
 
 #define PRINT_CLOSING_BRACKET(c) do {                 \
+   RESERVE (2);                                       \
    if (flags & f_spaces_around_brackets)              \
       *buf ++ = ' ';                                  \
    *buf ++ = (c);                                     \
 } while(0);                                           \
 
-void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts opts)
+/* Where serialize_out() puts its output: into a buffer that is big enough
+ * (end is NULL, see json_measure()) or into a bounded one that is given
+ * to write_fn() whenever the next piece might not fit.
+ */
+typedef struct json_out
+{
+   json_char * buf;     /* the next character goes here */
+   json_char * start;
+   json_char * end;
+   int (* write_fn) (void * ctx, const json_char * p, size_t len);
+   void * ctx;
+   int err;             /* set by the first write_fn() that fails */
+
+} json_out;
+
+static void out_flush (json_out * out)
+{
+   if (out->buf > out->start && !out->err)
+      out->err = out->write_fn (out->ctx, out->start, out->buf - out->start);
+
+   out->buf = out->start;
+}
+
+/* serialize_string() a piece at a time when the buffer is bounded */
+static json_char * out_string (json_out * out, json_char * buf,
+                               unsigned int length, const json_char * str)
+{
+   unsigned int n;
+   size_t room = out->end ? (size_t) (out->end - out->start) / 2 : 0;
+
+   while (length > 0)
+   {
+      /* each character may become two */
+      n = (room && length > room) ? (unsigned int) room : length;
+
+      RESERVE (2 * n);
+      buf += serialize_string (buf, n, str);
+      str += n;
+      length -= n;
+   }
+
+   return buf;
+}
+
+/* The one walk of the tree behind json_serialize_ex() and
+ * json_serialize_to_fd()/_FILE(). No null terminator is added.
+ */
+static void serialize_out (json_out * out, json_value * value, json_serialize_opts opts)
 {
    json_int_t integer, orig_integer;
    json_object_entry * entry;
    json_char * ptr, * dot;
+   json_char * buf = out->buf;
    int indent = 0;
    char indent_char;
    int i;
@@ -763,6 +1163,7 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
             {
                if (value->u.array.length == 0)
                {
+                  RESERVE (2);
                   *buf ++ = '[';
                   *buf ++ = ']';
 
@@ -787,6 +1188,7 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
 
             if (((json_builder_value *) value)->length_iterated > 0)
             {
+               RESERVE (2);
                *buf ++ = ',';
 
                if (flags & f_spaces_after_commas)
@@ -805,6 +1207,7 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
             {
                if (value->u.object.length == 0)
                {
+                  RESERVE (2);
                   *buf ++ = '{';
                   *buf ++ = '}';
 
@@ -829,6 +1232,7 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
 
             if (((json_builder_value *) value)->length_iterated > 0)
             {
+               RESERVE (2);
                *buf ++ = ',';
 
                if (flags & f_spaces_after_commas)
@@ -839,8 +1243,10 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
 
             entry = value->u.object.values + (((json_builder_value *) value)->length_iterated ++);
 
+            RESERVE (1);
             *buf ++ = '\"';
-            buf += serialize_string (buf, entry->name_length, entry->name);
+            buf = out_string (out, buf, entry->name_length, entry->name);
+            RESERVE (3);
             *buf ++ = '\"';
             *buf ++ = ':';
 
@@ -852,13 +1258,16 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
 
          case json_string:
 
+            RESERVE (1);
             *buf ++ = '\"';
-            buf += serialize_string (buf, value->u.string.length, value->u.string.ptr);
+            buf = out_string (out, buf, value->u.string.length, value->u.string.ptr);
+            RESERVE (1);
             *buf ++ = '\"';
             break;
 
          case json_integer:
 
+            RESERVE (24);  /* sign and up to 20 digits */
             integer = value->u.integer;
 
             if (integer < 0)
@@ -890,6 +1299,7 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
 
          case json_double:
 
+            RESERVE (48);
             ptr = buf;
 
             buf += sprintf (buf, "%g", value->u.dbl);
@@ -908,6 +1318,7 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
 
          case json_boolean:
 
+            RESERVE (5);
             if (value->u.boolean)
             {
                memcpy (buf, "true", 4);
@@ -923,6 +1334,7 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
 
          case json_null:
 
+            RESERVE (4);
             memcpy (buf, "null", 4);
             buf += 4;
             break;
@@ -934,38 +1346,126 @@ void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts
       value = value->parent;
    }
 
-   *buf = 0;
+   out->buf = buf;
+}
+
+void json_serialize_ex (json_char * buf, json_value * value, json_serialize_opts opts)
+{
+   json_out out;
+
+   memset (&out, 0, sizeof (out));
+   out.buf = out.start = buf;
+   serialize_out (&out, value, opts);
+   *out.buf = 0;
+}
+
+#define JSON_OUT_BUF_SZ (16 * 1024)
+
+static int write_fd (void * ctx, const json_char * p, size_t len)
+{
+   int fd = *(const int *) ctx;
+   ssize_t n;
+
+   while (len > 0)
+   {
+      n = write (fd, p, len);
+
+      if (n < 0)
+      {
+         if (errno == EINTR)
+            continue;
+
+         return -1;
+      }
+
+      p += n;
+      len -= n;
+   }
+
+   return 0;
+}
+
+static int write_FILE (void * ctx, const json_char * p, size_t len)
+{
+   return fwrite (p, 1, len, (FILE *) ctx) == len ? 0 : -1;
+}
+
+static int serialize_to (int (* write_fn) (void *, const json_char *, size_t),
+                         void * ctx, json_value * value,
+                         json_serialize_opts opts)
+{
+   json_char b [JSON_OUT_BUF_SZ];
+   json_out out;
+
+   out.buf = out.start = b;
+   out.end = b + sizeof (b);
+   out.write_fn = write_fn;
+   out.ctx = ctx;
+   out.err = 0;
+
+   serialize_out (&out, value, opts);
+   out_flush (&out);
+
+   return out.err;
+}
+
+int json_serialize_to_fd (int fd, json_value * value, json_serialize_opts opts)
+{
+   return serialize_to (write_fd, &fd, value, opts);
+}
+
+int json_serialize_to_FILE (FILE * fp, json_value * value, json_serialize_opts opts)
+{
+   return serialize_to (write_FILE, fp, value, opts);
+}
+
+
+/* True if 'value' and all below it are in an arena that will be freed as
+ * one, so there is nothing to free one by one.
+ */
+static int in_whole_arena (const json_value * value)
+{
+   json_arena * arena = value_arena (value);
+
+   return arena && !arena->mixed;
 }
 
 void json_builder_free (json_value * value)
 {
    json_value * cur_value;
+   json_arena * arena;
 
-   if (!value)
+   if (!value || in_whole_arena (value))
       return;
 
    value->parent = 0;
 
    while (value)
    {
+      arena = value_arena (value);
+
       switch (value->type)
       {
          case json_array:
 
             if (!value->u.array.length)
             {
-               free (value->u.array.values);
+               jb_free (arena, value->u.array.values);
                break;
             }
 
-            value = value->u.array.values [-- value->u.array.length];
+            cur_value = value->u.array.values [-- value->u.array.length];
+
+            if (!in_whole_arena (cur_value))
+               value = cur_value;
+
             continue;
 
          case json_object:
 
             if (!value->u.object.length)
             {
-               free (value->u.object.values);
+               jb_free (arena, value->u.object.values);
                break;
             }
 
@@ -977,15 +1477,22 @@ void json_builder_free (json_value * value)
                 * values, they are part of the same allocation as the values array
                 * itself.
                 */
-               free (value->u.object.values [value->u.object.length].name);
+               json_char * name = value->u.object.values [value->u.object.length].name;
+
+               if (!json_name_pooled (name))
+                  jb_free (arena, name);
             }
 
-            value = value->u.object.values [value->u.object.length].value;
+            cur_value = value->u.object.values [value->u.object.length].value;
+
+            if (!in_whole_arena (cur_value))
+               value = cur_value;
+
             continue;
 
          case json_string:
 
-            free (value->u.string.ptr);
+            jb_free (arena, value->u.string.ptr);
             break;
 
          default:
@@ -994,10 +1501,54 @@ void json_builder_free (json_value * value)
 
       cur_value = value;
       value = value->parent;
-      free (cur_value);
+      jb_free (arena, cur_value);
    }
 }
 
+void json_array_shift (json_value * array, unsigned int count)
+{
+   unsigned int i;
+
+   assert (array->type == json_array);
+   assert (count <= array->u.array.length);
+
+   for (i = 0; i < count; ++ i)
+      json_builder_free (array->u.array.values [i]);
+
+   array->u.array.length -= count;
+   memmove (array->u.array.values, array->u.array.values + count,
+            array->u.array.length * sizeof (json_value *));
+
+   if (((json_builder_value *) array)->is_builder_value)
+      ((json_builder_value *) array)->additional_length_allocated += count;
+}
+
+void json_object_shift (json_value * object, unsigned int count)
+{
+   unsigned int i;
+   json_object_entry * entry;
+
+   assert (object->type == json_object);
+   assert (count <= object->u.object.length);
+
+   if (!builderize (object))
+      return;
+
+   for (i = 0; i < count; ++ i)
+   {
+      entry = object->u.object.values + i;
+      if (!json_name_pooled (entry->name))
+         jb_free (value_arena (object), entry->name);
+      json_builder_free (entry->value);
+   }
+
+   object->u.object.length -= count;
+   memmove (object->u.object.values, object->u.object.values + count,
+            object->u.object.length * sizeof (json_object_entry));
+
+   ((json_builder_value *) object)->additional_length_allocated += count;
+}
+
 
 
 
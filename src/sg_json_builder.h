@@ -69,6 +69,43 @@
 #endif
 
 #include <stddef.h>
+#include <stdio.h>
+
+/* liblsscsi's copy of these carries its prefix; see sg_json.h */
+#define json_arena_free lsscsi_json_arena_free
+#define json_arena_is_mixed lsscsi_json_arena_is_mixed
+#define json_arena_new lsscsi_json_arena_new
+#define json_arena_reset lsscsi_json_arena_reset
+#define json_arena_use lsscsi_json_arena_use
+#define json_array_new lsscsi_json_array_new
+#define json_array_push lsscsi_json_array_push
+#define json_array_shift lsscsi_json_array_shift
+#define json_boolean_new lsscsi_json_boolean_new
+#define json_builder_extra lsscsi_json_builder_extra
+#define json_builder_free lsscsi_json_builder_free
+#define json_builder_values_made lsscsi_json_builder_values_made
+#define json_double_new lsscsi_json_double_new
+#define json_integer_new lsscsi_json_integer_new
+#define json_measure lsscsi_json_measure
+#define json_measure_ex lsscsi_json_measure_ex
+#define json_name_pool_add lsscsi_json_name_pool_add
+#define json_name_pooled lsscsi_json_name_pooled
+#define json_null_new lsscsi_json_null_new
+#define json_object_merge lsscsi_json_object_merge
+#define json_object_new lsscsi_json_object_new
+#define json_object_push lsscsi_json_object_push
+#define json_object_push_length lsscsi_json_object_push_length
+#define json_object_push_nocopy lsscsi_json_object_push_nocopy
+#define json_object_push_pooled lsscsi_json_object_push_pooled
+#define json_object_shift lsscsi_json_object_shift
+#define json_object_sort lsscsi_json_object_sort
+#define json_serialize lsscsi_json_serialize
+#define json_serialize_ex lsscsi_json_serialize_ex
+#define json_serialize_to_FILE lsscsi_json_serialize_to_FILE
+#define json_serialize_to_fd lsscsi_json_serialize_to_fd
+#define json_string_new lsscsi_json_string_new
+#define json_string_new_length lsscsi_json_string_new_length
+#define json_string_new_nocopy lsscsi_json_string_new_nocopy
 
 #ifdef __cplusplus
 
@@ -319,11 +356,79 @@ size_t json_measure_ex (json_value *, json_serialize_opts);
 void json_serialize (json_char * buf, json_value *);
 void json_serialize_ex (json_char * buf, json_value *, json_serialize_opts);
 
+/* Serializes a JSON value as json_serialize_ex() does but in a single walk
+ * of the tree, through a buffer of bounded size that is written out each
+ * time it fills, rather than into one large enough for the whole value.
+ * No null terminator is written. The _to_fd() variant uses write(2)
+ * (retrying short writes), _to_FILE() uses fwrite(3). Returns 0, or -1
+ * if a write failed (everything after that is dropped).
+ */
+int json_serialize_to_fd (int fd, json_value *, json_serialize_opts);
+int json_serialize_to_FILE (FILE * fp, json_value *, json_serialize_opts);
+
+
+/* Number of values made by the calling thread so far */
+unsigned long json_builder_values_made (void);
+
 
 /*** Cleaning up
  ***/
 void json_builder_free (json_value *);
 
+/* Removes (and frees) the first 'count' elements of an array or entries
+ * of an object, moving the rest down.
+ */
+void json_array_shift (json_value * array, unsigned int count);
+void json_object_shift (json_value * object, unsigned int count);
+
+
+/*** Arenas
+ ***
+ * While an arena is selected with json_arena_use() the values made by the
+ * calling thread (with their strings, names and arrays) are bump allocated
+ * from it instead of each coming from the heap. json_builder_free() does
+ * nothing for them; they all go at once when the arena is reset or freed.
+ * Values from elsewhere may be pushed into a value from an arena (and vice
+ * versa) but then json_builder_free() has to walk the tree again, see
+ * json_arena_is_mixed().
+ */
+typedef struct json_arena json_arena;
+
+json_arena * json_arena_new (void);
+
+/* Every value from the arena becomes invalid */
+void json_arena_reset (json_arena *);
+void json_arena_free (json_arena *);
+
+/* Selects the arena (or the heap if NULL) for values made by this thread
+ * from now on. Returns the one previously selected.
+ */
+json_arena * json_arena_use (json_arena *);
+
+/* True once a value not from the arena has been pushed into one that is */
+int json_arena_is_mixed (const json_arena *);
+
+/* Name pool: object names that last as long as the process, shared by all
+ * threads. A pooled name is pushed with json_object_push_pooled() without
+ * being copied, and is never freed by json_builder_free() and friends.
+ * Returns a pooled, null terminated copy of the 'length' bytes at 'name',
+ * or NULL when the (fixed size) pool is full. Each call adds a copy, so
+ * callers keep what they get (see sgj_key_intern()).
+ */
+const json_char * json_name_pool_add (const json_char * name,
+                                      unsigned int length);
+
+/* True if 'name' came from json_name_pool_add() */
+int json_name_pooled (const json_char * name);
+
+/* Same as json_object_push_length, but 'name' (from json_name_pool_add())
+ * is stored as it is. A name not from the pool is copied as usual.
+ */
+json_value * json_object_push_pooled (json_value * object,
+                                      unsigned int name_length,
+                                      const json_char * name,
+                                      json_value *);
+
 #ifdef __cplusplus
 }
 #endif
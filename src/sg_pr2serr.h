@@ -26,6 +26,15 @@ extern "C" {
  * Note that this header and its implementation do not depend on sg_lib.[hc]
  * or any other sg3_utils components. */
 
+/* These are built into liblsscsi, so they carry its prefix there rather
+ * than clash with the same names in a program (e.g. one using sg3_utils)
+ * that links liblsscsi. Callers in lsscsi still use the short names. */
+#define pr2serr lsscsi_pr2serr
+#define pr2ws lsscsi_pr2ws
+#define sg_warnings_strm lsscsi_warnings_strm
+#define sg_scnpr lsscsi_scnpr
+#define sg_scn3pr lsscsi_scn3pr
+
 #if __USE_MINGW_ANSI_STDIO -0 == 1
 #define __printf(a, b) __attribute__((__format__(gnu_printf, a, b)))
 #elif defined(__GNUC__) || defined(__clang__)